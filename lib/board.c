@@ -45,6 +45,7 @@ libsoc_board_init()
       while(fgets(line, sizeof(line), fp))
         {
           if (*line == '#' || *line == '\0' || *line == '\n') continue;
+          if (sscanf(line, " SOC = %15s", bc->soc) == 1) continue;
           ptr = calloc(sizeof(pin_mapping), 1);
           rc = sscanf(line, "%15[^=]=%d", ptr->pin, &ptr->gpio);
           if (rc != 2)
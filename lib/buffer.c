@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libsoc_buffer.h"
+#include "libsoc_debug.h"
+
+#define BUFFER_MIN_SHIFT 6
+#define BUFFER_MAX_SHIFT 16
+#define BUFFER_CLASSES (BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT + 1)
+
+// Released buffers a thread keeps per size class before handing them
+// all back to the shared pool
+#define BUFFER_CACHE_MAX 16
+
+/*
+ * Free buffers are linked through their first word. The shared pool is
+ * a stack per size class: threads push chains onto it with a compare and
+ * swap and take the whole stack with one exchange, so no pop ever reads
+ * a next pointer another thread may be changing and there is no ABA
+ * problem. Each thread takes from and releases into its own cache.
+ */
+
+struct buffer_free
+{
+  struct buffer_free *next;
+};
+
+struct buffer_cache
+{
+  struct buffer_free *list[BUFFER_CLASSES];
+  unsigned int count[BUFFER_CLASSES];
+};
+
+static struct buffer_free *buffer_pool[BUFFER_CLASSES];
+static libsoc_buffer_stats buffer_stats;
+
+static __thread struct buffer_cache buffer_cache;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+static __thread int buffer_registered;
+
+static int
+buffer_class (uint32_t size)
+{
+  int cls = 0;
+
+  if (size > LIBSOC_BUFFER_MAX)
+    return -1;
+
+  while ((1U << (cls + BUFFER_MIN_SHIFT)) < size)
+    cls++;
+
+  return cls;
+}
+
+static void
+buffer_push (int cls, struct buffer_free *first, struct buffer_free *last)
+{
+  struct buffer_free *head = __atomic_load_n (&buffer_pool[cls],
+					      __ATOMIC_RELAXED);
+
+  do
+    last->next = head;
+  while (!__atomic_compare_exchange_n (&buffer_pool[cls], &head, first, 1,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void
+buffer_spill (struct buffer_cache *cache, int cls)
+{
+  struct buffer_free *last = cache->list[cls];
+
+  if (last == NULL)
+    return;
+
+  while (last->next)
+    last = last->next;
+
+  buffer_push (cls, cache->list[cls], last);
+
+  cache->list[cls] = NULL;
+  cache->count[cls] = 0;
+}
+
+// Hands the cache of an exiting thread back to the shared pool
+static void
+buffer_thread_exit (void *arg)
+{
+  struct buffer_cache *cache = arg;
+  int cls;
+
+  for (cls = 0; cls < BUFFER_CLASSES; cls++)
+    buffer_spill (cache, cls);
+}
+
+static void
+buffer_key_create ()
+{
+  pthread_key_create (&buffer_key, buffer_thread_exit);
+}
+
+static struct buffer_cache *
+buffer_thread_cache ()
+{
+  if (!buffer_registered)
+    {
+      pthread_once (&buffer_once, buffer_key_create);
+      pthread_setspecific (buffer_key, &buffer_cache);
+      buffer_registered = 1;
+    }
+
+  return &buffer_cache;
+}
+
+uint8_t *
+libsoc_buffer_alloc (uint32_t size)
+{
+  struct buffer_cache *cache;
+  struct buffer_free *buf;
+  size_t align, page = sysconf (_SC_PAGESIZE);
+  void *mem;
+  int cls = buffer_class (size);
+
+  if (cls >= 0)
+    {
+      cache = buffer_thread_cache ();
+
+      if (cache->list[cls] == NULL)
+	{
+	  cache->list[cls] = __atomic_exchange_n (&buffer_pool[cls], NULL,
+						  __ATOMIC_ACQUIRE);
+	  cache->count[cls] = 0;
+
+	  for (buf = cache->list[cls]; buf; buf = buf->next)
+	    cache->count[cls]++;
+	}
+
+      buf = cache->list[cls];
+
+      if (buf)
+	{
+	  cache->list[cls] = buf->next;
+	  cache->count[cls]--;
+	  __atomic_fetch_add (&buffer_stats.hits, 1, __ATOMIC_RELAXED);
+	  return (uint8_t *) buf;
+	}
+
+      size = 1U << (cls + BUFFER_MIN_SHIFT);
+      __atomic_fetch_add (&buffer_stats.misses, 1, __ATOMIC_RELAXED);
+    }
+  else
+    __atomic_fetch_add (&buffer_stats.unpooled, 1, __ATOMIC_RELAXED);
+
+  align = size < page ? size : page;
+
+  if (posix_memalign (&mem, align, size) != 0)
+    {
+      libsoc_debug (__func__, "failed to allocate %u bytes", size);
+      return NULL;
+    }
+
+  return mem;
+}
+
+void
+libsoc_buffer_free (uint8_t * buf, uint32_t size)
+{
+  struct buffer_cache *cache;
+  struct buffer_free *node = (struct buffer_free *) buf;
+  int cls = buffer_class (size);
+
+  if (buf == NULL)
+    return;
+
+  if (cls < 0)
+    {
+      free (buf);
+      return;
+    }
+
+  cache = buffer_thread_cache ();
+
+  node->next = cache->list[cls];
+  cache->list[cls] = node;
+
+  if (++cache->count[cls] > BUFFER_CACHE_MAX)
+    buffer_spill (cache, cls);
+}
+
+void
+libsoc_buffer_get_stats (libsoc_buffer_stats * stats)
+{
+  stats->hits = __atomic_load_n (&buffer_stats.hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n (&buffer_stats.misses, __ATOMIC_RELAXED);
+  stats->unpooled = __atomic_load_n (&buffer_stats.unpooled,
+				     __ATOMIC_RELAXED);
+}
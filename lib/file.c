@@ -44,6 +44,32 @@ inline int file_read(int fd, void *buf, int count)
   return ret;
 }
 
+inline int file_pwrite(int fd, const char *str, int len)
+{
+  int ret_len = pwrite(fd, str, len, 0);
+
+  if (ret_len < 0)
+  {
+    perror("libsoc-file-debug");
+    return -1;
+  }
+
+  return ret_len;
+}
+
+inline int file_pread(int fd, void *buf, int count)
+{
+  int ret = pread(fd, buf, count, 0);
+
+  if (ret < 0)
+  {
+    perror("libsoc-file-debug");
+    return -1;
+  }
+
+  return ret;
+}
+
 inline int file_valid(char *path)
 {
   if (access(path, F_OK) == 0)
@@ -7,6 +7,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/gpio.h>
 
 #include "libsoc_file.h"
 #include "libsoc_debug.h"
@@ -47,11 +53,23 @@ libsoc_gpio_debug (const char *func, int gpio, char *format, ...)
 #endif
 }
 
+static const char *
+libsoc_gpio_sysfs_dir ()
+{
+  const char *dir = getenv ("LIBSOC_GPIO_SYSFS");
+
+  if (dir == NULL)
+    dir = "/sys/class/gpio";
+
+  return dir;
+}
+
 gpio *
 libsoc_gpio_request (unsigned int gpio_id, enum gpio_mode mode)
 {
   gpio *new_gpio;
   char tmp_str[STR_BUF];
+  const char *sysfs = libsoc_gpio_sysfs_dir ();
   int shared = 0;
 
   if (mode != LS_SHARED && mode != LS_GREEDY && mode != LS_WEAK)
@@ -64,7 +82,7 @@ libsoc_gpio_request (unsigned int gpio_id, enum gpio_mode mode)
 
   libsoc_gpio_debug (__func__, gpio_id, "requested gpio");
 
-  sprintf (tmp_str, "/sys/class/gpio/gpio%d/value", gpio_id);
+  sprintf (tmp_str, "%s/gpio%d/value", sysfs, gpio_id);
 
   if (file_valid (tmp_str))
     {
@@ -91,20 +109,22 @@ libsoc_gpio_request (unsigned int gpio_id, enum gpio_mode mode)
     }
   else
     {
-      int fd = file_open ("/sys/class/gpio/export", O_SYNC | O_WRONLY);
+      sprintf (tmp_str, "%s/export", sysfs);
+
+      int fd = file_open (tmp_str, O_SYNC | O_WRONLY);
 
       if (fd < 0)
 	return NULL;
 
       sprintf (tmp_str, "%d", gpio_id);
 
-      if (file_write (fd, tmp_str, STR_BUF) < 0)
+      if (file_write (fd, tmp_str, strlen (tmp_str)) < 0)
 	return NULL;
 
       if (file_close (fd))
 	return NULL;
 
-      sprintf (tmp_str, "/sys/class/gpio/gpio%d", gpio_id);
+      sprintf (tmp_str, "%s/gpio%d", sysfs, gpio_id);
 
       if (!file_valid (tmp_str))
 	{
@@ -119,27 +139,65 @@ libsoc_gpio_request (unsigned int gpio_id, enum gpio_mode mode)
   if (new_gpio == NULL)
     return NULL;
 
-  sprintf (tmp_str, "/sys/class/gpio/gpio%d/value", gpio_id);
+  new_gpio->gpio = gpio_id;
+  new_gpio->shared = shared;
+  new_gpio->callback = NULL;
+  new_gpio->direction_fd = -1;
+  new_gpio->edge_fd = -1;
+  new_gpio->direction = DIRECTION_ERROR;
+  new_gpio->edge = EDGE_ERROR;
+  new_gpio->lines = NULL;
+  new_gpio->line = 0;
+
+  sprintf (tmp_str, "%s/gpio%d/value", sysfs, gpio_id);
 
   new_gpio->value_fd = file_open (tmp_str, O_SYNC | O_RDWR);
 
   if (new_gpio->value_fd < 0)
+    goto error;
+
+  // The kernel leaves out the direction file of fixed direction lines,
+  // so without it the gpio is still usable, only not reconfigurable
+  sprintf (tmp_str, "%s/gpio%d/direction", sysfs, gpio_id);
+
+  if (file_valid (tmp_str))
+    new_gpio->direction_fd = file_open (tmp_str, O_SYNC | O_RDWR);
+
+  if (new_gpio->direction_fd < 0)
+    libsoc_gpio_debug (__func__, gpio_id, "direction can not be changed");
+
+  // Not every gpio can generate interrupts, so a missing edge file
+  // is not an error until an edge is actually requested
+  sprintf (tmp_str, "%s/gpio%d/edge", sysfs, gpio_id);
+
+  if (file_valid (tmp_str))
     {
-      free(new_gpio);
-      return NULL;
-    }
+      new_gpio->edge_fd = file_open (tmp_str, O_SYNC | O_RDWR);
 
-  new_gpio->gpio = gpio_id;
-  new_gpio->shared = shared;
-  new_gpio->callback = NULL;
+      if (new_gpio->edge_fd < 0)
+	goto error;
+    }
 
   return new_gpio;
+
+error:
+
+  if (new_gpio->value_fd >= 0)
+    file_close (new_gpio->value_fd);
+
+  if (new_gpio->direction_fd >= 0)
+    file_close (new_gpio->direction_fd);
+
+  free (new_gpio);
+
+  return NULL;
 }
 
 int
 libsoc_gpio_free (gpio * gpio)
 {
   char tmp_str[STR_BUF];
+  const char *sysfs = libsoc_gpio_sysfs_dir ();
   int fd;
 
   if (gpio == NULL)
@@ -150,13 +208,35 @@ libsoc_gpio_free (gpio * gpio)
 
   libsoc_gpio_debug (__func__, gpio->gpio, "freeing gpio");
 
-  if (gpio->callback != NULL)
+  if (gpio->lines != NULL)
+    {
+      if (gpio->lines->num_lines != 1)
+	{
+	  libsoc_gpio_debug (__func__, gpio->gpio,
+			     "line is part of a multi-line request,"
+			     " use libsoc_gpio_lines_free");
+	  return EXIT_FAILURE;
+	}
+
+      return libsoc_gpio_lines_free (gpio->lines);
+    }
+
+  if (gpio->callback != NULL && gpio->callback->callback_fn != NULL)
     {
       printf ("Freeing callback!\n");
       // Turn off the callback if there is one enabled
       libsoc_gpio_callback_interrupt_cancel (gpio);
     }
 
+  if (gpio->callback != NULL && gpio->callback->capture != NULL)
+    libsoc_gpio_capture_disable (gpio);
+
+  if (gpio->edge_fd >= 0 && file_close (gpio->edge_fd) < 0)
+    return EXIT_FAILURE;
+
+  if (gpio->direction_fd >= 0 && file_close (gpio->direction_fd) < 0)
+    return EXIT_FAILURE;
+
   if (file_close (gpio->value_fd) < 0)
     return EXIT_FAILURE;
 
@@ -166,20 +246,22 @@ libsoc_gpio_free (gpio * gpio)
       return EXIT_SUCCESS;
     }
 
-  fd = file_open ("/sys/class/gpio/unexport", O_SYNC | O_WRONLY);
+  sprintf (tmp_str, "%s/unexport", sysfs);
+
+  fd = file_open (tmp_str, O_SYNC | O_WRONLY);
 
   if (fd < 0)
     return EXIT_FAILURE;
 
   sprintf (tmp_str, "%d", gpio->gpio);
 
-  if (file_write (fd, tmp_str, STR_BUF) < 0)
+  if (file_write (fd, tmp_str, strlen (tmp_str)) < 0)
     return EXIT_FAILURE;
 
   if (file_close (fd) < 0)
     return EXIT_FAILURE;
 
-  sprintf (tmp_str, "/sys/class/gpio/gpio%d", gpio->gpio);
+  sprintf (tmp_str, "%s/gpio%d", sysfs, gpio->gpio);
 
   if (file_valid (tmp_str))
     {
@@ -192,382 +274,1755 @@ libsoc_gpio_free (gpio * gpio)
   return EXIT_SUCCESS;
 }
 
-int
-libsoc_gpio_set_direction (gpio * current_gpio, gpio_direction direction)
+/*
+ * Character device backend. Lines requested from /dev/gpiochipN with the
+ * v2 uAPI are held in a gpio_lines request, which owns a gpio handle per
+ * line so the libsoc_gpio_* calls work on them as on a sysfs gpio.
+ */
+
+#define LINE_FLAG_DIRECTION \
+  (GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_OUTPUT)
+#define LINE_FLAG_EDGE \
+  (GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING)
+
+static const uint64_t line_edge_flags[4] = {
+  GPIO_V2_LINE_FLAG_EDGE_RISING,
+  GPIO_V2_LINE_FLAG_EDGE_FALLING,
+  0,
+  LINE_FLAG_EDGE,
+};
+
+static const char *
+libsoc_gpio_cdev_dir ()
 {
-  int fd;
-  char path[STR_BUF];
+  const char *dir = getenv ("LIBSOC_GPIO_CDEV");
 
-  if (current_gpio == NULL)
-    {
-      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
-      return EXIT_FAILURE;
-    }
+  if (dir == NULL)
+    dir = "/dev";
 
-  libsoc_gpio_debug (__func__, current_gpio->gpio,
-		     "setting direction to %s",
-		     gpio_direction_strings[direction]);
+  return dir;
+}
 
-  sprintf (path, "/sys/class/gpio/gpio%d/direction", current_gpio->gpio);
+static int
+lines_build_config (gpio_lines * lines, struct gpio_v2_line_config *config)
+{
+  uint64_t output_mask = 0;
+  unsigned int i, j;
 
-  fd = file_open (path, O_SYNC | O_WRONLY);
+  memset (config, 0, sizeof (*config));
 
-  if (fd < 0)
-    return EXIT_FAILURE;
+  // Lines sharing the flags of line 0 use the base flags, every other
+  // distinct set of flags needs an attribute
+  config->flags = lines->flags[0];
 
-  if (file_write (fd, gpio_direction_strings[direction], STR_BUF) < 0)
-    return EXIT_FAILURE;
+  for (i = 0; i < lines->num_lines; i++)
+    {
+      if (lines->flags[i] & GPIO_V2_LINE_FLAG_OUTPUT)
+	output_mask |= 1ULL << i;
 
-  if (file_close (fd) < 0)
-    return EXIT_FAILURE;
+      if (lines->flags[i] == config->flags)
+	continue;
 
-  return EXIT_SUCCESS;
-}
+      for (j = 0; j < config->num_attrs; j++)
+	{
+	  if (config->attrs[j].attr.flags == lines->flags[i])
+	    break;
+	}
 
-gpio_direction
-libsoc_gpio_get_direction (gpio * current_gpio)
-{
-  int fd;
-  char tmp_str[STR_BUF];
+      if (j == config->num_attrs)
+	{
+	  // Keep one attribute free for the output values
+	  if (j == GPIO_V2_LINE_NUM_ATTRS_MAX - 1)
+	    return EXIT_FAILURE;
 
-  if (current_gpio == NULL)
-    {
-      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
-      return DIRECTION_ERROR;
-    }
+	  config->attrs[j].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+	  config->attrs[j].attr.flags = lines->flags[i];
+	  config->num_attrs++;
+	}
 
-  sprintf (tmp_str, "/sys/class/gpio/gpio%d/direction", current_gpio->gpio);
+      config->attrs[j].mask |= 1ULL << i;
+    }
 
-  fd = file_open (tmp_str, O_RDONLY);
+  if (output_mask)
+    {
+      j = config->num_attrs++;
 
-  if (fd < 0)
-    return DIRECTION_ERROR;
+      config->attrs[j].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+      config->attrs[j].attr.values = lines->values;
+      config->attrs[j].mask = output_mask;
+    }
 
-  lseek (fd, 0, SEEK_SET);
+  return EXIT_SUCCESS;
+}
 
-  if (file_read (fd, tmp_str, STR_BUF) < 0)
-    return DIRECTION_ERROR;
+static int
+lines_update_flags (gpio * current_gpio, uint64_t clear, uint64_t set)
+{
+  gpio_lines *lines = current_gpio->lines;
+  struct gpio_v2_line_config config;
+  uint64_t old_flags = lines->flags[current_gpio->line];
 
-  if (file_close (fd) < 0)
-    return DIRECTION_ERROR;
+  lines->flags[current_gpio->line] = (old_flags & ~clear) | set;
 
-  if (strncmp (tmp_str, "in", 2) <= 0)
+  if (lines_build_config (lines, &config) == EXIT_FAILURE)
     {
       libsoc_gpio_debug (__func__, current_gpio->gpio,
-			 "read direction as input");
-      return INPUT;
+			 "too many distinct line configurations");
+      goto error;
     }
-  else
+
+  if (ioctl (lines->fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0)
     {
       libsoc_gpio_debug (__func__, current_gpio->gpio,
-			 "read direction as output");
-      return OUTPUT;
+			 "setting line config failed");
+      perror ("libsoc-gpio-debug");
+      goto error;
     }
+
+  return EXIT_SUCCESS;
+
+error:
+
+  lines->flags[current_gpio->line] = old_flags;
+
+  return EXIT_FAILURE;
 }
 
-int
-libsoc_gpio_set_level (gpio * current_gpio, gpio_level level)
+static int
+lines_read_info (gpio * current_gpio, uint64_t * flags)
 {
-  if (current_gpio == NULL)
+  struct gpio_v2_line_info info;
+
+  memset (&info, 0, sizeof (info));
+  info.offset = current_gpio->lines->offsets[current_gpio->line];
+
+  if (ioctl (current_gpio->lines->chip_fd, GPIO_V2_GET_LINEINFO_IOCTL,
+	     &info) < 0)
     {
-      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      libsoc_gpio_debug (__func__, current_gpio->gpio,
+			 "reading line info failed");
+      perror ("libsoc-gpio-debug");
       return EXIT_FAILURE;
     }
 
-  libsoc_gpio_debug (__func__, current_gpio->gpio, "setting level to %d",
-		     level);
-
-  if (file_write (current_gpio->value_fd, gpio_level_strings[level], 1) < 0)
-    return EXIT_FAILURE;
+  *flags = info.flags;
 
   return EXIT_SUCCESS;
 }
 
-gpio_level
-libsoc_gpio_get_level (gpio * current_gpio)
+static int
+lines_wait_event (gpio * gpio, int timeout)
 {
-  char level[STR_BUF];
-
-  if (current_gpio == NULL)
-    {
-      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
-      return LEVEL_ERROR;
-    }
+  struct gpio_v2_line_event events[16];
+  struct timespec start, now;
+  struct pollfd pfd;
+  int i, n, remaining = timeout;
 
-  lseek (current_gpio->value_fd, 0, SEEK_SET);
+  pfd.fd = gpio->value_fd;
+  pfd.events = POLLIN;
 
-  if (read (current_gpio->value_fd, level, STR_BUF) < 0)
-  {
-    libsoc_gpio_debug (__func__, current_gpio->gpio, "level read failed");
-    perror ("libgpio");
-    return LEVEL_ERROR;
-  }
+  clock_gettime (CLOCK_MONOTONIC, &start);
 
-  if (strncmp (level, "0", 1) <= 0)
-    {
-      libsoc_gpio_debug (__func__, current_gpio->gpio, "read level as low");
-      return LOW;
-    }
-  else
+  // Events for the other lines of a multi-line request are consumed
+  // while waiting for one on this line
+  while (1)
     {
-      libsoc_gpio_debug (__func__, current_gpio->gpio, "read level as high");
-      return HIGH;
-    }
-}
+      pfd.revents = 0;
 
-int
-libsoc_gpio_set_edge (gpio * current_gpio, gpio_edge edge)
-{
-  int fd;
-  char path[STR_BUF];
+      n = poll (&pfd, 1, remaining);
 
-  if (current_gpio == NULL)
-    {
-      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
-      return EXIT_FAILURE;
-    }
+      if (n < 0)
+	{
+	  libsoc_gpio_debug (__func__, gpio->gpio, "poll failed");
+	  perror ("libsoc-gpio-debug");
+	  return EXIT_FAILURE;
+	}
 
-  libsoc_gpio_debug (__func__, current_gpio->gpio, "setting edge to %s",
-		     gpio_edge_strings[edge]);
+      if (n == 0)
+	return EXIT_FAILURE;
 
-  sprintf (path, "/sys/class/gpio/gpio%d/edge", current_gpio->gpio);
+      n = read (gpio->value_fd, events, sizeof (events));
 
-  fd = file_open (path, O_SYNC | O_WRONLY);
+      if (n < 0)
+	{
+	  libsoc_gpio_debug (__func__, gpio->gpio, "event read failed");
+	  perror ("libsoc-gpio-debug");
+	  return EXIT_FAILURE;
+	}
 
-  if (fd < 0)
-    return EXIT_FAILURE;
+      for (i = 0; i < n / (int) sizeof (events[0]); i++)
+	{
+	  if (events[i].offset == gpio->gpio)
+	    return EXIT_SUCCESS;
+	}
 
-  if (file_write (fd, gpio_edge_strings[edge], STR_BUF) < 0)
-    return EXIT_FAILURE;
+      if (timeout < 0)
+	continue;
 
-  if (file_close (fd) < 0)
-    return EXIT_FAILURE;
+      clock_gettime (CLOCK_MONOTONIC, &now);
 
-  return EXIT_SUCCESS;
+      remaining = timeout - ((now.tv_sec - start.tv_sec) * 1000
+			     + (now.tv_nsec - start.tv_nsec) / 1000000);
+
+      if (remaining <= 0)
+	return EXIT_FAILURE;
+    }
 }
 
-gpio_edge
-libsoc_gpio_get_edge (gpio * current_gpio)
+gpio_lines *
+libsoc_gpio_lines_request (unsigned int chip, const unsigned int *offsets,
+			   unsigned int num_lines, gpio_direction direction)
 {
-  int fd;
-  char tmp_str[STR_BUF];
+  struct gpio_v2_line_request req;
+  gpio_lines *lines;
+  char path[STR_BUF];
+  unsigned int i;
 
-  if (current_gpio == NULL)
+  if (offsets == NULL || num_lines == 0 || num_lines > GPIO_LINES_MAX
+      || (direction != INPUT && direction != OUTPUT))
     {
-      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
-      return EDGE_ERROR;
+      libsoc_gpio_debug (__func__, -1, "invalid line request");
+      return NULL;
     }
 
-  sprintf (tmp_str, "/sys/class/gpio/gpio%d/edge", current_gpio->gpio);
+  libsoc_gpio_debug (__func__, -1, "requesting %d lines on gpiochip%d",
+		     num_lines, chip);
 
-  fd = file_open (tmp_str, O_RDONLY);
+  lines = calloc (1, sizeof (gpio_lines));
 
-  if (fd < 0)
-    return EDGE_ERROR;
+  if (lines == NULL)
+    return NULL;
 
-  lseek (fd, 0, SEEK_SET);
+  lines->chip = chip;
+  lines->num_lines = num_lines;
+  lines->fd = -1;
 
-  if (file_read (fd, tmp_str, STR_BUF) < 0)
-    return EDGE_ERROR;
+  sprintf (path, "%s/gpiochip%d", libsoc_gpio_cdev_dir (), chip);
 
-  if (file_close (fd) < 0)
-    return EDGE_ERROR;
+  lines->chip_fd = file_open (path, O_RDWR | O_CLOEXEC);
 
-  if (strncmp (tmp_str, "r", 1) == 0)
+  if (lines->chip_fd < 0)
+    goto error;
+
+  memset (&req, 0, sizeof (req));
+
+  for (i = 0; i < num_lines; i++)
     {
-      libsoc_gpio_debug (__func__, current_gpio->gpio, "read edge as rising");
-      return RISING;
+      lines->offsets[i] = offsets[i];
+      lines->flags[i] = (direction == OUTPUT) ?
+	GPIO_V2_LINE_FLAG_OUTPUT : GPIO_V2_LINE_FLAG_INPUT;
+      req.offsets[i] = offsets[i];
     }
-  else if (strncmp (tmp_str, "f", 1) == 0)
+
+  strcpy (req.consumer, "libsoc");
+  req.num_lines = num_lines;
+  lines_build_config (lines, &req.config);
+
+  if (ioctl (lines->chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
     {
-      libsoc_gpio_debug (__func__, current_gpio->gpio,
-			 "read edge as falling");
-      return FALLING;
+      libsoc_gpio_debug (__func__, -1, "line request failed");
+      perror ("libsoc-gpio-debug");
+      goto error;
     }
-  else if (strncmp (tmp_str, "b", 1) == 0)
+
+  lines->fd = req.fd;
+
+  for (i = 0; i < num_lines; i++)
     {
-      libsoc_gpio_debug (__func__, current_gpio->gpio,
-			 "read edge as both");
-      return BOTH;
+      gpio *new_gpio = calloc (1, sizeof (gpio));
+
+      if (new_gpio == NULL)
+	goto error;
+
+      new_gpio->gpio = offsets[i];
+      new_gpio->value_fd = lines->fd;
+      new_gpio->direction_fd = -1;
+      new_gpio->edge_fd = -1;
+      new_gpio->direction = direction;
+      new_gpio->edge = NONE;
+      new_gpio->lines = lines;
+      new_gpio->line = i;
+
+      lines->gpios[i] = new_gpio;
     }
-  else
+
+  return lines;
+
+error:
+
+  for (i = 0; i < num_lines; i++)
+    free (lines->gpios[i]);
+
+  if (lines->fd >= 0)
+    file_close (lines->fd);
+
+  if (lines->chip_fd >= 0)
+    file_close (lines->chip_fd);
+
+  free (lines);
+
+  return NULL;
+}
+
+gpio *
+libsoc_gpio_request_line (unsigned int chip, unsigned int offset,
+			  gpio_direction direction)
+{
+  gpio_lines *lines = libsoc_gpio_lines_request (chip, &offset, 1, direction);
+
+  if (lines == NULL)
+    return NULL;
+
+  return lines->gpios[0];
+}
+
+gpio *
+libsoc_gpio_lines_get_gpio (gpio_lines * lines, unsigned int index)
+{
+  if (lines == NULL || index >= lines->num_lines)
     {
-      libsoc_gpio_debug (__func__, current_gpio->gpio, "read edge as none");
-      return NONE;
+      libsoc_gpio_debug (__func__, -1, "invalid lines pointer or index");
+      return NULL;
     }
+
+  return lines->gpios[index];
 }
 
 int
-libsoc_gpio_wait_interrupt (gpio * gpio, int timeout)
+libsoc_gpio_lines_set_values (gpio_lines * lines, uint64_t mask,
+			      uint64_t bits)
 {
-  if (gpio == NULL)
-    {
-      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
-      return EDGE_ERROR;
-    }
+  struct gpio_v2_line_values values;
 
-  if (libsoc_gpio_get_direction (gpio) != INPUT)
+  if (lines == NULL)
     {
-      libsoc_gpio_debug (__func__, gpio->gpio, "gpio is not set as input");
+      libsoc_gpio_debug (__func__, -1, "invalid lines pointer");
       return EXIT_FAILURE;
     }
 
-  gpio_edge test_edge = libsoc_gpio_get_edge (gpio);
+  values.bits = bits;
+  values.mask = mask;
 
-  if (test_edge == EDGE_ERROR || test_edge == NONE)
+  if (ioctl (lines->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0)
     {
-      libsoc_gpio_debug (__func__, gpio->gpio,
-			 "edge must be FALLING, RISING or BOTH");
+      libsoc_gpio_debug (__func__, -1, "setting line values failed");
+      perror ("libsoc-gpio-debug");
       return EXIT_FAILURE;
     }
 
-  struct pollfd pfd[1];
-  char buffer[1];
+  lines->values = (lines->values & ~mask) | (bits & mask);
 
-  pfd[0].fd = gpio->value_fd;
-  pfd[0].events = POLLPRI;
-  pfd[0].revents = 0;
+  return EXIT_SUCCESS;
+}
 
-  // Read data for clean initial poll
-  lseek (pfd[0].fd, 0, SEEK_SET);
-  read (pfd[0].fd, buffer, 1);
+int
+libsoc_gpio_lines_get_values (gpio_lines * lines, uint64_t mask,
+			      uint64_t * bits)
+{
+  struct gpio_v2_line_values values;
 
-  int ready = poll (pfd, 1, timeout);
+  if (lines == NULL || bits == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid lines or bits pointer");
+      return EXIT_FAILURE;
+    }
 
-  int ret;
+  values.bits = 0;
+  values.mask = mask;
 
-  switch (ready)
+  if (ioctl (lines->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
     {
-    case -1:
+      libsoc_gpio_debug (__func__, -1, "reading line values failed");
+      perror ("libsoc-gpio-debug");
+      return EXIT_FAILURE;
+    }
+
+  *bits = values.bits & mask;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_gpio_lines_free (gpio_lines * lines)
+{
+  unsigned int i;
+  gpio *gpio;
+
+  if (lines == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid lines pointer");
+      return EXIT_FAILURE;
+    }
+
+  libsoc_gpio_debug (__func__, -1, "freeing %d lines on gpiochip%d",
+		     lines->num_lines, lines->chip);
+
+  for (i = 0; i < lines->num_lines; i++)
+    {
+      gpio = lines->gpios[i];
+
+      if (gpio->callback != NULL && gpio->callback->callback_fn != NULL)
+	libsoc_gpio_callback_interrupt_cancel (gpio);
+
+      if (gpio->callback != NULL && gpio->callback->capture != NULL)
+	libsoc_gpio_capture_disable (gpio);
+
+      free (gpio);
+    }
+
+  if (file_close (lines->fd) < 0 || file_close (lines->chip_fd) < 0)
+    {
+      free (lines);
+      return EXIT_FAILURE;
+    }
+
+  free (lines);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_gpio_set_direction (gpio * current_gpio, gpio_direction direction)
+{
+  const char *str;
+
+  if (current_gpio == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      return EXIT_FAILURE;
+    }
+
+  libsoc_gpio_debug (__func__, current_gpio->gpio,
+		     "setting direction to %s",
+		     gpio_direction_strings[direction]);
+
+  if (current_gpio->lines != NULL)
+    {
+      // Edge detection is only available on inputs
+      if (direction == OUTPUT)
+	{
+	  if (lines_update_flags (current_gpio,
+				  LINE_FLAG_DIRECTION | LINE_FLAG_EDGE,
+				  GPIO_V2_LINE_FLAG_OUTPUT) == EXIT_FAILURE)
+	    return EXIT_FAILURE;
+
+	  current_gpio->edge = NONE;
+	}
+      else if (lines_update_flags (current_gpio, LINE_FLAG_DIRECTION,
+				   GPIO_V2_LINE_FLAG_INPUT) == EXIT_FAILURE)
+	{
+	  return EXIT_FAILURE;
+	}
+
+      current_gpio->direction = direction;
+
+      return EXIT_SUCCESS;
+    }
+
+  if (current_gpio->direction_fd < 0)
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio,
+			 "gpio has no direction file");
+      return EXIT_FAILURE;
+    }
+
+  str = gpio_direction_strings[direction];
+
+  if (file_pwrite (current_gpio->direction_fd, str, strlen (str)) < 0)
+    {
+      current_gpio->direction = DIRECTION_ERROR;
+      return EXIT_FAILURE;
+    }
+
+  current_gpio->direction = direction;
+
+  return EXIT_SUCCESS;
+}
+
+static gpio_direction
+libsoc_gpio_read_direction (gpio * current_gpio)
+{
+  char tmp_str[STR_BUF];
+  uint64_t flags;
+  int len;
+
+  if (current_gpio->lines != NULL)
+    {
+      if (lines_read_info (current_gpio, &flags) == EXIT_FAILURE)
+	return DIRECTION_ERROR;
+
+      return (flags & GPIO_V2_LINE_FLAG_OUTPUT) ? OUTPUT : INPUT;
+    }
+
+  if (current_gpio->direction_fd < 0)
+    return DIRECTION_ERROR;
+
+  len = file_pread (current_gpio->direction_fd, tmp_str, STR_BUF - 1);
+
+  if (len < 0)
+    return DIRECTION_ERROR;
+
+  tmp_str[len] = '\0';
+
+  if (strncmp (tmp_str, "in", 2) <= 0)
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio,
+			 "read direction as input");
+      return INPUT;
+    }
+  else
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio,
+			 "read direction as output");
+      return OUTPUT;
+    }
+}
+
+gpio_direction
+libsoc_gpio_get_direction (gpio * current_gpio)
+{
+  if (current_gpio == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      return DIRECTION_ERROR;
+    }
+
+  if (current_gpio->direction == DIRECTION_ERROR)
+    current_gpio->direction = libsoc_gpio_read_direction (current_gpio);
+
+  return current_gpio->direction;
+}
+
+int
+libsoc_gpio_set_level (gpio * current_gpio, gpio_level level)
+{
+  if (current_gpio == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      return EXIT_FAILURE;
+    }
+
+  libsoc_gpio_debug (__func__, current_gpio->gpio, "setting level to %d",
+		     level);
+
+  if (current_gpio->lines != NULL)
+    return libsoc_gpio_lines_set_values (current_gpio->lines,
+					 1ULL << current_gpio->line,
+					 (uint64_t) level << current_gpio->line);
+
+  if (file_pwrite (current_gpio->value_fd, gpio_level_strings[level], 1) < 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
+
+gpio_level
+libsoc_gpio_get_level (gpio * current_gpio)
+{
+  char level[STR_BUF];
+  uint64_t bits;
+
+  if (current_gpio == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      return LEVEL_ERROR;
+    }
+
+  if (current_gpio->lines != NULL)
+    {
+      if (libsoc_gpio_lines_get_values (current_gpio->lines,
+					1ULL << current_gpio->line,
+					&bits) == EXIT_FAILURE)
+	return LEVEL_ERROR;
+
+      return bits ? HIGH : LOW;
+    }
+
+  if (pread (current_gpio->value_fd, level, 1, 0) < 1)
+  {
+    libsoc_gpio_debug (__func__, current_gpio->gpio, "level read failed");
+    perror ("libgpio");
+    return LEVEL_ERROR;
+  }
+
+  if (strncmp (level, "0", 1) <= 0)
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio, "read level as low");
+      return LOW;
+    }
+  else
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio, "read level as high");
+      return HIGH;
+    }
+}
+
+gpio_group *
+libsoc_gpio_group_create (gpio ** gpios, unsigned int num_gpios)
+{
+  gpio_group *group;
+  unsigned int i, r;
+
+  if (gpios == NULL || num_gpios == 0 || num_gpios > GPIO_GROUP_MAX)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpios or num_gpios %d",
+			 num_gpios);
+      return NULL;
+    }
+
+  group = calloc (1, sizeof (gpio_group));
+
+  if (group == NULL)
+    return NULL;
+
+  for (i = 0; i < num_gpios; i++)
+    {
+      if (gpios[i] == NULL)
+	{
+	  libsoc_gpio_debug (__func__, -1, "invalid gpio at index %d", i);
+	  free (group);
+	  return NULL;
+	}
+
+      group->gpios[i] = gpios[i];
+
+      if (gpios[i]->lines == NULL)
+	{
+	  group->sysfs_mask |= 1ULL << i;
+	  continue;
+	}
+
+      // Lines of the same character device request share one ioctl
+      for (r = 0; r < group->num_requests; r++)
+	{
+	  if (group->requests[r] == gpios[i]->lines)
+	    break;
+	}
+
+      if (r == group->num_requests)
+	group->requests[group->num_requests++] = gpios[i]->lines;
+
+      group->request_masks[r] |= 1ULL << i;
+    }
+
+  group->num_gpios = num_gpios;
+
+  libsoc_gpio_debug (__func__, -1, "created group of %d gpios, %d line "
+		     "requests", num_gpios, group->num_requests);
+
+  return group;
+}
+
+int
+libsoc_gpio_group_set_mask (gpio_group * group, uint64_t mask, uint64_t bits)
+{
+  uint64_t pending, line_mask, line_bits;
+  unsigned int i, r;
+  gpio *gpio;
+  int ret = EXIT_SUCCESS;
+
+  if (group == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid group pointer");
+      return EXIT_FAILURE;
+    }
+
+  for (r = 0; r < group->num_requests; r++)
+    {
+      pending = mask & group->request_masks[r];
+      line_mask = 0;
+      line_bits = 0;
+
+      while (pending)
+	{
+	  i = __builtin_ctzll (pending);
+	  pending &= pending - 1;
+
+	  gpio = group->gpios[i];
+	  line_mask |= 1ULL << gpio->line;
+
+	  if (bits & (1ULL << i))
+	    line_bits |= 1ULL << gpio->line;
+	}
+
+      if (line_mask != 0
+	  && libsoc_gpio_lines_set_values (group->requests[r], line_mask,
+					   line_bits) == EXIT_FAILURE)
+	ret = EXIT_FAILURE;
+    }
+
+  // sysfs has no multi gpio attribute, each value file takes one write
+  pending = mask & group->sysfs_mask;
+
+  while (pending)
+    {
+      i = __builtin_ctzll (pending);
+      pending &= pending - 1;
+
+      if (file_pwrite (group->gpios[i]->value_fd,
+		       gpio_level_strings[(bits >> i) & 1], 1) < 0)
+	ret = EXIT_FAILURE;
+    }
+
+  return ret;
+}
+
+int
+libsoc_gpio_group_get_mask (gpio_group * group, uint64_t mask,
+			    uint64_t * bits)
+{
+  uint64_t pending, line_mask, line_bits, result = 0;
+  unsigned int i, r;
+  char level;
+
+  if (group == NULL || bits == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid group or bits pointer");
+      return EXIT_FAILURE;
+    }
+
+  for (r = 0; r < group->num_requests; r++)
+    {
+      pending = mask & group->request_masks[r];
+      line_mask = 0;
+
+      if (pending == 0)
+	continue;
+
+      while (pending)
+	{
+	  i = __builtin_ctzll (pending);
+	  pending &= pending - 1;
+	  line_mask |= 1ULL << group->gpios[i]->line;
+	}
+
+      if (libsoc_gpio_lines_get_values (group->requests[r], line_mask,
+					&line_bits) == EXIT_FAILURE)
+	return EXIT_FAILURE;
+
+      pending = mask & group->request_masks[r];
+
+      while (pending)
+	{
+	  i = __builtin_ctzll (pending);
+	  pending &= pending - 1;
+
+	  if (line_bits & (1ULL << group->gpios[i]->line))
+	    result |= 1ULL << i;
+	}
+    }
+
+  pending = mask & group->sysfs_mask;
+
+  while (pending)
+    {
+      i = __builtin_ctzll (pending);
+      pending &= pending - 1;
+
+      if (file_pread (group->gpios[i]->value_fd, &level, 1) < 1)
+	return EXIT_FAILURE;
+
+      if (level != '0')
+	result |= 1ULL << i;
+    }
+
+  *bits = result;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_gpio_group_free (gpio_group * group)
+{
+  if (group == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid group pointer");
+      return EXIT_FAILURE;
+    }
+
+  free (group);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_gpio_set_edge (gpio * current_gpio, gpio_edge edge)
+{
+  const char *str;
+
+  if (current_gpio == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      return EXIT_FAILURE;
+    }
+
+  libsoc_gpio_debug (__func__, current_gpio->gpio, "setting edge to %s",
+		     gpio_edge_strings[edge]);
+
+  if (current_gpio->lines != NULL)
+    {
+      if (lines_update_flags (current_gpio, LINE_FLAG_EDGE,
+			      line_edge_flags[edge]) == EXIT_FAILURE)
+	return EXIT_FAILURE;
+
+      current_gpio->edge = edge;
+
+      return EXIT_SUCCESS;
+    }
+
+  if (current_gpio->edge_fd < 0)
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio,
+			 "gpio does not support edges");
+      return EXIT_FAILURE;
+    }
+
+  str = gpio_edge_strings[edge];
+
+  if (file_pwrite (current_gpio->edge_fd, str, strlen (str)) < 0)
+    {
+      current_gpio->edge = EDGE_ERROR;
+      return EXIT_FAILURE;
+    }
+
+  current_gpio->edge = edge;
+
+  return EXIT_SUCCESS;
+}
+
+static gpio_edge
+libsoc_gpio_read_edge (gpio * current_gpio)
+{
+  char tmp_str[STR_BUF];
+  uint64_t flags;
+  int len;
+
+  if (current_gpio->lines != NULL)
+    {
+      if (lines_read_info (current_gpio, &flags) == EXIT_FAILURE)
+	return EDGE_ERROR;
+
+      switch (flags & LINE_FLAG_EDGE)
+	{
+	case GPIO_V2_LINE_FLAG_EDGE_RISING:
+	  return RISING;
+	case GPIO_V2_LINE_FLAG_EDGE_FALLING:
+	  return FALLING;
+	case LINE_FLAG_EDGE:
+	  return BOTH;
+	default:
+	  return NONE;
+	}
+    }
+
+  if (current_gpio->edge_fd < 0)
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio,
+			 "gpio does not support edges");
+      return EDGE_ERROR;
+    }
+
+  len = file_pread (current_gpio->edge_fd, tmp_str, STR_BUF - 1);
+
+  if (len < 0)
+    return EDGE_ERROR;
+
+  tmp_str[len] = '\0';
+
+  if (strncmp (tmp_str, "r", 1) == 0)
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio, "read edge as rising");
+      return RISING;
+    }
+  else if (strncmp (tmp_str, "f", 1) == 0)
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio,
+			 "read edge as falling");
+      return FALLING;
+    }
+  else if (strncmp (tmp_str, "b", 1) == 0)
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio,
+			 "read edge as both");
+      return BOTH;
+    }
+  else
+    {
+      libsoc_gpio_debug (__func__, current_gpio->gpio, "read edge as none");
+      return NONE;
+    }
+}
+
+gpio_edge
+libsoc_gpio_get_edge (gpio * current_gpio)
+{
+  if (current_gpio == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      return EDGE_ERROR;
+    }
+
+  if (current_gpio->edge == EDGE_ERROR)
+    current_gpio->edge = libsoc_gpio_read_edge (current_gpio);
+
+  return current_gpio->edge;
+}
+
+int
+libsoc_gpio_resync (gpio * current_gpio)
+{
+  if (current_gpio == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      return EXIT_FAILURE;
+    }
+
+  libsoc_gpio_debug (__func__, current_gpio->gpio,
+		     "resyncing direction and edge");
+
+  current_gpio->direction = libsoc_gpio_read_direction (current_gpio);
+
+  if (current_gpio->direction == DIRECTION_ERROR)
+    return EXIT_FAILURE;
+
+  // A gpio without an edge file has nothing further to resync
+  if (current_gpio->lines == NULL && current_gpio->edge_fd < 0)
+    return EXIT_SUCCESS;
+
+  current_gpio->edge = libsoc_gpio_read_edge (current_gpio);
+
+  if (current_gpio->edge == EDGE_ERROR)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_gpio_wait_interrupt (gpio * gpio, int timeout)
+{
+  if (gpio == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer");
+      return EDGE_ERROR;
+    }
+
+  if (libsoc_gpio_get_direction (gpio) != INPUT)
+    {
+      libsoc_gpio_debug (__func__, gpio->gpio, "gpio is not set as input");
+      return EXIT_FAILURE;
+    }
+
+  gpio_edge test_edge = libsoc_gpio_get_edge (gpio);
+
+  if (test_edge == EDGE_ERROR || test_edge == NONE)
+    {
+      libsoc_gpio_debug (__func__, gpio->gpio,
+			 "edge must be FALLING, RISING or BOTH");
+      return EXIT_FAILURE;
+    }
+
+  if (gpio->lines != NULL)
+    return lines_wait_event (gpio, timeout);
+
+  struct pollfd pfd[1];
+  char buffer[1];
+
+  pfd[0].fd = gpio->value_fd;
+  pfd[0].events = POLLPRI;
+  pfd[0].revents = 0;
+
+  // Read data for clean initial poll
+  pread (pfd[0].fd, buffer, 1, 0);
+
+  int ready = poll (pfd, 1, timeout);
+
+  int ret;
+
+  switch (ready)
+    {
+    case -1:
       libsoc_gpio_debug (__func__, gpio->gpio, "poll failed");
       perror ("libsoc-gpio-debug");
       ret = EXIT_FAILURE;
       break;
 
-    case 0:
-      ret = EXIT_FAILURE;
-      break;
+    case 0:
+      ret = EXIT_FAILURE;
+      break;
+
+    default:
+      ret = EXIT_SUCCESS;
+      break;
+    }
+
+  return ret;
+
+}
+
+/*
+ * All interrupt callbacks are serviced by one epoll instance and a small
+ * pool of dispatcher threads. Each registered gpio owns a slot in a
+ * table, and the epoll data carries the slot index with a generation
+ * count so that events still queued for a cancelled slot are ignored.
+ * EPOLLONESHOT guarantees only one thread services a gpio at a time, the
+ * fd is re-armed once the callback returns. A character device request
+ * has one fd for all of its lines, so it takes a single slot and events
+ * are routed to the gpio of each line by offset.
+ */
+
+#define DISPATCH_MAX_EVENTS 16
+#define DISPATCH_WAKEUP     UINT64_MAX
+#define DISPATCH_NO_SLOT    UINT32_MAX
+
+struct gpio_dispatch_slot {
+  gpio *gpio;
+  gpio_lines *lines;
+  uint32_t generation;
+  uint32_t next_free;
+  int busy;
+  int release_pending;
+  pthread_t busy_thread;
+};
+
+static struct gpio_dispatcher {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  int epoll_fd;
+  int wakeup_fd;
+  unsigned int num_threads;
+  pthread_t *threads;
+  struct gpio_dispatch_slot *slots;
+  uint32_t num_slots;
+  uint32_t free_slot;
+  unsigned int active;
+} dispatcher = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .idle = PTHREAD_COND_INITIALIZER,
+  .epoll_fd = -1,
+  .wakeup_fd = -1,
+  .free_slot = DISPATCH_NO_SLOT,
+};
+
+static uint64_t
+dispatch_key (uint32_t slot, uint32_t generation)
+{
+  return ((uint64_t) generation << 32) | slot;
+}
+
+static int
+dispatch_arm (uint32_t slot, int op)
+{
+  struct epoll_event ev;
+  struct gpio_dispatch_slot *s = &dispatcher.slots[slot];
+
+  ev.data.u64 = dispatch_key (slot, s->generation);
+
+  if (s->lines != NULL)
+    {
+      ev.events = EPOLLIN | EPOLLONESHOT;
+      return epoll_ctl (dispatcher.epoll_fd, op, s->lines->fd, &ev);
+    }
+
+  ev.events = EPOLLPRI | EPOLLONESHOT;
+
+  return epoll_ctl (dispatcher.epoll_fd, op, s->gpio->value_fd, &ev);
+}
+
+// Must be called with the dispatcher lock held
+static void
+dispatch_release_slot (uint32_t slot)
+{
+  struct gpio_dispatch_slot *s = &dispatcher.slots[slot];
+
+  s->gpio = NULL;
+  s->lines = NULL;
+  s->release_pending = 0;
+  s->next_free = dispatcher.free_slot;
+  dispatcher.free_slot = slot;
+  dispatcher.active--;
+}
+
+// Must be called with the dispatcher lock held
+static uint32_t
+dispatch_alloc_slot (gpio * gpio, gpio_lines * lines)
+{
+  uint32_t slot;
+
+  if (dispatcher.free_slot == DISPATCH_NO_SLOT)
+    {
+      uint32_t i, num_slots = dispatcher.num_slots ? dispatcher.num_slots * 2 : 16;
+      struct gpio_dispatch_slot *slots;
+
+      slots = realloc (dispatcher.slots, num_slots * sizeof (*slots));
+
+      if (slots == NULL)
+	return DISPATCH_NO_SLOT;
+
+      for (i = dispatcher.num_slots; i < num_slots; i++)
+	{
+	  slots[i].gpio = NULL;
+	  slots[i].lines = NULL;
+	  slots[i].generation = 0;
+	  slots[i].next_free = (i + 1 < num_slots) ? i + 1 : DISPATCH_NO_SLOT;
+	}
+
+      dispatcher.free_slot = dispatcher.num_slots;
+      dispatcher.slots = slots;
+      dispatcher.num_slots = num_slots;
+    }
+
+  slot = dispatcher.free_slot;
+  dispatcher.free_slot = dispatcher.slots[slot].next_free;
+
+  dispatcher.slots[slot].gpio = gpio;
+  dispatcher.slots[slot].lines = lines;
+  dispatcher.slots[slot].busy = 0;
+  dispatcher.slots[slot].release_pending = 0;
+  dispatcher.active++;
+
+  return slot;
+}
+
+/*
+ * Capture rings are single producer, single consumer. The producer is
+ * whichever dispatcher thread services the gpio, EPOLLONESHOT means only
+ * one does so at a time. The consumer is the caller of
+ * libsoc_gpio_capture_drain. The sequence number counts every edge seen,
+ * including those dropped because the ring was full.
+ */
+
+struct gpio_event_ring {
+  uint32_t head;
+  uint32_t tail;
+  uint32_t mask;
+  uint32_t sequence;
+  gpio_event events[];
+};
+
+static void
+capture_push (struct gpio_event_ring *ring, uint64_t timestamp,
+	      gpio_level level, uint32_t sequence)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail > ring->mask)
+    return;
+
+  ring->events[head & ring->mask].timestamp = timestamp;
+  ring->events[head & ring->mask].level = level;
+  ring->events[head & ring->mask].sequence = sequence;
+
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Character device events carry their own kernel timestamp and per line
+// sequence number, so gaps also show events the kernel had to drop
+static void
+dispatch_line_events (gpio_lines * lines)
+{
+  struct gpio_v2_line_event events[DISPATCH_MAX_EVENTS];
+  struct gpio_event_ring *capture;
+  int (*callback_fn) (void *);
+  void *callback_arg;
+  unsigned int line;
+  int i, n;
+
+  n = read (lines->fd, events, sizeof (events));
+
+  for (i = 0; i < n / (int) sizeof (events[0]); i++)
+    {
+      for (line = 0; line < lines->num_lines; line++)
+	{
+	  if (lines->offsets[line] == events[i].offset)
+	    break;
+	}
+
+      if (line == lines->num_lines)
+	continue;
 
-    default:
-      ret = EXIT_SUCCESS;
-      break;
-    }
+      pthread_mutex_lock (&dispatcher.lock);
 
-  return ret;
+      callback_fn = NULL;
+      callback_arg = NULL;
+      capture = NULL;
+
+      if (lines->gpios[line]->callback != NULL)
+	{
+	  callback_fn = lines->gpios[line]->callback->callback_fn;
+	  callback_arg = lines->gpios[line]->callback->callback_arg;
+	  capture = lines->gpios[line]->callback->capture;
+	}
 
+      pthread_mutex_unlock (&dispatcher.lock);
+
+      libsoc_gpio_debug (__func__, events[i].offset, "caught interrupt");
+
+      if (capture != NULL)
+	capture_push (capture, events[i].timestamp_ns,
+		      events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE ?
+		      HIGH : LOW, events[i].line_seqno - 1);
+
+      if (callback_fn != NULL)
+	callback_fn (callback_arg);
+    }
 }
 
-void *
-__libsoc_new_interrupt_callback_thread (void *void_gpio)
+static void
+dispatch_event (uint64_t key, uint64_t timestamp)
 {
-  gpio *gpio = void_gpio;
+  uint32_t slot = key & 0xffffffff;
+  uint32_t generation = key >> 32;
+  struct gpio_dispatch_slot *s;
+  struct gpio_event_ring *capture = NULL;
+  int (*callback_fn) (void *) = NULL;
+  void *callback_arg = NULL;
+  gpio_lines *lines;
+  gpio *gpio;
+  char buffer[1];
 
-  struct pollfd pfd[1];
+  pthread_mutex_lock (&dispatcher.lock);
 
-  pfd[0].fd = gpio->value_fd;
-  pfd[0].events = POLLPRI;
-  pfd[0].revents = 0;
+  if (slot >= dispatcher.num_slots
+      || (dispatcher.slots[slot].gpio == NULL
+	  && dispatcher.slots[slot].lines == NULL)
+      || dispatcher.slots[slot].generation != generation)
+    {
+      // Event for a gpio that has since been cancelled
+      pthread_mutex_unlock (&dispatcher.lock);
+      return;
+    }
 
-  char buffer[1];
+  s = &dispatcher.slots[slot];
+  gpio = s->gpio;
+  lines = s->lines;
 
-  // Read data for clean initial poll
-  read (pfd[0].fd, buffer, 1);
+  if (gpio != NULL)
+    {
+      callback_fn = gpio->callback->callback_fn;
+      callback_arg = gpio->callback->callback_arg;
+      capture = gpio->callback->capture;
+    }
+
+  s->busy = 1;
+  s->busy_thread = pthread_self ();
+
+  pthread_mutex_unlock (&dispatcher.lock);
+
+  if (lines != NULL)
+    {
+      dispatch_line_events (lines);
+    }
+  else
+    {
+      // Read data to clear the event before running the callback, so an
+      // edge during the callback is reported again once re-armed
+      if (pread (gpio->value_fd, buffer, sizeof (buffer), 0) < 1)
+	buffer[0] = '0';
+
+      libsoc_gpio_debug (__func__, gpio->gpio, "caught interrupt");
+
+      if (capture != NULL)
+	capture_push (capture, timestamp, buffer[0] == '0' ? LOW : HIGH,
+		      capture->sequence++);
+
+      if (callback_fn != NULL)
+	callback_fn (callback_arg);
+    }
+
+  pthread_mutex_lock (&dispatcher.lock);
+
+  s = &dispatcher.slots[slot];
+  s->busy = 0;
 
-  gpio->callback->ready = 1;
+  if (s->release_pending)
+    {
+      // The callback cancelled itself
+      dispatch_release_slot (slot);
+    }
+  else if (s->generation == generation)
+    {
+      dispatch_arm (slot, EPOLL_CTL_MOD);
+    }
 
-  // There is an issue here when I believe a couple of interrupts are 
-  // missed in the test case, and they occur between ready = 1 and the 
-  // start of the poll. Any suggestions would be welcomed...
+  pthread_cond_broadcast (&dispatcher.idle);
+
+  pthread_mutex_unlock (&dispatcher.lock);
+}
+
+static void *
+dispatch_thread (void *arg)
+{
+  struct gpio_dispatcher *d = arg;
+  struct epoll_event events[DISPATCH_MAX_EVENTS];
+  struct timespec now;
+  uint64_t timestamp;
+  int i, n;
 
   while (1)
     {
-      int ready = poll (pfd, 1, -1);
+      n = epoll_wait (d->epoll_fd, events, DISPATCH_MAX_EVENTS, -1);
 
-      switch (ready)
+      if (n < 0)
 	{
-	case 1:
+	  if (errno == EINTR)
+	    continue;
 
-	  if (pfd[0].revents & POLLPRI)
-	    {
-	      libsoc_gpio_debug (__func__, gpio->gpio, "caught interrupt");
-	      gpio->callback->callback_fn (gpio->callback->callback_arg);
+	  perror ("libsoc-gpio-debug");
+	  return NULL;
+	}
 
-	      // Read data to clear poll event
-	      read (pfd[0].fd, buffer, sizeof (buffer));
-	    }
-	  break;
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      timestamp = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
 
-	default:
-	  break;
+      for (i = 0; i < n; i++)
+	{
+	  // The wakeup eventfd is never read, so it stays ready and every
+	  // dispatcher thread sees it
+	  if (events[i].data.u64 == DISPATCH_WAKEUP)
+	    return NULL;
+
+	  dispatch_event (events[i].data.u64, timestamp);
 	}
     }
 }
 
+// Must be called with the dispatcher lock held
+static int
+dispatch_start (unsigned int num_threads)
+{
+  struct epoll_event ev;
+  unsigned int i;
+
+  if (num_threads == 0)
+    num_threads = 1;
+
+  dispatcher.epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+  if (dispatcher.epoll_fd < 0)
+    goto error;
+
+  dispatcher.wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+  if (dispatcher.wakeup_fd < 0)
+    goto error;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = DISPATCH_WAKEUP;
+
+  if (epoll_ctl (dispatcher.epoll_fd, EPOLL_CTL_ADD, dispatcher.wakeup_fd,
+		 &ev) < 0)
+    goto error;
+
+  dispatcher.threads = malloc (num_threads * sizeof (pthread_t));
+
+  if (dispatcher.threads == NULL)
+    goto error;
+
+  for (i = 0; i < num_threads; i++)
+    {
+      if (pthread_create (&dispatcher.threads[i], NULL, dispatch_thread,
+			  &dispatcher) != 0)
+	break;
+
+      dispatcher.num_threads++;
+    }
+
+  if (dispatcher.num_threads == 0)
+    goto error;
+
+  libsoc_gpio_debug (__func__, -1, "dispatcher started with %d threads",
+		     dispatcher.num_threads);
+
+  return EXIT_SUCCESS;
+
+error:
+
+  perror ("libsoc-gpio-debug");
+
+  free (dispatcher.threads);
+  dispatcher.threads = NULL;
+
+  if (dispatcher.wakeup_fd >= 0)
+    close (dispatcher.wakeup_fd);
+
+  if (dispatcher.epoll_fd >= 0)
+    close (dispatcher.epoll_fd);
+
+  dispatcher.wakeup_fd = -1;
+  dispatcher.epoll_fd = -1;
+
+  return EXIT_FAILURE;
+}
+
 int
-libsoc_gpio_callback_interrupt (gpio * gpio, int (*callback_fn) (void *),
-				void *arg)
+libsoc_gpio_dispatcher_init (unsigned int num_threads)
+{
+  int ret = EXIT_FAILURE;
+
+  pthread_mutex_lock (&dispatcher.lock);
+
+  if (dispatcher.epoll_fd >= 0)
+    libsoc_gpio_debug (__func__, -1, "dispatcher already running");
+  else
+    ret = dispatch_start (num_threads);
+
+  pthread_mutex_unlock (&dispatcher.lock);
+
+  return ret;
+}
+
+int
+libsoc_gpio_dispatcher_shutdown ()
 {
-  pthread_t *poll_thread = malloc (sizeof (pthread_t));
-  pthread_attr_t pthread_attr;
+  uint64_t one = 1;
+  unsigned int i;
 
-  pthread_attr_init (&pthread_attr);
-  pthread_attr_setschedpolicy (&pthread_attr, SCHED_FIFO);
+  pthread_mutex_lock (&dispatcher.lock);
 
+  if (dispatcher.epoll_fd < 0)
+    {
+      pthread_mutex_unlock (&dispatcher.lock);
+      return EXIT_SUCCESS;
+    }
+
+  if (dispatcher.active > 0)
+    {
+      libsoc_gpio_debug (__func__, -1, "%d callbacks still registered",
+			 dispatcher.active);
+      pthread_mutex_unlock (&dispatcher.lock);
+      return EXIT_FAILURE;
+    }
+
+  write (dispatcher.wakeup_fd, &one, sizeof (one));
+
+  pthread_mutex_unlock (&dispatcher.lock);
+
+  for (i = 0; i < dispatcher.num_threads; i++)
+    pthread_join (dispatcher.threads[i], NULL);
+
+  pthread_mutex_lock (&dispatcher.lock);
+
+  close (dispatcher.wakeup_fd);
+  close (dispatcher.epoll_fd);
+  free (dispatcher.threads);
+
+  dispatcher.wakeup_fd = -1;
+  dispatcher.epoll_fd = -1;
+  dispatcher.threads = NULL;
+  dispatcher.num_threads = 0;
+
+  pthread_mutex_unlock (&dispatcher.lock);
+
+  libsoc_gpio_debug (__func__, -1, "dispatcher stopped");
+
+  return EXIT_SUCCESS;
+}
+
+// Must be called with the dispatcher lock held, waits until no
+// dispatcher thread is using the slot. Returns 0 if called from the
+// dispatcher thread servicing the slot, which can not wait for itself.
+static int
+dispatch_wait_idle (uint32_t slot)
+{
+  struct gpio_dispatch_slot *s = &dispatcher.slots[slot];
+
+  if (s->busy && pthread_equal (s->busy_thread, pthread_self ()))
+    return 0;
+
+  while (dispatcher.slots[slot].busy)
+    pthread_cond_wait (&dispatcher.idle, &dispatcher.lock);
+
+  return 1;
+}
+
+static int
+dispatch_register (gpio * gpio, int (*callback_fn) (void *), void *arg,
+		   struct gpio_event_ring *capture)
+{
   struct gpio_callback *new_gpio_callback;
+  char buffer[1];
+  uint32_t slot;
 
-  libsoc_gpio_debug (__func__, gpio->gpio, "creating new callback");
+  pthread_mutex_lock (&dispatcher.lock);
+
+  if (gpio->callback != NULL)
+    {
+      // Already watched, attach the callback or capture ring to it
+      if ((callback_fn != NULL && gpio->callback->callback_fn != NULL)
+	  || (capture != NULL && gpio->callback->capture != NULL))
+	{
+	  libsoc_gpio_debug (__func__, gpio->gpio, "already enabled");
+	  pthread_mutex_unlock (&dispatcher.lock);
+	  return EXIT_FAILURE;
+	}
+
+      if (callback_fn != NULL)
+	{
+	  gpio->callback->callback_arg = arg;
+	  gpio->callback->callback_fn = callback_fn;
+	}
+      else
+	{
+	  gpio->callback->capture = capture;
+	}
+
+      pthread_mutex_unlock (&dispatcher.lock);
+      return EXIT_SUCCESS;
+    }
 
   new_gpio_callback = malloc (sizeof (struct gpio_callback));
 
+  if (new_gpio_callback == NULL)
+    goto error;
+
   new_gpio_callback->callback_fn = callback_fn;
   new_gpio_callback->callback_arg = arg;
-  new_gpio_callback->thread = poll_thread;
-
-  gpio->callback = new_gpio_callback;
-
-  new_gpio_callback->ready = 0;
+  new_gpio_callback->capture = capture;
 
-  int ret = pthread_create (poll_thread, NULL,
-			    __libsoc_new_interrupt_callback_thread, gpio);
+  if (dispatcher.epoll_fd < 0 && dispatch_start (1) == EXIT_FAILURE)
+    goto error;
 
-  if (ret == 0)
+  if (gpio->lines != NULL)
     {
-      // Wait for thread to be initialised and ready
-      while (new_gpio_callback->ready != 1)
+      gpio_lines *lines = gpio->lines;
+
+      // The request fd is shared by all of its lines and only needs
+      // adding to epoll for the first one
+      if (lines->watchers == 0)
 	{
-	  usleep (50);
+	  slot = dispatch_alloc_slot (NULL, lines);
+
+	  if (slot == DISPATCH_NO_SLOT)
+	    goto error;
+
+	  if (dispatch_arm (slot, EPOLL_CTL_ADD) < 0)
+	    {
+	      perror ("libsoc-gpio-debug");
+	      dispatch_release_slot (slot);
+	      goto error;
+	    }
+
+	  lines->slot = slot;
 	}
+
+      lines->watchers++;
+
+      new_gpio_callback->slot = lines->slot;
+      gpio->callback = new_gpio_callback;
+
+      pthread_mutex_unlock (&dispatcher.lock);
+
+      return EXIT_SUCCESS;
     }
-  else
+
+  slot = dispatch_alloc_slot (gpio, NULL);
+
+  if (slot == DISPATCH_NO_SLOT)
+    goto error;
+
+  new_gpio_callback->slot = slot;
+  gpio->callback = new_gpio_callback;
+
+  // Read data for clean initial poll
+  pread (gpio->value_fd, buffer, sizeof (buffer), 0);
+
+  if (dispatch_arm (slot, EPOLL_CTL_ADD) < 0)
+    {
+      perror ("libsoc-gpio-debug");
+      dispatch_release_slot (slot);
+      gpio->callback = NULL;
+      goto error;
+    }
+
+  pthread_mutex_unlock (&dispatcher.lock);
+
+  return EXIT_SUCCESS;
+
+error:
+
+  pthread_mutex_unlock (&dispatcher.lock);
+
+  free (new_gpio_callback);
+
+  return EXIT_FAILURE;
+}
+
+// Must be called with the dispatcher lock held
+static void
+dispatch_unregister (gpio * gpio)
+{
+  uint32_t slot = gpio->callback->slot;
+
+  if (gpio->lines != NULL && --gpio->lines->watchers > 0)
     {
-      free (gpio->callback->thread);
+      // Other lines of the request are still watched, only wait for
+      // the dispatcher to stop using this gpio's callback
+      dispatch_wait_idle (slot);
+
       free (gpio->callback);
 
+      gpio->callback = NULL;
+
+      return;
+    }
+
+  epoll_ctl (dispatcher.epoll_fd, EPOLL_CTL_DEL, gpio->value_fd, NULL);
+
+  // Invalidate any events already fetched by another dispatcher thread
+  dispatcher.slots[slot].generation++;
+
+  if (dispatch_wait_idle (slot))
+    dispatch_release_slot (slot);
+  else
+    dispatcher.slots[slot].release_pending = 1;
+
+  free (gpio->callback);
+
+  gpio->callback = NULL;
+}
+
+int
+libsoc_gpio_callback_interrupt (gpio * gpio, int (*callback_fn) (void *),
+				void *arg)
+{
+  if (gpio == NULL || callback_fn == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio or callback pointer");
       return EXIT_FAILURE;
     }
 
-  return EXIT_SUCCESS;
+  libsoc_gpio_debug (__func__, gpio->gpio, "creating new callback");
+
+  return dispatch_register (gpio, callback_fn, arg, NULL);
 }
 
 int
 libsoc_gpio_callback_interrupt_cancel (gpio * gpio)
 {
-  if (gpio->callback->thread == NULL)
+  if (gpio == NULL || gpio->callback == NULL
+      || gpio->callback->callback_fn == NULL)
   {
-    libsoc_gpio_debug (__func__, gpio->gpio, "callback thread was NULL");
+    libsoc_gpio_debug (__func__, -1, "callback was NULL");
     return EXIT_FAILURE;
   }
 
-  pthread_cancel (*gpio->callback->thread);
+  pthread_mutex_lock (&dispatcher.lock);
+
+  if (gpio->callback->capture != NULL)
+    {
+      // Keep the gpio watched for the capture ring
+      gpio->callback->callback_fn = NULL;
+      dispatch_wait_idle (gpio->callback->slot);
+    }
+  else
+    {
+      dispatch_unregister (gpio);
+    }
+
+  pthread_mutex_unlock (&dispatcher.lock);
 
-  pthread_join (*gpio->callback->thread, NULL);
+  libsoc_gpio_debug (__func__, gpio->gpio, "callback was stopped");
 
-  free (gpio->callback->thread);
-  free (gpio->callback);
+  return EXIT_SUCCESS;
+}
 
-  gpio->callback = NULL;
+int
+libsoc_gpio_capture_enable (gpio * gpio, unsigned int capacity)
+{
+  struct gpio_event_ring *ring;
+  uint32_t size = 1;
+
+  if (gpio == NULL || capacity == 0)
+    {
+      libsoc_gpio_debug (__func__, -1, "invalid gpio pointer or capacity");
+      return EXIT_FAILURE;
+    }
+
+  while (size < capacity)
+    size <<= 1;
+
+  libsoc_gpio_debug (__func__, gpio->gpio, "capturing %d events", size);
+
+  ring = calloc (1, sizeof (*ring) + size * sizeof (gpio_event));
+
+  if (ring == NULL)
+    return EXIT_FAILURE;
+
+  ring->mask = size - 1;
+
+  if (dispatch_register (gpio, NULL, NULL, ring) == EXIT_FAILURE)
+    {
+      free (ring);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_gpio_capture_disable (gpio * gpio)
+{
+  struct gpio_event_ring *ring;
+
+  if (gpio == NULL || gpio->callback == NULL
+      || gpio->callback->capture == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "capture was not enabled");
+      return EXIT_FAILURE;
+    }
+
+  pthread_mutex_lock (&dispatcher.lock);
+
+  ring = gpio->callback->capture;
+
+  if (gpio->callback->callback_fn != NULL)
+    {
+      // Keep the gpio watched for the callback
+      gpio->callback->capture = NULL;
+      dispatch_wait_idle (gpio->callback->slot);
+    }
+  else
+    {
+      dispatch_unregister (gpio);
+    }
+
+  pthread_mutex_unlock (&dispatcher.lock);
 
-  libsoc_gpio_debug (__func__, gpio->gpio, "callback thread was stopped");
+  free (ring);
+
+  libsoc_gpio_debug (__func__, gpio->gpio, "capture was stopped");
 
   return EXIT_SUCCESS;
 }
+
+int
+libsoc_gpio_capture_drain (gpio * gpio, gpio_event * events,
+			   unsigned int max_events)
+{
+  struct gpio_event_ring *ring;
+  uint32_t head, tail, count, i;
+
+  if (gpio == NULL || events == NULL || gpio->callback == NULL
+      || gpio->callback->capture == NULL)
+    {
+      libsoc_gpio_debug (__func__, -1, "capture was not enabled");
+      return -1;
+    }
+
+  ring = gpio->callback->capture;
+
+  tail = ring->tail;
+  head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+  count = head - tail;
+
+  if (count > max_events)
+    count = max_events;
+
+  for (i = 0; i < count; i++)
+    events[i] = ring->events[(tail + i) & ring->mask];
+
+  __atomic_store_n (&ring->tail, tail + count, __ATOMIC_RELEASE);
+
+  return count;
+}
@@ -1,16 +1,24 @@
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <linux/types.h>
 
 #include "libsoc_i2c.h"
+#include "libsoc_buffer.h"
 #include "libsoc_debug.h"
 #include "libsoc_file.h"
 
+#define STR_BUF 256
+
+// Register writes up to this size, address included, need no allocation
+#define I2C_REG_WRITE_LOCAL 64
+
 inline void
 libsoc_i2c_debug (const char *func, i2c * i2c, char *format, ...)
 {
@@ -41,6 +49,120 @@ libsoc_i2c_debug (const char *func, i2c * i2c, char *format, ...)
 #endif
 }
 
+static const char *
+libsoc_i2c_dev_dir ()
+{
+  const char *dir = getenv ("LIBSOC_I2C_DEV");
+
+  if (dir == NULL)
+    dir = "/dev";
+
+  return dir;
+}
+
+/*
+ * Open adapters, one per bus number, shared by every device handle on
+ * the bus. The list is only walked when handles are created and freed.
+ */
+static i2c_bus *i2c_buses;
+static pthread_mutex_t i2c_buses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+i2c_bus *
+libsoc_i2c_bus_get (uint8_t bus_num)
+{
+  pthread_mutexattr_t attr;
+  char path[STR_BUF];
+  i2c_bus *bus;
+
+  pthread_mutex_lock (&i2c_buses_lock);
+
+  for (bus = i2c_buses; bus; bus = bus->next)
+    {
+      if (bus->bus == bus_num)
+	{
+	  bus->refs++;
+	  goto done;
+	}
+    }
+
+  libsoc_i2c_debug (__func__, NULL, "opening i2c bus %d", bus_num);
+
+  snprintf (path, STR_BUF, "%s/i2c-%d", libsoc_i2c_dev_dir (), bus_num);
+
+  if (!file_valid (path))
+    {
+      libsoc_i2c_debug (__func__, NULL, "%s not a vaild device", path);
+      goto done;
+    }
+
+  bus = calloc (1, sizeof (i2c_bus));
+
+  if (bus == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "failed to allocate memory");
+      goto done;
+    }
+
+  bus->fd = file_open (path, O_SYNC | O_RDWR);
+
+  if (bus->fd < 0)
+    {
+      libsoc_i2c_debug (__func__, NULL, "%s could not be opened", path);
+      free (bus);
+      bus = NULL;
+      goto done;
+    }
+
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init (&bus->lock, &attr);
+  pthread_mutexattr_destroy (&attr);
+
+  bus->bus = bus_num;
+  bus->refs = 1;
+  bus->slave = -1;
+  bus->timeout = -1;
+  bus->next = i2c_buses;
+  i2c_buses = bus;
+
+done:
+
+  pthread_mutex_unlock (&i2c_buses_lock);
+
+  return bus;
+}
+
+int
+libsoc_i2c_bus_put (i2c_bus * bus)
+{
+  i2c_bus **link;
+
+  if (bus == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "bus was not valid");
+      return EXIT_FAILURE;
+    }
+
+  pthread_mutex_lock (&i2c_buses_lock);
+
+  if (--bus->refs == 0)
+    {
+      libsoc_i2c_debug (__func__, NULL, "closing i2c bus %d", bus->bus);
+
+      for (link = &i2c_buses; *link != bus; link = &(*link)->next)
+	;
+
+      *link = bus->next;
+      file_close (bus->fd);
+      pthread_mutex_destroy (&bus->lock);
+      free (bus);
+    }
+
+  pthread_mutex_unlock (&i2c_buses_lock);
+
+  return EXIT_SUCCESS;
+}
+
 i2c *
 libsoc_i2c_init (uint8_t i2c_bus, uint8_t i2c_address)
 {
@@ -57,34 +179,20 @@ libsoc_i2c_init (uint8_t i2c_bus, uint8_t i2c_address)
       return NULL;
     }
 
-  char path[40];
-
   i2c_dev->bus = i2c_bus;
   i2c_dev->address = i2c_address;
+  i2c_dev->pec = 0;
+  i2c_dev->adapter = libsoc_i2c_bus_get (i2c_bus);
 
-  sprintf (path, "/dev/i2c-%d", i2c_dev->bus);
-
-  if (!file_valid (path))
+  if (i2c_dev->adapter == NULL)
     {
-      libsoc_i2c_debug (__func__, i2c_dev, "%s not a vaild device", path);
-      goto error;
+      free (i2c_dev);
+      return NULL;
     }
 
-  i2c_dev->fd = file_open (path, O_SYNC | O_RDWR);
-
-  if (i2c_dev->fd < 0)
-    {
-      libsoc_i2c_debug (__func__, i2c_dev, "%s could not be opened", path);
-      goto error;
-    }
+  i2c_dev->fd = i2c_dev->adapter->fd;
 
   return i2c_dev;
-
-error:
-
-  free (i2c_dev);
-
-  return NULL;
 }
 
 int
@@ -98,40 +206,113 @@ libsoc_i2c_free (i2c * i2c)
 
   libsoc_i2c_debug (__func__, i2c, "freeing i2c device");
 
+  libsoc_i2c_bus_put (i2c->adapter);
   free (i2c);
 
   return EXIT_SUCCESS;
 }
 
+/*
+ * Messages are built on the caller's stack, so several threads can use
+ * the same handle. The bus lock is recursive and only contended when a
+ * thread holds the bus for a transaction with libsoc_i2c_lock.
+ */
+static int
+libsoc_i2c_transfer (i2c * i2c, struct i2c_msg *messages, int num_messages)
+{
+  struct i2c_rdwr_ioctl_data packets;
+  int ret;
+
+  packets.msgs = messages;
+  packets.nmsgs = num_messages;
+
+  pthread_mutex_lock (&i2c->adapter->lock);
+  ret = ioctl (i2c->fd, I2C_RDWR, &packets);
+  pthread_mutex_unlock (&i2c->adapter->lock);
+
+  if (ret < 0)
+    {
+      libsoc_i2c_debug (__func__, i2c, "message failed");
+      perror ("libsoc-i2c-debug");
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+// Sends the messages stored in the handle, which is not reentrant
 int 
 libsoc_i2c_ioctl(i2c * i2c, int num_messages)
 {
    i2c->packets.msgs = i2c->messages;
    i2c->packets.nmsgs = num_messages;
 
-   if (ioctl(i2c->fd, I2C_RDWR, &i2c->packets) < 0)
-   {
-      libsoc_i2c_debug(__func__, i2c, "message failed");
-      perror ("libsoc-i2c-debug");
+   return libsoc_i2c_transfer (i2c, i2c->messages, num_messages);
+}
+
+int
+libsoc_i2c_lock (i2c * i2c)
+{
+  if (i2c == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "i2c was not valid");
       return EXIT_FAILURE;
-   }
+    }
+
+  pthread_mutex_lock (&i2c->adapter->lock);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_unlock (i2c * i2c)
+{
+  if (i2c == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "i2c was not valid");
+      return EXIT_FAILURE;
+    }
+
+  pthread_mutex_unlock (&i2c->adapter->lock);
 
-   return EXIT_SUCCESS;
+  return EXIT_SUCCESS;
 }
 
+// The timeout belongs to the shared adapter, not to the handle
 int
 libsoc_i2c_set_timeout(i2c * i2c, int timeout)
 {
+   int ret = EXIT_SUCCESS;
+
+   if (i2c == NULL)
+   {
+      libsoc_i2c_debug(__func__, NULL, "i2c was not valid");
+      return EXIT_FAILURE;
+   }
+
+   pthread_mutex_lock (&i2c->adapter->lock);
+
+   if (i2c->adapter->timeout == timeout)
+      goto done;
+
    if (ioctl(i2c->fd, I2C_TIMEOUT, timeout) < 0)
    {
       libsoc_i2c_debug(__func__, i2c, "setting timeout failed");
       perror ("libsoc-i2c-debug");
-      return EXIT_FAILURE;
+      ret = EXIT_FAILURE;
+      goto done;
    }
-   
-   libsoc_i2c_debug(__func__, i2c, "timeout set to %dms", (timeout*10));
-   
-   return EXIT_SUCCESS;
+
+   i2c->adapter->timeout = timeout;
+
+   libsoc_i2c_debug(__func__, i2c, "timeout of i2c-%d set to %dms",
+                    i2c->bus, (timeout*10));
+
+done:
+
+   pthread_mutex_unlock (&i2c->adapter->lock);
+
+   return ret;
 }
 
 int 
@@ -145,12 +326,14 @@ libsoc_i2c_write (i2c * i2c, uint8_t * buffer, uint16_t len)
     
       libsoc_i2c_debug(__func__, i2c, "Writing buffer of length %d", len);
   
-   i2c->messages[0].addr = i2c->address;
-   i2c->messages[0].flags = 0;
-   i2c->messages[0].len = len;
-   i2c->messages[0].buf = buffer;
+   struct i2c_msg message;
 
-   return libsoc_i2c_ioctl(i2c, 1);
+   message.addr = i2c->address;
+   message.flags = 0;
+   message.len = len;
+   message.buf = buffer;
+
+   return libsoc_i2c_transfer (i2c, &message, 1);
 }
 
 int 
@@ -164,11 +347,910 @@ libsoc_i2c_read (i2c * i2c, uint8_t * buffer, uint16_t len)
     
     libsoc_i2c_debug(__func__, i2c, "Reading buffer of length %d", len);
   
-   i2c->messages[0].addr = i2c->address;
-   i2c->messages[0].flags = I2C_M_RD;
-   i2c->messages[0].len = len;
-   i2c->messages[0].buf = buffer;
+   struct i2c_msg message;
+
+   message.addr = i2c->address;
+   message.flags = I2C_M_RD;
+   message.len = len;
+   message.buf = buffer;
+
+   return libsoc_i2c_transfer (i2c, &message, 1);
+}
+
+
+int
+libsoc_i2c_write_read (i2c * i2c, uint8_t * wbuf, uint16_t wlen,
+		       uint8_t * rbuf, uint16_t rlen)
+{
+  if (i2c == NULL || wbuf == NULL || rbuf == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "i2c | buffer was NULL");
+      return EXIT_FAILURE;
+    }
+
+  libsoc_i2c_debug (__func__, i2c, "writing %d bytes then reading %d",
+		    wlen, rlen);
+
+  // Both messages go in one I2C_RDWR, joined by a repeated start
+  struct i2c_msg messages[2];
 
-   return libsoc_i2c_ioctl(i2c, 1);
+  messages[0].addr = i2c->address;
+  messages[0].flags = 0;
+  messages[0].len = wlen;
+  messages[0].buf = wbuf;
+
+  messages[1].addr = i2c->address;
+  messages[1].flags = I2C_M_RD;
+  messages[1].len = rlen;
+  messages[1].buf = rbuf;
+
+  return libsoc_i2c_transfer (i2c, messages, 2);
+}
+
+int
+libsoc_i2c_read_reg (i2c * i2c, uint8_t reg, uint8_t * buffer, uint16_t len)
+{
+  return libsoc_i2c_write_read (i2c, &reg, 1, buffer, len);
+}
+
+int
+libsoc_i2c_read_reg16 (i2c * i2c, uint16_t reg, uint8_t * buffer,
+		       uint16_t len)
+{
+  uint8_t addr[2] = { reg >> 8, reg };
+
+  return libsoc_i2c_write_read (i2c, addr, 2, buffer, len);
+}
+
+// The register address has to lead the data in the same message, short
+// writes are assembled on the stack and longer ones in a pool buffer
+static int
+libsoc_i2c_write_addressed (i2c * i2c, uint8_t * addr, uint16_t addr_len,
+			    uint8_t * buffer, uint16_t len)
+{
+  uint8_t local[I2C_REG_WRITE_LOCAL], *msg = local;
+  uint32_t size = addr_len + len;
+  int ret;
+
+  if (i2c == NULL || buffer == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "i2c | buffer was NULL");
+      return EXIT_FAILURE;
+    }
+
+  if (size > 0xffff)
+    {
+      libsoc_i2c_debug (__func__, i2c, "write of %d bytes is too long",
+			size);
+      return EXIT_FAILURE;
+    }
+
+  if (size > sizeof (local))
+    {
+      msg = libsoc_buffer_alloc (size);
+
+      if (msg == NULL)
+	{
+	  libsoc_i2c_debug (__func__, i2c, "failed to allocate memory");
+	  return EXIT_FAILURE;
+	}
+    }
+
+  memcpy (msg, addr, addr_len);
+  memcpy (msg + addr_len, buffer, len);
+
+  ret = libsoc_i2c_write (i2c, msg, size);
+
+  if (msg != local)
+    libsoc_buffer_free (msg, size);
+
+  return ret;
+}
+
+int
+libsoc_i2c_write_reg (i2c * i2c, uint8_t reg, uint8_t * buffer, uint16_t len)
+{
+  return libsoc_i2c_write_addressed (i2c, &reg, 1, buffer, len);
+}
+
+int
+libsoc_i2c_write_reg16 (i2c * i2c, uint16_t reg, uint8_t * buffer,
+			uint16_t len)
+{
+  uint8_t addr[2] = { reg >> 8, reg };
+
+  return libsoc_i2c_write_addressed (i2c, addr, 2, buffer, len);
+}
+
+// Reads the functionality of the adapter the first time it is asked for
+static unsigned long
+libsoc_i2c_bus_funcs (i2c_bus * bus)
+{
+  pthread_mutex_lock (&bus->lock);
+
+  if (!bus->funcs_probed)
+    {
+      if (ioctl (bus->fd, I2C_FUNCS, &bus->funcs) < 0)
+	{
+	  libsoc_i2c_debug (__func__, NULL, "i2c-%d functionality unknown",
+			    bus->bus);
+	  perror ("libsoc-i2c-debug");
+	  bus->funcs = 0;
+	}
+
+      bus->funcs_probed = 1;
+    }
+
+  pthread_mutex_unlock (&bus->lock);
+
+  return bus->funcs;
+}
+
+int
+libsoc_i2c_get_funcs (i2c * i2c, unsigned long *funcs)
+{
+  if (i2c == NULL || funcs == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "i2c | funcs was NULL");
+      return EXIT_FAILURE;
+    }
+
+  *funcs = libsoc_i2c_bus_funcs (i2c->adapter);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_smbus_set_pec (i2c * i2c, int enable)
+{
+  if (i2c == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "i2c was not valid");
+      return EXIT_FAILURE;
+    }
+
+  if (enable && !(libsoc_i2c_bus_funcs (i2c->adapter) & I2C_FUNC_SMBUS_PEC))
+    {
+      libsoc_i2c_debug (__func__, i2c, "adapter does not support PEC");
+      return EXIT_FAILURE;
+    }
+
+  i2c->pec = enable ? 1 : 0;
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * I2C_SMBUS addresses the device set on the file descriptor with
+ * I2C_SLAVE, and I2C_PEC is also a setting of the descriptor, which all
+ * devices of the bus share. Both are set under the bus lock, and only
+ * when they differ from what the last SMBus transfer on the bus used, so
+ * repeated transfers to one device take a single ioctl each.
+ */
+static int
+libsoc_i2c_smbus (i2c * i2c, char read_write, uint8_t command, int size,
+		  union i2c_smbus_data *data)
+{
+  struct i2c_smbus_ioctl_data args;
+  i2c_bus *bus;
+  int ret = EXIT_FAILURE;
+
+  if (i2c == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "i2c was not valid");
+      return EXIT_FAILURE;
+    }
+
+  bus = i2c->adapter;
+
+  args.read_write = read_write;
+  args.command = command;
+  args.size = size;
+  args.data = data;
+
+  pthread_mutex_lock (&bus->lock);
+
+  if (bus->slave != i2c->address)
+    {
+      if (ioctl (bus->fd, I2C_SLAVE, (unsigned long) i2c->address) < 0)
+	{
+	  libsoc_i2c_debug (__func__, i2c, "setting slave address failed");
+	  perror ("libsoc-i2c-debug");
+	  bus->slave = -1;
+	  goto done;
+	}
+
+      bus->slave = i2c->address;
+    }
+
+  if (bus->pec != i2c->pec)
+    {
+      if (ioctl (bus->fd, I2C_PEC, (unsigned long) i2c->pec) < 0)
+	{
+	  libsoc_i2c_debug (__func__, i2c, "setting PEC failed");
+	  perror ("libsoc-i2c-debug");
+	  goto done;
+	}
+
+      bus->pec = i2c->pec;
+    }
+
+  if (ioctl (bus->fd, I2C_SMBUS, &args) < 0)
+    {
+      libsoc_i2c_debug (__func__, i2c, "smbus transfer failed");
+      perror ("libsoc-i2c-debug");
+      goto done;
+    }
+
+  ret = EXIT_SUCCESS;
+
+done:
+
+  pthread_mutex_unlock (&bus->lock);
+
+  return ret;
+}
+
+int
+libsoc_i2c_smbus_quick (i2c * i2c, uint8_t read_write)
+{
+  return libsoc_i2c_smbus (i2c, read_write, 0, I2C_SMBUS_QUICK, NULL);
+}
+
+int
+libsoc_i2c_smbus_read_byte (i2c * i2c, uint8_t * value)
+{
+  union i2c_smbus_data data;
+
+  if (libsoc_i2c_smbus (i2c, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data)
+      == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  *value = data.byte;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_smbus_write_byte (i2c * i2c, uint8_t value)
+{
+  return libsoc_i2c_smbus (i2c, I2C_SMBUS_WRITE, value, I2C_SMBUS_BYTE, NULL);
 }
 
+int
+libsoc_i2c_smbus_read_byte_data (i2c * i2c, uint8_t command, uint8_t * value)
+{
+  union i2c_smbus_data data;
+
+  if (libsoc_i2c_smbus (i2c, I2C_SMBUS_READ, command, I2C_SMBUS_BYTE_DATA,
+			&data) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  *value = data.byte;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_smbus_write_byte_data (i2c * i2c, uint8_t command, uint8_t value)
+{
+  union i2c_smbus_data data;
+
+  data.byte = value;
+
+  return libsoc_i2c_smbus (i2c, I2C_SMBUS_WRITE, command, I2C_SMBUS_BYTE_DATA,
+			   &data);
+}
+
+int
+libsoc_i2c_smbus_read_word_data (i2c * i2c, uint8_t command,
+				 uint16_t * value)
+{
+  union i2c_smbus_data data;
+
+  if (libsoc_i2c_smbus (i2c, I2C_SMBUS_READ, command, I2C_SMBUS_WORD_DATA,
+			&data) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  *value = data.word;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_smbus_write_word_data (i2c * i2c, uint8_t command, uint16_t value)
+{
+  union i2c_smbus_data data;
+
+  data.word = value;
+
+  return libsoc_i2c_smbus (i2c, I2C_SMBUS_WRITE, command, I2C_SMBUS_WORD_DATA,
+			   &data);
+}
+
+int
+libsoc_i2c_smbus_read_block_data (i2c * i2c, uint8_t command,
+				  uint8_t * buffer, uint8_t * len)
+{
+  union i2c_smbus_data data;
+
+  if (buffer == NULL || len == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "buffer | len was NULL");
+      return EXIT_FAILURE;
+    }
+
+  if (libsoc_i2c_smbus (i2c, I2C_SMBUS_READ, command, I2C_SMBUS_BLOCK_DATA,
+			&data) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  // The count comes from the device, the kernel bounds it
+  *len = data.block[0];
+  memcpy (buffer, &data.block[1], *len);
+
+  return EXIT_SUCCESS;
+}
+
+static int
+libsoc_i2c_smbus_write_block (i2c * i2c, uint8_t command, int size,
+			      uint8_t * buffer, uint8_t len)
+{
+  union i2c_smbus_data data;
+
+  if (buffer == NULL || len > I2C_SMBUS_BLOCK_MAX)
+    {
+      libsoc_i2c_debug (__func__, i2c, "buffer was NULL or longer than %d",
+			I2C_SMBUS_BLOCK_MAX);
+      return EXIT_FAILURE;
+    }
+
+  data.block[0] = len;
+  memcpy (&data.block[1], buffer, len);
+
+  return libsoc_i2c_smbus (i2c, I2C_SMBUS_WRITE, command, size, &data);
+}
+
+int
+libsoc_i2c_smbus_write_block_data (i2c * i2c, uint8_t command,
+				   uint8_t * buffer, uint8_t len)
+{
+  return libsoc_i2c_smbus_write_block (i2c, command, I2C_SMBUS_BLOCK_DATA,
+				       buffer, len);
+}
+
+int
+libsoc_i2c_smbus_read_i2c_block_data (i2c * i2c, uint8_t command,
+				      uint8_t * buffer, uint8_t len)
+{
+  union i2c_smbus_data data;
+
+  if (buffer == NULL || len > I2C_SMBUS_BLOCK_MAX)
+    {
+      libsoc_i2c_debug (__func__, i2c, "buffer was NULL or longer than %d",
+			I2C_SMBUS_BLOCK_MAX);
+      return EXIT_FAILURE;
+    }
+
+  // The length to read is passed in the count byte
+  data.block[0] = len;
+
+  if (libsoc_i2c_smbus (i2c, I2C_SMBUS_READ, command,
+			I2C_SMBUS_I2C_BLOCK_DATA, &data) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  memcpy (buffer, &data.block[1], len);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_smbus_write_i2c_block_data (i2c * i2c, uint8_t command,
+				       uint8_t * buffer, uint8_t len)
+{
+  return libsoc_i2c_smbus_write_block (i2c, command,
+				       I2C_SMBUS_I2C_BLOCK_DATA, buffer, len);
+}
+
+int
+libsoc_i2c_smbus_read_regs (i2c * i2c, uint8_t command, uint8_t * buffer,
+			    uint16_t len)
+{
+  unsigned long funcs;
+  uint16_t done, chunk;
+
+  if (i2c == NULL || buffer == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "i2c | buffer was NULL");
+      return EXIT_FAILURE;
+    }
+
+  funcs = libsoc_i2c_bus_funcs (i2c->adapter);
+
+  // Neither I2C_RDWR nor I2C block transfers carry a PEC, so a checked
+  // read has to use byte reads, which do
+  if (i2c->pec)
+    funcs &= ~(I2C_FUNC_I2C | I2C_FUNC_SMBUS_READ_I2C_BLOCK);
+
+  if (funcs & I2C_FUNC_I2C)
+    return libsoc_i2c_read_reg (i2c, command, buffer, len);
+
+  if (funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK)
+    {
+      for (done = 0; done < len; done += chunk)
+	{
+	  chunk = len - done;
+
+	  if (chunk > I2C_SMBUS_BLOCK_MAX)
+	    chunk = I2C_SMBUS_BLOCK_MAX;
+
+	  if (libsoc_i2c_smbus_read_i2c_block_data (i2c, command + done,
+						    buffer + done, chunk)
+	      == EXIT_FAILURE)
+	    return EXIT_FAILURE;
+	}
+
+      return EXIT_SUCCESS;
+    }
+
+  libsoc_i2c_debug (__func__, i2c, "no block reads or PEC on, reading %d"
+		    " bytes one at a time", len);
+
+  for (done = 0; done < len; done++)
+    {
+      if (libsoc_i2c_smbus_read_byte_data (i2c, command + done,
+					   buffer + done) == EXIT_FAILURE)
+	return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+i2c_batch *
+libsoc_i2c_batch_init ()
+{
+  i2c_batch *batch = calloc (1, sizeof (i2c_batch));
+
+  if (batch == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "failed to allocate memory");
+      return NULL;
+    }
+
+  batch->fd = -1;
+
+  return batch;
+}
+
+static int
+libsoc_i2c_batch_add (i2c_batch * batch, i2c * i2c, uint16_t flags0,
+		      uint8_t * buf0, uint16_t len0, uint8_t * buf1,
+		      uint16_t len1)
+{
+  unsigned int n = buf1 ? 2 : 1, op;
+  struct i2c_msg *msg;
+
+  if (batch == NULL || i2c == NULL || buf0 == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "batch, i2c or buffer was NULL");
+      return -1;
+    }
+
+  if (batch->adapter && batch->adapter != i2c->adapter)
+    {
+      libsoc_i2c_debug (__func__, i2c, "batch is for bus %d", batch->bus);
+      return -1;
+    }
+
+  if (batch->num_messages + n > I2C_BATCH_MAX)
+    {
+      libsoc_i2c_debug (__func__, i2c, "batch is full");
+      return -1;
+    }
+
+  batch->fd = i2c->fd;
+  batch->bus = i2c->bus;
+  batch->adapter = i2c->adapter;
+
+  op = batch->num_ops++;
+  batch->op_messages[op] = n;
+  batch->status[op] = 0;
+
+  msg = &batch->messages[batch->num_messages];
+  batch->num_messages += n;
+
+  msg[0].addr = i2c->address;
+  msg[0].flags = flags0;
+  msg[0].len = len0;
+  msg[0].buf = buf0;
+
+  if (buf1)
+    {
+      msg[1].addr = i2c->address;
+      msg[1].flags = I2C_M_RD;
+      msg[1].len = len1;
+      msg[1].buf = buf1;
+    }
+
+  return op;
+}
+
+int
+libsoc_i2c_batch_add_write (i2c_batch * batch, i2c * i2c, uint8_t * buffer,
+			    uint16_t len)
+{
+  return libsoc_i2c_batch_add (batch, i2c, 0, buffer, len, NULL, 0);
+}
+
+int
+libsoc_i2c_batch_add_read (i2c_batch * batch, i2c * i2c, uint8_t * buffer,
+			   uint16_t len)
+{
+  return libsoc_i2c_batch_add (batch, i2c, I2C_M_RD, buffer, len, NULL, 0);
+}
+
+int
+libsoc_i2c_batch_add_write_read (i2c_batch * batch, i2c * i2c,
+				 uint8_t * wbuf, uint16_t wlen,
+				 uint8_t * rbuf, uint16_t rlen)
+{
+  if (rbuf == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "read buffer was NULL");
+      return -1;
+    }
+
+  return libsoc_i2c_batch_add (batch, i2c, 0, wbuf, wlen, rbuf, rlen);
+}
+
+int
+libsoc_i2c_batch_add_read_reg (i2c_batch * batch, i2c * i2c, uint8_t reg,
+			       uint8_t * buffer, uint16_t len)
+{
+  int op;
+
+  if (batch == NULL || batch->num_ops >= I2C_BATCH_MAX)
+    {
+      libsoc_i2c_debug (__func__, i2c, "batch was NULL or full");
+      return -1;
+    }
+
+  // The address byte lives in the batch so the caller need not keep it
+  batch->regs[batch->num_ops] = reg;
+
+  op = libsoc_i2c_batch_add (batch, i2c, 0, &batch->regs[batch->num_ops], 1,
+			     buffer, len);
+
+  return op;
+}
+
+static int
+libsoc_i2c_batch_ioctl (i2c_batch * batch, unsigned int first,
+			unsigned int count)
+{
+  struct i2c_rdwr_ioctl_data packets;
+  int ret;
+
+  packets.msgs = &batch->messages[first];
+  packets.nmsgs = count;
+
+  pthread_mutex_lock (&batch->adapter->lock);
+  ret = ioctl (batch->fd, I2C_RDWR, &packets);
+  pthread_mutex_unlock (&batch->adapter->lock);
+
+  return ret < 0 ? errno : 0;
+}
+
+/*
+ * I2C_RDWR fails as a whole and does not say which message was not
+ * acknowledged. When an ioctl of several operations fails and the batch
+ * allows it, operations that read are sent again one at a time to find
+ * which devices failed. Writes are not repeated, as they may not be safe
+ * to apply twice, and are all given the error of the combined ioctl.
+ */
+static int
+libsoc_i2c_batch_attribute (i2c_batch * batch, unsigned int op,
+			    unsigned int num_ops, unsigned int first,
+			    int error)
+{
+  unsigned int i, n;
+  int failed = 0;
+
+  for (i = op; i < op + num_ops; i++)
+    {
+      n = batch->op_messages[i];
+
+      if (batch->retry_reads && num_ops > 1
+	  && (batch->messages[first + n - 1].flags & I2C_M_RD))
+	batch->status[i] = libsoc_i2c_batch_ioctl (batch, first, n);
+      else
+	batch->status[i] = error;
+
+      if (batch->status[i])
+	failed++;
+
+      first += n;
+    }
+
+  return failed;
+}
+
+int
+libsoc_i2c_batch_set_retry_reads (i2c_batch * batch, int enable)
+{
+  if (batch == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "batch was not valid");
+      return EXIT_FAILURE;
+    }
+
+  batch->retry_reads = enable ? 1 : 0;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_batch_transfer (i2c_batch * batch)
+{
+  unsigned int op = 0, first = 0, num_ops, count;
+  int error, failed = 0;
+
+  if (batch == NULL || batch->num_ops == 0)
+    {
+      libsoc_i2c_debug (__func__, NULL, "batch was empty");
+      return EXIT_FAILURE;
+    }
+
+  while (op < batch->num_ops)
+    {
+      // As many whole operations as fit in one ioctl
+      for (num_ops = 0, count = 0; op + num_ops < batch->num_ops
+	   && count + batch->op_messages[op + num_ops] <=
+	   I2C_RDWR_IOCTL_MAX_MSGS; num_ops++)
+	count += batch->op_messages[op + num_ops];
+
+      libsoc_i2c_debug (__func__, NULL, "sending %d messages on i2c-%d",
+			count, batch->bus);
+
+      error = libsoc_i2c_batch_ioctl (batch, first, count);
+
+      if (error)
+	failed += libsoc_i2c_batch_attribute (batch, op, num_ops, first,
+					      error);
+      else
+	memset (&batch->status[op], 0, num_ops * sizeof (int));
+
+      op += num_ops;
+      first += count;
+    }
+
+  if (failed)
+    {
+      libsoc_i2c_debug (__func__, NULL, "%d operations failed", failed);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_batch_get_status (i2c_batch * batch, int op)
+{
+  if (batch == NULL || op < 0 || (unsigned int) op >= batch->num_ops)
+    return EINVAL;
+
+  return batch->status[op];
+}
+
+void
+libsoc_i2c_batch_clear (i2c_batch * batch)
+{
+  batch->num_ops = 0;
+  batch->num_messages = 0;
+  batch->fd = -1;
+  batch->adapter = NULL;
+}
+
+int
+libsoc_i2c_batch_free (i2c_batch * batch)
+{
+  if (batch == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "batch was not valid");
+      return EXIT_FAILURE;
+    }
+
+  free (batch);
+
+  return EXIT_SUCCESS;
+}
+
+// Internal flag marking registers that are in the table
+#define I2C_REG_DECLARED 0x80
+
+#define REGMAP_TEST(bits, reg) ((bits)[(reg) >> 3] & (1 << ((reg) & 7)))
+#define REGMAP_SET(bits, reg) ((bits)[(reg) >> 3] |= 1 << ((reg) & 7))
+#define REGMAP_CLEAR(bits, reg) ((bits)[(reg) >> 3] &= ~(1 << ((reg) & 7)))
+
+i2c_regmap *
+libsoc_i2c_regmap_init (i2c * i2c, const i2c_reg * table,
+			unsigned int num_regs)
+{
+  i2c_regmap *map;
+  unsigned int i;
+
+  if (i2c == NULL || table == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "i2c or register table was NULL");
+      return NULL;
+    }
+
+  map = calloc (1, sizeof (i2c_regmap));
+
+  if (map == NULL)
+    {
+      libsoc_i2c_debug (__func__, i2c, "failed to allocate memory");
+      return NULL;
+    }
+
+  map->i2c = i2c;
+
+  for (i = 0; i < num_regs; i++)
+    {
+      // A register that is not cacheable is volatile
+      map->flags[table[i].reg] = table[i].flags | I2C_REG_DECLARED;
+
+      if (!(table[i].flags & I2C_REG_CACHEABLE))
+	map->flags[table[i].reg] |= I2C_REG_VOLATILE;
+    }
+
+  return map;
+}
+
+int
+libsoc_i2c_regmap_read (i2c_regmap * map, uint8_t reg, uint8_t * value)
+{
+  uint8_t flags = map->flags[reg];
+
+  if (!(flags & I2C_REG_DECLARED))
+    {
+      libsoc_i2c_debug (__func__, map->i2c, "register 0x%02x not declared",
+			reg);
+      return EXIT_FAILURE;
+    }
+
+  if (!(flags & I2C_REG_VOLATILE) && REGMAP_TEST (map->valid, reg))
+    {
+      map->stats.hits++;
+      *value = map->values[reg];
+      return EXIT_SUCCESS;
+    }
+
+  map->stats.misses++;
+  map->stats.bus_reads++;
+
+  if (libsoc_i2c_read_reg (map->i2c, reg, value, 1) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  if (!(flags & I2C_REG_VOLATILE))
+    {
+      map->values[reg] = *value;
+      REGMAP_SET (map->valid, reg);
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_regmap_write (i2c_regmap * map, uint8_t reg, uint8_t value)
+{
+  uint8_t flags = map->flags[reg];
+
+  if (!(flags & I2C_REG_DECLARED) || (flags & I2C_REG_READ_ONLY))
+    {
+      libsoc_i2c_debug (__func__, map->i2c, "register 0x%02x not writable",
+			reg);
+      return EXIT_FAILURE;
+    }
+
+  // Volatile registers are written through, others wait for a sync
+  if (flags & I2C_REG_VOLATILE)
+    {
+      map->stats.bus_writes++;
+      map->stats.registers_written++;
+      return libsoc_i2c_write_reg (map->i2c, reg, &value, 1);
+    }
+
+  if (REGMAP_TEST (map->valid, reg) && map->values[reg] == value)
+    return EXIT_SUCCESS;
+
+  map->values[reg] = value;
+  REGMAP_SET (map->valid, reg);
+  REGMAP_SET (map->dirty, reg);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_i2c_regmap_update_bits (i2c_regmap * map, uint8_t reg, uint8_t mask,
+			       uint8_t bits)
+{
+  uint8_t value;
+
+  if (libsoc_i2c_regmap_read (map, reg, &value) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  return libsoc_i2c_regmap_write (map, reg, (value & ~mask) | (bits & mask));
+}
+
+/*
+ * Runs of consecutive dirty registers are written as one burst starting
+ * at the first register of the run, which relies on the device
+ * incrementing its register pointer after each byte, as most do.
+ */
+int
+libsoc_i2c_regmap_sync (i2c_regmap * map)
+{
+  unsigned int reg = 0, end;
+  int ret = EXIT_SUCCESS;
+
+  while (reg < I2C_REGMAP_SIZE)
+    {
+      if (!REGMAP_TEST (map->dirty, reg))
+	{
+	  reg++;
+	  continue;
+	}
+
+      for (end = reg + 1; end < I2C_REGMAP_SIZE && REGMAP_TEST (map->dirty,
+								end); end++)
+	;
+
+      libsoc_i2c_debug (__func__, map->i2c, "writing registers 0x%02x to"
+			" 0x%02x", reg, end - 1);
+
+      map->stats.bus_writes++;
+      map->stats.registers_written += end - reg;
+
+      if (libsoc_i2c_write_reg (map->i2c, reg, &map->values[reg], end - reg)
+	  == EXIT_FAILURE)
+	ret = EXIT_FAILURE;
+      else
+	{
+	  for (; reg < end; reg++)
+	    REGMAP_CLEAR (map->dirty, reg);
+	}
+
+      reg = end;
+    }
+
+  return ret;
+}
+
+void
+libsoc_i2c_regmap_invalidate (i2c_regmap * map)
+{
+  libsoc_i2c_debug (__func__, map->i2c, "dropping cached registers");
+
+  memset (map->valid, 0, sizeof (map->valid));
+  memset (map->dirty, 0, sizeof (map->dirty));
+}
+
+void
+libsoc_i2c_regmap_get_stats (i2c_regmap * map, i2c_regmap_stats * stats)
+{
+  *stats = map->stats;
+}
+
+int
+libsoc_i2c_regmap_free (i2c_regmap * map)
+{
+  if (map == NULL)
+    {
+      libsoc_i2c_debug (__func__, NULL, "regmap was not valid");
+      return EXIT_FAILURE;
+    }
+
+  free (map);
+
+  return EXIT_SUCCESS;
+}
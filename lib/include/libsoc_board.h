@@ -23,10 +23,12 @@ typedef struct pin_mapping {
  * \struct board_config
  * \brief a struct to hold board specific information
  * \param pin_mappings* - the head of the linked list of pin-mappings
+ * \param char[16] - the SoC name from a "SOC = name" line, empty if unset
  */
 
 typedef struct {
   pin_mapping *pin_mappings;
+  char soc[16];
 } board_config;
 
 /**
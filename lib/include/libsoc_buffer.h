@@ -0,0 +1,69 @@
+#ifndef _LIBSOC_BUFFER_H_
+#define _LIBSOC_BUFFER_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \def LIBSOC_BUFFER_MAX
+ * \brief largest buffer kept in the pool, larger ones are allocated and
+ *  freed on every call but are still page aligned
+ */
+
+#define LIBSOC_BUFFER_MAX 65536
+
+/**
+ * \struct libsoc_buffer_stats
+ * \brief counters of the buffer pool
+ * \param unsigned long hits - allocations served from the pool
+ * \param unsigned long misses - allocations that needed new memory
+ * \param unsigned long unpooled - allocations larger than LIBSOC_BUFFER_MAX
+ */
+
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long unpooled;
+} libsoc_buffer_stats;
+
+/**
+ * \fn uint8_t* libsoc_buffer_alloc(uint32_t size)
+ * \brief gets a transfer buffer from the pool. Sizes are rounded up to a
+ *  power of two of at least 64 bytes and the buffer is aligned to its
+ *  size, or to the page size for larger buffers, so it never shares a
+ *  cache line with other data and never straddles a page it does not
+ *  need to. spidev and i2c-dev copy every transfer into buffers of their
+ *  own whatever the alignment, so what the pool saves is the malloc and
+ *  free of each transfer. The buffer is a plain pointer and can be given
+ *  to any spi or i2c transfer call
+ *
+ *  Each thread keeps a small cache of released buffers and refills it
+ *  from a shared lock-free pool, so allocating and releasing take no
+ *  locks and usually no atomic operations
+ * \param uint32_t size - size in bytes
+ * \return uint8_t* buffer or NULL on failure
+ */
+uint8_t* libsoc_buffer_alloc(uint32_t size);
+
+/**
+ * \fn void libsoc_buffer_free(uint8_t* buf, uint32_t size)
+ * \brief returns a buffer to the pool, any thread may free it
+ * \param uint8_t* buf - buffer from libsoc_buffer_alloc or NULL
+ * \param uint32_t size - the size given to libsoc_buffer_alloc
+ */
+void libsoc_buffer_free(uint8_t* buf, uint32_t size);
+
+/**
+ * \fn void libsoc_buffer_get_stats(libsoc_buffer_stats* stats)
+ * \brief copies the pool counters
+ * \param libsoc_buffer_stats* stats - filled with the counters
+ */
+void libsoc_buffer_get_stats(libsoc_buffer_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -2,6 +2,7 @@
 #define _LIBSOC_GPIO_H_
 
 #include <pthread.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,36 +13,20 @@ extern "C" {
  * \brief representation of an interrupt callback
  * \param int (*callback_fn)(void*) - the function to callback on interrupt
  * \param void *callback_arg - the argument to pass to the callback function
- * \param pthread_t *thread - the pthread struct on which the poll and
- *  callback function runs
- * \param int ready - signal when the pthread is ready to accept interrupts
+ * \param struct gpio_event_ring *capture - ring of captured edge events,
+ *  NULL unless capture has been enabled
+ * \param unsigned int slot - index of the gpio in the interrupt dispatcher
  */
 
+struct gpio_event_ring;
+
 struct gpio_callback {
 	int (*callback_fn) (void *);
 	void *callback_arg;
-	pthread_t *thread;
-	int ready;
+	struct gpio_event_ring *capture;
+	unsigned int slot;
 };
 
-/**
- * \struct gpio
- * \brief representation of a single requested gpio
- * \param unsigned int gpio gpio id
- * \param int value_fd file descriptor to gpio value file
- * \param struct gpio_callback *callback - struct used to store interrupt
- *  callback data
- * \param int shared - set if the request flag was shared and the GPIO was
- *  exported on request
- */
-
-typedef struct {
-	unsigned int gpio;
-	int value_fd;
-	struct gpio_callback *callback;
-	int shared;
-} gpio;
-
 /**
  * \enum gpio_direction
  * \brief defined values for input/output direction
@@ -77,6 +62,128 @@ typedef enum {
 	BOTH = 3,
 } gpio_edge;
 
+/**
+ * \struct gpio_event
+ * \brief a captured edge event
+ * \param uint64_t timestamp - CLOCK_MONOTONIC time of the event in ns
+ * \param gpio_level level - level of the gpio after the edge
+ * \param uint32_t sequence - incremented for every edge seen, a gap
+ *  between consecutive drained events is the number of events lost
+ *  because the ring was full
+ */
+
+typedef struct {
+	uint64_t timestamp;
+	gpio_level level;
+	uint32_t sequence;
+} gpio_event;
+
+/**
+ * \def GPIO_LINES_MAX
+ * \brief maximum number of lines in a single character device request
+ */
+
+#define GPIO_LINES_MAX 64
+
+struct gpio_lines;
+
+/**
+ * \struct gpio
+ * \brief representation of a single requested gpio, either a sysfs gpio
+ *  or a line of a character device request
+ * \param unsigned int gpio gpio id, or the line offset on the gpiochip
+ * \param int value_fd file descriptor to gpio value file
+ * \param int direction_fd file descriptor to gpio direction file, -1 if
+ *  the line has a fixed direction
+ * \param int edge_fd file descriptor to gpio edge file, -1 if the gpio
+ *  cannot generate interrupts
+ * \param gpio_direction direction - cached direction, DIRECTION_ERROR
+ *  until it has been set or read
+ * \param gpio_edge edge - cached edge, EDGE_ERROR until it has been set
+ *  or read
+ * \param struct gpio_callback *callback - struct used to store interrupt
+ *  callback and capture data
+ * \param int shared - set if the request flag was shared and the GPIO was
+ *  exported on request
+ * \param struct gpio_lines *lines - the character device request owning
+ *  this gpio, NULL for a sysfs gpio
+ * \param unsigned int line - index of the gpio within lines
+ */
+
+typedef struct {
+	unsigned int gpio;
+	int value_fd;
+	int direction_fd;
+	int edge_fd;
+	gpio_direction direction;
+	gpio_edge edge;
+	struct gpio_callback *callback;
+	int shared;
+	struct gpio_lines *lines;
+	unsigned int line;
+} gpio;
+
+/**
+ * \struct gpio_lines
+ * \brief a set of lines requested together from a /dev/gpiochipN
+ *  character device, all of the lines can be read or written with a
+ *  single ioctl
+ * \param int fd - file descriptor of the line request
+ * \param int chip_fd - file descriptor of the gpiochip
+ * \param unsigned int chip - gpiochip number
+ * \param unsigned int num_lines - number of lines in the request
+ * \param unsigned int offsets[] - offset of each line on the gpiochip
+ * \param uint64_t flags[] - current configuration flags of each line
+ * \param uint64_t values - last output values written, bit n is line n
+ * \param gpio *gpios[] - gpio handle of each line
+ * \param unsigned int watchers - lines registered with the interrupt
+ *  dispatcher
+ * \param unsigned int slot - index of the request in the interrupt
+ *  dispatcher
+ */
+
+typedef struct gpio_lines {
+	int fd;
+	int chip_fd;
+	unsigned int chip;
+	unsigned int num_lines;
+	unsigned int offsets[GPIO_LINES_MAX];
+	uint64_t flags[GPIO_LINES_MAX];
+	uint64_t values;
+	gpio *gpios[GPIO_LINES_MAX];
+	unsigned int watchers;
+	unsigned int slot;
+} gpio_lines;
+
+/**
+ * \def GPIO_GROUP_MAX
+ * \brief maximum number of gpios in a group
+ */
+
+#define GPIO_GROUP_MAX 64
+
+/**
+ * \struct gpio_group
+ * \brief a set of gpios driven and read together through a bitmask, bit
+ *  n is gpio n of the group. Lines of one character device request are
+ *  accessed with a single ioctl, sysfs gpios with one access each
+ * \param unsigned int num_gpios - number of gpios in the group
+ * \param gpio *gpios[] - the gpios of the group, not owned by the group
+ * \param uint64_t sysfs_mask - group bits of the sysfs gpios
+ * \param unsigned int num_requests - number of distinct line requests
+ * \param gpio_lines *requests[] - the line requests used by the group
+ * \param uint64_t request_masks[] - group bits of each line request
+ */
+
+typedef struct {
+	unsigned int num_gpios;
+	gpio *gpios[GPIO_GROUP_MAX];
+	uint64_t sysfs_mask;
+	unsigned int num_requests;
+	gpio_lines *requests[GPIO_GROUP_MAX];
+	uint64_t request_masks[GPIO_GROUP_MAX];
+} gpio_group;
+
 /**
  * \enum gpio_mode  
  * 
@@ -99,7 +206,10 @@ enum gpio_mode {
 
 /**
  * \fn gpio* libsoc_gpio_request(unsigned int gpio_id)
- * \brief request a gpio to use
+ * \brief request a gpio to use, the value, direction and edge files are
+ *  kept open for the life of the gpio. The sysfs root defaults to
+ *  /sys/class/gpio and can be overridden with the LIBSOC_GPIO_SYSFS
+ *  environment variable.
  * \param unsigned int gpio_id - the id of the gpio you wish to request
  * \param unsigned int mode - mode for opening GPIO
  * \return pointer to gpio* on success NULL on fail
@@ -108,9 +218,88 @@ enum gpio_mode {
 
 gpio *libsoc_gpio_request(unsigned int gpio_id, enum gpio_mode mode);
 
+/**
+ * \fn gpio* libsoc_gpio_request_line(unsigned int chip, unsigned int offset, gpio_direction direction)
+ * \brief request a single line from the /dev/gpiochipN character device,
+ *  the returned gpio is used with the same libsoc_gpio_* calls as a sysfs
+ *  gpio. The device directory defaults to /dev and can be overridden with
+ *  the LIBSOC_GPIO_CDEV environment variable.
+ * \param unsigned int chip - the gpiochip number
+ * \param unsigned int offset - the line offset on the gpiochip
+ * \param gpio_direction direction - initial direction, INPUT or OUTPUT
+ * \return pointer to gpio* on success NULL on fail
+ */
+
+gpio *libsoc_gpio_request_line(unsigned int chip, unsigned int offset,
+			       gpio_direction direction);
+
+/**
+ * \fn gpio_lines* libsoc_gpio_lines_request(unsigned int chip, const unsigned int* offsets, unsigned int num_lines, gpio_direction direction)
+ * \brief request several lines of a gpiochip in a single request, so they
+ *  can be read or written together with one ioctl
+ * \param unsigned int chip - the gpiochip number
+ * \param const unsigned int* offsets - the line offsets, line n of the
+ *  request is bit n of the values
+ * \param unsigned int num_lines - number of lines, up to GPIO_LINES_MAX
+ * \param gpio_direction direction - initial direction of every line
+ * \return pointer to gpio_lines* on success NULL on fail
+ */
+
+gpio_lines *libsoc_gpio_lines_request(unsigned int chip,
+				      const unsigned int *offsets,
+				      unsigned int num_lines,
+				      gpio_direction direction);
+
+/**
+ * \fn gpio* libsoc_gpio_lines_get_gpio(gpio_lines* lines, unsigned int index)
+ * \brief get the gpio handle for one line of a request, the handle is
+ *  owned by the request and freed with it
+ * \param gpio_lines* lines - valid line request
+ * \param unsigned int index - index of the line in the request
+ * \return pointer to gpio* on success NULL on fail
+ */
+
+gpio *libsoc_gpio_lines_get_gpio(gpio_lines * lines, unsigned int index);
+
+/**
+ * \fn int libsoc_gpio_lines_set_values(gpio_lines* lines, uint64_t mask, uint64_t bits)
+ * \brief set the level of every line in mask with a single ioctl
+ * \param gpio_lines* lines - valid line request
+ * \param uint64_t mask - lines to set, bit n is line n of the request
+ * \param uint64_t bits - levels to set the lines to
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_lines_set_values(gpio_lines * lines, uint64_t mask,
+				 uint64_t bits);
+
+/**
+ * \fn int libsoc_gpio_lines_get_values(gpio_lines* lines, uint64_t mask, uint64_t* bits)
+ * \brief read the level of every line in mask with a single ioctl
+ * \param gpio_lines* lines - valid line request
+ * \param uint64_t mask - lines to read, bit n is line n of the request
+ * \param uint64_t* bits - set to the levels read, lines outside the
+ *  mask read as 0
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_lines_get_values(gpio_lines * lines, uint64_t mask,
+				 uint64_t * bits);
+
+/**
+ * \fn int libsoc_gpio_lines_free(gpio_lines* lines)
+ * \brief release a line request and the gpio handles of its lines
+ * \param gpio_lines* lines - valid line request
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_lines_free(gpio_lines * lines);
+
 /**
  * \fn int libsoc_gpio_free(gpio* gpio)
- * \brief free a previously requested gpio
+ * \brief free a previously requested gpio. A gpio from
+ * libsoc_gpio_request_line() releases its line request, lines of a bulk
+ * request are released with libsoc_gpio_lines_free()
  * \param gpio* gpio - valid pointer to a requested gpio
  * \return EXIT_SUCCESS or EXIT_FAILURE 
  */
@@ -119,7 +308,8 @@ int libsoc_gpio_free(gpio * gpio);
 
 /**
  * \fn int libsoc_gpio_set_direction(gpio* current_gpio, gpio_direction direction)
- * \brief set GPIO to input or output
+ * \brief set GPIO to input or output, fails on a sysfs gpio with a
+ *  fixed direction, which has no direction file
  * \param gpio* current_gpio - pointer to gpio struct on which to set the direction
  * \param gpio_direction direction - enumerated direction, INPUT or OUTPUT
  * \return EXIT_SUCCESS or EXIT_FAILURE
@@ -129,9 +319,11 @@ int libsoc_gpio_set_direction(gpio * current_gpio, gpio_direction direction);
 
 /**
  * \fn gpio_direction libsoc_gpio_get_direction(gpio* current_gpio)
- * \brief get the current direction of the gpio
+ * \brief get the current direction of the gpio, the direction is read
+ *  from sysfs once and then served from the gpio struct
  * \param gpio* current_gpio - pointer to gpio struct on which to get the direction
- * \return current GPIO direction, INPUT or OUTPUT
+ * \return current GPIO direction, INPUT or OUTPUT, DIRECTION_ERROR if it
+ *  can not be read or the gpio has no direction file
  */
 
 gpio_direction libsoc_gpio_get_direction(gpio * current_gpio);
@@ -166,7 +358,8 @@ void libsoc_gpio_set_debug(int level);
 
 /**
  * \fn gpio_edge libsoc_gpio_get_edge(gpio* current_gpio)
- * \brief gets the current gpio edge value
+ * \brief gets the current gpio edge value, the edge is read from sysfs
+ *  once and then served from the gpio struct
  * \param gpio* current_gpio - pointer to gpio struct on which to get the edge
  * \return gpio_edge, RISING, FALLING or NONE
  */
@@ -183,6 +376,16 @@ gpio_edge libsoc_gpio_get_edge(gpio * current_gpio);
 
 int libsoc_gpio_set_edge(gpio * current_gpio, gpio_edge edge);
 
+/**
+ * \fn int libsoc_gpio_resync(gpio* current_gpio)
+ * \brief re-read the direction and edge of the gpio from sysfs, use this
+ *  when another process may have reconfigured the gpio
+ * \param gpio* current_gpio - the gpio to resync
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_resync(gpio * current_gpio);
+
 /**
  * \fn int libsoc_gpio_wait_interrupt(gpio* gpio, int timeout)
  * \brief takes a gpio and waits for length of timeout or until an
@@ -197,10 +400,33 @@ int libsoc_gpio_set_edge(gpio * current_gpio, gpio_edge edge);
 
 int libsoc_gpio_wait_interrupt(gpio * gpio, int timeout);
 
+/**
+ * \fn int libsoc_gpio_dispatcher_init(unsigned int num_threads)
+ * \brief start the interrupt dispatcher which services every gpio
+ *  callback from a single epoll instance. Calling this is optional, the
+ *  dispatcher is started with one thread when the first callback is
+ *  registered.
+ * \param unsigned int num_threads - number of dispatcher threads, callbacks
+ *  for different gpios may run concurrently when this is more than one
+ * \return EXIT_SUCCESS or EXIT_FAILURE if already running
+ */
+
+int libsoc_gpio_dispatcher_init(unsigned int num_threads);
+
+/**
+ * \fn int libsoc_gpio_dispatcher_shutdown()
+ * \brief stop the dispatcher threads, all callbacks must have been
+ *  cancelled first
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_dispatcher_shutdown();
+
 /**
  * \fn int libsoc_gpio_callback_interrupt(gpio* gpio, int (*callback_fn)(void*), void* arg)
  * \brief takes a gpio and a callback function, when an interrupt occurs
  *  on the edge previously specified, the callback function is called
+ *  from the interrupt dispatcher
  * \param gpio* gpio - the gpio for which you want the interrupt to 
  *  trigger the callback function
  * \param int (*callback_fn)(void*) - the function you wish to call with
@@ -221,6 +447,90 @@ int libsoc_gpio_callback_interrupt(gpio * gpio, int (*callback_fn) (void *),
 
 int libsoc_gpio_callback_interrupt_cancel(gpio * gpio);
 
+/**
+ * \fn int libsoc_gpio_capture_enable(gpio* gpio, unsigned int capacity)
+ * \brief record every interrupt on the gpio as a timestamped gpio_event
+ *  in a lock-free ring, serviced by the interrupt dispatcher. Capture can
+ *  be used together with, or instead of, a callback. Character device
+ *  lines record the kernel timestamp and sequence number of each edge.
+ * \param gpio* gpio - the gpio to capture events from, the edge must
+ *  already be set
+ * \param unsigned int capacity - number of events the ring can hold
+ *  before events are dropped, rounded up to a power of two
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_capture_enable(gpio * gpio, unsigned int capacity);
+
+/**
+ * \fn int libsoc_gpio_capture_disable(gpio* gpio)
+ * \brief stop capturing events and free the ring, must not be called
+ *  while another thread is draining the ring
+ * \param gpio* gpio - gpio with capture enabled
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_capture_disable(gpio * gpio);
+
+/**
+ * \fn int libsoc_gpio_capture_drain(gpio* gpio, gpio_event* events, unsigned int max_events)
+ * \brief copy up to max_events captured events out of the ring in
+ *  arrival order, only one thread may drain a gpio at a time
+ * \param gpio* gpio - gpio with capture enabled
+ * \param gpio_event* events - array to fill
+ * \param unsigned int max_events - size of the events array
+ * \return number of events copied or -1 on failure
+ */
+
+int libsoc_gpio_capture_drain(gpio * gpio, gpio_event * events,
+			      unsigned int max_events);
+
+/**
+ * \fn gpio_group* libsoc_gpio_group_create(gpio** gpios, unsigned int num_gpios)
+ * \brief build a group from already requested gpios, the gpios can mix
+ *  sysfs gpios and lines of any number of character device requests
+ * \param gpio** gpios - the gpios, gpios[n] becomes bit n of the masks
+ * \param unsigned int num_gpios - number of gpios, up to GPIO_GROUP_MAX
+ * \return pointer to gpio_group* on success NULL on fail
+ */
+
+gpio_group *libsoc_gpio_group_create(gpio ** gpios, unsigned int num_gpios);
+
+/**
+ * \fn int libsoc_gpio_group_set_mask(gpio_group* group, uint64_t mask, uint64_t bits)
+ * \brief set the level of every gpio in mask, using one ioctl per line
+ *  request and one write per sysfs gpio
+ * \param gpio_group* group - valid group
+ * \param uint64_t mask - gpios to set
+ * \param uint64_t bits - levels to set the gpios to
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_group_set_mask(gpio_group * group, uint64_t mask,
+			       uint64_t bits);
+
+/**
+ * \fn int libsoc_gpio_group_get_mask(gpio_group* group, uint64_t mask, uint64_t* bits)
+ * \brief read the level of every gpio in mask
+ * \param gpio_group* group - valid group
+ * \param uint64_t mask - gpios to read
+ * \param uint64_t* bits - set to the levels read, gpios outside the mask
+ *  read as 0
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_group_get_mask(gpio_group * group, uint64_t mask,
+			       uint64_t * bits);
+
+/**
+ * \fn int libsoc_gpio_group_free(gpio_group* group)
+ * \brief free a group, the gpios in it are left requested
+ * \param gpio_group* group - valid group
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+
+int libsoc_gpio_group_free(gpio_group * group);
+
 #ifdef __cplusplus
 }
 #endif
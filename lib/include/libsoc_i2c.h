@@ -2,6 +2,7 @@
 #define _LIBSOC_I2C_H_
 
 #include <stdint.h>
+#include <pthread.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
@@ -9,12 +10,50 @@
 extern "C" {
 #endif
 
+/**
+ * \struct i2c_bus
+ * \brief an open i2c adapter, shared by all device handles on the bus and
+ *  closed when the last one is freed
+ * \param int fd - file descriptor of the /dev/i2c-N device
+ * \param uint8_t bus - i2c bus number
+ * \param unsigned int refs - number of users of the adapter
+ * \param pthread_mutex_t lock - recursive lock held for each transfer and
+ *  across transactions taken with libsoc_i2c_lock
+ * \param unsigned long funcs - I2C_FUNCS mask of the adapter, probed the
+ *  first time it is needed
+ * \param int funcs_probed - set once funcs is known
+ * \param int slave - address last set with I2C_SLAVE, -1 if none
+ * \param int pec - packet error checking last set with I2C_PEC
+ * \param int timeout - timeout set with libsoc_i2c_set_timeout, in 10s of
+ *  milliseconds, -1 until one is set
+ */
+
+typedef struct i2c_bus i2c_bus;
+
+struct i2c_bus {
+  int fd;
+  uint8_t bus;
+  unsigned int refs;
+  i2c_bus *next;
+  pthread_mutex_t lock;
+  unsigned long funcs;
+  int funcs_probed;
+  int slave;
+  int pec;
+  int timeout;
+};
+
 /**
  * \struct i2c
- * \brief representation of spi device and chipselect
- * \param int fd - file descriptor to open i2c device
+ * \brief representation of an i2c device on a bus
+ * \param int fd - file descriptor of the shared bus adapter
  * \param uint8_t bus - i2c bus number
  * \param uint8_t address - address of i2c device on the bus
+ * \param packets, messages - unused, transfers build their messages on
+ *  the stack so a handle can be used from several threads
+ * \param i2c_bus* adapter - the shared bus adapter
+ * \param uint8_t pec - SMBus transfers of the device use packet error
+ *  checking
  */
 
 typedef struct {
@@ -23,11 +62,153 @@ typedef struct {
   uint8_t address;
   struct i2c_rdwr_ioctl_data packets;
   struct i2c_msg messages[2];
+  i2c_bus *adapter;
+  uint8_t pec;
 } i2c;
 
+/**
+ * \def I2C_BATCH_MAX
+ * \brief maximum number of messages in a batch, a batch is sent in
+ *  ioctls of up to I2C_RDWR_IOCTL_MAX_MSGS messages each
+ */
+
+#define I2C_BATCH_MAX 128
+
+/**
+ * \struct i2c_batch
+ * \brief operations on several i2c devices of the same bus, sent with as
+ *  few I2C_RDWR ioctls as possible. Each operation is a write, a read or
+ *  a write followed by a read with a repeated start
+ * \param int fd - file descriptor of the bus, from the first device added
+ * \param uint8_t bus - i2c bus number
+ * \param unsigned int num_ops - number of operations added
+ * \param unsigned int num_messages - number of messages added
+ * \param struct i2c_msg messages[] - the messages of all operations
+ * \param uint8_t op_messages[] - number of messages of each operation
+ * \param int status[] - 0 or the errno of each operation
+ * \param uint8_t regs[] - register addresses of read_reg operations
+ * \param i2c_bus* adapter - adapter of the bus
+ * \param int retry_reads - reads of a failed ioctl are sent again one at a
+ *  time to find the devices at fault, set with
+ *  libsoc_i2c_batch_set_retry_reads
+ */
+
+typedef struct {
+  int fd;
+  uint8_t bus;
+  i2c_bus *adapter;
+  int retry_reads;
+  unsigned int num_ops;
+  unsigned int num_messages;
+  struct i2c_msg messages[I2C_BATCH_MAX];
+  uint8_t op_messages[I2C_BATCH_MAX];
+  int status[I2C_BATCH_MAX];
+  uint8_t regs[I2C_BATCH_MAX];
+} i2c_batch;
+
+/**
+ * \def I2C_REG_CACHEABLE
+ * \brief register whose value only changes when written, reads are served
+ *  from the regmap cache and writes are held until a sync
+ */
+
+#define I2C_REG_CACHEABLE 0x01
+
+/**
+ * \def I2C_REG_VOLATILE
+ * \brief register the device may change itself, such as a status or data
+ *  register, always read from and written to the device
+ */
+
+#define I2C_REG_VOLATILE  0x02
+
+/**
+ * \def I2C_REG_READ_ONLY
+ * \brief register that can not be written, may be combined with
+ *  I2C_REG_CACHEABLE for constants such as an id register
+ */
+
+#define I2C_REG_READ_ONLY 0x04
+
+/**
+ * \def I2C_REGMAP_SIZE
+ * \brief number of registers covered by a regmap
+ */
+
+#define I2C_REGMAP_SIZE   256
+
+/**
+ * \struct i2c_reg
+ * \brief an entry of a regmap register table
+ * \param uint8_t reg - register address
+ * \param uint8_t flags - I2C_REG_CACHEABLE or I2C_REG_VOLATILE, and
+ *  optionally I2C_REG_READ_ONLY
+ */
+
+typedef struct {
+  uint8_t reg;
+  uint8_t flags;
+} i2c_reg;
+
+/**
+ * \struct i2c_regmap_stats
+ * \brief counters of a regmap
+ * \param unsigned long hits - register reads served from the cache
+ * \param unsigned long misses - register reads that went to the device
+ * \param unsigned long bus_reads - read transactions on the bus
+ * \param unsigned long bus_writes - write transactions on the bus
+ * \param unsigned long registers_written - registers written by them
+ */
+
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long bus_reads;
+  unsigned long bus_writes;
+  unsigned long registers_written;
+} i2c_regmap_stats;
+
+/**
+ * \struct i2c_regmap
+ * \brief write back cache of the 8 bit registers of an i2c device
+ * \param i2c* i2c - the device
+ * \param uint8_t flags[] - flags of each register, 0 if not declared
+ * \param uint8_t values[] - cached register values
+ * \param uint8_t valid[] - bitmap of registers with a cached value
+ * \param uint8_t dirty[] - bitmap of registers not yet written to the device
+ * \param i2c_regmap_stats stats - counters
+ */
+
+typedef struct {
+  i2c *i2c;
+  uint8_t flags[I2C_REGMAP_SIZE];
+  uint8_t values[I2C_REGMAP_SIZE];
+  uint8_t valid[I2C_REGMAP_SIZE / 8];
+  uint8_t dirty[I2C_REGMAP_SIZE / 8];
+  i2c_regmap_stats stats;
+} i2c_regmap;
+
+/**
+ * \fn i2c_bus * libsoc_i2c_bus_get (uint8_t i2c_bus)
+ * \brief gets a reference to the adapter of a bus, opening /dev/i2c-N
+ *  only if no one has it open yet
+ * \param uint8_t i2c_bus - the linux enumerated bus number
+ * \return i2c_bus* or NULL on failure
+ */
+i2c_bus * libsoc_i2c_bus_get (uint8_t i2c_bus);
+
+/**
+ * \fn int libsoc_i2c_bus_put (i2c_bus * bus)
+ * \brief drops a reference to an adapter, the last one closes it
+ * \param i2c_bus* bus - adapter from libsoc_i2c_bus_get
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_bus_put (i2c_bus * bus);
+
 /**
  * \fn i2c * libsoc_i2c_init (uint8_t i2c_bus, uint8_t i2c_address)
- * \brief initialises new i2c instance at specified address
+ * \brief initialises new i2c instance at specified address. All handles
+ *  on a bus share one open adapter, so only the first makes syscalls
  * \param uint8_t i2c_bus - the linux enumerated bus number
  * \param uint8_t i2c_address - 
  * \return i2c* struct pointer or NULL on failure
@@ -36,12 +217,31 @@ i2c * libsoc_i2c_init (uint8_t i2c_bus, uint8_t i2c_address);
 
 /**
  * \fn libsoc_i2c_free (i2c * i2c)
- * \brief frees the malloced i2c struct
+ * \brief frees the malloced i2c struct, the bus adapter is closed with
+ *  the last handle on it
  * \param i2c* i2c - valid i2c struct pointer
  * \return EXIT_SUCCESS or EXIT_FAILURE
  */
 int libsoc_i2c_free (i2c * i2c);
 
+/**
+ * \fn libsoc_i2c_lock(i2c *i2c)
+ * \brief holds the bus of the device so a transaction of several calls,
+ *  on this or other devices of the bus, is not interleaved with transfers
+ *  from other threads. Single calls need no lock, the lock is recursive
+ * \param i2c *i2c - valid i2c device struct
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_lock (i2c * i2c);
+
+/**
+ * \fn libsoc_i2c_unlock(i2c *i2c)
+ * \brief releases the bus held with libsoc_i2c_lock
+ * \param i2c *i2c - valid i2c device struct
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_unlock (i2c * i2c);
+
 /**
  * \fn libsoc_i2c_write(i2c *i2c, uint8_t *buffer, uint16_t len)
  * \brief write a specified amount of data to i2c slave
@@ -62,10 +262,426 @@ int libsoc_i2c_write (i2c * i2c, uint8_t * buffer, uint16_t len);
  */
 int libsoc_i2c_read (i2c * i2c, uint8_t * buffer, uint16_t len);
 
+/**
+ * \fn libsoc_i2c_write_read(i2c *i2c, uint8_t *wbuf, uint16_t wlen, uint8_t *rbuf, uint16_t rlen)
+ * \brief write to an i2c slave and then read from it in one I2C_RDWR
+ *  ioctl, with a repeated start instead of a stop between the two
+ * \param i2c *i2c - valid i2c device struct
+ * \param uint8_t *wbuf - pointer to output data buffer
+ * \param uint16_t wlen - length of wbuf in bytes
+ * \param uint8_t *rbuf - pointer to input data buffer
+ * \param uint16_t rlen - length of rbuf in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_write_read (i2c * i2c, uint8_t * wbuf, uint16_t wlen,
+  uint8_t * rbuf, uint16_t rlen);
+
+/**
+ * \fn libsoc_i2c_read_reg(i2c *i2c, uint8_t reg, uint8_t *buffer, uint16_t len)
+ * \brief read len bytes starting at an 8 bit register address, the
+ *  address is written and the data read back with a repeated start
+ * \param i2c *i2c - valid i2c device struct
+ * \param uint8_t reg - register address
+ * \param uint8_t *buffer - pointer to input data buffer
+ * \param uint16_t len - length of buffer in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_read_reg (i2c * i2c, uint8_t reg, uint8_t * buffer,
+  uint16_t len);
+
+/**
+ * \fn libsoc_i2c_read_reg16(i2c *i2c, uint16_t reg, uint8_t *buffer, uint16_t len)
+ * \brief read len bytes starting at a 16 bit register address, sent
+ *  most significant byte first
+ * \param i2c *i2c - valid i2c device struct
+ * \param uint16_t reg - register address
+ * \param uint8_t *buffer - pointer to input data buffer
+ * \param uint16_t len - length of buffer in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_read_reg16 (i2c * i2c, uint16_t reg, uint8_t * buffer,
+  uint16_t len);
+
+/**
+ * \fn libsoc_i2c_write_reg(i2c *i2c, uint8_t reg, uint8_t *buffer, uint16_t len)
+ * \brief write len bytes starting at an 8 bit register address, the
+ *  address and data are sent in one message
+ * \param i2c *i2c - valid i2c device struct
+ * \param uint8_t reg - register address
+ * \param uint8_t *buffer - pointer to output data buffer
+ * \param uint16_t len - length of buffer in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_write_reg (i2c * i2c, uint8_t reg, uint8_t * buffer,
+  uint16_t len);
+
+/**
+ * \fn libsoc_i2c_write_reg16(i2c *i2c, uint16_t reg, uint8_t *buffer, uint16_t len)
+ * \brief write len bytes starting at a 16 bit register address, sent
+ *  most significant byte first
+ * \param i2c *i2c - valid i2c device struct
+ * \param uint16_t reg - register address
+ * \param uint8_t *buffer - pointer to output data buffer
+ * \param uint16_t len - length of buffer in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_write_reg16 (i2c * i2c, uint16_t reg, uint8_t * buffer,
+  uint16_t len);
+
+/**
+ * \fn i2c_batch* libsoc_i2c_batch_init()
+ * \brief allocates an empty batch
+ * \return i2c_batch* or NULL on failure
+ */
+i2c_batch* libsoc_i2c_batch_init ();
+
+/**
+ * \fn int libsoc_i2c_batch_add_write(i2c_batch* batch, i2c* i2c, uint8_t* buffer, uint16_t len)
+ * \brief adds a write to a device, all devices of a batch must be on the
+ *  same bus. Buffers must stay valid until the batch is transferred
+ * \param i2c_batch* batch - valid batch
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t* buffer - pointer to output data buffer
+ * \param uint16_t len - length of buffer in bytes
+ * \return int - operation index for libsoc_i2c_batch_get_status, or -1
+ */
+int libsoc_i2c_batch_add_write (i2c_batch * batch, i2c * i2c,
+  uint8_t * buffer, uint16_t len);
+
+/**
+ * \fn int libsoc_i2c_batch_add_read(i2c_batch* batch, i2c* i2c, uint8_t* buffer, uint16_t len)
+ * \brief adds a read from a device into its own buffer
+ * \param i2c_batch* batch - valid batch
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t* buffer - pointer to input data buffer
+ * \param uint16_t len - length of buffer in bytes
+ * \return int - operation index for libsoc_i2c_batch_get_status, or -1
+ */
+int libsoc_i2c_batch_add_read (i2c_batch * batch, i2c * i2c,
+  uint8_t * buffer, uint16_t len);
+
+/**
+ * \fn int libsoc_i2c_batch_add_write_read(i2c_batch* batch, i2c* i2c, uint8_t* wbuf, uint16_t wlen, uint8_t* rbuf, uint16_t rlen)
+ * \brief adds a write then read with a repeated start, the two messages
+ *  are always sent in the same ioctl
+ * \param i2c_batch* batch - valid batch
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t* wbuf - pointer to output data buffer
+ * \param uint16_t wlen - length of wbuf in bytes
+ * \param uint8_t* rbuf - pointer to input data buffer
+ * \param uint16_t rlen - length of rbuf in bytes
+ * \return int - operation index for libsoc_i2c_batch_get_status, or -1
+ */
+int libsoc_i2c_batch_add_write_read (i2c_batch * batch, i2c * i2c,
+  uint8_t * wbuf, uint16_t wlen, uint8_t * rbuf, uint16_t rlen);
+
+/**
+ * \fn int libsoc_i2c_batch_add_read_reg(i2c_batch* batch, i2c* i2c, uint8_t reg, uint8_t* buffer, uint16_t len)
+ * \brief adds a read of len bytes from an 8 bit register address
+ * \param i2c_batch* batch - valid batch
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t reg - register address
+ * \param uint8_t* buffer - pointer to input data buffer
+ * \param uint16_t len - length of buffer in bytes
+ * \return int - operation index for libsoc_i2c_batch_get_status, or -1
+ */
+int libsoc_i2c_batch_add_read_reg (i2c_batch * batch, i2c * i2c,
+  uint8_t reg, uint8_t * buffer, uint16_t len);
+
+/**
+ * \fn int libsoc_i2c_batch_set_retry_reads(i2c_batch* batch, int enable)
+ * \brief when an ioctl fails, sends its operations that read again one
+ *  at a time to find the devices at fault. Off by default: operations
+ *  before the one that was not acknowledged may already have completed,
+ *  and reading them again loses data from registers that clear on read
+ *  or FIFOs. Only enable it when every read of the batch can be repeated
+ * \param i2c_batch* batch - valid batch
+ * \param int enable - 1 to retry reads, 0 not to
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_batch_set_retry_reads (i2c_batch * batch, int enable);
+
+/**
+ * \fn int libsoc_i2c_batch_transfer(i2c_batch* batch)
+ * \brief sends the batch in as few I2C_RDWR ioctls as possible. The bus
+ *  reports a failure for a whole ioctl, so every operation of a failed
+ *  ioctl gets its error, unless reads are retried with
+ *  libsoc_i2c_batch_set_retry_reads. Writes are never sent twice
+ * \param i2c_batch* batch - valid batch
+ * \return EXIT_SUCCESS, or EXIT_FAILURE if any operation failed
+ */
+int libsoc_i2c_batch_transfer (i2c_batch * batch);
+
+/**
+ * \fn int libsoc_i2c_batch_get_status(i2c_batch* batch, int op)
+ * \brief gets the result of an operation of the last transfer
+ * \param i2c_batch* batch - valid batch
+ * \param int op - operation index returned when it was added
+ * \return int - 0 on success or the errno it failed with
+ */
+int libsoc_i2c_batch_get_status (i2c_batch * batch, int op);
+
+/**
+ * \fn void libsoc_i2c_batch_clear(i2c_batch* batch)
+ * \brief removes all operations so the batch can be built again
+ * \param i2c_batch* batch - valid batch
+ */
+void libsoc_i2c_batch_clear (i2c_batch * batch);
+
+/**
+ * \fn int libsoc_i2c_batch_free(i2c_batch* batch)
+ * \brief frees the batch
+ * \param i2c_batch* batch - valid batch
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_batch_free (i2c_batch * batch);
+
+/**
+ * \fn i2c_regmap* libsoc_i2c_regmap_init(i2c* i2c, const i2c_reg* table, unsigned int num_regs)
+ * \brief creates a register cache for a device with 8 bit registers. Only
+ *  registers in the table can be accessed
+ * \param i2c* i2c - valid i2c device struct
+ * \param const i2c_reg* table - the registers of the device
+ * \param unsigned int num_regs - number of entries in table
+ * \return i2c_regmap* or NULL on failure
+ */
+i2c_regmap* libsoc_i2c_regmap_init (i2c * i2c, const i2c_reg * table,
+  unsigned int num_regs);
+
+/**
+ * \fn int libsoc_i2c_regmap_read(i2c_regmap* map, uint8_t reg, uint8_t* value)
+ * \brief reads a register, cacheable registers only go to the device the
+ *  first time
+ * \param i2c_regmap* map - valid regmap
+ * \param uint8_t reg - register address
+ * \param uint8_t* value - filled with the register value
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_regmap_read (i2c_regmap * map, uint8_t reg, uint8_t * value);
+
+/**
+ * \fn int libsoc_i2c_regmap_write(i2c_regmap* map, uint8_t reg, uint8_t value)
+ * \brief writes a register. Volatile registers are written to the device
+ *  at once, cacheable ones are marked dirty and written by
+ *  libsoc_i2c_regmap_sync, writing an unchanged value does nothing
+ * \param i2c_regmap* map - valid regmap
+ * \param uint8_t reg - register address
+ * \param uint8_t value - new value
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_regmap_write (i2c_regmap * map, uint8_t reg, uint8_t value);
+
+/**
+ * \fn int libsoc_i2c_regmap_update_bits(i2c_regmap* map, uint8_t reg, uint8_t mask, uint8_t bits)
+ * \brief sets the bits of a register selected by mask to bits, a read
+ *  modify write that needs no bus access once a cacheable register is
+ *  known
+ * \param i2c_regmap* map - valid regmap
+ * \param uint8_t reg - register address
+ * \param uint8_t mask - bits to change
+ * \param uint8_t bits - new values of those bits
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_regmap_update_bits (i2c_regmap * map, uint8_t reg,
+  uint8_t mask, uint8_t bits);
+
+/**
+ * \fn int libsoc_i2c_regmap_sync(i2c_regmap* map)
+ * \brief writes all dirty registers to the device. Each run of
+ *  consecutive dirty registers is sent as one burst write, which needs
+ *  the device to auto increment its register address
+ * \param i2c_regmap* map - valid regmap
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_regmap_sync (i2c_regmap * map);
+
+/**
+ * \fn void libsoc_i2c_regmap_invalidate(i2c_regmap* map)
+ * \brief forgets all cached values and unsynced writes, for example after
+ *  the device has been reset
+ * \param i2c_regmap* map - valid regmap
+ */
+void libsoc_i2c_regmap_invalidate (i2c_regmap * map);
+
+/**
+ * \fn void libsoc_i2c_regmap_get_stats(i2c_regmap* map, i2c_regmap_stats* stats)
+ * \brief copies the counters of the regmap
+ * \param i2c_regmap* map - valid regmap
+ * \param i2c_regmap_stats* stats - filled with the counters
+ */
+void libsoc_i2c_regmap_get_stats (i2c_regmap * map, i2c_regmap_stats * stats);
+
+/**
+ * \fn int libsoc_i2c_regmap_free(i2c_regmap* map)
+ * \brief frees the regmap, unsynced writes are lost
+ * \param i2c_regmap* map - valid regmap
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_regmap_free (i2c_regmap * map);
+
+/**
+ * \fn int libsoc_i2c_get_funcs(i2c* i2c, unsigned long* funcs)
+ * \brief gets the I2C_FUNC_* mask of the adapter of the device. It is
+ *  read with I2C_FUNCS once per bus and served from the bus afterwards
+ * \param i2c* i2c - valid i2c device struct
+ * \param unsigned long* funcs - filled with the mask
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_get_funcs (i2c * i2c, unsigned long *funcs);
+
+/**
+ * \fn int libsoc_i2c_smbus_set_pec(i2c* i2c, int enable)
+ * \brief enables or disables packet error checking on the SMBus
+ *  transfers of the device, only if the adapter has I2C_FUNC_SMBUS_PEC
+ * \param i2c* i2c - valid i2c device struct
+ * \param int enable - 1 to use PEC, 0 not to
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_set_pec (i2c * i2c, int enable);
+
+/**
+ * \fn int libsoc_i2c_smbus_quick(i2c* i2c, uint8_t read_write)
+ * \brief sends an SMBus quick command, only the read/write bit
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t read_write - I2C_SMBUS_READ or I2C_SMBUS_WRITE
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_quick (i2c * i2c, uint8_t read_write);
+
+/**
+ * \fn int libsoc_i2c_smbus_read_byte(i2c* i2c, uint8_t* value)
+ * \brief SMBus receive byte, a read of one byte with no command
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t* value - filled with the byte
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_read_byte (i2c * i2c, uint8_t * value);
+
+/**
+ * \fn int libsoc_i2c_smbus_write_byte(i2c* i2c, uint8_t value)
+ * \brief SMBus send byte, a write of one byte with no command
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t value - the byte
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_write_byte (i2c * i2c, uint8_t value);
+
+/**
+ * \fn int libsoc_i2c_smbus_read_byte_data(i2c* i2c, uint8_t command, uint8_t* value)
+ * \brief SMBus read byte, reads the byte at a command code
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - command code or register address
+ * \param uint8_t* value - filled with the byte
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_read_byte_data (i2c * i2c, uint8_t command,
+  uint8_t * value);
+
+/**
+ * \fn int libsoc_i2c_smbus_write_byte_data(i2c* i2c, uint8_t command, uint8_t value)
+ * \brief SMBus write byte, writes the byte at a command code
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - command code or register address
+ * \param uint8_t value - the byte
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_write_byte_data (i2c * i2c, uint8_t command,
+  uint8_t value);
+
+/**
+ * \fn int libsoc_i2c_smbus_read_word_data(i2c* i2c, uint8_t command, uint16_t* value)
+ * \brief SMBus read word, the device sends the low byte first
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - command code or register address
+ * \param uint16_t* value - filled with the word
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_read_word_data (i2c * i2c, uint8_t command,
+  uint16_t * value);
+
+/**
+ * \fn int libsoc_i2c_smbus_write_word_data(i2c* i2c, uint8_t command, uint16_t value)
+ * \brief SMBus write word, the low byte is sent first
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - command code or register address
+ * \param uint16_t value - the word
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_write_word_data (i2c * i2c, uint8_t command,
+  uint16_t value);
+
+/**
+ * \fn int libsoc_i2c_smbus_read_block_data(i2c* i2c, uint8_t command, uint8_t* buffer, uint8_t* len)
+ * \brief SMBus block read, the device sends a count then that many bytes
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - command code
+ * \param uint8_t* buffer - room for I2C_SMBUS_BLOCK_MAX bytes
+ * \param uint8_t* len - filled with the count sent by the device
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_read_block_data (i2c * i2c, uint8_t command,
+  uint8_t * buffer, uint8_t * len);
+
+/**
+ * \fn int libsoc_i2c_smbus_write_block_data(i2c* i2c, uint8_t command, uint8_t* buffer, uint8_t len)
+ * \brief SMBus block write, a count then up to I2C_SMBUS_BLOCK_MAX bytes
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - command code
+ * \param uint8_t* buffer - pointer to output data buffer
+ * \param uint8_t len - length of buffer in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_write_block_data (i2c * i2c, uint8_t command,
+  uint8_t * buffer, uint8_t len);
+
+/**
+ * \fn int libsoc_i2c_smbus_read_i2c_block_data(i2c* i2c, uint8_t command, uint8_t* buffer, uint8_t len)
+ * \brief reads up to I2C_SMBUS_BLOCK_MAX bytes from a command code with
+ *  no count byte, as an 8 bit register read
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - command code or register address
+ * \param uint8_t* buffer - pointer to input data buffer
+ * \param uint8_t len - length of buffer in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_read_i2c_block_data (i2c * i2c, uint8_t command,
+  uint8_t * buffer, uint8_t len);
+
+/**
+ * \fn int libsoc_i2c_smbus_write_i2c_block_data(i2c* i2c, uint8_t command, uint8_t* buffer, uint8_t len)
+ * \brief writes up to I2C_SMBUS_BLOCK_MAX bytes at a command code with no
+ *  count byte
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - command code or register address
+ * \param uint8_t* buffer - pointer to output data buffer
+ * \param uint8_t len - length of buffer in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_write_i2c_block_data (i2c * i2c, uint8_t command,
+  uint8_t * buffer, uint8_t len);
+
+/**
+ * \fn int libsoc_i2c_smbus_read_regs(i2c* i2c, uint8_t command, uint8_t* buffer, uint16_t len)
+ * \brief reads len bytes from consecutive registers with the fewest
+ *  transactions the adapter allows: one I2C_RDWR read if it is a plain
+ *  i2c adapter, otherwise I2C block reads of up to I2C_SMBUS_BLOCK_MAX
+ *  bytes, and a byte read per register if the adapter has neither. With
+ *  PEC on every register is read with its own checked byte read, as the
+ *  other two carry no PEC
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t command - first register address
+ * \param uint8_t* buffer - pointer to input data buffer
+ * \param uint16_t len - length of buffer in bytes
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_i2c_smbus_read_regs (i2c * i2c, uint8_t command,
+  uint8_t * buffer, uint16_t len);
+
 /**
  * \fn libsoc_i2c_set_timeout(i2c *i2c, int timeout)
  * \brief set the timeout in is 10's of milliseconds, i.e. a timeout of
- * 2 is 2 x 10ms = 20ms
+ * 2 is 2 x 10ms = 20ms. The timeout is a setting of the adapter, so it
+ * applies to every device handle on the same bus
  * \param i2c *i2c - valid i2c device struct
  * \return EXIT_SUCCESS or EXIT_FAILURE 
  */
@@ -1,19 +1,100 @@
 #ifndef _LIBSOC_MMAP_GPIO_H_
 #define _LIBSOC_MMAP_GPIO_H_
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * \def MMAP_GPIO_NO_REG
+ * \brief register offset of a register the SoC does not have
+ */
+
+#define MMAP_GPIO_NO_REG 0xffffffff
+
+/**
+ * \def MMAP_GPIO_MAX_BANKS
+ * \brief maximum number of gpio banks of a SoC
+ */
+
+#define MMAP_GPIO_MAX_BANKS 16
+
+/**
+ * \struct mmap_gpio_soc
+ * \brief register layout of a SoC gpio controller. Banks of 32 gpios are
+ *  addressed as ports 'A', 'B', ... and all offsets are relative to the
+ *  start of a bank
+ * \param const char* name - SoC name used to select the descriptor
+ * \param unsigned long base - physical address of bank 0
+ * \param unsigned long size - bytes to map, from base for strided banks or
+ *  from each bank base
+ * \param unsigned int num_banks - number of banks
+ * \param unsigned int bank_stride - distance between banks that share one
+ *  mapping
+ * \param const unsigned long* bank_bases - physical address of each bank
+ *  when they are not evenly spaced, NULL otherwise
+ * \param const unsigned int* bank_pins - number of gpios in each bank when
+ *  some have fewer than 32, NULL otherwise
+ * \param unsigned int data_in - input level register
+ * \param unsigned int data_out - output level register
+ * \param unsigned int set - write one to set register or MMAP_GPIO_NO_REG
+ * \param unsigned int clear - write one to clear register or
+ *  MMAP_GPIO_NO_REG
+ * \param unsigned int dir - first direction/function register
+ * \param unsigned int dir_bits - bits per gpio in the dir registers
+ * \param unsigned int dir_banked - set if every bank has its own dir
+ *  registers, otherwise they are indexed by bank * 32 + pin from bank 0
+ * \param int dir_input - dir field value of an input
+ * \param int dir_output - dir field value of an output
+ * \param unsigned int pull - first pull register or MMAP_GPIO_NO_REG
+ * \param unsigned int pull_bits - bits per gpio in the pull registers
+ * \param unsigned int drive - first drive level register or
+ *  MMAP_GPIO_NO_REG
+ * \param unsigned int drive_bits - bits per gpio in the drive registers
+ */
+
+typedef struct {
+	const char* name;
+	unsigned long base;
+	unsigned long size;
+	unsigned int num_banks;
+	unsigned int bank_stride;
+	const unsigned long* bank_bases;
+	const unsigned int* bank_pins;
+	unsigned int data_in;
+	unsigned int data_out;
+	unsigned int set;
+	unsigned int clear;
+	unsigned int dir;
+	unsigned int dir_bits;
+	unsigned int dir_banked;
+	int dir_input;
+	int dir_output;
+	unsigned int pull;
+	unsigned int pull_bits;
+	unsigned int drive;
+	unsigned int drive_bits;
+} mmap_gpio_soc;
+
 /**
  * \struct mmap_gpio
  * \brief representation of an pointers to the port registers
- * \param int cfg - the configure register
- * \param int pull - the pull register
- * \param int drv_level - the multi-driven register
+ * \param int cfg - the direction/function field
+ * \param int pull - the pull field, -1 if the SoC has no pull register
+ * \param int drv_level - the multi-driven field, -1 if the SoC has no
+ *  drive register
  * \param int data - data register
- * \param char port - port letter
+ * \param char port - port letter, 'A' is bank 0
  * \param int pin - port bit
+ * \param volatile uint32_t* data_in - input level register of the port
+ * \param volatile uint32_t* data_out - output level register of the port
+ * \param volatile uint32_t* set - set register of the port, NULL if the
+ *  SoC has none
+ * \param volatile uint32_t* clear - clear register of the port, NULL if
+ *  the SoC has none
+ * \param uint32_t mask - bit of the pin in the port registers
  */
 
 typedef struct {
@@ -23,8 +104,33 @@ typedef struct {
 	int data;
 	const char port;
 	const unsigned int pin;
+	volatile uint32_t* data_in;
+	volatile uint32_t* data_out;
+	volatile uint32_t* set;
+	volatile uint32_t* clear;
+	uint32_t mask;
 } mmap_gpio;
 
+/**
+ * \def MMAP_GPIO_GROUP_MAX
+ * \brief maximum number of gpios in a group
+ */
+
+#define MMAP_GPIO_GROUP_MAX 64
+
+/**
+ * \struct mmap_gpio_group
+ * \brief a set of gpios written and read together through a bitmask,
+ *  bit n is gpio n of the group
+ * \param unsigned int num_gpios - number of gpios in the group
+ * \param mmap_gpio* gpios[] - the gpios of the group, not owned by the group
+ */
+
+typedef struct {
+	unsigned int num_gpios;
+	mmap_gpio* gpios[MMAP_GPIO_GROUP_MAX];
+} mmap_gpio_group;
+
 /**
  * \struct mmap_gpio_direction
  * \brief defined values for input/output direction
@@ -49,11 +155,45 @@ typedef enum {
 
 /**
  * \fn int libsoc_mmap_gpio_init
- * \brief initialize mmap gpio, call it once before using gpio
+ * \brief initialize mmap gpio, call it once before using gpio. The SoC is
+ *  taken from the LIBSOC_MMAP_GPIO_SOC environment variable, then from the
+ *  SOC entry of the board config, and defaults to "allwinner"
+ * \return 0 or -1 if fail
  */
 
 int libsoc_mmap_gpio_init();
 
+/**
+ * \fn int libsoc_mmap_gpio_init_soc(const mmap_gpio_soc* soc, const char* mem_path)
+ * \brief initialize mmap gpio for the given SoC
+ * \param const mmap_gpio_soc* soc - register layout to use, NULL to pick
+ *  one as libsoc_mmap_gpio_init does
+ * \param const char* mem_path - file to map, at an offset equal to the
+ *  physical address. NULL uses the LIBSOC_MMAP_GPIO_MEM environment
+ *  variable or /dev/mem
+ * \return 0 or -1 if fail
+ */
+
+int libsoc_mmap_gpio_init_soc(const mmap_gpio_soc* soc, const char* mem_path);
+
+/**
+ * \fn const mmap_gpio_soc* libsoc_mmap_gpio_find_soc(const char* name)
+ * \brief look up a built in SoC descriptor: "allwinner", "bcm2835",
+ *  "bcm2836" (also BCM2837) or "am335x"
+ * \param const char* name - SoC name
+ * \return descriptor or NULL if unknown
+ */
+
+const mmap_gpio_soc* libsoc_mmap_gpio_find_soc(const char* name);
+
+/**
+ * \fn const mmap_gpio_soc* libsoc_mmap_gpio_get_soc
+ * \brief get the descriptor mmap gpio was initialized with
+ * \return descriptor or NULL if not initialized
+ */
+
+const mmap_gpio_soc* libsoc_mmap_gpio_get_soc();
+
 /**
  * \fn void libsoc_mmap_gpio_shutdown
  * \brief shutdown mmap gpio
@@ -61,6 +201,34 @@ int libsoc_mmap_gpio_init();
 
 void libsoc_mmap_gpio_shutdown();
 
+/**
+ * \fn int libsoc_mmap_gpio_share_locks(const char* name)
+ * \brief move the per port register locks into the POSIX shared memory
+ *  object name, so processes sharing it serialize their register updates.
+ *  The shared locks are robust mutexes, a process that dies holding one
+ *  does not block the others.
+ *  Call it after init and before any gpio is used, init does it
+ *  automatically when LIBSOC_MMAP_GPIO_LOCK holds the name
+ * \param const char* name - shared memory object name, like "/libsoc-gpio"
+ * \return 0 or -1 if fail
+ */
+
+int libsoc_mmap_gpio_share_locks(const char* name);
+
+/**
+ * \fn int libsoc_mmap_gpio_port_update(char port, uint32_t mask, uint32_t bits)
+ * \brief set the output level of the pins in mask to the matching bits,
+ *  atomically with respect to other libsoc threads and processes sharing
+ *  the locks. Uses the set and clear registers when the SoC has them,
+ *  otherwise a locked read-modify-write of the data register
+ * \param char port - the port name ('A', 'B, 'C', ..)
+ * \param uint32_t mask - pins to update, all of them in the port
+ * \param uint32_t bits - levels to set the pins to
+ * \return 0 or -1 in case of fail
+ */
+
+int libsoc_mmap_gpio_port_update(char port, uint32_t mask, uint32_t bits);
+
 /**
  * \fn mmap_gpio* libsoc_mmap_gpio_request(char port, unsigned int pin)
  * \brief request a gpio to use
@@ -100,7 +268,8 @@ mmap_gpio_direction libsoc_mmap_gpio_get_direction(mmap_gpio* gpio);
 
 /**
  * \fn int libsoc_mmap_gpio_set_level(mmap_gpio* gpio, mmap_gpio_level level)
- * \brief set the gpio level to high or low
+ * \brief set the gpio level to high or low, only the data register (or
+ *  set/clear register) of the port is written
  * \param mmap_gpio* gpio - pointer to gpio struct on which to set the level
  * \param gpio_level level - enumerated mmap_gpio_level, HIGH or LOW
  * \return current level of LEVEL_ERROR in case of fail
@@ -110,13 +279,68 @@ int libsoc_mmap_gpio_set_level(mmap_gpio* gpio, mmap_gpio_level level);
 
 /**
  * \fn mmap_gpio_level libsoc_mmap_gpio_get_level(mmap_gpio* gpio)
- * \brief gets the current gpio level
+ * \brief gets the current gpio level, read from the input data register
  * \param mmap_gpio* gpio - pointer to gpio struct on which to get the level
  * \return current level of LEVEL_ERROR in case of fail
  */
 
 mmap_gpio_level libsoc_mmap_gpio_get_level(mmap_gpio* gpio);
 
+/**
+ * \fn int libsoc_mmap_gpio_get_port(char port, uint32_t* value)
+ * \brief read the input data register of a whole port with a single load,
+ *  bit n is the level of pin n
+ * \param char port - the port name ('A', 'B, 'C', ..)
+ * \param uint32_t* value - set to the register value
+ * \return 0 or -1 in case of fail
+ */
+
+int libsoc_mmap_gpio_get_port(char port, uint32_t* value);
+
+/**
+ * \fn mmap_gpio_group* libsoc_mmap_gpio_group_create(mmap_gpio** gpios, unsigned int num_gpios)
+ * \brief build a group from already requested gpios
+ * \param mmap_gpio** gpios - the gpios, gpios[n] becomes bit n of the masks
+ * \param unsigned int num_gpios - number of gpios, up to MMAP_GPIO_GROUP_MAX
+ * \return pointer to mmap_gpio_group* or NULL if fail
+ */
+
+mmap_gpio_group* libsoc_mmap_gpio_group_create(mmap_gpio** gpios, unsigned int num_gpios);
+
+/**
+ * \fn void libsoc_mmap_gpio_group_free(mmap_gpio_group* group)
+ * \brief free a group, the gpios in it are left requested
+ * \param mmap_gpio_group* group - valid pointer to a group
+ */
+
+void libsoc_mmap_gpio_group_free(mmap_gpio_group* group);
+
+/**
+ * \fn int libsoc_mmap_gpio_group_set_mask(mmap_gpio_group* group, uint64_t mask, uint64_t bits)
+ * \brief set the level of every gpio in mask with a single data register
+ *  write per port, or one set and one clear register write on SoCs that
+ *  have them
+ * \param mmap_gpio_group* group - valid pointer to a group
+ * \param uint64_t mask - gpios to set
+ * \param uint64_t bits - levels to set the gpios to
+ * \return 0 or -1 in case of fail
+ */
+
+int libsoc_mmap_gpio_group_set_mask(mmap_gpio_group* group, uint64_t mask, uint64_t bits);
+
+/**
+ * \fn int libsoc_mmap_gpio_group_get_mask(mmap_gpio_group* group, uint64_t mask, uint64_t* bits)
+ * \brief read the level of every gpio in mask with a single data register
+ *  read per port
+ * \param mmap_gpio_group* group - valid pointer to a group
+ * \param uint64_t mask - gpios to read
+ * \param uint64_t* bits - set to the levels read, gpios outside the mask
+ *  read as 0
+ * \return 0 or -1 in case of fail
+ */
+
+int libsoc_mmap_gpio_group_get_mask(mmap_gpio_group* group, uint64_t mask, uint64_t* bits);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,145 @@
+#ifndef _LIBSOC_MMAP_GPIO_FAST_H_
+#define _LIBSOC_MMAP_GPIO_FAST_H_
+
+#include <stdint.h>
+#include <endian.h>
+
+#include "libsoc_mmap_gpio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \struct mmap_gpio_pin
+ * \brief resolved registers of a mmap gpio for the inline calls below.
+ *  The calls compile to plain volatile loads and stores with no library
+ *  call, so they suit tight bit-bang loops. Volatile accesses are never
+ *  merged or reordered against each other by the compiler, and gpio
+ *  registers are mapped as device memory, so the CPU keeps them in
+ *  program order as well. On SoCs without set/clear registers the calls
+ *  do an unlocked read-modify-write of the data register, use
+ *  libsoc_mmap_gpio_port_update if other threads drive the same port
+ * \param volatile uint32_t* data_in - input level register of the port
+ * \param volatile uint32_t* data_out - output level register of the port
+ * \param volatile uint32_t* set - set register, NULL if the SoC has none
+ * \param volatile uint32_t* clear - clear register, NULL if the SoC has none
+ * \param uint32_t mask - pin bit, already in register byte order
+ * \param int level - last level written, used by toggle
+ */
+
+typedef struct {
+	volatile uint32_t* data_in;
+	volatile uint32_t* data_out;
+	volatile uint32_t* set;
+	volatile uint32_t* clear;
+	uint32_t mask;
+	int level;
+} mmap_gpio_pin;
+
+/**
+ * \fn mmap_gpio_pin libsoc_mmap_gpio_fast_resolve(const mmap_gpio* gpio)
+ * \brief resolve a requested gpio into a pin descriptor, the descriptor is
+ *  valid until libsoc_mmap_gpio_shutdown
+ * \param const mmap_gpio* gpio - valid pointer to a requested gpio
+ * \return pin descriptor
+ */
+
+static inline mmap_gpio_pin libsoc_mmap_gpio_fast_resolve(const mmap_gpio* gpio)
+{
+	mmap_gpio_pin pin;
+
+	pin.data_in = gpio->data_in;
+	pin.data_out = gpio->data_out;
+	pin.set = gpio->set;
+	pin.clear = gpio->clear;
+	pin.mask = htole32(gpio->mask);
+	pin.level = (*gpio->data_out & pin.mask) ? 1 : 0;
+
+	return pin;
+}
+
+/**
+ * \fn void libsoc_mmap_gpio_fast_set(mmap_gpio_pin* pin)
+ * \brief drive the pin high, a single store on SoCs with a set register
+ * \param mmap_gpio_pin* pin - resolved pin
+ */
+
+static inline void libsoc_mmap_gpio_fast_set(mmap_gpio_pin* pin)
+{
+	if (pin->set != NULL)
+		*pin->set = pin->mask;
+	else
+		*pin->data_out = *pin->data_out | pin->mask;
+
+	pin->level = 1;
+}
+
+/**
+ * \fn void libsoc_mmap_gpio_fast_clear(mmap_gpio_pin* pin)
+ * \brief drive the pin low, a single store on SoCs with a clear register
+ * \param mmap_gpio_pin* pin - resolved pin
+ */
+
+static inline void libsoc_mmap_gpio_fast_clear(mmap_gpio_pin* pin)
+{
+	if (pin->clear != NULL)
+		*pin->clear = pin->mask;
+	else
+		*pin->data_out = *pin->data_out & ~pin->mask;
+
+	pin->level = 0;
+}
+
+/**
+ * \fn void libsoc_mmap_gpio_fast_write(mmap_gpio_pin* pin, int level)
+ * \brief drive the pin to level
+ * \param mmap_gpio_pin* pin - resolved pin
+ * \param int level - zero for low, high otherwise
+ */
+
+static inline void libsoc_mmap_gpio_fast_write(mmap_gpio_pin* pin, int level)
+{
+	if (level)
+		libsoc_mmap_gpio_fast_set(pin);
+	else
+		libsoc_mmap_gpio_fast_clear(pin);
+}
+
+/**
+ * \fn void libsoc_mmap_gpio_fast_toggle(mmap_gpio_pin* pin)
+ * \brief invert the level last written to the pin. With set/clear
+ *  registers this is a single store, otherwise a read-modify-write of the
+ *  data register
+ * \param mmap_gpio_pin* pin - resolved pin
+ */
+
+static inline void libsoc_mmap_gpio_fast_toggle(mmap_gpio_pin* pin)
+{
+	if (pin->set != NULL)
+	{
+		libsoc_mmap_gpio_fast_write(pin, !pin->level);
+	}
+	else
+	{
+		*pin->data_out = *pin->data_out ^ pin->mask;
+		pin->level = !pin->level;
+	}
+}
+
+/**
+ * \fn int libsoc_mmap_gpio_fast_read(const mmap_gpio_pin* pin)
+ * \brief sample the pin from the input data register
+ * \param const mmap_gpio_pin* pin - resolved pin
+ * \return 1 if high, 0 if low
+ */
+
+static inline int libsoc_mmap_gpio_fast_read(const mmap_gpio_pin* pin)
+{
+	return (*pin->data_in & pin->mask) ? 1 : 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _LIBSOC_MMAP_GPIO_FAST_H_
@@ -0,0 +1,192 @@
+#ifndef _LIBSOC_POLLER_H_
+#define _LIBSOC_POLLER_H_
+
+#include <stdint.h>
+
+#include "libsoc_i2c.h"
+#include "libsoc_spi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \def POLLER_JOBS_MAX
+ * \brief maximum number of jobs a poller can run, every i2c job due at
+ *  the same time fits in one batch
+ */
+
+#define POLLER_JOBS_MAX 64
+
+/**
+ * \def POLLER_DATA_MAX
+ * \brief maximum number of bytes a job writes or reads each period
+ */
+
+#define POLLER_DATA_MAX 32
+
+/**
+ * \struct poller
+ * \brief periodic jobs on the devices of one i2c or spi bus, run by a
+ *  single thread woken by a timerfd. Jobs due together are sent earliest
+ *  deadline first, i2c jobs as one batch and spi jobs on the same device
+ *  as one message
+ */
+
+typedef struct poller poller;
+
+/**
+ * \struct poller_result
+ * \brief the outcome of one run of a job
+ * \param uint64_t release - CLOCK_MONOTONIC time in ns the run was due
+ * \param uint64_t completion - CLOCK_MONOTONIC time in ns its transfer
+ *  ended
+ * \param uint32_t sequence - number of the release, a gap between
+ *  consecutive results is the number of releases skipped or results lost
+ *  because the ring was full
+ * \param int status - 0 or the errno of the transfer
+ * \param uint16_t len - number of bytes in data
+ * \param uint8_t data[] - the bytes read
+ */
+
+typedef struct {
+  uint64_t release;
+  uint64_t completion;
+  uint32_t sequence;
+  int status;
+  uint16_t len;
+  uint8_t data[POLLER_DATA_MAX];
+} poller_result;
+
+/**
+ * \struct poller_stats
+ * \brief counters of a job. Latency runs from the release of a run to
+ *  the end of its transfer
+ * \param uint64_t runs - number of transfers made
+ * \param uint64_t errors - runs whose transfer failed
+ * \param uint64_t deadline_misses - runs that ended after their deadline,
+ *  and releases skipped
+ * \param uint64_t skipped - releases not run at all because the job was
+ *  more than a period late
+ * \param uint64_t overflows - results dropped because the ring was full
+ * \param uint64_t latency_min - shortest latency in ns
+ * \param uint64_t latency_max - longest latency in ns
+ * \param uint64_t latency_total - sum of all latencies in ns, divide by
+ *  runs for the mean
+ */
+
+typedef struct {
+  uint64_t runs;
+  uint64_t errors;
+  uint64_t deadline_misses;
+  uint64_t skipped;
+  uint64_t overflows;
+  uint64_t latency_min;
+  uint64_t latency_max;
+  uint64_t latency_total;
+} poller_stats;
+
+/**
+ * \fn poller* libsoc_poller_init()
+ * \brief allocates a poller with no jobs
+ * \return poller* or NULL on failure
+ */
+poller* libsoc_poller_init ();
+
+/**
+ * \fn int libsoc_poller_add_i2c(poller* poller, i2c* i2c, uint8_t* wbuf, uint16_t wlen, uint16_t rlen, uint32_t period_us, uint32_t deadline_us, unsigned int capacity)
+ * \brief adds a job that writes wbuf to an i2c device and then reads rlen
+ *  bytes with a repeated start, every period. Either length may be 0 for
+ *  a job that only reads or only writes. All jobs of a poller must be on
+ *  the same bus, and jobs can only be added while it is stopped
+ * \param poller* poller - valid poller
+ * \param i2c* i2c - valid i2c device struct
+ * \param uint8_t* wbuf - bytes to write, copied into the job
+ * \param uint16_t wlen - length of wbuf, up to POLLER_DATA_MAX
+ * \param uint16_t rlen - bytes to read, up to POLLER_DATA_MAX
+ * \param uint32_t period_us - period in microseconds
+ * \param uint32_t deadline_us - time after each release by which the run
+ *  must have ended, 0 for the period
+ * \param unsigned int capacity - number of results the ring can hold,
+ *  rounded up to a power of two
+ * \return int - job index, or -1 on failure
+ */
+int libsoc_poller_add_i2c (poller * poller, i2c * i2c, uint8_t * wbuf,
+  uint16_t wlen, uint16_t rlen, uint32_t period_us, uint32_t deadline_us,
+  unsigned int capacity);
+
+/**
+ * \fn int libsoc_poller_add_spi(poller* poller, spi* spi, uint8_t* tx, uint32_t len, uint32_t period_us, uint32_t deadline_us, unsigned int capacity)
+ * \brief adds a job that sends tx to a spi device and keeps the bytes
+ *  received, every period. All jobs of a poller must be on the same spidev
+ *  bus, and jobs can only be added while it is stopped
+ * \param poller* poller - valid poller
+ * \param spi* spi - valid spi struct pointer
+ * \param uint8_t* tx - bytes to send, copied into the job, or NULL to
+ *  send zeros
+ * \param uint32_t len - length of the transfer, up to POLLER_DATA_MAX
+ * \param uint32_t period_us - period in microseconds
+ * \param uint32_t deadline_us - time after each release by which the run
+ *  must have ended, 0 for the period
+ * \param unsigned int capacity - number of results the ring can hold,
+ *  rounded up to a power of two
+ * \return int - job index, or -1 on failure
+ */
+int libsoc_poller_add_spi (poller * poller, spi * spi, uint8_t * tx,
+  uint32_t len, uint32_t period_us, uint32_t deadline_us,
+  unsigned int capacity);
+
+/**
+ * \fn int libsoc_poller_start(poller* poller)
+ * \brief releases every job now and starts the thread running them
+ * \param poller* poller - valid poller with at least one job
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_poller_start (poller * poller);
+
+/**
+ * \fn int libsoc_poller_stop(poller* poller)
+ * \brief stops the thread once its current transfer has ended, results
+ *  already published stay in the rings
+ * \param poller* poller - valid running poller
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_poller_stop (poller * poller);
+
+/**
+ * \fn int libsoc_poller_drain(poller* poller, int job, poller_result* results, unsigned int max_results)
+ * \brief copies up to max_results results of a job out of its lock-free
+ *  ring in the order they were produced. Each ring has a single consumer,
+ *  only one thread may drain a job at a time
+ * \param poller* poller - valid poller
+ * \param int job - job index returned when it was added
+ * \param poller_result* results - array to copy into
+ * \param unsigned int max_results - size of results
+ * \return int - number of results copied, or -1 on failure
+ */
+int libsoc_poller_drain (poller * poller, int job, poller_result * results,
+  unsigned int max_results);
+
+/**
+ * \fn int libsoc_poller_get_stats(poller* poller, int job, poller_stats* stats)
+ * \brief copies the counters of a job
+ * \param poller* poller - valid poller
+ * \param int job - job index returned when it was added
+ * \param poller_stats* stats - filled with the counters
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_poller_get_stats (poller * poller, int job, poller_stats * stats);
+
+/**
+ * \fn int libsoc_poller_free(poller* poller)
+ * \brief stops the poller if it is running and frees it with its rings,
+ *  the device handles are left open
+ * \param poller* poller - valid poller
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_poller_free (poller * poller);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -2,6 +2,7 @@
 #define _LIBSOC_SPI_H_
 
 #include <stdint.h>
+#include <linux/spi/spidev.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,12 +16,21 @@ extern "C" {
  *  callback data
  * \param uint8_t spi_dev - major number of spi device
  * \param uint8_t spi_dev - minor number of spi device
+ * \param uint32_t mode - last mode flags written to or read from the device
+ * \param uint8_t bits_per_word - last bits per word written or read
+ * \param uint32_t speed - last speed in Hz written or read
+ * \param uint8_t cached - which of mode, bits_per_word and speed are
+ *  known, unchanged values are not written to the device again
  */
 
 typedef struct {
   int fd;
   uint8_t spi_dev;
   uint8_t chip_select;
+  uint32_t mode;
+  uint8_t bits_per_word;
+  uint32_t speed;
+  uint8_t cached;
 } spi;
 
 /**
@@ -45,6 +55,110 @@ typedef enum {
   MODE_ERROR,
 } spi_mode;
 
+/**
+ * \def SPI_TRANSFERS_MAX
+ * \brief maximum number of segments in a transaction
+ */
+
+#define SPI_TRANSFERS_MAX 32
+
+/**
+ * \struct spi_transaction
+ * \brief a chain of transfers sent to the device in one SPI_IOC_MESSAGE
+ *  ioctl, chip select stays asserted between segments unless cs_change is
+ *  set on a segment. Each segment has its own buffers, so a header and a
+ *  payload can be sent without copying them together
+ * \param spi* spi - the device the transaction is sent to
+ * \param unsigned int num_transfers - number of segments added
+ * \param struct spi_ioc_transfer transfers[] - the segments
+ */
+
+typedef struct {
+  spi *spi;
+  unsigned int num_transfers;
+  struct spi_ioc_transfer transfers[SPI_TRANSFERS_MAX];
+} spi_transaction;
+
+/**
+ * \def SPI_REQUEST_PENDING
+ * \brief status of a queued request that has not completed yet
+ */
+
+#define SPI_REQUEST_PENDING -1
+
+/**
+ * \struct spi_request
+ * \brief a transfer submitted to an spi_queue. The request and its
+ *  buffers are owned by the caller and must stay valid until it completes
+ * \param spi* spi - the device to transfer with
+ * \param uint8_t* tx - bytes to send or NULL
+ * \param uint8_t* rx - buffer for received bytes or NULL
+ * \param uint32_t len - length of the transfer in bytes
+ * \param uint8_t tx_nbits - wires used to send, 0 or 1 for single, 2 for
+ *  dual or 4 for quad, the mode must allow it
+ * \param uint8_t rx_nbits - wires used to receive, as tx_nbits
+ * \param void (*callback_fn)(spi_request*, void*) - optional, called on
+ *  the queue worker thread when the transfer has completed
+ * \param void* callback_arg - argument passed to callback_fn
+ * \param int status - SPI_REQUEST_PENDING, then EXIT_SUCCESS or
+ *  EXIT_FAILURE
+ * \param spi_request* next - used by the queue
+ */
+
+typedef struct spi_request spi_request;
+
+struct spi_request {
+  spi *spi;
+  uint8_t *tx;
+  uint8_t *rx;
+  uint32_t len;
+  uint8_t tx_nbits;
+  uint8_t rx_nbits;
+  void (*callback_fn) (spi_request *, void *);
+  void *callback_arg;
+  int status;
+  spi_request *next;
+};
+
+/**
+ * \struct spi_queue
+ * \brief asynchronous submission queue with its own worker thread,
+ *  usually one per spi bus
+ */
+
+typedef struct spi_queue spi_queue;
+
+/**
+ * \def SPI_BUS_MAX_DEVICES
+ * \brief number of chip selects a shared bus can hold
+ */
+
+#define SPI_BUS_MAX_DEVICES 16
+
+/**
+ * \struct spi_bus
+ * \brief a spidev bus shared by several threads, owning the spi handle
+ *  of every chip select added to it
+ */
+
+typedef struct spi_bus spi_bus;
+
+/**
+ * \struct spi_bus_stats
+ * \brief counters of a shared bus
+ * \param uint64_t grants - number of times the bus was handed to a device
+ * \param uint64_t config_switches - grants that needed a different mode,
+ *  speed or bits per word from the previous one
+ * \param uint64_t config_switches_avoided - grants that went to a device
+ *  sharing the current config ahead of an older waiter
+ */
+
+typedef struct {
+  uint64_t grants;
+  uint64_t config_switches;
+  uint64_t config_switches_avoided;
+} spi_bus_stats;
+
 /**
  * \fn spi* libsoc_spi_init (uint8_t spidev_device, uint8_t chip_select)
  * \brief opens the spidev character device and intitialises a new spi
@@ -55,6 +169,80 @@ typedef enum {
  */
 spi* libsoc_spi_init (uint8_t spidev_device, uint8_t chip_select);
 
+/**
+ * \fn spi_bus* libsoc_spi_bus_init(uint8_t spidev_device, uint32_t latency_us)
+ * \brief creates a shared bus. Threads take turns on the bus in the
+ *  order they asked for it, except that a waiter whose device shares the
+ *  current mode, speed and bits per word may go ahead of an older one that
+ *  has waited less than latency_us
+ * \param uint8_t spidev_device - the major spidev number
+ * \param uint32_t latency_us - how long a waiter can be passed over to
+ *  save a config switch, 0 for strict first come first served
+ * \return spi_bus* or NULL on failure
+ */
+spi_bus* libsoc_spi_bus_init(uint8_t spidev_device, uint32_t latency_us);
+
+/**
+ * \fn spi* libsoc_spi_bus_add_device(spi_bus* bus, uint8_t chip_select, spi_mode mode, uint32_t speed, spi_bpw bpw)
+ * \brief opens the spidev device for a chip select on the bus and sets
+ *  the config applied whenever it is given the bus. Adding a chip select
+ *  again changes its config and returns the same handle
+ * \param spi_bus* bus - valid bus
+ * \param uint8_t chip_select - the minor spidev number
+ * \param enum spi_mode mode - MODE_0, MODE_1, MODE_2 or MODE_3
+ * \param uint32_t speed - spi bus speed in Hz
+ * \param enum spi_bpw bpw - BITS_8 or BITS_16
+ * \return spi* owned by the bus, or NULL on failure
+ */
+spi* libsoc_spi_bus_add_device(spi_bus* bus, uint8_t chip_select,
+  spi_mode mode, uint32_t speed, spi_bpw bpw);
+
+/**
+ * \fn int libsoc_spi_bus_acquire(spi_bus* bus, spi* spi)
+ * \brief waits for the bus and applies the config of the device, only
+ *  the values that changed are written. Any transfer calls may then be
+ *  used on the device until libsoc_spi_bus_release
+ * \param spi_bus* bus - valid bus
+ * \param spi* spi - device returned by libsoc_spi_bus_add_device
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_bus_acquire(spi_bus* bus, spi* spi);
+
+/**
+ * \fn int libsoc_spi_bus_release(spi_bus* bus)
+ * \brief hands the bus to the next waiter
+ * \param spi_bus* bus - valid bus held by the caller
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_bus_release(spi_bus* bus);
+
+/**
+ * \fn int libsoc_spi_bus_transfer(spi_bus* bus, spi_transaction* transaction)
+ * \brief acquires the bus for the device of the transaction, sends it
+ *  and releases the bus
+ * \param spi_bus* bus - valid bus
+ * \param spi_transaction* transaction - transaction on a bus device
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_bus_transfer(spi_bus* bus, spi_transaction* transaction);
+
+/**
+ * \fn void libsoc_spi_bus_get_stats(spi_bus* bus, spi_bus_stats* stats)
+ * \brief copies the counters of the bus
+ * \param spi_bus* bus - valid bus
+ * \param spi_bus_stats* stats - filled with the counters
+ */
+void libsoc_spi_bus_get_stats(spi_bus* bus, spi_bus_stats* stats);
+
+/**
+ * \fn int libsoc_spi_bus_free(spi_bus* bus)
+ * \brief frees the bus and every device handle it owns, the bus must
+ *  not be held or waited on
+ * \param spi_bus* bus - valid bus
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_bus_free(spi_bus* bus);
+
 /**
  * \fn int libsoc_spi_free(spi* spi)
  * \brief frees the malloced spi struct
@@ -97,9 +285,70 @@ int libsoc_spi_set_bits_per_word(spi* spi, spi_bpw bpw);
  */
 int libsoc_spi_set_speed(spi* spi, uint32_t speed);
 
+/**
+ * \fn int libsoc_spi_configure(spi* spi, spi_mode mode, uint32_t speed, spi_bpw bpw)
+ * \brief sets mode, speed and bits per word of the spi device in one call.
+ *  Only the values that differ from the ones last set on this spi struct
+ *  are written, so drivers can re-assert their config before every
+ *  transfer for the cost of a few compares
+ * \param spi* spi - valid spi struct pointer
+ * \param enum spi_mode - MODE_0, MODE_1, MODE_2 or MODE_3
+ * \param uint32_t speed - spi bus speed in Hz
+ * \param enum spi_bpw - BITS_8 or BITS_16
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_configure(spi* spi, spi_mode mode, uint32_t speed,
+  spi_bpw bpw);
+
+/**
+ * \fn void libsoc_spi_invalidate_config(spi* spi)
+ * \brief forgets the cached mode, speed and bits per word, so the next
+ *  get reads them from the device and the next set or configure writes
+ *  them. Use it when another process may have changed the device config
+ * \param spi* spi - valid spi struct pointer
+ */
+void libsoc_spi_invalidate_config(spi* spi);
+
+/**
+ * \fn int libsoc_spi_set_mode32(spi* spi, uint32_t mode)
+ * \brief sets the full 32 bit mode of the spi device, the clock mode
+ *  SPI_MODE_0 to SPI_MODE_3 or'ed with any of the kernel flags SPI_CS_HIGH,
+ *  SPI_LSB_FIRST, SPI_3WIRE, SPI_NO_CS, SPI_TX_DUAL, SPI_TX_QUAD,
+ *  SPI_RX_DUAL, SPI_RX_QUAD and others from linux/spi/spi.h. Controllers
+ *  may drop dual and quad flags they do not support, see
+ *  libsoc_spi_probe_mode32. libsoc_spi_set_mode and libsoc_spi_configure
+ *  keep these flags and only change the clock mode
+ * \param spi* spi - valid spi struct pointer
+ * \param uint32_t mode - mode flags
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_set_mode32(spi* spi, uint32_t mode);
+
+/**
+ * \fn int libsoc_spi_get_mode32(spi* spi, uint32_t* mode)
+ * \brief gets the full 32 bit mode of the spi device, served from the
+ *  spi struct once it is known
+ * \param spi* spi - valid spi struct pointer
+ * \param uint32_t* mode - filled with the mode flags
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_get_mode32(spi* spi, uint32_t* mode);
+
+/**
+ * \fn int libsoc_spi_probe_mode32(spi* spi, uint32_t flags, uint32_t* accepted)
+ * \brief tries each of the given mode flags on the controller and reports
+ *  which ones it kept, the mode is restored afterwards
+ * \param spi* spi - valid spi struct pointer
+ * \param uint32_t flags - mode flags to try, e.g. SPI_TX_QUAD | SPI_RX_QUAD
+ * \param uint32_t* accepted - filled with the flags the controller kept
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_probe_mode32(spi* spi, uint32_t flags, uint32_t* accepted);
+
 /**
  * \fn spi_mode libsoc_spi_get_mode(spi* spi)
- * \brief gets the current mode of the spi bus
+ * \brief gets the current mode of the spi bus, served from the
+ *  spi struct once it is known
  * \param spi* spi - valid spi struct pointer
  * \return enum spi_mode - MODE_0/1/2/3 on success, MODE_ERROR on fail
  */
@@ -107,7 +356,8 @@ spi_mode libsoc_spi_get_mode(spi* spi);
 
 /**
  * \fn uint32_t libsoc_spi_get_speed(spi* spi)
- * \brief gets the current speed of the spi bus
+ * \brief gets the current speed of the spi bus, served from the
+ *  spi struct once it is known
  * \param spi* spi - valid spi struct pointer
  * \return uint32 - current speed of spi bus in Hz
  */
@@ -115,7 +365,8 @@ uint32_t libsoc_spi_get_speed(spi* spi);
 
 /**
  * \fn spi_bpw libsoc_spi_get_bits_per_word(spi* spi)
- * \brief gets the current bits per word of the spi bus
+ * \brief gets the current bits per word of the spi bus, served from the
+ *  spi struct once it is known
  * \param spi* spi - valid spi struct pointer
  * \return enum spi_bpw - BITS_8/16 on success, BITS_ERROR on fail
  */
@@ -123,7 +374,8 @@ spi_bpw libsoc_spi_get_bits_per_word(spi* spi);
 
 /**
  * \fn int libsoc_spi_write(spi* spi, uint8_t* tx, uint32_t len)
- * \brief writes data to the spi bus
+ * \brief writes data to the spi bus, transfers longer than the spidev
+ *  bufsiz are split into several messages
  * \param spi* spi - valid spi struct pointer
  * \param uint8_t* tx - array of bytes to send on the bus
  * \param uint32_t len - the length of the transfer in bytes
@@ -154,6 +406,207 @@ int libsoc_spi_read(spi* spi, uint8_t* rx, uint32_t len);
  */
 int libsoc_spi_rw(spi* spi, uint8_t* tx, uint8_t* rx, uint32_t len);
 
+/**
+ * \fn uint32_t libsoc_spi_get_bufsiz()
+ * \brief gets the largest number of bytes spidev sends or receives in one
+ *  message, read once from /sys/module/spidev/parameters/bufsiz. spidev
+ *  rounds every transfer up to its allocation alignment when checking
+ *  this limit, so libsoc charges each one a multiple of 128 bytes. Longer
+ *  transfers are split into several messages with chip select kept
+ *  asserted between them
+ * \return uint32_t - bufsiz in bytes, 4096 if it can not be read or is
+ *  below 128
+ */
+uint32_t libsoc_spi_get_bufsiz();
+
+/**
+ * \typedef spi_stream_fn
+ * \brief callback filling or draining one chunk of a streamed transfer
+ * \param void* arg - argument given to the stream call
+ * \param uint8_t* buf - chunk buffer
+ * \param uint32_t offset - offset of the chunk in the stream
+ * \param uint32_t len - chunk length, at most libsoc_spi_get_bufsiz()
+ * \return EXIT_SUCCESS or EXIT_FAILURE to abort the stream
+ */
+typedef int (*spi_stream_fn) (void *arg, uint8_t * buf, uint32_t offset,
+  uint32_t len);
+
+/**
+ * \fn int libsoc_spi_write_stream(spi* spi, uint32_t len, spi_stream_fn fill, void* arg)
+ * \brief write len bytes produced by fill, with double buffering: a worker
+ *  thread fills the next chunk while the current one is on the bus
+ * \param spi* spi - valid spi struct pointer
+ * \param uint32_t len - total length of the stream in bytes
+ * \param spi_stream_fn fill - called on the worker thread for each chunk
+ * \param void* arg - passed to fill
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_write_stream(spi* spi, uint32_t len, spi_stream_fn fill,
+  void* arg);
+
+/**
+ * \fn int libsoc_spi_read_stream(spi* spi, uint32_t len, spi_stream_fn consume, void* arg)
+ * \brief read len bytes handing each chunk to consume, with double
+ *  buffering: a worker thread consumes a chunk while the next one is read
+ * \param spi* spi - valid spi struct pointer
+ * \param uint32_t len - total length of the stream in bytes
+ * \param spi_stream_fn consume - called on the worker thread for each chunk
+ * \param void* arg - passed to consume
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_read_stream(spi* spi, uint32_t len, spi_stream_fn consume,
+  void* arg);
+
+/**
+ * \fn spi_queue* libsoc_spi_queue_init()
+ * \brief creates an asynchronous queue and starts its worker thread. The
+ *  worker sends requests back to back, adjacent requests for the same
+ *  device are merged into one spidev message with chip select released
+ *  between them
+ * \return spi_queue* or NULL on failure
+ */
+spi_queue* libsoc_spi_queue_init();
+
+/**
+ * \fn int libsoc_spi_queue_submit(spi_queue* queue, spi_request* request)
+ * \brief queues a request without taking a lock or allocating, so it can
+ *  be called from real time threads. Only a submit to an idle queue makes
+ *  a syscall, a non blocking write to wake the worker
+ * \param spi_queue* queue - valid queue
+ * \param spi_request* request - request with spi, buffers and len set
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_queue_submit(spi_queue* queue, spi_request* request);
+
+/**
+ * \fn int libsoc_spi_request_done(spi_request* request)
+ * \brief checks whether a submitted request has completed
+ * \param spi_request* request - submitted request
+ * \return 1 when complete, 0 when still pending
+ */
+int libsoc_spi_request_done(spi_request* request);
+
+/**
+ * \fn int libsoc_spi_request_wait(spi_request* request)
+ * \brief blocks until a submitted request has completed
+ * \param spi_request* request - submitted request
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_request_wait(spi_request* request);
+
+/**
+ * \fn int libsoc_spi_queue_free(spi_queue* queue)
+ * \brief sends any requests still queued, stops the worker thread and
+ *  frees the queue
+ * \param spi_queue* queue - valid queue
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_queue_free(spi_queue* queue);
+
+/**
+ * \fn spi_transaction* libsoc_spi_transaction_init(spi* spi)
+ * \brief allocate an empty transaction for the spi device
+ * \param spi* spi - valid spi struct pointer
+ * \return spi_transaction* struct pointer or NULL on failure
+ */
+spi_transaction* libsoc_spi_transaction_init(spi* spi);
+
+/**
+ * \fn int libsoc_spi_transaction_add(spi_transaction* transaction, uint8_t* tx, uint8_t* rx, uint32_t len)
+ * \brief append a segment to the transaction, the buffers are used in
+ *  place and must stay valid until the transaction is transferred
+ * \param spi_transaction* transaction - valid transaction
+ * \param uint8_t* tx - bytes to send, or NULL to send zeros
+ * \param uint8_t* rx - buffer for received bytes, or NULL to discard them
+ * \param uint32_t len - the length of the segment in bytes
+ * \return index of the new segment, -1 on failure
+ */
+int libsoc_spi_transaction_add(spi_transaction* transaction, uint8_t* tx,
+  uint8_t* rx, uint32_t len);
+
+/**
+ * \fn int libsoc_spi_transaction_set_cs_change(spi_transaction* transaction, int index, uint8_t cs_change)
+ * \brief deassert chip select after the segment, before the next one
+ * \param spi_transaction* transaction - valid transaction
+ * \param int index - segment index returned by libsoc_spi_transaction_add
+ * \param uint8_t cs_change - 1 to toggle chip select, 0 to keep it
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_transaction_set_cs_change(spi_transaction* transaction,
+  int index, uint8_t cs_change);
+
+/**
+ * \fn int libsoc_spi_transaction_set_delay(spi_transaction* transaction, int index, uint16_t delay_usecs)
+ * \brief delay after the segment, before chip select changes or the next
+ *  segment starts
+ * \param spi_transaction* transaction - valid transaction
+ * \param int index - segment index returned by libsoc_spi_transaction_add
+ * \param uint16_t delay_usecs - delay in microseconds
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_transaction_set_delay(spi_transaction* transaction,
+  int index, uint16_t delay_usecs);
+
+/**
+ * \fn int libsoc_spi_transaction_set_speed(spi_transaction* transaction, int index, uint32_t speed)
+ * \brief override the bus speed for the segment
+ * \param spi_transaction* transaction - valid transaction
+ * \param int index - segment index returned by libsoc_spi_transaction_add
+ * \param uint32_t speed - speed in Hz, 0 for the device speed
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_transaction_set_speed(spi_transaction* transaction,
+  int index, uint32_t speed);
+
+/**
+ * \fn int libsoc_spi_transaction_set_bits_per_word(spi_transaction* transaction, int index, spi_bpw bpw)
+ * \brief override the bits per word for the segment
+ * \param spi_transaction* transaction - valid transaction
+ * \param int index - segment index returned by libsoc_spi_transaction_add
+ * \param enum spi_bpw - bits per word eith BITS_8 or BITS_16
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_transaction_set_bits_per_word(spi_transaction* transaction,
+  int index, spi_bpw bpw);
+
+/**
+ * \fn int libsoc_spi_transaction_set_nbits(spi_transaction* transaction, int index, uint8_t tx_nbits, uint8_t rx_nbits)
+ * \brief sets how many wires a segment is sent and received on, so a
+ *  command can go out on one wire and the data come back on four. The
+ *  device mode must include the matching SPI_TX_ and SPI_RX_ flags
+ * \param spi_transaction* transaction - valid transaction
+ * \param int index - segment index returned by libsoc_spi_transaction_add
+ * \param uint8_t tx_nbits - 0 or 1 for single, 2 for dual, 4 for quad
+ * \param uint8_t rx_nbits - 0 or 1 for single, 2 for dual, 4 for quad
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_transaction_set_nbits(spi_transaction* transaction,
+  int index, uint8_t tx_nbits, uint8_t rx_nbits);
+
+/**
+ * \fn int libsoc_spi_transaction_transfer(spi_transaction* transaction)
+ * \brief send every segment of the transaction with a single ioctl
+ * \param spi_transaction* transaction - valid transaction
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_transaction_transfer(spi_transaction* transaction);
+
+/**
+ * \fn int libsoc_spi_transaction_clear(spi_transaction* transaction)
+ * \brief remove all segments so the transaction can be built again
+ * \param spi_transaction* transaction - valid transaction
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_transaction_clear(spi_transaction* transaction);
+
+/**
+ * \fn int libsoc_spi_transaction_free(spi_transaction* transaction)
+ * \brief frees the transaction, the buffers are left untouched
+ * \param spi_transaction* transaction - valid transaction
+ * \return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int libsoc_spi_transaction_free(spi_transaction* transaction);
+
 #ifdef __cplusplus
 }
 #endif
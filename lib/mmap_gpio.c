@@ -13,162 +13,651 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <endian.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
+#include "libsoc_board.h"
 #include "libsoc_mmap_gpio.h"
 
-#define PIO_REG_SIZE 0x228 /*0x300*/
-#define PIO_PORT_SIZE 0x24
+#define LE32TOH(X)		le32toh(*((volatile uint32_t*)(X)))
 
-#define PIO_REG_CFG(B, N, I)	((B) + (N)*0x24 + ((I)<<2) + 0x00)
-#define PIO_REG_DLEVEL(B, N, I)	((B) + (N)*0x24 + ((I)<<2) + 0x14)
-#define PIO_REG_PULL(B, N, I)	((B) + (N)*0x24 + ((I)<<2) + 0x1C)
-#define PIO_REG_DATA(B, N)		((B) + (N)*0x24 + 0x10)
-#define PIO_NR_PORTS			9 /* A-I */
+#define PIO_SUCCESS 0
 
-#define LE32TOH(X)		le32toh(*((uint32_t*)(X)))
+#define MMAP_GPIO_MEM "/dev/mem"
+
+/* Allwinner sunxi PIO (A10/A13/A20/R8/H3): 9 ports A-I of 0x24 bytes */
+static const mmap_gpio_soc soc_allwinner = {
+	.name = "allwinner",
+	.base = 0x01c20800,
+	.size = 0x400,
+	.num_banks = 9,
+	.bank_stride = 0x24,
+	.bank_bases = NULL,
+	.bank_pins = NULL,
+	.data_in = 0x10,
+	.data_out = 0x10,
+	.set = MMAP_GPIO_NO_REG,
+	.clear = MMAP_GPIO_NO_REG,
+	.dir = 0x00,
+	.dir_bits = 4,
+	.dir_banked = 1,
+	.dir_input = 0,
+	.dir_output = 1,
+	.pull = 0x1c,
+	.pull_bits = 2,
+	.drive = 0x14,
+	.drive_bits = 2,
+};
+
+/*
+ * BCM283x: 54 gpios in two banks, 32 in bank 0 and 22 in bank 1. The
+ * level, set and clear registers of bank 1 follow those of bank 0, so the
+ * bank stride is one register, while the function select registers cover
+ * all gpios.
+ */
+static const unsigned int bcm283x_bank_pins[] = { 32, 22 };
+
+#define SOC_BCM283X(NAME, BASE) { \
+	.name = NAME, \
+	.base = BASE, \
+	.size = 0xb4, \
+	.num_banks = 2, \
+	.bank_stride = 0x04, \
+	.bank_bases = NULL, \
+	.bank_pins = bcm283x_bank_pins, \
+	.data_in = 0x34, \
+	.data_out = 0x34, \
+	.set = 0x1c, \
+	.clear = 0x28, \
+	.dir = 0x00, \
+	.dir_bits = 3, \
+	.dir_banked = 0, \
+	.dir_input = 0, \
+	.dir_output = 1, \
+	.pull = MMAP_GPIO_NO_REG, \
+	.pull_bits = 0, \
+	.drive = MMAP_GPIO_NO_REG, \
+	.drive_bits = 0, \
+}
 
-#define PIO_SUCCESS 0
+static const mmap_gpio_soc soc_bcm2835 = SOC_BCM283X("bcm2835", 0x20200000);
+static const mmap_gpio_soc soc_bcm2836 = SOC_BCM283X("bcm2836", 0x3f200000);
+
+/* TI AM335x: 4 GPIO modules of 32 gpios spread over the L4 buses */
+static const unsigned long am335x_bank_bases[] = {
+	0x44e07000, 0x4804c000, 0x481ac000, 0x481ae000,
+};
+
+static const mmap_gpio_soc soc_am335x = {
+	.name = "am335x",
+	.base = 0x44e07000,
+	.size = 0x1000,
+	.num_banks = 4,
+	.bank_stride = 0,
+	.bank_bases = am335x_bank_bases,
+	.bank_pins = NULL,
+	.data_in = 0x138,
+	.data_out = 0x13c,
+	.set = 0x194,
+	.clear = 0x190,
+	.dir = 0x134,
+	.dir_bits = 1,
+	.dir_banked = 1,
+	.dir_input = 1,
+	.dir_output = 0,
+	.pull = MMAP_GPIO_NO_REG,
+	.pull_bits = 0,
+	.drive = MMAP_GPIO_NO_REG,
+	.drive_bits = 0,
+};
+
+static const mmap_gpio_soc* socs[] = {
+	&soc_allwinner,
+	&soc_bcm2835,
+	&soc_bcm2836,
+	&soc_am335x,
+	NULL,
+};
+
+/* marks a shared lock object whose mutexes have been initialised */
+#define PIO_SHARED_LOCKS_READY 0x6c736f63
+
+/*
+ * Locks shared between processes are robust mutexes, so a process that
+ * dies holding one does not leave the others blocked forever.
+ */
+struct pio_shared_locks {
+	uint32_t ready;
+	pthread_mutex_t locks[MMAP_GPIO_MAX_BANKS];
+};
+
+static struct {
+	const mmap_gpio_soc* soc;
+	char* banks[MMAP_GPIO_MAX_BANKS];
+	void* maps[MMAP_GPIO_MAX_BANKS];
+	size_t map_sizes[MMAP_GPIO_MAX_BANKS];
+	unsigned int num_maps;
+	uint32_t locks[MMAP_GPIO_MAX_BANKS];
+	struct pio_shared_locks* shared;
+	size_t shared_size;
+} gpio_mem;
+
+static char* pio_bank(unsigned int bank)
+{
+	return gpio_mem.banks[bank];
+}
+
+/* address and shift of a pin's field in a banked per pin field register */
+static volatile uint32_t* pio_field(unsigned int bank, unsigned int reg, unsigned int bits, unsigned int pin, uint32_t* shift)
+{
+	unsigned int per_reg = 32 / bits;
 
-static char* gpio_mem = NULL;
+	*shift = (pin % per_reg) * bits;
+	return (volatile uint32_t*)(pio_bank(bank) + reg + (pin / per_reg) * 4);
+}
 
-static int pio_get(const char* buf, mmap_gpio* pio)
+static volatile uint32_t* pio_dir_field(unsigned int bank, unsigned int pin, uint32_t* shift)
 {
-	uint32_t port = pio->port - 'A';
-	if (port > PIO_NR_PORTS)
+	const mmap_gpio_soc* soc = gpio_mem.soc;
+
+	if (soc->dir_banked)
 	{
-		return -1;
+		return pio_field(bank, soc->dir, soc->dir_bits, pin, shift);
+	}
+
+	return pio_field(0, soc->dir, soc->dir_bits, bank * 32 + pin, shift);
+}
+
+static void pio_futex(uint32_t* addr, int op, uint32_t val)
+{
+	syscall(SYS_futex, addr, op | FUTEX_PRIVATE_FLAG, val, NULL, NULL, 0);
+}
+
+static void pio_shared_lock(unsigned int bank)
+{
+	pthread_mutex_t* lock = &gpio_mem.shared->locks[bank];
+
+	/*
+	 * The owner died while holding the lock. Registers are only written
+	 * with single stores, so whatever it left behind is consistent.
+	 */
+	if (pthread_mutex_lock(lock) == EOWNERDEAD)
+		pthread_mutex_consistent(lock);
+}
+
+/*
+ * Per bank lock for registers that can only be updated with a read
+ * modify write. Within a process the lock word is 0 when free, 1 when
+ * held and 2 when held with waiters, so the uncontended path is a single
+ * compare and swap. Exclusive accesses are not reliable on device
+ * memory, so the compare and swap is done on the lock word rather than
+ * the register. Locks shared with other processes are robust mutexes.
+ */
+static void pio_lock(unsigned int bank)
+{
+	uint32_t* lock = &gpio_mem.locks[bank];
+	uint32_t c = 0;
+
+	if (gpio_mem.shared != NULL)
+	{
+		pio_shared_lock(bank);
+		return;
+	}
+
+	if (__atomic_compare_exchange_n(lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	if (c != 2)
+		c = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+
+	while (c != 0)
+	{
+		pio_futex(lock, FUTEX_WAIT, 2);
+		c = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void pio_unlock(unsigned int bank)
+{
+	uint32_t* lock = &gpio_mem.locks[bank];
+
+	if (gpio_mem.shared != NULL)
+	{
+		pthread_mutex_unlock(&gpio_mem.shared->locks[bank]);
+		return;
 	}
 
+	if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) != 1)
+		pio_futex(lock, FUTEX_WAKE, 1);
+}
+
+static void pio_update(unsigned int bank, volatile uint32_t* addr, uint32_t mask, uint32_t bits)
+{
+	uint32_t val;
+
+	pio_lock(bank);
+	val = le32toh(*addr);
+	val = (val & ~mask) | (bits & mask);
+	*addr = htole32(val);
+	pio_unlock(bank);
+}
+
+static int pio_get_field(volatile uint32_t* addr, uint32_t shift, unsigned int bits)
+{
+	return (LE32TOH(addr) >> shift) & ((1U << bits) - 1);
+}
+
+static void pio_set_field(volatile uint32_t* addr, uint32_t shift, unsigned int bits, int value)
+{
+	uint32_t mask = ((1U << bits) - 1) << shift;
 	uint32_t val;
-	uint32_t port_num_func, port_num_pull;
-	uint32_t offset_func, offset_pull;
 
-	port_num_func = pio->pin >> 3;
-	offset_func = ((pio->pin & 0x07) << 2);
+	val = le32toh(*addr);
+	val &= ~mask;
+	val |= ((uint32_t)value << shift) & mask;
+	*addr = htole32(val);
+}
+
+/* mask of the gpios that exist in a bank */
+static uint32_t pio_bank_mask(uint32_t bank)
+{
+	const unsigned int* pins = gpio_mem.soc->bank_pins;
+
+	if (pins == NULL || pins[bank] >= 32)
+	{
+		return 0xffffffff;
+	}
+
+	return (0x01 << pins[bank]) - 1;
+}
+
+static int pio_port(const mmap_gpio* pio, uint32_t* port)
+{
+	if (gpio_mem.soc == NULL)
+	{
+		return -1;
+	}
+
+	*port = pio->port - 'A';
+	if (*port >= gpio_mem.soc->num_banks || pio->pin >= 32
+		|| !(pio_bank_mask(*port) & (0x01 << pio->pin)))
+	{
+		return -1;
+	}
 
-	port_num_pull = pio->pin >> 4;
-	offset_pull = ((pio->pin & 0x0f) << 1);
+	return PIO_SUCCESS;
+}
+
+static int pio_get(mmap_gpio* pio)
+{
+	const mmap_gpio_soc* soc = gpio_mem.soc;
+	uint32_t port, shift;
+	volatile uint32_t* addr;
+
+	if (pio_port(pio, &port) != PIO_SUCCESS)
+	{
+		return -1;
+	}
 
 	/* func */
-	val = LE32TOH(PIO_REG_CFG(buf, port, port_num_func));
-	pio->cfg = (val>>offset_func) & 0x07;
+	addr = pio_dir_field(port, pio->pin, &shift);
+	pio->cfg = pio_get_field(addr, shift, soc->dir_bits);
 
 	/* pull */
-	val = LE32TOH(PIO_REG_PULL(buf, port, port_num_pull));
-	pio->pull = (val>>offset_pull) & 0x03;
+	pio->pull = -1;
+	if (soc->pull != MMAP_GPIO_NO_REG)
+	{
+		addr = pio_field(port, soc->pull, soc->pull_bits, pio->pin, &shift);
+		pio->pull = pio_get_field(addr, shift, soc->pull_bits);
+	}
 
 	/* dlevel */
-	val = LE32TOH(PIO_REG_DLEVEL(buf, port, port_num_pull));
-	pio->drv_level = (val>>offset_pull) & 0x03;
+	pio->drv_level = -1;
+	if (soc->drive != MMAP_GPIO_NO_REG)
+	{
+		addr = pio_field(port, soc->drive, soc->drive_bits, pio->pin, &shift);
+		pio->drv_level = pio_get_field(addr, shift, soc->drive_bits);
+	}
 
 	/* i/o data */
-	if (pio->cfg > 1)
+	if (pio->cfg != soc->dir_input && pio->cfg != soc->dir_output)
 		pio->data = -1;
-	else {
-		val = LE32TOH(PIO_REG_DATA(buf, port));
-		pio->data = (val >> pio->pin) & 0x01;
-	}
+	else
+		pio->data = (LE32TOH(pio_bank(port) + soc->data_in) >> pio->pin) & 0x01;
 
 	return PIO_SUCCESS;
 }
 
-static int pio_set(char* buf, mmap_gpio* pio)
+static int pio_set_dir(mmap_gpio* pio)
 {
-	uint32_t port = pio->port - 'A';
-	if (port > PIO_NR_PORTS)
+	const mmap_gpio_soc* soc = gpio_mem.soc;
+	uint32_t port, shift;
+	volatile uint32_t* addr;
+
+	if (pio_port(pio, &port) != PIO_SUCCESS)
 	{
 		return -1;
 	}
 
-	uint32_t *addr, val;
-	uint32_t port_num_func, port_num_pull;
-	uint32_t offset_func, offset_pull;
+	/* shared function select registers are all guarded by the bank 0 lock */
+	unsigned int lock = soc->dir_banked ? port : 0;
 
-	port_num_func = pio->pin >> 3;
-	offset_func = ((pio->pin & 0x07) << 2);
+	addr = pio_dir_field(port, pio->pin, &shift);
+	pio_lock(lock);
+	pio_set_field(addr, shift, soc->dir_bits, pio->cfg);
+	pio_unlock(lock);
 
-	port_num_pull = pio->pin >> 4;
-	offset_pull = ((pio->pin & 0x0f) << 1);
+	return PIO_SUCCESS;
+}
 
-	/* func */
-	if (pio->cfg >= 0) {
-		addr = (uint32_t*)PIO_REG_CFG(buf, port, port_num_func);
-		val = le32toh(*addr);
-		val &= ~(0x07 << offset_func);
-		val |=  (pio->cfg & 0x07) << offset_func;
-		*addr = htole32(val);
+/* precompute the data registers and mask used by the level calls */
+static void pio_resolve(mmap_gpio* pio)
+{
+	const mmap_gpio_soc* soc = gpio_mem.soc;
+	char* bank = pio_bank(pio->port - 'A');
+
+	pio->data_in = (volatile uint32_t*)(bank + soc->data_in);
+	pio->data_out = (volatile uint32_t*)(bank + soc->data_out);
+	pio->set = NULL;
+	pio->clear = NULL;
+	if (soc->set != MMAP_GPIO_NO_REG && soc->clear != MMAP_GPIO_NO_REG)
+	{
+		pio->set = (volatile uint32_t*)(bank + soc->set);
+		pio->clear = (volatile uint32_t*)(bank + soc->clear);
 	}
+	pio->mask = 0x01 << pio->pin;
+}
 
-	/* pull */
-	if (pio->pull >= 0) {
-		addr = (uint32_t*)PIO_REG_PULL(buf, port, port_num_pull);
-		val = le32toh(*addr);
-		val &= ~(0x03 << offset_pull);
-		val |=  (pio->pull & 0x03) << offset_pull;
-		*addr = htole32(val);
+static void* pio_map(int fd, unsigned long base, unsigned long size)
+{
+	int pagesize = sysconf(_SC_PAGESIZE);
+	off_t addr = base & ~(pagesize - 1);
+	unsigned long offset = base & (pagesize - 1);
+	size_t len = (offset + size + pagesize - 1) & ~(pagesize - 1);
+	char* mem;
+
+	mem = mmap(NULL, len, PROT_WRITE | PROT_READ, MAP_SHARED, fd, addr);
+	if (mem == MAP_FAILED)
+	{
+		return NULL;
 	}
 
-	/* dlevel */
-	if (pio->drv_level >= 0) {
-		addr = (uint32_t*)PIO_REG_DLEVEL(buf, port, port_num_pull);
-		val = le32toh(*addr);
-		val &= ~(0x03 << offset_pull);
-		val |=  (pio->drv_level & 0x03) << offset_pull;
-		*addr = htole32(val);
-	}
-
-	/* data */
-	if (pio->data >= 0) {
-		addr = (uint32_t*)PIO_REG_DATA(buf, port);
-		val = le32toh(*addr);
-		if (pio->data)
-			val |= (0x01 << pio->pin);
-		else
-			val &= ~(0x01 << pio->pin);
-		*addr = htole32(val);
+	gpio_mem.maps[gpio_mem.num_maps] = mem;
+	gpio_mem.map_sizes[gpio_mem.num_maps] = len;
+	gpio_mem.num_maps++;
+
+	return mem + offset;
+}
+
+/* the SOC= entry of the board config, if there is one */
+static const mmap_gpio_soc* pio_board_soc()
+{
+	const mmap_gpio_soc* soc = NULL;
+	const char* conf = getenv("LIBSOC_GPIO_CONF");
+	board_config* config;
+
+	if (conf == NULL)
+		conf = GPIO_CONF;
+
+	if (access(conf, R_OK) != 0)
+	{
+		return NULL;
 	}
 
-	return PIO_SUCCESS;
+	config = libsoc_board_init();
+	if (config != NULL && config->soc[0] != '\0')
+	{
+		soc = libsoc_mmap_gpio_find_soc(config->soc);
+	}
+
+	libsoc_board_free(config);
+
+	return soc;
+}
+
+const mmap_gpio_soc* libsoc_mmap_gpio_find_soc(const char* name)
+{
+	unsigned int i;
+
+	if (name == NULL)
+	{
+		return NULL;
+	}
+
+	for (i = 0; socs[i] != NULL; i++)
+	{
+		if (strcmp(socs[i]->name, name) == 0)
+		{
+			return socs[i];
+		}
+	}
+
+	return NULL;
 }
 
 int libsoc_mmap_gpio_init()
 {
-	if (gpio_mem != NULL)
+	return libsoc_mmap_gpio_init_soc(NULL, NULL);
+}
+
+int libsoc_mmap_gpio_init_soc(const mmap_gpio_soc* soc, const char* mem_path)
+{
+	if (gpio_mem.soc != NULL)
 	{
 		return 0;
 	}
 
-	int ret = -1;
+	if (soc == NULL)
+	{
+		const char* name = getenv("LIBSOC_MMAP_GPIO_SOC");
+
+		if (name != NULL)
+		{
+			soc = libsoc_mmap_gpio_find_soc(name);
+			if (soc == NULL)
+			{
+				printf("Unknown SoC %s\n", name);
+				return -1;
+			}
+		}
+		else
+		{
+			soc = pio_board_soc();
+		}
+
+		/* older releases only supported Allwinner */
+		if (soc == NULL)
+		{
+			soc = &soc_allwinner;
+		}
+	}
 
-	int pagesize = sysconf(_SC_PAGESIZE);
-	int addr = 0x01c20800 & ~(pagesize - 1);
-	int offset = 0x01c20800 & (pagesize - 1);
+	if (soc->num_banks == 0 || soc->num_banks > MMAP_GPIO_MAX_BANKS)
+	{
+		printf("Invalid SoC descriptor %s\n", soc->name);
+		return -1;
+	}
 
-	int fd = open("/dev/mem", O_RDWR);
+	if (mem_path == NULL)
+	{
+		mem_path = getenv("LIBSOC_MMAP_GPIO_MEM");
+		if (mem_path == NULL)
+			mem_path = MMAP_GPIO_MEM;
+	}
+
+	int ret = -1;
+	unsigned int i;
+
+	int fd = open(mem_path, O_RDWR | O_SYNC);
 	if (fd == -1) 
 	{
-		printf("Failed to open /dev/mem");
-		goto clean;
+		printf("Failed to open %s", mem_path);
+		return -1;
 	}
 
-	gpio_mem = mmap(NULL, (0x800 + pagesize - 1) & ~(pagesize - 1), PROT_WRITE | PROT_READ, MAP_SHARED, fd, addr);
-	if (gpio_mem == MAP_FAILED) 
+	if (soc->bank_bases == NULL)
+	{
+		char* mem = pio_map(fd, soc->base, soc->size);
+		if (mem == NULL)
+		{
+			printf("Failed to map GPIO");
+			goto clean;
+		}
+
+		for (i = 0; i < soc->num_banks; i++)
+		{
+			gpio_mem.banks[i] = mem + i * soc->bank_stride;
+		}
+	}
+	else
 	{
-		printf("Failed to map GPIO");
-		goto clean;
+		for (i = 0; i < soc->num_banks; i++)
+		{
+			gpio_mem.banks[i] = pio_map(fd, soc->bank_bases[i], soc->size);
+			if (gpio_mem.banks[i] == NULL)
+			{
+				printf("Failed to map GPIO bank %d", i);
+				goto clean;
+			}
+		}
 	}
-	gpio_mem += offset;
 
+	gpio_mem.soc = soc;
 	ret = 0;
 
+	const char* lock_name = getenv("LIBSOC_MMAP_GPIO_LOCK");
+	if (lock_name != NULL && libsoc_mmap_gpio_share_locks(lock_name) != 0)
+	{
+		ret = -1;
+	}
+
 clean:
 	close(fd);
+	if (ret != 0)
+	{
+		libsoc_mmap_gpio_shutdown();
+	}
 	return ret;
 }
 
 void libsoc_mmap_gpio_shutdown()
 {
-	gpio_mem = NULL;
+	unsigned int i;
+
+	for (i = 0; i < gpio_mem.num_maps; i++)
+	{
+		munmap(gpio_mem.maps[i], gpio_mem.map_sizes[i]);
+	}
+
+	if (gpio_mem.shared != NULL)
+	{
+		munmap(gpio_mem.shared, gpio_mem.shared_size);
+	}
+
+	memset(&gpio_mem, 0, sizeof(gpio_mem));
+}
+
+/* called with the shared object flocked, so only one process does this */
+static void pio_init_shared_locks(struct pio_shared_locks* shared)
+{
+	pthread_mutexattr_t attr;
+	unsigned int i;
+
+	if (shared->ready == PIO_SHARED_LOCKS_READY)
+	{
+		return;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+	for (i = 0; i < MMAP_GPIO_MAX_BANKS; i++)
+	{
+		pthread_mutex_init(&shared->locks[i], &attr);
+	}
+
+	pthread_mutexattr_destroy(&attr);
+
+	__atomic_store_n(&shared->ready, PIO_SHARED_LOCKS_READY, __ATOMIC_RELEASE);
+}
+
+const mmap_gpio_soc* libsoc_mmap_gpio_get_soc()
+{
+	return gpio_mem.soc;
+}
+
+int libsoc_mmap_gpio_share_locks(const char* name)
+{
+	size_t size = sysconf(_SC_PAGESIZE);
+	void* map;
+
+	if (name == NULL || gpio_mem.shared != NULL)
+	{
+		return -1;
+	}
+
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+	{
+		printf("Failed to open shared locks %s\n", name);
+		return -1;
+	}
+
+	/*
+	 * The first process to take the file lock initialises the mutexes of
+	 * a new, zeroed object. The file lock goes away with its holder, so a
+	 * process dying here does not block the others.
+	 */
+	if (flock(fd, LOCK_EX) < 0 || ftruncate(fd, size) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		printf("Failed to map shared locks %s\n", name);
+		close(fd);
+		return -1;
+	}
+
+	pio_init_shared_locks(map);
+	close(fd);
+
+	gpio_mem.shared = map;
+	gpio_mem.shared_size = size;
+
+	return 0;
+}
+
+int libsoc_mmap_gpio_port_update(char port, uint32_t mask, uint32_t bits)
+{
+	const mmap_gpio_soc* soc = gpio_mem.soc;
+	uint32_t bank = port - 'A';
+
+	if (soc == NULL || bank >= soc->num_banks || (mask & ~pio_bank_mask(bank)))
+	{
+		return -1;
+	}
+
+	if (soc->set != MMAP_GPIO_NO_REG && soc->clear != MMAP_GPIO_NO_REG)
+	{
+		/* set and clear registers only affect the bits written as one */
+		if (mask & bits)
+			*(volatile uint32_t*)(pio_bank(bank) + soc->set) = htole32(mask & bits);
+		if (mask & ~bits)
+			*(volatile uint32_t*)(pio_bank(bank) + soc->clear) = htole32(mask & ~bits);
+	}
+	else
+	{
+		pio_update(bank, (volatile uint32_t*)(pio_bank(bank) + soc->data_out), mask, bits);
+	}
+
+	return 0;
 }
 
 mmap_gpio* libsoc_mmap_gpio_request(char port, unsigned int pin)
@@ -176,11 +665,13 @@ mmap_gpio* libsoc_mmap_gpio_request(char port, unsigned int pin)
 	mmap_gpio* gpio = calloc(sizeof(mmap_gpio), 1);
 	*(char*)&gpio->port = port;
 	*(int*)&gpio->pin = pin;
-	if (pio_get(gpio_mem, gpio) == PIO_SUCCESS)
+	if (pio_get(gpio) == PIO_SUCCESS)
 	{
+		pio_resolve(gpio);
 		return gpio;
 	}
 
+	free(gpio);
 	return NULL;
 }
 
@@ -196,8 +687,8 @@ int libsoc_mmap_gpio_set_direction(mmap_gpio* gpio, mmap_gpio_direction directio
 		return DIRECTION_ERROR;
 	}
 
-	gpio->cfg = (direction == OUTPUT ? 1 : 0);
-	if (pio_set(gpio_mem, gpio) == PIO_SUCCESS)
+	gpio->cfg = (direction == OUTPUT ? gpio_mem.soc->dir_output : gpio_mem.soc->dir_input);
+	if (pio_set_dir(gpio) == PIO_SUCCESS)
 	{
 		return direction;
 	}
@@ -212,7 +703,7 @@ mmap_gpio_direction libsoc_mmap_gpio_get_direction(mmap_gpio* gpio)
 		return DIRECTION_ERROR;
 	}
 
-	return (gpio->cfg == 1 ? OUTPUT : INPUT);
+	return (gpio->cfg == gpio_mem.soc->dir_output ? OUTPUT : INPUT);
 }
 
 int libsoc_mmap_gpio_set_level(mmap_gpio* gpio, mmap_gpio_level level)
@@ -222,13 +713,22 @@ int libsoc_mmap_gpio_set_level(mmap_gpio* gpio, mmap_gpio_level level)
 		return LEVEL_ERROR;
 	}
 
-	gpio->data = (level == HIGH ? 1 : 0);
-	if (pio_set(gpio_mem, gpio) == PIO_SUCCESS)
+	/* only the data register is touched, the configuration is left alone */
+	if (gpio->set != NULL)
+	{
+		if (level == HIGH)
+			*gpio->set = htole32(gpio->mask);
+		else
+			*gpio->clear = htole32(gpio->mask);
+	}
+	else
 	{
-		return level;
+		pio_update(gpio->port - 'A', gpio->data_out, gpio->mask, level == HIGH ? gpio->mask : 0);
 	}
 
-	return LEVEL_ERROR;	
+	gpio->data = (level == HIGH ? 1 : 0);
+
+	return level;
 }
 
 mmap_gpio_level libsoc_mmap_gpio_get_level(mmap_gpio* gpio)
@@ -238,5 +738,155 @@ mmap_gpio_level libsoc_mmap_gpio_get_level(mmap_gpio* gpio)
 		return LEVEL_ERROR;
 	}
 
-	return (gpio->data & 0x1 ? HIGH : LOW);
+	/* always sample the pin, inputs change behind our back */
+	gpio->data = (le32toh(*gpio->data_in) & gpio->mask) ? 1 : 0;
+
+	return (gpio->data ? HIGH : LOW);
+}
+
+int libsoc_mmap_gpio_get_port(char port, uint32_t* value)
+{
+	uint32_t bank = port - 'A';
+
+	if (gpio_mem.soc == NULL || bank >= gpio_mem.soc->num_banks || value == NULL)
+	{
+		return -1;
+	}
+
+	*value = LE32TOH(pio_bank(bank) + gpio_mem.soc->data_in);
+
+	return 0;
+}
+
+mmap_gpio_group* libsoc_mmap_gpio_group_create(mmap_gpio** gpios, unsigned int num_gpios)
+{
+	if (gpios == NULL || num_gpios == 0 || num_gpios > MMAP_GPIO_GROUP_MAX)
+	{
+		return NULL;
+	}
+
+	mmap_gpio_group* group = calloc(sizeof(mmap_gpio_group), 1);
+	if (group == NULL)
+	{
+		return NULL;
+	}
+
+	unsigned int i;
+	for (i = 0; i < num_gpios; i++)
+	{
+		uint32_t port;
+		if (gpios[i] == NULL || pio_port(gpios[i], &port) != PIO_SUCCESS)
+		{
+			free(group);
+			return NULL;
+		}
+
+		group->gpios[i] = gpios[i];
+	}
+	group->num_gpios = num_gpios;
+
+	return group;
+}
+
+void libsoc_mmap_gpio_group_free(mmap_gpio_group* group)
+{
+	free(group);
+}
+
+int libsoc_mmap_gpio_group_set_mask(mmap_gpio_group* group, uint64_t mask, uint64_t bits)
+{
+	if (group == NULL)
+	{
+		return -1;
+	}
+
+	/* gather the pins of each port so every port is written once */
+	uint32_t port_mask[MMAP_GPIO_MAX_BANKS] = { 0 };
+	uint32_t port_bits[MMAP_GPIO_MAX_BANKS] = { 0 };
+	const mmap_gpio_soc* soc = gpio_mem.soc;
+	volatile uint32_t* addr;
+	uint32_t port;
+	unsigned int i;
+
+	for (i = 0; i < group->num_gpios; i++)
+	{
+		if (!(mask & (1ULL << i)))
+		{
+			continue;
+		}
+
+		mmap_gpio* gpio = group->gpios[i];
+		port = gpio->port - 'A';
+
+		port_mask[port] |= 0x01 << gpio->pin;
+		gpio->data = (bits >> i) & 0x01;
+		if (gpio->data)
+		{
+			port_bits[port] |= 0x01 << gpio->pin;
+		}
+	}
+
+	for (port = 0; port < soc->num_banks; port++)
+	{
+		if (port_mask[port] == 0)
+		{
+			continue;
+		}
+
+		if (soc->set != MMAP_GPIO_NO_REG && soc->clear != MMAP_GPIO_NO_REG)
+		{
+			addr = (volatile uint32_t*)(pio_bank(port) + soc->set);
+			*addr = htole32(port_bits[port]);
+			addr = (volatile uint32_t*)(pio_bank(port) + soc->clear);
+			*addr = htole32(port_mask[port] & ~port_bits[port]);
+		}
+		else
+		{
+			addr = (volatile uint32_t*)(pio_bank(port) + soc->data_out);
+			pio_update(port, addr, port_mask[port], port_bits[port]);
+		}
+	}
+
+	return 0;
+}
+
+int libsoc_mmap_gpio_group_get_mask(mmap_gpio_group* group, uint64_t mask, uint64_t* bits)
+{
+	if (group == NULL || bits == NULL)
+	{
+		return -1;
+	}
+
+	uint32_t port_val[MMAP_GPIO_MAX_BANKS];
+	uint32_t port_read = 0;
+	uint32_t port;
+	uint64_t result = 0;
+	unsigned int i;
+
+	for (i = 0; i < group->num_gpios; i++)
+	{
+		if (!(mask & (1ULL << i)))
+		{
+			continue;
+		}
+
+		mmap_gpio* gpio = group->gpios[i];
+		port = gpio->port - 'A';
+
+		/* one data register read per port */
+		if (!(port_read & (0x01 << port)))
+		{
+			port_val[port] = LE32TOH(pio_bank(port) + gpio_mem.soc->data_in);
+			port_read |= 0x01 << port;
+		}
+
+		if ((port_val[port] >> gpio->pin) & 0x01)
+		{
+			result |= 1ULL << i;
+		}
+	}
+
+	*bits = result;
+
+	return 0;
 }
@@ -0,0 +1,634 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "libsoc_poller.h"
+#include "libsoc_debug.h"
+
+/*
+ * Result rings are single producer, single consumer, like the gpio
+ * capture rings. The producer is the poller thread and the consumer the
+ * caller of libsoc_poller_drain.
+ */
+
+struct poller_ring
+{
+  uint32_t head;
+  uint32_t tail;
+  uint32_t mask;
+  poller_result results[];
+};
+
+struct poller_job
+{
+  i2c *i2c;
+  spi *spi;
+  uint8_t wbuf[POLLER_DATA_MAX];
+  uint8_t rbuf[POLLER_DATA_MAX];
+  uint16_t wlen;
+  uint16_t rlen;
+  uint64_t period;
+  uint64_t deadline;
+  uint64_t release;
+  uint32_t sequence;
+  int status;
+  uint64_t completion;
+  poller_stats stats;
+  struct poller_ring *ring;
+};
+
+struct poller
+{
+  struct poller_job jobs[POLLER_JOBS_MAX];
+  unsigned int num_jobs;
+  i2c_bus *adapter;
+  spi *spi;
+  i2c_batch *batch;
+  spi_transaction *transaction;
+  int timer_fd;
+  int wakeup_fd;
+  int running;
+  int stop;
+  pthread_t thread;
+  pthread_mutex_t lock;
+};
+
+static uint64_t
+poller_now ()
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+poller *
+libsoc_poller_init ()
+{
+  poller *p = calloc (1, sizeof (poller));
+
+  if (p == NULL)
+    {
+      libsoc_debug (__func__, "failed to allocate memory");
+      return NULL;
+    }
+
+  p->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  p->wakeup_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+  if (p->timer_fd < 0 || p->wakeup_fd < 0)
+    {
+      libsoc_debug (__func__, "failed to create timerfd or eventfd");
+      perror ("libsoc-poller-debug");
+
+      if (p->timer_fd >= 0)
+	close (p->timer_fd);
+
+      if (p->wakeup_fd >= 0)
+	close (p->wakeup_fd);
+
+      free (p);
+      return NULL;
+    }
+
+  pthread_mutex_init (&p->lock, NULL);
+
+  return p;
+}
+
+static struct poller_job *
+poller_add (poller * poller, uint16_t wlen, uint16_t rlen,
+	    uint32_t period_us, uint32_t deadline_us, unsigned int capacity)
+{
+  struct poller_job *job;
+  uint32_t size = 1;
+
+  if (poller->running)
+    {
+      libsoc_debug (__func__, "jobs can not be added while running");
+      return NULL;
+    }
+
+  if (poller->num_jobs >= POLLER_JOBS_MAX || wlen > POLLER_DATA_MAX
+      || rlen > POLLER_DATA_MAX || period_us == 0 || capacity == 0)
+    {
+      libsoc_debug (__func__, "poller is full or job is not valid");
+      return NULL;
+    }
+
+  while (size < capacity)
+    size <<= 1;
+
+  job = &poller->jobs[poller->num_jobs];
+  memset (job, 0, sizeof (*job));
+
+  job->ring = calloc (1, sizeof (struct poller_ring)
+		      + size * sizeof (poller_result));
+
+  if (job->ring == NULL)
+    {
+      libsoc_debug (__func__, "failed to allocate memory");
+      return NULL;
+    }
+
+  job->ring->mask = size - 1;
+  job->wlen = wlen;
+  job->rlen = rlen;
+  job->period = period_us * 1000ULL;
+  job->deadline = (deadline_us ? deadline_us : period_us) * 1000ULL;
+  job->stats.latency_min = UINT64_MAX;
+
+  return job;
+}
+
+int
+libsoc_poller_add_i2c (poller * poller, i2c * i2c, uint8_t * wbuf,
+		       uint16_t wlen, uint16_t rlen, uint32_t period_us,
+		       uint32_t deadline_us, unsigned int capacity)
+{
+  struct poller_job *job;
+
+  if (poller == NULL || i2c == NULL || (wlen && wbuf == NULL)
+      || wlen + rlen == 0)
+    {
+      libsoc_debug (__func__, "invalid poller, device or buffer");
+      return -1;
+    }
+
+  if (poller->spi || (poller->adapter && poller->adapter != i2c->adapter))
+    {
+      libsoc_debug (__func__, "jobs of a poller must share one bus");
+      return -1;
+    }
+
+  if (poller->batch == NULL && (poller->batch = libsoc_i2c_batch_init ())
+      == NULL)
+    return -1;
+
+  job = poller_add (poller, wlen, rlen, period_us, deadline_us, capacity);
+
+  if (job == NULL)
+    return -1;
+
+  job->i2c = i2c;
+  memcpy (job->wbuf, wbuf, wlen);
+  poller->adapter = i2c->adapter;
+
+  return poller->num_jobs++;
+}
+
+int
+libsoc_poller_add_spi (poller * poller, spi * spi, uint8_t * tx,
+		       uint32_t len, uint32_t period_us,
+		       uint32_t deadline_us, unsigned int capacity)
+{
+  struct poller_job *job;
+
+  if (poller == NULL || spi == NULL || len == 0 || len > POLLER_DATA_MAX)
+    {
+      libsoc_debug (__func__, "invalid poller, device or length");
+      return -1;
+    }
+
+  if (poller->adapter || (poller->spi && poller->spi->spi_dev
+			  != spi->spi_dev))
+    {
+      libsoc_debug (__func__, "jobs of a poller must share one bus");
+      return -1;
+    }
+
+  if (poller->transaction == NULL
+      && (poller->transaction = libsoc_spi_transaction_init (spi)) == NULL)
+    return -1;
+
+  job = poller_add (poller, len, len, period_us, deadline_us, capacity);
+
+  if (job == NULL)
+    return -1;
+
+  job->spi = spi;
+
+  if (tx)
+    memcpy (job->wbuf, tx, len);
+
+  poller->spi = spi;
+
+  return poller->num_jobs++;
+}
+
+/*
+ * Jobs whose release has passed, ordered by absolute deadline. There are
+ * few enough jobs for an insertion sort.
+ */
+static unsigned int
+poller_collect (poller * poller, struct poller_job **due, uint64_t now)
+{
+  struct poller_job *job;
+  unsigned int i, j, n = 0;
+
+  for (i = 0; i < poller->num_jobs; i++)
+    {
+      job = &poller->jobs[i];
+
+      if (job->release > now)
+	continue;
+
+      for (j = n; j > 0 && due[j - 1]->release + due[j - 1]->deadline
+	   > job->release + job->deadline; j--)
+	due[j] = due[j - 1];
+
+      due[j] = job;
+      n++;
+    }
+
+  return n;
+}
+
+// Every due i2c job is one operation of a single batch, sent in order
+static void
+poller_run_i2c (poller * poller, struct poller_job **due, unsigned int n)
+{
+  struct poller_job *job;
+  uint64_t completion;
+  unsigned int i;
+  int op[POLLER_JOBS_MAX];
+
+  libsoc_i2c_batch_clear (poller->batch);
+
+  for (i = 0; i < n; i++)
+    {
+      job = due[i];
+
+      if (job->wlen && job->rlen)
+	op[i] = libsoc_i2c_batch_add_write_read (poller->batch, job->i2c,
+						 job->wbuf, job->wlen,
+						 job->rbuf, job->rlen);
+      else if (job->wlen)
+	op[i] = libsoc_i2c_batch_add_write (poller->batch, job->i2c,
+					    job->wbuf, job->wlen);
+      else
+	op[i] = libsoc_i2c_batch_add_read (poller->batch, job->i2c,
+					   job->rbuf, job->rlen);
+    }
+
+  libsoc_i2c_batch_transfer (poller->batch);
+  completion = poller_now ();
+
+  for (i = 0; i < n; i++)
+    {
+      due[i]->status = libsoc_i2c_batch_get_status (poller->batch, op[i]);
+      due[i]->completion = completion;
+    }
+}
+
+/*
+ * spidev has a file descriptor per chip select, so only consecutive jobs
+ * on the same device can share a message. Chip select is released
+ * between them as if they had been sent one at a time.
+ */
+static void
+poller_run_spi (poller * poller, struct poller_job **due, unsigned int n)
+{
+  spi_transaction *transaction = poller->transaction;
+  unsigned int i, j, end;
+  uint64_t completion;
+  int index = -1, status;
+
+  for (i = 0; i < n; i = end)
+    {
+      transaction->spi = due[i]->spi;
+      libsoc_spi_transaction_clear (transaction);
+
+      for (end = i; end < n && due[end]->spi == due[i]->spi
+	   && end - i < SPI_TRANSFERS_MAX; end++)
+	{
+	  index = libsoc_spi_transaction_add (transaction, due[end]->wbuf,
+					      due[end]->rbuf, due[end]->rlen);
+	  libsoc_spi_transaction_set_cs_change (transaction, index, 1);
+	}
+
+      libsoc_spi_transaction_set_cs_change (transaction, index, 0);
+
+      errno = 0;
+      status = 0;
+
+      if (libsoc_spi_transaction_transfer (transaction) == EXIT_FAILURE)
+	status = errno ? errno : EIO;
+
+      completion = poller_now ();
+
+      for (j = i; j < end; j++)
+	{
+	  due[j]->status = status;
+	  due[j]->completion = completion;
+	}
+    }
+}
+
+static void
+poller_publish (struct poller_job *job)
+{
+  struct poller_ring *ring = job->ring;
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  poller_result *result;
+
+  if (head - tail > ring->mask)
+    {
+      job->stats.overflows++;
+      return;
+    }
+
+  result = &ring->results[head & ring->mask];
+  result->release = job->release;
+  result->completion = job->completion;
+  result->sequence = job->sequence;
+  result->status = job->status;
+  result->len = job->status ? 0 : job->rlen;
+  memcpy (result->data, job->rbuf, result->len);
+
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Releases stay on the grid of the first one, so a late run does not
+ * shift the ones after it. A job more than a period behind runs once for
+ * its latest release and the older ones are counted as skipped.
+ */
+static void
+poller_finish (poller * poller, struct poller_job **due, unsigned int n)
+{
+  struct poller_job *job;
+  uint64_t latency;
+  unsigned int i;
+
+  pthread_mutex_lock (&poller->lock);
+
+  for (i = 0; i < n; i++)
+    {
+      job = due[i];
+      latency = job->completion - job->release;
+
+      job->stats.runs++;
+      job->stats.latency_total += latency;
+
+      if (latency < job->stats.latency_min)
+	job->stats.latency_min = latency;
+
+      if (latency > job->stats.latency_max)
+	job->stats.latency_max = latency;
+
+      if (job->status)
+	job->stats.errors++;
+
+      if (latency > job->deadline)
+	job->stats.deadline_misses++;
+
+      poller_publish (job);
+
+      job->release += job->period;
+      job->sequence++;
+
+      while (job->release + job->period <= job->completion)
+	{
+	  job->release += job->period;
+	  job->sequence++;
+	  job->stats.skipped++;
+	  job->stats.deadline_misses++;
+	}
+    }
+
+  pthread_mutex_unlock (&poller->lock);
+}
+
+static void
+poller_arm (poller * poller)
+{
+  struct itimerspec timer;
+  uint64_t next = UINT64_MAX;
+  unsigned int i;
+
+  for (i = 0; i < poller->num_jobs; i++)
+    {
+      if (poller->jobs[i].release < next)
+	next = poller->jobs[i].release;
+    }
+
+  memset (&timer, 0, sizeof (timer));
+  timer.it_value.tv_sec = next / 1000000000ULL;
+  timer.it_value.tv_nsec = next % 1000000000ULL;
+
+  // An absolute time already past expires at once
+  if (timerfd_settime (poller->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL)
+      < 0)
+    perror ("libsoc-poller-debug");
+}
+
+static void *
+poller_thread (void *arg)
+{
+  struct poller_job *due[POLLER_JOBS_MAX];
+  poller *p = arg;
+  struct pollfd fds[2];
+  uint64_t count;
+  unsigned int n;
+
+  fds[0].fd = p->timer_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = p->wakeup_fd;
+  fds[1].events = POLLIN;
+
+  while (1)
+    {
+      if (poll (fds, 2, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  perror ("libsoc-poller-debug");
+	  break;
+	}
+
+      if (fds[1].revents & POLLIN)
+	{
+	  if (read (p->wakeup_fd, &count, sizeof (count)) < 0)
+	    perror ("libsoc-poller-debug");
+	}
+
+      if (__atomic_load_n (&p->stop, __ATOMIC_ACQUIRE))
+	break;
+
+      if (!(fds[0].revents & POLLIN))
+	continue;
+
+      if (read (p->timer_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+	perror ("libsoc-poller-debug");
+
+      n = poller_collect (p, due, poller_now ());
+
+      if (n)
+	{
+	  if (p->adapter)
+	    poller_run_i2c (p, due, n);
+	  else
+	    poller_run_spi (p, due, n);
+
+	  poller_finish (p, due, n);
+	}
+
+      poller_arm (p);
+    }
+
+  return NULL;
+}
+
+int
+libsoc_poller_start (poller * poller)
+{
+  uint64_t now;
+  unsigned int i;
+
+  if (poller == NULL || poller->num_jobs == 0 || poller->running)
+    {
+      libsoc_debug (__func__, "poller has no jobs or is already running");
+      return EXIT_FAILURE;
+    }
+
+  now = poller_now ();
+
+  // Every job is released at once so the first runs share a transfer
+  for (i = 0; i < poller->num_jobs; i++)
+    poller->jobs[i].release = now;
+
+  poller->stop = 0;
+  poller_arm (poller);
+
+  if (pthread_create (&poller->thread, NULL, poller_thread, poller) != 0)
+    {
+      libsoc_debug (__func__, "failed to start poller thread");
+      return EXIT_FAILURE;
+    }
+
+  poller->running = 1;
+
+  libsoc_debug (__func__, "polling %d jobs", poller->num_jobs);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_poller_stop (poller * poller)
+{
+  struct itimerspec timer;
+  uint64_t one = 1;
+
+  if (poller == NULL || !poller->running)
+    {
+      libsoc_debug (__func__, "poller was not running");
+      return EXIT_FAILURE;
+    }
+
+  __atomic_store_n (&poller->stop, 1, __ATOMIC_RELEASE);
+
+  if (write (poller->wakeup_fd, &one, sizeof (one)) < 0)
+    perror ("libsoc-poller-debug");
+
+  pthread_join (poller->thread, NULL);
+  poller->running = 0;
+
+  memset (&timer, 0, sizeof (timer));
+  timerfd_settime (poller->timer_fd, 0, &timer, NULL);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_poller_drain (poller * poller, int job, poller_result * results,
+		     unsigned int max_results)
+{
+  struct poller_ring *ring;
+  uint32_t head, tail, count, i;
+
+  if (poller == NULL || results == NULL || job < 0
+      || job >= (int) poller->num_jobs)
+    {
+      libsoc_debug (__func__, "invalid poller or job %d", job);
+      return -1;
+    }
+
+  ring = poller->jobs[job].ring;
+
+  tail = ring->tail;
+  head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+  count = head - tail;
+
+  if (count > max_results)
+    count = max_results;
+
+  for (i = 0; i < count; i++)
+    results[i] = ring->results[(tail + i) & ring->mask];
+
+  __atomic_store_n (&ring->tail, tail + count, __ATOMIC_RELEASE);
+
+  return count;
+}
+
+int
+libsoc_poller_get_stats (poller * poller, int job, poller_stats * stats)
+{
+  if (poller == NULL || stats == NULL || job < 0
+      || job >= (int) poller->num_jobs)
+    {
+      libsoc_debug (__func__, "invalid poller or job %d", job);
+      return EXIT_FAILURE;
+    }
+
+  pthread_mutex_lock (&poller->lock);
+  *stats = poller->jobs[job].stats;
+  pthread_mutex_unlock (&poller->lock);
+
+  if (stats->runs == 0)
+    stats->latency_min = 0;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_poller_free (poller * poller)
+{
+  unsigned int i;
+
+  if (poller == NULL)
+    {
+      libsoc_debug (__func__, "poller was not valid");
+      return EXIT_FAILURE;
+    }
+
+  if (poller->running)
+    libsoc_poller_stop (poller);
+
+  for (i = 0; i < poller->num_jobs; i++)
+    free (poller->jobs[i].ring);
+
+  if (poller->batch)
+    libsoc_i2c_batch_free (poller->batch);
+
+  if (poller->transaction)
+    libsoc_spi_transaction_free (poller->transaction);
+
+  close (poller->timer_fd);
+  close (poller->wakeup_fd);
+  pthread_mutex_destroy (&poller->lock);
+  free (poller);
+
+  return EXIT_SUCCESS;
+}
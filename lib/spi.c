@@ -4,14 +4,38 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 
 #include "libsoc_spi.h"
+#include "libsoc_buffer.h"
 #include "libsoc_debug.h"
 #include "libsoc_file.h"
 
+#define STR_BUF 256
+
+#define SPIDEV_BUFSIZ         "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_BUFSIZ_DEFAULT 4096
+
+/*
+ * spidev charges every transfer its length rounded up to
+ * ARCH_KMALLOC_MINALIGN against bufsiz. 128 is the largest alignment any
+ * architecture has used, so messages charged with it fit everywhere.
+ */
+#define SPIDEV_ALIGN          128
+#define SPIDEV_CHARGE(len)    (((len) + SPIDEV_ALIGN - 1) & ~(SPIDEV_ALIGN - 1))
+
+#define SPI_CACHED_MODE  0x01
+#define SPI_CACHED_SPEED 0x02
+#define SPI_CACHED_BPW   0x04
+
 inline void
 libsoc_spi_debug (const char *func, spi * spi, char *format, ...)
 {
@@ -42,6 +66,158 @@ libsoc_spi_debug (const char *func, spi * spi, char *format, ...)
 #endif
 }
 
+static const char *
+libsoc_spi_dev_dir ()
+{
+  const char *dir = getenv ("LIBSOC_SPI_DEV");
+
+  if (dir == NULL)
+    dir = "/dev";
+
+  return dir;
+}
+
+static uint32_t spi_bufsiz = SPIDEV_BUFSIZ_DEFAULT;
+static pthread_once_t spi_bufsiz_once = PTHREAD_ONCE_INIT;
+
+static void
+libsoc_spi_read_bufsiz ()
+{
+  const char *path = getenv ("LIBSOC_SPI_BUFSIZ");
+  unsigned long bufsiz;
+  FILE *fp;
+
+  if (path == NULL)
+    path = SPIDEV_BUFSIZ;
+
+  fp = fopen (path, "r");
+
+  if (fp == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "%s not readable, assuming %d bytes",
+			path, SPIDEV_BUFSIZ_DEFAULT);
+      return;
+    }
+
+  if (fscanf (fp, "%lu", &bufsiz) == 1 && bufsiz >= SPIDEV_ALIGN)
+    spi_bufsiz = bufsiz;
+
+  fclose (fp);
+
+  libsoc_spi_debug (__func__, NULL, "spidev bufsiz is %d bytes", spi_bufsiz);
+}
+
+uint32_t
+libsoc_spi_get_bufsiz ()
+{
+  pthread_once (&spi_bufsiz_once, libsoc_spi_read_bufsiz);
+
+  return spi_bufsiz;
+}
+
+static int
+libsoc_spi_flush (spi * spi, struct spi_ioc_transfer *msg, unsigned int n,
+		  int last)
+{
+  /*
+   * A message always ends by deasserting chip select, unless its last
+   * transfer has cs_change set. Inverting the flag of a message that
+   * had to be split keeps the device selected into the next message,
+   * or deselects it if the segment asked for a chip select change.
+   */
+  if (!last)
+    msg[n - 1].cs_change = !msg[n - 1].cs_change;
+
+  if (ioctl (spi->fd, SPI_IOC_MESSAGE (n), msg) < 1)
+    {
+      perror ("libsoc-spi-debug");
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Send transfers in as few SPI_IOC_MESSAGE ioctls as spidev accepts.
+ * spidev rejects messages whose transfers, each charged SPIDEV_CHARGE of
+ * its length, add up to more than bufsiz bytes to send or to receive, so
+ * transfers are split into pieces that fill each message up to the limit.
+ */
+static int
+libsoc_spi_send (spi * spi, const struct spi_ioc_transfer *transfers,
+		 unsigned int num_transfers)
+{
+  struct spi_ioc_transfer msg[SPI_TRANSFERS_MAX];
+  uint32_t bufsiz = libsoc_spi_get_bufsiz ();
+  uint32_t tx_room = bufsiz, rx_room = bufsiz;
+  uint32_t done, room, avail;
+  unsigned int i, n = 0;
+
+  for (i = 0; i < num_transfers; i++)
+    {
+      const struct spi_ioc_transfer *tr = &transfers[i];
+
+      done = 0;
+
+      while (done < tr->len)
+	{
+	  room = tr->len - done;
+	  avail = UINT32_MAX;
+
+	  if (tr->tx_buf && tx_room < avail)
+	    avail = tx_room;
+
+	  if (tr->rx_buf && rx_room < avail)
+	    avail = rx_room;
+
+	  // Split on aligned boundaries, which also keeps whole words together
+	  if (SPIDEV_CHARGE (room) > avail)
+	    room = avail & ~(SPIDEV_ALIGN - 1);
+
+	  if (room == 0 || n == SPI_TRANSFERS_MAX)
+	    {
+	      if (libsoc_spi_flush (spi, msg, n, 0) == EXIT_FAILURE)
+		return EXIT_FAILURE;
+
+	      tx_room = bufsiz;
+	      rx_room = bufsiz;
+	      n = 0;
+	      continue;
+	    }
+
+	  msg[n] = *tr;
+	  msg[n].len = room;
+
+	  if (tr->tx_buf)
+	    {
+	      msg[n].tx_buf += done;
+	      tx_room -= SPIDEV_CHARGE (room);
+	    }
+
+	  if (tr->rx_buf)
+	    {
+	      msg[n].rx_buf += done;
+	      rx_room -= SPIDEV_CHARGE (room);
+	    }
+
+	  // Delays and chip select changes belong to the end of the segment
+	  if (done + room < tr->len)
+	    {
+	      msg[n].cs_change = 0;
+	      msg[n].delay_usecs = 0;
+	    }
+
+	  done += room;
+	  n++;
+	}
+    }
+
+  if (n > 0 && libsoc_spi_flush (spi, msg, n, 1) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
+
 spi *
 libsoc_spi_init (uint8_t spidev_device, uint8_t chip_select)
 {
@@ -58,12 +234,14 @@ libsoc_spi_init (uint8_t spidev_device, uint8_t chip_select)
       return NULL;
     }
 
-  char path[40];
+  char path[STR_BUF];
 
   spi_dev->spi_dev = spidev_device;
   spi_dev->chip_select = chip_select;
+  spi_dev->cached = 0;
 
-  sprintf (path, "/dev/spidev%d.%d", spi_dev->spi_dev, spi_dev->chip_select);
+  snprintf (path, STR_BUF, "%s/spidev%d.%d", libsoc_spi_dev_dir (),
+	    spi_dev->spi_dev, spi_dev->chip_select);
 
   if (!file_valid (path))
     {
@@ -88,14 +266,18 @@ error:
   return NULL;
 }
 
-int
-libsoc_spi_set_bits_per_word (spi * spi, spi_bpw bpw)
+/*
+ * The last value written to or read from the device, for each of mode,
+ * speed and bits per word, is kept in the spi struct. Writes of an
+ * unchanged value are skipped and reads are served from the struct.
+ */
+static int
+libsoc_spi_write_bits_per_word (spi * spi, uint8_t bpw)
 {
-  if (bpw != BITS_8 && bpw != BITS_16)
+  if ((spi->cached & SPI_CACHED_BPW) && spi->bits_per_word == bpw)
     {
-      libsoc_spi_debug (__func__, spi, "bits per word was not BITS_8"
-			" or BITS_16", bpw);
-      return EXIT_FAILURE;
+      libsoc_spi_debug (__func__, spi, "bits per word already %d", bpw);
+      return EXIT_SUCCESS;
     }
 
   libsoc_spi_debug (__func__, spi, "setting bits per word to %d", bpw);
@@ -105,42 +287,25 @@ libsoc_spi_set_bits_per_word (spi * spi, spi_bpw bpw)
   if (ret == -1)
     {
       libsoc_spi_debug (__func__, spi, "failed setting bits per word");
+      spi->cached &= ~SPI_CACHED_BPW;
       return EXIT_FAILURE;
     }
 
+  spi->bits_per_word = bpw;
+  spi->cached |= SPI_CACHED_BPW;
+
   return EXIT_SUCCESS;
 }
 
-spi_bpw
-libsoc_spi_get_bits_per_word (spi * spi)
+static int
+libsoc_spi_write_speed (spi * spi, uint32_t speed)
 {
-  uint8_t bpw;
-
-  int ret = ioctl (spi->fd, SPI_IOC_RD_BITS_PER_WORD, &bpw);
-
-  if (ret == -1)
-    {
-      libsoc_spi_debug (__func__, spi, "failed reading bits per word");
-      return BPW_ERROR;
-    }
-
-  switch (bpw)
+  if ((spi->cached & SPI_CACHED_SPEED) && spi->speed == speed)
     {
-    case 8:
-      libsoc_spi_debug (__func__, spi, "read bits per word as 8");
-      return BITS_8;
-    case 16:
-      libsoc_spi_debug (__func__, spi, "read bits per word as 16");
-      return BITS_16;
-    default:
-      libsoc_spi_debug (__func__, spi, "bits per word not recognised");
-      return BPW_ERROR;
+      libsoc_spi_debug (__func__, spi, "speed already %dHz", speed);
+      return EXIT_SUCCESS;
     }
-}
 
-int
-libsoc_spi_set_speed (spi * spi, uint32_t speed)
-{
   libsoc_spi_debug (__func__, spi, "setting speed to %dHz", speed);
 
   int ret = ioctl (spi->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
@@ -148,76 +313,165 @@ libsoc_spi_set_speed (spi * spi, uint32_t speed)
   if (ret == -1)
     {
       libsoc_spi_debug (__func__, spi, "failed setting speed");
+      spi->cached &= ~SPI_CACHED_SPEED;
       return EXIT_FAILURE;
     }
 
+  spi->speed = speed;
+  spi->cached |= SPI_CACHED_SPEED;
+
   return EXIT_SUCCESS;
 }
 
-uint32_t
-libsoc_spi_get_speed (spi * spi)
+// Modes without flags above bit 7 use the 8 bit ioctl, which older
+// kernels without SPI_IOC_WR_MODE32 also understand
+static int
+libsoc_spi_write_mode (spi * spi, uint32_t mode)
 {
-  uint32_t speed;
-
-  int ret = ioctl (spi->fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed);
+  uint8_t mode8 = mode;
+  int ret;
 
-  if (ret == -1)
+  if ((spi->cached & SPI_CACHED_MODE) && spi->mode == mode)
     {
-      libsoc_spi_debug (__func__, spi, "failed reading speed");
-      return -1;
+      libsoc_spi_debug (__func__, spi, "mode already 0x%x", mode);
+      return EXIT_SUCCESS;
     }
 
-  libsoc_spi_debug (__func__, spi, "read speed as %dHz", speed);
+  libsoc_spi_debug (__func__, spi, "setting mode to 0x%x", mode);
 
-  return speed;
-}
+  if (mode > 0xff)
+    ret = ioctl (spi->fd, SPI_IOC_WR_MODE32, &mode);
+  else
+    ret = ioctl (spi->fd, SPI_IOC_WR_MODE, &mode8);
 
-int
-libsoc_spi_set_mode (spi * spi, spi_mode mode)
-{
-  if (spi == NULL)
+  if (ret == -1)
     {
-      libsoc_spi_debug (__func__, NULL, "spi was not valid");
+      libsoc_spi_debug (__func__, spi, "failed setting mode");
+      spi->cached &= ~SPI_CACHED_MODE;
       return EXIT_FAILURE;
     }
 
-  libsoc_spi_debug (__func__, spi, "setting mode to %d", mode);
+  spi->mode = mode;
+  spi->cached |= SPI_CACHED_MODE;
 
-  uint8_t new_mode;
+  return EXIT_SUCCESS;
+}
 
+static int
+libsoc_spi_mode_bits (spi_mode mode, uint8_t * bits)
+{
   switch (mode)
     {
     case MODE_0:
-      new_mode = SPI_MODE_0;
+      *bits = SPI_MODE_0;
       break;
     case MODE_1:
-      new_mode = SPI_MODE_1;
+      *bits = SPI_MODE_1;
       break;
     case MODE_2:
-      new_mode = SPI_MODE_2;
+      *bits = SPI_MODE_2;
       break;
     case MODE_3:
-      new_mode = SPI_MODE_3;
+      *bits = SPI_MODE_3;
       break;
     default:
       return EXIT_FAILURE;
     }
 
-  int ret = ioctl (spi->fd, SPI_IOC_WR_MODE, &new_mode);
+  return EXIT_SUCCESS;
+}
 
-  if (ret == -1)
+// Clock polarity and phase replace those of the last known mode, any
+// other flags set with libsoc_spi_set_mode32 are kept
+static uint32_t
+libsoc_spi_clock_mode (spi * spi, uint8_t bits)
+{
+  if (!(spi->cached & SPI_CACHED_MODE))
+    return bits;
+
+  return (spi->mode & ~(SPI_CPHA | SPI_CPOL)) | bits;
+}
+
+int
+libsoc_spi_set_bits_per_word (spi * spi, spi_bpw bpw)
+{
+  if (bpw != BITS_8 && bpw != BITS_16)
     {
-      libsoc_spi_debug (__func__, spi, "failed setting mode");
+      libsoc_spi_debug (__func__, spi, "bits per word was not BITS_8"
+			" or BITS_16", bpw);
       return EXIT_FAILURE;
     }
 
-  return EXIT_SUCCESS;
+  return libsoc_spi_write_bits_per_word (spi, bpw);
 }
 
-spi_mode
-libsoc_spi_get_mode (spi * spi)
+spi_bpw
+libsoc_spi_get_bits_per_word (spi * spi)
 {
-  uint8_t mode;
+  uint8_t bpw = spi->bits_per_word;
+
+  if (!(spi->cached & SPI_CACHED_BPW))
+    {
+      int ret = ioctl (spi->fd, SPI_IOC_RD_BITS_PER_WORD, &bpw);
+
+      if (ret == -1)
+	{
+	  libsoc_spi_debug (__func__, spi, "failed reading bits per word");
+	  return BPW_ERROR;
+	}
+
+      spi->bits_per_word = bpw;
+      spi->cached |= SPI_CACHED_BPW;
+    }
+
+  switch (bpw)
+    {
+    case 8:
+      libsoc_spi_debug (__func__, spi, "read bits per word as 8");
+      return BITS_8;
+    case 16:
+      libsoc_spi_debug (__func__, spi, "read bits per word as 16");
+      return BITS_16;
+    default:
+      libsoc_spi_debug (__func__, spi, "bits per word not recognised");
+      return BPW_ERROR;
+    }
+}
+
+int
+libsoc_spi_set_speed (spi * spi, uint32_t speed)
+{
+  return libsoc_spi_write_speed (spi, speed);
+}
+
+uint32_t
+libsoc_spi_get_speed (spi * spi)
+{
+  uint32_t speed = spi->speed;
+
+  if (!(spi->cached & SPI_CACHED_SPEED))
+    {
+      int ret = ioctl (spi->fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed);
+
+      if (ret == -1)
+	{
+	  libsoc_spi_debug (__func__, spi, "failed reading speed");
+	  return -1;
+	}
+
+      spi->speed = speed;
+      spi->cached |= SPI_CACHED_SPEED;
+    }
+
+  libsoc_spi_debug (__func__, spi, "read speed as %dHz", speed);
+
+  return speed;
+}
+
+int
+libsoc_spi_set_mode (spi * spi, spi_mode mode)
+{
+  uint8_t new_mode;
 
   if (spi == NULL)
     {
@@ -225,15 +479,24 @@ libsoc_spi_get_mode (spi * spi)
       return EXIT_FAILURE;
     }
 
-  int ret = ioctl (spi->fd, SPI_IOC_RD_MODE, &mode);
-
-  if (ret == -1)
+  if (libsoc_spi_mode_bits (mode, &new_mode) == EXIT_FAILURE)
     {
-      libsoc_spi_debug (__func__, spi, "failed reading mode");
-      return MODE_ERROR;
+      libsoc_spi_debug (__func__, spi, "mode %d not recognised", mode);
+      return EXIT_FAILURE;
     }
 
-  switch (mode)
+  return libsoc_spi_write_mode (spi, libsoc_spi_clock_mode (spi, new_mode));
+}
+
+spi_mode
+libsoc_spi_get_mode (spi * spi)
+{
+  uint32_t mode;
+
+  if (libsoc_spi_get_mode32 (spi, &mode) == EXIT_FAILURE)
+    return MODE_ERROR;
+
+  switch (mode & (SPI_CPHA | SPI_CPOL))
     {
     case SPI_MODE_0:
       libsoc_spi_debug (__func__, spi, "read mode as 0");
@@ -244,15 +507,144 @@ libsoc_spi_get_mode (spi * spi)
     case SPI_MODE_2:
       libsoc_spi_debug (__func__, spi, "read mode as 2");
       return MODE_2;
-    case SPI_MODE_3:
+    default:
       libsoc_spi_debug (__func__, spi, "read mode as 3");
       return MODE_3;
-    default:
-      libsoc_spi_debug (__func__, spi, "mode not recognised");
-      return MODE_ERROR;
     }
 }
 
+int
+libsoc_spi_set_mode32 (spi * spi, uint32_t mode)
+{
+  if (spi == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "spi was not valid");
+      return EXIT_FAILURE;
+    }
+
+  return libsoc_spi_write_mode (spi, mode);
+}
+
+int
+libsoc_spi_get_mode32 (spi * spi, uint32_t * mode)
+{
+  if (spi == NULL || mode == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "spi was not valid");
+      return EXIT_FAILURE;
+    }
+
+  if (!(spi->cached & SPI_CACHED_MODE))
+    {
+      int ret = ioctl (spi->fd, SPI_IOC_RD_MODE32, &spi->mode);
+
+      if (ret == -1)
+	{
+	  uint8_t mode8;
+
+	  // Kernels before 3.15 only have the 8 bit mode
+	  ret = ioctl (spi->fd, SPI_IOC_RD_MODE, &mode8);
+	  spi->mode = mode8;
+	}
+
+      if (ret == -1)
+	{
+	  libsoc_spi_debug (__func__, spi, "failed reading mode");
+	  return EXIT_FAILURE;
+	}
+
+      spi->cached |= SPI_CACHED_MODE;
+    }
+
+  *mode = spi->mode;
+
+  libsoc_spi_debug (__func__, spi, "read mode as 0x%x", *mode);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Controllers reject some unsupported flags and silently drop others,
+ * dual and quad in particular, so each flag is written on its own and
+ * read back. The original mode is restored afterwards.
+ */
+int
+libsoc_spi_probe_mode32 (spi * spi, uint32_t flags, uint32_t * accepted)
+{
+  uint32_t mode, try, readback, bit;
+  int ret = EXIT_SUCCESS;
+
+  if (accepted == NULL
+      || libsoc_spi_get_mode32 (spi, &mode) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  *accepted = 0;
+
+  for (bit = 1; bit && bit <= flags; bit <<= 1)
+    {
+      if (!(flags & bit))
+	continue;
+
+      try = mode | bit;
+
+      if (ioctl (spi->fd, SPI_IOC_WR_MODE32, &try) == -1)
+	continue;
+
+      if (ioctl (spi->fd, SPI_IOC_RD_MODE32, &readback) != -1
+	  && (readback & bit))
+	*accepted |= bit;
+    }
+
+  libsoc_spi_debug (__func__, spi, "controller accepted 0x%x of 0x%x",
+		    *accepted, flags);
+
+  if (ioctl (spi->fd, SPI_IOC_WR_MODE32, &mode) == -1)
+    {
+      libsoc_spi_debug (__func__, spi, "failed restoring mode");
+      spi->cached &= ~SPI_CACHED_MODE;
+      ret = EXIT_FAILURE;
+    }
+
+  return ret;
+}
+
+int
+libsoc_spi_configure (spi * spi, spi_mode mode, uint32_t speed,
+		      spi_bpw bpw)
+{
+  uint8_t new_mode;
+
+  if (spi == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "spi was not valid");
+      return EXIT_FAILURE;
+    }
+
+  if (libsoc_spi_mode_bits (mode, &new_mode) == EXIT_FAILURE
+      || (bpw != BITS_8 && bpw != BITS_16))
+    {
+      libsoc_spi_debug (__func__, spi, "mode %d or bits per word %d not"
+			" recognised", mode, bpw);
+      return EXIT_FAILURE;
+    }
+
+  if (libsoc_spi_write_mode (spi, libsoc_spi_clock_mode (spi, new_mode))
+      == EXIT_FAILURE
+      || libsoc_spi_write_speed (spi, speed) == EXIT_FAILURE
+      || libsoc_spi_write_bits_per_word (spi, bpw) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
+
+void
+libsoc_spi_invalidate_config (spi * spi)
+{
+  libsoc_spi_debug (__func__, spi, "dropping cached config");
+
+  spi->cached = 0;
+}
+
 int
 libsoc_spi_write (spi * spi, uint8_t * tx, uint32_t len)
 {
@@ -278,9 +670,9 @@ libsoc_spi_write (spi * spi, uint8_t * tx, uint32_t len)
     .len = len,
   };
 
-  ret = ioctl (spi->fd, SPI_IOC_MESSAGE (1), &tr);
+  ret = libsoc_spi_send (spi, &tr, 1);
 
-  if (ret < 1)
+  if (ret == EXIT_FAILURE)
   {
     libsoc_spi_debug (__func__, spi, "failed sending message");
     return EXIT_FAILURE;
@@ -314,9 +706,9 @@ libsoc_spi_read (spi * spi, uint8_t * rx, uint32_t len)
     .len = len,
   };
 
-  ret = ioctl (spi->fd, SPI_IOC_MESSAGE (1), &tr);
+  ret = libsoc_spi_send (spi, &tr, 1);
 
-  if (ret < 1)
+  if (ret == EXIT_FAILURE)
     {
       libsoc_spi_debug (__func__, spi, "failed recieving message");
       return EXIT_FAILURE;
@@ -351,9 +743,9 @@ libsoc_spi_rw (spi * spi, uint8_t * tx, uint8_t * rx, uint32_t len)
     .len = len,
   };
 
-  ret = ioctl (spi->fd, SPI_IOC_MESSAGE (1), &tr);
+  ret = libsoc_spi_send (spi, &tr, 1);
 
-  if (ret < 1)
+  if (ret == EXIT_FAILURE)
   {
     libsoc_spi_debug (__func__, spi, "failed duplex transfer");
     return EXIT_FAILURE;
@@ -362,6 +754,933 @@ libsoc_spi_rw (spi * spi, uint8_t * tx, uint8_t * rx, uint32_t len)
   return EXIT_SUCCESS;
 }
 
+struct spi_stream
+{
+  spi *spi;
+  uint32_t len;
+  uint32_t chunk;
+  int write;
+  spi_stream_fn fn;
+  void *arg;
+  uint8_t *buf[2];
+  int full[2];
+  int error;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static int
+libsoc_spi_stream_wait (struct spi_stream *stream, int b, int full)
+{
+  int error;
+
+  pthread_mutex_lock (&stream->lock);
+
+  while (stream->full[b] != full && !stream->error)
+    pthread_cond_wait (&stream->cond, &stream->lock);
+
+  error = stream->error;
+
+  pthread_mutex_unlock (&stream->lock);
+
+  return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void
+libsoc_spi_stream_post (struct spi_stream *stream, int b, int full, int ret)
+{
+  pthread_mutex_lock (&stream->lock);
+
+  stream->full[b] = full;
+
+  if (ret == EXIT_FAILURE)
+    stream->error = 1;
+
+  pthread_cond_broadcast (&stream->cond);
+  pthread_mutex_unlock (&stream->lock);
+}
+
+/*
+ * The worker runs the callback stage: it fills the buffer the bus is not
+ * using for a write stream, or drains the buffer the bus just filled for
+ * a read stream.
+ */
+static void *
+libsoc_spi_stream_worker (void *arg)
+{
+  struct spi_stream *stream = arg;
+  uint32_t offset, n;
+  int b, ret;
+
+  for (offset = 0, b = 0; offset < stream->len; offset += n, b ^= 1)
+    {
+      n = stream->len - offset;
+
+      if (n > stream->chunk)
+	n = stream->chunk;
+
+      if (libsoc_spi_stream_wait (stream, b, !stream->write) == EXIT_FAILURE)
+	break;
+
+      ret = stream->fn (stream->arg, stream->buf[b], offset, n);
+
+      libsoc_spi_stream_post (stream, b, stream->write, ret);
+    }
+
+  return NULL;
+}
+
+static int
+libsoc_spi_stream (spi * spi, uint32_t len, spi_stream_fn fn, void *arg,
+		   int write)
+{
+  struct spi_stream stream;
+  struct spi_ioc_transfer tr;
+  pthread_t worker;
+  uint32_t offset, n;
+  int b, ret;
+
+  if (spi == NULL || fn == NULL || len == 0)
+    {
+      libsoc_spi_debug (__func__, spi, "spi or callback was NULL");
+      return EXIT_FAILURE;
+    }
+
+  memset (&stream, 0, sizeof (stream));
+  stream.spi = spi;
+  stream.len = len;
+  stream.chunk = libsoc_spi_get_bufsiz () & ~(SPIDEV_ALIGN - 1);
+  stream.write = write;
+  stream.fn = fn;
+  stream.arg = arg;
+  stream.buf[0] = libsoc_buffer_alloc (stream.chunk);
+  stream.buf[1] = libsoc_buffer_alloc (stream.chunk);
+
+  if (stream.buf[0] == NULL || stream.buf[1] == NULL)
+    {
+      libsoc_spi_debug (__func__, spi, "failed to allocate memory");
+      libsoc_buffer_free (stream.buf[0], stream.chunk);
+      libsoc_buffer_free (stream.buf[1], stream.chunk);
+      return EXIT_FAILURE;
+    }
+
+  pthread_mutex_init (&stream.lock, NULL);
+  pthread_cond_init (&stream.cond, NULL);
+
+  if (pthread_create (&worker, NULL, libsoc_spi_stream_worker, &stream) != 0)
+    {
+      libsoc_spi_debug (__func__, spi, "failed to start worker thread");
+      stream.error = 1;
+      goto done;
+    }
+
+  for (offset = 0, b = 0; offset < len; offset += n, b ^= 1)
+    {
+      n = len - offset;
+
+      if (n > stream.chunk)
+	n = stream.chunk;
+
+      if (libsoc_spi_stream_wait (&stream, b, write) == EXIT_FAILURE)
+	break;
+
+      // Keep the device selected until the last chunk
+      memset (&tr, 0, sizeof (tr));
+      tr.len = n;
+      tr.cs_change = offset + n < len;
+
+      if (write)
+	tr.tx_buf = (unsigned long) stream.buf[b];
+      else
+	tr.rx_buf = (unsigned long) stream.buf[b];
+
+      ret = EXIT_SUCCESS;
+
+      if (ioctl (spi->fd, SPI_IOC_MESSAGE (1), &tr) < 1)
+	{
+	  libsoc_spi_debug (__func__, spi, "failed stream transfer");
+	  perror ("libsoc-spi-debug");
+	  ret = EXIT_FAILURE;
+	}
+
+      libsoc_spi_stream_post (&stream, b, !write, ret);
+    }
+
+  pthread_join (worker, NULL);
+
+done:
+
+  pthread_cond_destroy (&stream.cond);
+  pthread_mutex_destroy (&stream.lock);
+  libsoc_buffer_free (stream.buf[0], stream.chunk);
+  libsoc_buffer_free (stream.buf[1], stream.chunk);
+
+  return stream.error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_write_stream (spi * spi, uint32_t len, spi_stream_fn fill,
+			 void *arg)
+{
+  libsoc_spi_debug (__func__, spi, "performing streamed write of %d bytes",
+		    len);
+
+  return libsoc_spi_stream (spi, len, fill, arg, 1);
+}
+
+int
+libsoc_spi_read_stream (spi * spi, uint32_t len, spi_stream_fn consume,
+			void *arg)
+{
+  libsoc_spi_debug (__func__, spi, "performing streamed read of %d bytes",
+		    len);
+
+  return libsoc_spi_stream (spi, len, consume, arg, 0);
+}
+
+/*
+ * Async queue. Submitters push requests onto a lock-free stack with a
+ * compare and swap, the worker takes the whole stack with one exchange
+ * and reverses it into submission order. Only a push onto an empty stack
+ * writes the eventfd, the worker drains everything before it sleeps.
+ */
+
+struct spi_queue
+{
+  spi_request *head;
+  int wakeup_fd;
+  int stop;
+  pthread_t worker;
+};
+
+static void
+libsoc_spi_request_complete (spi_request * request, int status)
+{
+  if (request->callback_fn)
+    request->callback_fn (request, request->callback_arg);
+
+  // The request may be reused by its owner as soon as status is set
+  __atomic_store_n (&request->status, status, __ATOMIC_RELEASE);
+  syscall (SYS_futex, &request->status, FUTEX_WAKE, INT32_MAX, NULL, NULL,
+	   0);
+}
+
+/*
+ * Adjacent requests for the same device that fit together in one spidev
+ * message are sent with one ioctl. cs_change is set on every transfer but
+ * the last, so chip select is still released between requests exactly as
+ * if they had been sent one at a time.
+ */
+static spi_request *
+libsoc_spi_queue_send (spi_request * list)
+{
+  struct spi_ioc_transfer tr[SPI_TRANSFERS_MAX];
+  spi_request *group[SPI_TRANSFERS_MAX];
+  uint32_t bufsiz = libsoc_spi_get_bufsiz (), bytes = 0;
+  spi *spi = list->spi;
+  unsigned int i, n = 0;
+  int status;
+
+  memset (tr, 0, sizeof (tr));
+
+  while (list && list->spi == spi && n < SPI_TRANSFERS_MAX
+	 && (n == 0 || bytes + SPIDEV_CHARGE (list->len) <= bufsiz))
+    {
+      tr[n].tx_buf = (unsigned long) list->tx;
+      tr[n].rx_buf = (unsigned long) list->rx;
+      tr[n].len = list->len;
+      tr[n].tx_nbits = list->tx_nbits;
+      tr[n].rx_nbits = list->rx_nbits;
+      tr[n].cs_change = 1;
+      bytes += SPIDEV_CHARGE (list->len);
+      group[n++] = list;
+      list = list->next;
+    }
+
+  tr[n - 1].cs_change = 0;
+
+  libsoc_spi_debug (__func__, spi, "sending %d queued transfers", n);
+
+  // A single request longer than bufsiz is split by libsoc_spi_send
+  status = libsoc_spi_send (spi, tr, n);
+
+  for (i = 0; i < n; i++)
+    libsoc_spi_request_complete (group[i], status);
+
+  return list;
+}
+
+static void *
+libsoc_spi_queue_worker (void *arg)
+{
+  spi_queue *queue = arg;
+  spi_request *list, *next, *fifo;
+  uint64_t count;
+
+  while (1)
+    {
+      list = __atomic_exchange_n (&queue->head, NULL, __ATOMIC_ACQUIRE);
+
+      if (list == NULL)
+	{
+	  if (__atomic_load_n (&queue->stop, __ATOMIC_ACQUIRE))
+	    break;
+
+	  if (read (queue->wakeup_fd, &count, sizeof (count)) < 0
+	      && errno != EINTR)
+	    {
+	      perror ("libsoc-spi-debug");
+	      break;
+	    }
+
+	  continue;
+	}
+
+      for (fifo = NULL; list; list = next)
+	{
+	  next = list->next;
+	  list->next = fifo;
+	  fifo = list;
+	}
+
+      while (fifo)
+	fifo = libsoc_spi_queue_send (fifo);
+    }
+
+  return NULL;
+}
+
+spi_queue *
+libsoc_spi_queue_init ()
+{
+  spi_queue *queue = calloc (1, sizeof (spi_queue));
+
+  if (queue == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "failed to allocate memory");
+      return NULL;
+    }
+
+  queue->wakeup_fd = eventfd (0, EFD_CLOEXEC);
+
+  if (queue->wakeup_fd < 0)
+    {
+      libsoc_spi_debug (__func__, NULL, "failed to create eventfd");
+      perror ("libsoc-spi-debug");
+      goto error;
+    }
+
+  if (pthread_create (&queue->worker, NULL, libsoc_spi_queue_worker, queue)
+      != 0)
+    {
+      libsoc_spi_debug (__func__, NULL, "failed to start worker thread");
+      close (queue->wakeup_fd);
+      goto error;
+    }
+
+  return queue;
+
+error:
+
+  free (queue);
+
+  return NULL;
+}
+
+static void
+libsoc_spi_queue_wakeup (spi_queue * queue)
+{
+  uint64_t one = 1;
+
+  if (write (queue->wakeup_fd, &one, sizeof (one)) < 0)
+    perror ("libsoc-spi-debug");
+}
+
+int
+libsoc_spi_queue_submit (spi_queue * queue, spi_request * request)
+{
+  spi_request *head;
+
+  if (queue == NULL || request == NULL || request->spi == NULL
+      || request->len == 0)
+    {
+      libsoc_spi_debug (__func__, NULL, "queue or request was not valid");
+      return EXIT_FAILURE;
+    }
+
+  request->status = SPI_REQUEST_PENDING;
+  head = __atomic_load_n (&queue->head, __ATOMIC_RELAXED);
+
+  do
+    request->next = head;
+  while (!__atomic_compare_exchange_n (&queue->head, &head, request, 1,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (head == NULL)
+    libsoc_spi_queue_wakeup (queue);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_request_done (spi_request * request)
+{
+  return __atomic_load_n (&request->status, __ATOMIC_ACQUIRE) !=
+    SPI_REQUEST_PENDING;
+}
+
+int
+libsoc_spi_request_wait (spi_request * request)
+{
+  int status;
+
+  while ((status = __atomic_load_n (&request->status, __ATOMIC_ACQUIRE)) ==
+	 SPI_REQUEST_PENDING)
+    syscall (SYS_futex, &request->status, FUTEX_WAIT, SPI_REQUEST_PENDING,
+	     NULL, NULL, 0);
+
+  return status;
+}
+
+int
+libsoc_spi_queue_free (spi_queue * queue)
+{
+  if (queue == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "queue was not valid");
+      return EXIT_FAILURE;
+    }
+
+  // Requests already submitted are still sent before the worker exits
+  __atomic_store_n (&queue->stop, 1, __ATOMIC_RELEASE);
+  libsoc_spi_queue_wakeup (queue);
+  pthread_join (queue->worker, NULL);
+
+  close (queue->wakeup_fd);
+  free (queue);
+
+  return EXIT_SUCCESS;
+}
+
+spi_transaction *
+libsoc_spi_transaction_init (spi * spi)
+{
+  spi_transaction *transaction;
+
+  if (spi == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "spi was not valid");
+      return NULL;
+    }
+
+  transaction = calloc (1, sizeof (spi_transaction));
+
+  if (transaction == NULL)
+    {
+      libsoc_spi_debug (__func__, spi, "failed to allocate memory");
+      return NULL;
+    }
+
+  transaction->spi = spi;
+
+  return transaction;
+}
+
+int
+libsoc_spi_transaction_add (spi_transaction * transaction, uint8_t * tx,
+			    uint8_t * rx, uint32_t len)
+{
+  struct spi_ioc_transfer *tr;
+
+  if (transaction == NULL || (tx == NULL && rx == NULL) || len == 0)
+    {
+      libsoc_spi_debug (__func__, NULL, "invalid transaction or segment");
+      return -1;
+    }
+
+  if (transaction->num_transfers >= SPI_TRANSFERS_MAX)
+    {
+      libsoc_spi_debug (__func__, transaction->spi,
+			"transaction already has %d segments",
+			SPI_TRANSFERS_MAX);
+      return -1;
+    }
+
+  tr = &transaction->transfers[transaction->num_transfers];
+
+  memset (tr, 0, sizeof (struct spi_ioc_transfer));
+  tr->tx_buf = (unsigned long) tx;
+  tr->rx_buf = (unsigned long) rx;
+  tr->len = len;
+
+  return transaction->num_transfers++;
+}
+
+static struct spi_ioc_transfer *
+libsoc_spi_transaction_segment (spi_transaction * transaction, int index)
+{
+  if (transaction == NULL || index < 0
+      || index >= (int) transaction->num_transfers)
+    {
+      libsoc_spi_debug (__func__, NULL, "invalid segment index %d", index);
+      return NULL;
+    }
+
+  return &transaction->transfers[index];
+}
+
+int
+libsoc_spi_transaction_set_cs_change (spi_transaction * transaction,
+				      int index, uint8_t cs_change)
+{
+  struct spi_ioc_transfer *tr =
+    libsoc_spi_transaction_segment (transaction, index);
+
+  if (tr == NULL)
+    return EXIT_FAILURE;
+
+  tr->cs_change = cs_change ? 1 : 0;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_transaction_set_delay (spi_transaction * transaction, int index,
+				  uint16_t delay_usecs)
+{
+  struct spi_ioc_transfer *tr =
+    libsoc_spi_transaction_segment (transaction, index);
+
+  if (tr == NULL)
+    return EXIT_FAILURE;
+
+  tr->delay_usecs = delay_usecs;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_transaction_set_speed (spi_transaction * transaction, int index,
+				  uint32_t speed)
+{
+  struct spi_ioc_transfer *tr =
+    libsoc_spi_transaction_segment (transaction, index);
+
+  if (tr == NULL)
+    return EXIT_FAILURE;
+
+  tr->speed_hz = speed;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_transaction_set_bits_per_word (spi_transaction * transaction,
+					  int index, spi_bpw bpw)
+{
+  struct spi_ioc_transfer *tr =
+    libsoc_spi_transaction_segment (transaction, index);
+
+  if (tr == NULL)
+    return EXIT_FAILURE;
+
+  if (bpw != BITS_8 && bpw != BITS_16)
+    {
+      libsoc_spi_debug (__func__, transaction->spi, "bits per word was not"
+			" BITS_8 or BITS_16");
+      return EXIT_FAILURE;
+    }
+
+  tr->bits_per_word = bpw;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_transaction_set_nbits (spi_transaction * transaction, int index,
+				  uint8_t tx_nbits, uint8_t rx_nbits)
+{
+  struct spi_ioc_transfer *tr =
+    libsoc_spi_transaction_segment (transaction, index);
+
+  if (tr == NULL)
+    return EXIT_FAILURE;
+
+  if (tx_nbits > 4 || rx_nbits > 4 || tx_nbits == 3 || rx_nbits == 3)
+    {
+      libsoc_spi_debug (__func__, transaction->spi, "nbits must be 0, 1,"
+			" 2 or 4");
+      return EXIT_FAILURE;
+    }
+
+  tr->tx_nbits = tx_nbits;
+  tr->rx_nbits = rx_nbits;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_transaction_transfer (spi_transaction * transaction)
+{
+  int ret;
+
+  if (transaction == NULL || transaction->num_transfers == 0)
+    {
+      libsoc_spi_debug (__func__, NULL, "transaction was empty");
+      return EXIT_FAILURE;
+    }
+
+  libsoc_spi_debug (__func__, transaction->spi,
+		    "performing transaction of %d segments",
+		    transaction->num_transfers);
+
+  ret = libsoc_spi_send (transaction->spi, transaction->transfers,
+			 transaction->num_transfers);
+
+  if (ret == EXIT_FAILURE)
+    {
+      libsoc_spi_debug (__func__, transaction->spi, "failed transaction");
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_transaction_clear (spi_transaction * transaction)
+{
+  if (transaction == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "transaction was not valid");
+      return EXIT_FAILURE;
+    }
+
+  transaction->num_transfers = 0;
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_transaction_free (spi_transaction * transaction)
+{
+  if (transaction == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "transaction was not valid");
+      return EXIT_FAILURE;
+    }
+
+  free (transaction);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Shared bus. Threads wait for the bus in a list, and the releasing
+ * thread hands it straight to the next waiter. The next waiter is the
+ * oldest one, unless its device needs a different config from the one
+ * the controller was last set up for and it has waited less than the
+ * latency bound. In that case the oldest waiter whose device shares the
+ * current config goes first.
+ */
+
+struct spi_bus_device
+{
+  spi *spi;
+  uint8_t mode;
+  uint8_t bits_per_word;
+  uint32_t speed;
+};
+
+struct spi_bus_waiter
+{
+  struct spi_bus_device *device;
+  uint64_t queued;
+  int granted;
+  pthread_cond_t cond;
+  struct spi_bus_waiter *next;
+};
+
+struct spi_bus
+{
+  uint8_t spidev_device;
+  uint32_t latency_us;
+  struct spi_bus_device devices[SPI_BUS_MAX_DEVICES];
+  pthread_mutex_t lock;
+  int busy;
+  struct spi_bus_device *current;
+  struct spi_bus_waiter *waiters;
+  spi_bus_stats stats;
+};
+
+static uint64_t
+libsoc_spi_bus_now ()
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int
+libsoc_spi_bus_same_config (struct spi_bus_device *a,
+			    struct spi_bus_device *b)
+{
+  return a->mode == b->mode && a->speed == b->speed
+    && a->bits_per_word == b->bits_per_word;
+}
+
+static struct spi_bus_device *
+libsoc_spi_bus_device (spi_bus * bus, spi * spi)
+{
+  unsigned int i;
+
+  for (i = 0; i < SPI_BUS_MAX_DEVICES; i++)
+    {
+      if (bus->devices[i].spi == spi)
+	return &bus->devices[i];
+    }
+
+  return NULL;
+}
+
+// Must be called with the bus lock held
+static void
+libsoc_spi_bus_grant (spi_bus * bus, struct spi_bus_device *device)
+{
+  if (bus->current && !libsoc_spi_bus_same_config (bus->current, device))
+    bus->stats.config_switches++;
+
+  bus->current = device;
+  bus->busy = 1;
+  bus->stats.grants++;
+}
+
+// Must be called with the bus lock held
+static void
+libsoc_spi_bus_grant_next (spi_bus * bus)
+{
+  struct spi_bus_waiter **pick = &bus->waiters, **w;
+
+  if (*pick == NULL)
+    return;
+
+  if (bus->current
+      && !libsoc_spi_bus_same_config (bus->current, (*pick)->device)
+      && libsoc_spi_bus_now () - (*pick)->queued < bus->latency_us)
+    {
+      for (w = &(*pick)->next; *w; w = &(*w)->next)
+	{
+	  if (libsoc_spi_bus_same_config (bus->current, (*w)->device))
+	    {
+	      pick = w;
+	      bus->stats.config_switches_avoided++;
+	      break;
+	    }
+	}
+    }
+
+  struct spi_bus_waiter *waiter = *pick;
+
+  *pick = waiter->next;
+  libsoc_spi_bus_grant (bus, waiter->device);
+  waiter->granted = 1;
+  pthread_cond_signal (&waiter->cond);
+}
+
+spi_bus *
+libsoc_spi_bus_init (uint8_t spidev_device, uint32_t latency_us)
+{
+  spi_bus *bus;
+
+  libsoc_spi_debug (__func__, NULL, "initialising spidev bus %d",
+		    spidev_device);
+
+  bus = calloc (1, sizeof (spi_bus));
+
+  if (bus == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "failed to allocate memory");
+      return NULL;
+    }
+
+  bus->spidev_device = spidev_device;
+  bus->latency_us = latency_us;
+  pthread_mutex_init (&bus->lock, NULL);
+
+  return bus;
+}
+
+spi *
+libsoc_spi_bus_add_device (spi_bus * bus, uint8_t chip_select,
+			   spi_mode mode, uint32_t speed, spi_bpw bpw)
+{
+  struct spi_bus_device *device;
+  uint8_t bits;
+
+  if (bus == NULL || chip_select >= SPI_BUS_MAX_DEVICES)
+    {
+      libsoc_spi_debug (__func__, NULL, "bus or chip select %d not valid",
+			chip_select);
+      return NULL;
+    }
+
+  if (libsoc_spi_mode_bits (mode, &bits) == EXIT_FAILURE
+      || (bpw != BITS_8 && bpw != BITS_16))
+    {
+      libsoc_spi_debug (__func__, NULL, "mode %d or bits per word %d not"
+			" recognised", mode, bpw);
+      return NULL;
+    }
+
+  pthread_mutex_lock (&bus->lock);
+
+  device = &bus->devices[chip_select];
+
+  if (device->spi == NULL)
+    device->spi = libsoc_spi_init (bus->spidev_device, chip_select);
+
+  if (device->spi)
+    {
+      device->mode = mode;
+      device->speed = speed;
+      device->bits_per_word = bpw;
+    }
+
+  pthread_mutex_unlock (&bus->lock);
+
+  return device->spi;
+}
+
+int
+libsoc_spi_bus_acquire (spi_bus * bus, spi * spi)
+{
+  struct spi_bus_device *device;
+  struct spi_bus_waiter waiter;
+
+  if (bus == NULL || (device = libsoc_spi_bus_device (bus, spi)) == NULL)
+    {
+      libsoc_spi_debug (__func__, spi, "device is not on this bus");
+      return EXIT_FAILURE;
+    }
+
+  pthread_mutex_lock (&bus->lock);
+
+  if (!bus->busy && bus->waiters == NULL)
+    libsoc_spi_bus_grant (bus, device);
+  else
+    {
+      struct spi_bus_waiter **tail = &bus->waiters;
+
+      waiter.device = device;
+      waiter.queued = libsoc_spi_bus_now ();
+      waiter.granted = 0;
+      waiter.next = NULL;
+      pthread_cond_init (&waiter.cond, NULL);
+
+      while (*tail)
+	tail = &(*tail)->next;
+
+      *tail = &waiter;
+
+      while (!waiter.granted)
+	pthread_cond_wait (&waiter.cond, &bus->lock);
+
+      pthread_cond_destroy (&waiter.cond);
+    }
+
+  pthread_mutex_unlock (&bus->lock);
+
+  // Only the values that differ from the last ones set are written
+  if (libsoc_spi_configure (spi, device->mode, device->speed,
+			    device->bits_per_word) == EXIT_FAILURE)
+    {
+      libsoc_spi_bus_release (bus);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_bus_release (spi_bus * bus)
+{
+  if (bus == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "bus was not valid");
+      return EXIT_FAILURE;
+    }
+
+  pthread_mutex_lock (&bus->lock);
+
+  bus->busy = 0;
+  libsoc_spi_bus_grant_next (bus);
+
+  pthread_mutex_unlock (&bus->lock);
+
+  return EXIT_SUCCESS;
+}
+
+int
+libsoc_spi_bus_transfer (spi_bus * bus, spi_transaction * transaction)
+{
+  int ret;
+
+  if (transaction == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "transaction was not valid");
+      return EXIT_FAILURE;
+    }
+
+  if (libsoc_spi_bus_acquire (bus, transaction->spi) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  ret = libsoc_spi_transaction_transfer (transaction);
+
+  libsoc_spi_bus_release (bus);
+
+  return ret;
+}
+
+void
+libsoc_spi_bus_get_stats (spi_bus * bus, spi_bus_stats * stats)
+{
+  pthread_mutex_lock (&bus->lock);
+
+  *stats = bus->stats;
+
+  pthread_mutex_unlock (&bus->lock);
+}
+
+int
+libsoc_spi_bus_free (spi_bus * bus)
+{
+  unsigned int i;
+
+  if (bus == NULL)
+    {
+      libsoc_spi_debug (__func__, NULL, "bus was not valid");
+      return EXIT_FAILURE;
+    }
+
+  if (bus->busy || bus->waiters)
+    {
+      libsoc_spi_debug (__func__, NULL, "bus is still in use");
+      return EXIT_FAILURE;
+    }
+
+  for (i = 0; i < SPI_BUS_MAX_DEVICES; i++)
+    {
+      if (bus->devices[i].spi)
+	libsoc_spi_free (bus->devices[i].spi);
+    }
+
+  pthread_mutex_destroy (&bus->lock);
+  free (bus);
+
+  return EXIT_SUCCESS;
+}
+
 int
 libsoc_spi_free (spi * spi)
 {
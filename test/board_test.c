@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "libsoc_board.h"
@@ -20,6 +21,7 @@ int main(void)
   _write(fd, "GPIO_BAR =42 \n");
   _write(fd, "GPIO_B = 421 \n");
   _write(fd, "GPIO_C =21 \n");
+  _write(fd, "SOC = am335x\n");
   close(fd);
 
   setenv("LIBSOC_GPIO_CONF", template, 1);
@@ -50,6 +52,11 @@ int main(void)
       printf("ERROR: GPIO_C %d != 21\n", id);
       fails++;
     }
+  if (strcmp(config->soc, "am335x"))
+    {
+      printf("ERROR: SOC %s != am335x\n", config->soc);
+      fails++;
+    }
 
   printf("Tests completed with %d failure(s).\n", fails);
   libsoc_board_free(config);
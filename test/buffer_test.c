@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libsoc_buffer.h"
+
+/**
+ *
+ * This buffer_test checks the alignment of pool buffers, that released
+ * buffers are reused, and that buffers cached by a thread go back to the
+ * shared pool when it exits. Several threads then allocate and free in a
+ * loop to check the pool stays consistent under contention.
+ *
+ * Build: gcc -I../lib/include buffer_test.c -o buffer_test -lsoc -lpthread
+ *
+ */
+
+#define NUM_THREADS 4
+#define ITERATIONS 100000
+
+static uint8_t *handed;
+
+static void *
+cache_and_exit (void *arg)
+{
+  (void) arg;
+
+  // Freed into this thread's cache, which goes to the pool on exit
+  libsoc_buffer_free (libsoc_buffer_alloc (1000), 1000);
+  handed = libsoc_buffer_alloc (1000);
+  libsoc_buffer_free (handed, 1000);
+
+  return NULL;
+}
+
+static void *
+churn (void *arg)
+{
+  uint8_t *bufs[8];
+  int i, j, fails = 0;
+
+  (void) arg;
+
+  for (i = 0; i < ITERATIONS; i++)
+    {
+      for (j = 0; j < 8; j++)
+	{
+	  bufs[j] = libsoc_buffer_alloc (64 << (j % 4));
+	  bufs[j][0] = j;
+	}
+
+      for (j = 0; j < 8; j++)
+	{
+	  if (bufs[j][0] != j)
+	    fails++;
+
+	  libsoc_buffer_free (bufs[j], 64 << (j % 4));
+	}
+    }
+
+  return (void *) (long) fails;
+}
+
+int
+main (void)
+{
+  static const uint32_t sizes[] = { 1, 64, 100, 4000, 4096, 20000, 65536 };
+  unsigned long page = sysconf (_SC_PAGESIZE);
+  libsoc_buffer_stats before, after;
+  pthread_t threads[NUM_THREADS];
+  uint8_t *buf, *again;
+  unsigned int i;
+  void *ret;
+  int fails = 0;
+
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    {
+      unsigned long align = 64;
+
+      while (align < sizes[i] && align < page)
+	align <<= 1;
+
+      buf = libsoc_buffer_alloc (sizes[i]);
+
+      if (buf == NULL || (unsigned long) buf % align)
+	{
+	  printf ("ERROR: %d byte buffer at %p is not aligned\n", sizes[i],
+		  buf);
+	  fails++;
+	}
+
+      libsoc_buffer_free (buf, sizes[i]);
+    }
+
+  // A released buffer is handed out again without a new allocation
+  libsoc_buffer_get_stats (&before);
+  buf = libsoc_buffer_alloc (300);
+  libsoc_buffer_free (buf, 300);
+  again = libsoc_buffer_alloc (300);
+  libsoc_buffer_get_stats (&after);
+
+  if (again != buf || after.hits - before.hits != 1
+      || after.misses - before.misses != 1)
+    {
+      printf ("ERROR: buffer was not reused, %lu hits %lu misses\n",
+	      after.hits - before.hits, after.misses - before.misses);
+      fails++;
+    }
+
+  libsoc_buffer_free (again, 300);
+
+  pthread_create (&threads[0], NULL, cache_and_exit, NULL);
+  pthread_join (threads[0], NULL);
+
+  if (libsoc_buffer_alloc (1024) != handed)
+    {
+      printf ("ERROR: exiting thread did not return its buffers\n");
+      fails++;
+    }
+
+  buf = libsoc_buffer_alloc (LIBSOC_BUFFER_MAX + 1);
+  libsoc_buffer_get_stats (&before);
+
+  if (buf == NULL || (unsigned long) buf % page || before.unpooled != 1)
+    {
+      printf ("ERROR: large buffer was not page aligned\n");
+      fails++;
+    }
+
+  libsoc_buffer_free (buf, LIBSOC_BUFFER_MAX + 1);
+
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create (&threads[i], NULL, churn, NULL);
+
+  for (i = 0; i < NUM_THREADS; i++)
+    {
+      pthread_join (threads[i], &ret);
+      fails += (long) ret;
+    }
+
+  libsoc_buffer_get_stats (&after);
+
+  printf ("%lu hits, %lu misses, %lu unpooled\n", after.hits, after.misses,
+	  after.unpooled);
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,89 @@
+#ifndef _FAKE_DEV_H_
+#define _FAKE_DEV_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+/**
+ *
+ * Fixture shared by the tests that run i2c and spi code without hardware.
+ *
+ * Empty device nodes are created in a temporary directory and libsoc is
+ * pointed at it with the LIBSOC_I2C_DEV and LIBSOC_SPI_DEV environment
+ * variables. ioctl is interposed by the test executable and handed to the
+ * sim_ioctl of the test, which models its devices and passes requests it
+ * does not handle on with real_ioctl.
+ *
+ */
+
+#define FAKE_DEV_MAX 8
+
+static char fake_dev_dir[] = "/tmp/libsoc-test-XXXXXX";
+static char fake_dev_paths[FAKE_DEV_MAX][64];
+static int fake_dev_count;
+
+static int sim_ioctl (int fd, unsigned long request, void *arg);
+
+int
+ioctl (int fd, unsigned long request, ...)
+{
+  va_list args;
+  void *arg;
+
+  va_start (args, request);
+  arg = va_arg (args, void *);
+  va_end (args);
+
+  return sim_ioctl (fd, request, arg);
+}
+
+static int
+real_ioctl (int fd, unsigned long request, void *arg)
+{
+  return syscall (SYS_ioctl, fd, request, arg);
+}
+
+// Creates the temporary directory and points libsoc at it
+static int
+fake_dev_init (void)
+{
+  if (mkdtemp (fake_dev_dir) == NULL)
+    return EXIT_FAILURE;
+
+  setenv ("LIBSOC_I2C_DEV", fake_dev_dir, 1);
+  setenv ("LIBSOC_SPI_DEV", fake_dev_dir, 1);
+
+  return EXIT_SUCCESS;
+}
+
+// Creates an empty file in the directory and returns its path
+static const char *
+fake_dev_create (const char *name)
+{
+  char *path;
+
+  if (fake_dev_count == FAKE_DEV_MAX)
+    return NULL;
+
+  path = fake_dev_paths[fake_dev_count++];
+  snprintf (path, sizeof (fake_dev_paths[0]), "%s/%s", fake_dev_dir, name);
+  close (open (path, O_CREAT | O_RDWR, 0644));
+
+  return path;
+}
+
+// Removes every file created and the directory
+static void
+fake_dev_cleanup (void)
+{
+  while (fake_dev_count > 0)
+    unlink (fake_dev_paths[--fake_dev_count]);
+
+  rmdir (fake_dev_dir);
+}
+
+#endif
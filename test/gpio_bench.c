@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "libsoc_gpio.h"
+
+/**
+ *
+ * This gpio_bench measures the cost of the sysfs gpio attribute calls
+ * without needing any hardware. A fake /sys/class/gpio tree is built in
+ * a temporary directory and libsoc is pointed at it with the
+ * LIBSOC_GPIO_SYSFS environment variable.
+ *
+ * The file syscalls used by libsoc are interposed by this executable so
+ * the number of syscalls per operation can be reported alongside the
+ * time per operation. The "legacy" rows reproduce the old per call
+ * open/lseek/read|write/close sequence for comparison. Direction and
+ * edge are cached in the gpio struct, so their getters only touch sysfs
+ * after a resync.
+ *
+ * Build: gcc -O2 -I../lib/include gpio_bench.c -o gpio_bench -lsoc
+ *
+ */
+
+#define GPIO_ID     42
+#define ITERATIONS  100000
+#define STR_BUF     256
+
+static unsigned long syscalls = 0;
+
+int
+open (const char *path, int flags, ...)
+{
+  va_list args;
+  mode_t mode;
+
+  va_start (args, flags);
+  mode = va_arg (args, mode_t);
+  va_end (args);
+
+  syscalls++;
+  return syscall (SYS_openat, AT_FDCWD, path, flags, mode);
+}
+
+int
+open64 (const char *path, int flags, ...)
+{
+  va_list args;
+  mode_t mode;
+
+  va_start (args, flags);
+  mode = va_arg (args, mode_t);
+  va_end (args);
+
+  syscalls++;
+  return syscall (SYS_openat, AT_FDCWD, path, flags, mode);
+}
+
+int
+close (int fd)
+{
+  syscalls++;
+  return syscall (SYS_close, fd);
+}
+
+ssize_t
+read (int fd, void *buf, size_t count)
+{
+  syscalls++;
+  return syscall (SYS_read, fd, buf, count);
+}
+
+ssize_t
+write (int fd, const void *buf, size_t count)
+{
+  syscalls++;
+  return syscall (SYS_write, fd, buf, count);
+}
+
+off_t
+lseek (int fd, off_t offset, int whence)
+{
+  syscalls++;
+  return syscall (SYS_lseek, fd, offset, whence);
+}
+
+ssize_t
+pread (int fd, void *buf, size_t count, off_t offset)
+{
+  syscalls++;
+  return syscall (SYS_pread64, fd, buf, count, offset);
+}
+
+ssize_t
+pwrite (int fd, const void *buf, size_t count, off_t offset)
+{
+  syscalls++;
+  return syscall (SYS_pwrite64, fd, buf, count, offset);
+}
+
+ssize_t pread64 (int fd, void *buf, size_t count, off_t offset)
+  __attribute__ ((alias ("pread")));
+ssize_t pwrite64 (int fd, const void *buf, size_t count, off_t offset)
+  __attribute__ ((alias ("pwrite")));
+
+static char sysfs_dir[] = "/tmp/libsoc-gpio-XXXXXX";
+static const char legacy_direction_strings[2][STR_BUF] = { "in", "out" };
+static const char legacy_edge_strings[4][STR_BUF] =
+  { "rising", "falling", "none", "both" };
+
+static void
+make_file (const char *name, const char *contents)
+{
+  char path[STR_BUF];
+  FILE *fp;
+
+  sprintf (path, "%s/%s", sysfs_dir, name);
+
+  fp = fopen (path, "w");
+  fputs (contents, fp);
+  fclose (fp);
+}
+
+static int
+make_fake_sysfs ()
+{
+  char path[STR_BUF];
+
+  if (mkdtemp (sysfs_dir) == NULL)
+    return EXIT_FAILURE;
+
+  sprintf (path, "%s/gpio%d", sysfs_dir, GPIO_ID);
+
+  if (mkdir (path, 0755) < 0)
+    return EXIT_FAILURE;
+
+  make_file ("export", "");
+  make_file ("unexport", "");
+
+  sprintf (path, "gpio%d/value", GPIO_ID);
+  make_file (path, "0\n");
+
+  sprintf (path, "gpio%d/direction", GPIO_ID);
+  make_file (path, "in\n");
+
+  sprintf (path, "gpio%d/edge", GPIO_ID);
+  make_file (path, "none\n");
+
+  return EXIT_SUCCESS;
+}
+
+static void
+remove_fake_sysfs ()
+{
+  char cmd[STR_BUF];
+
+  sprintf (cmd, "rm -rf %s", sysfs_dir);
+  system (cmd);
+}
+
+static void
+legacy_write (const char *attr, const char *str)
+{
+  char path[STR_BUF];
+  int fd;
+
+  sprintf (path, "%s/gpio%d/%s", sysfs_dir, GPIO_ID, attr);
+
+  fd = open (path, O_SYNC | O_WRONLY);
+  write (fd, str, STR_BUF);
+  close (fd);
+}
+
+static void
+legacy_read (const char *attr)
+{
+  char path[STR_BUF];
+  int fd;
+
+  sprintf (path, "%s/gpio%d/%s", sysfs_dir, GPIO_ID, attr);
+
+  fd = open (path, O_RDONLY);
+  lseek (fd, 0, SEEK_SET);
+  lseek (fd, 0, SEEK_SET);
+  read (fd, path, STR_BUF);
+  close (fd);
+}
+
+static gpio *bench_gpio;
+
+static void
+op_legacy_set_direction (int i)
+{
+  legacy_write ("direction", legacy_direction_strings[i & 1]);
+}
+
+static void
+op_legacy_get_direction (int i)
+{
+  (void) i;
+
+  legacy_read ("direction");
+}
+
+static void
+op_legacy_set_edge (int i)
+{
+  legacy_write ("edge", legacy_edge_strings[i & 3]);
+}
+
+static void
+op_legacy_get_edge (int i)
+{
+  (void) i;
+
+  legacy_read ("edge");
+}
+
+static void
+op_set_direction (int i)
+{
+  libsoc_gpio_set_direction (bench_gpio, i & 1);
+}
+
+static void
+op_get_direction (int i)
+{
+  (void) i;
+
+  libsoc_gpio_get_direction (bench_gpio);
+}
+
+static void
+op_set_edge (int i)
+{
+  libsoc_gpio_set_edge (bench_gpio, i & 3);
+}
+
+static void
+op_get_edge (int i)
+{
+  (void) i;
+
+  libsoc_gpio_get_edge (bench_gpio);
+}
+
+static void
+op_set_level (int i)
+{
+  libsoc_gpio_set_level (bench_gpio, i & 1);
+}
+
+static void
+op_get_level (int i)
+{
+  (void) i;
+
+  libsoc_gpio_get_level (bench_gpio);
+}
+
+static void
+op_resync (int i)
+{
+  (void) i;
+
+  libsoc_gpio_resync (bench_gpio);
+}
+
+static void
+run (const char *name, void (*op) (int))
+{
+  struct timespec start, end;
+  unsigned long start_syscalls = syscalls;
+  double ns;
+  int i;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < ITERATIONS; i++)
+    op (i);
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+  printf ("%-24s %8.2f syscalls/op %10.1f ns/op\n", name,
+	  (double) (syscalls - start_syscalls) / ITERATIONS, ns / ITERATIONS);
+}
+
+int
+main (void)
+{
+  int ret = EXIT_FAILURE;
+
+  if (make_fake_sysfs () == EXIT_FAILURE)
+    {
+      printf ("Failed to create fake sysfs tree\n");
+      return EXIT_FAILURE;
+    }
+
+  setenv ("LIBSOC_GPIO_SYSFS", sysfs_dir, 1);
+
+  bench_gpio = libsoc_gpio_request (GPIO_ID, LS_SHARED);
+
+  if (bench_gpio == NULL)
+    {
+      printf ("Failed to request gpio from %s\n", sysfs_dir);
+      goto fail;
+    }
+
+  run ("legacy set_direction", op_legacy_set_direction);
+  run ("legacy get_direction", op_legacy_get_direction);
+  run ("legacy set_edge", op_legacy_set_edge);
+  run ("legacy get_edge", op_legacy_get_edge);
+
+  run ("set_direction", op_set_direction);
+  run ("get_direction", op_get_direction);
+  run ("set_edge", op_set_edge);
+  run ("get_edge", op_get_edge);
+  run ("set_level", op_set_level);
+  run ("get_level", op_get_level);
+  run ("resync", op_resync);
+
+  libsoc_gpio_free (bench_gpio);
+
+  ret = EXIT_SUCCESS;
+
+fail:
+
+  remove_fake_sysfs ();
+
+  return ret;
+}
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/gpio.h>
+
+#include "libsoc_gpio.h"
+
+/**
+ *
+ * This gpio_cdev_test exercises the gpio character device backend
+ * without hardware. The gpio ioctls are interposed by this executable
+ * and served by a small stand-in for the kernel: a line request returns
+ * the read end of a pipe, and edge events are injected by writing
+ * gpio_v2_line_event records to the other end.
+ *
+ * A fake /dev/gpiochip0 is created in a temporary directory and libsoc
+ * is pointed at it with the LIBSOC_GPIO_CDEV environment variable.
+ *
+ * Build: gcc -I../lib/include gpio_cdev_test.c -o gpio_cdev_test -lsoc
+ *
+ */
+
+#define BUS_WIDTH 16
+
+static struct {
+  int event_fd;
+  unsigned int num_lines;
+  unsigned int offsets[GPIO_V2_LINES_MAX];
+  struct gpio_v2_line_config config;
+  uint64_t values;
+  unsigned int set_values_calls;
+  unsigned int get_values_calls;
+} sim[4];
+
+static unsigned int num_sims = 0;
+
+static int
+sim_find (int fd)
+{
+  unsigned int i;
+
+  for (i = 0; i < num_sims; i++)
+    {
+      if (sim[i].event_fd == fd)
+	return i;
+    }
+
+  return -1;
+}
+
+static uint64_t
+sim_line_flags (unsigned int s, unsigned int line)
+{
+  struct gpio_v2_line_config *config = &sim[s].config;
+  unsigned int i;
+
+  for (i = 0; i < config->num_attrs; i++)
+    {
+      if (config->attrs[i].attr.id == GPIO_V2_LINE_ATTR_ID_FLAGS
+	  && config->attrs[i].mask & (1ULL << line))
+	return config->attrs[i].attr.flags;
+    }
+
+  return config->flags;
+}
+
+static int
+sim_check_config (struct gpio_v2_line_config *config, unsigned int s)
+{
+  unsigned int line;
+  uint64_t flags;
+
+  sim[s].config = *config;
+
+  for (line = 0; line < sim[s].num_lines; line++)
+    {
+      flags = sim_line_flags (s, line);
+
+      // The kernel rejects edge detection on outputs
+      if ((flags & GPIO_V2_LINE_FLAG_OUTPUT)
+	  && (flags & (GPIO_V2_LINE_FLAG_EDGE_RISING |
+		       GPIO_V2_LINE_FLAG_EDGE_FALLING)))
+	{
+	  errno = EINVAL;
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+int
+ioctl (int fd, unsigned long request, ...)
+{
+  struct gpio_v2_line_request *req;
+  struct gpio_v2_line_values *values;
+  struct gpio_v2_line_info *info;
+  unsigned int i;
+  int pipe_fds[2];
+  va_list args;
+  void *arg;
+  int s;
+
+  va_start (args, request);
+  arg = va_arg (args, void *);
+  va_end (args);
+
+  switch (request)
+    {
+    case GPIO_V2_GET_LINE_IOCTL:
+      req = arg;
+
+      if (pipe (pipe_fds) < 0)
+	return -1;
+
+      s = num_sims++;
+      sim[s].event_fd = pipe_fds[0];
+      sim[s].num_lines = req->num_lines;
+      memcpy (sim[s].offsets, req->offsets, sizeof (req->offsets));
+
+      if (sim_check_config (&req->config, s) < 0)
+	return -1;
+
+      // Keep the write end to inject events, indexed by the read end
+      req->fd = pipe_fds[0];
+      dup2 (pipe_fds[1], 100 + s);
+      close (pipe_fds[1]);
+      return 0;
+
+    case GPIO_V2_LINE_SET_CONFIG_IOCTL:
+      return sim_check_config (arg, sim_find (fd));
+
+    case GPIO_V2_LINE_SET_VALUES_IOCTL:
+      values = arg;
+      s = sim_find (fd);
+      sim[s].values = (sim[s].values & ~values->mask)
+	| (values->bits & values->mask);
+      sim[s].set_values_calls++;
+      return 0;
+
+    case GPIO_V2_LINE_GET_VALUES_IOCTL:
+      values = arg;
+      s = sim_find (fd);
+      values->bits = sim[s].values & values->mask;
+      sim[s].get_values_calls++;
+      return 0;
+
+    case GPIO_V2_GET_LINEINFO_IOCTL:
+      info = arg;
+
+      for (s = 0; s < (int) num_sims; s++)
+	{
+	  for (i = 0; i < sim[s].num_lines; i++)
+	    {
+	      if (sim[s].offsets[i] == info->offset)
+		{
+		  info->flags = sim_line_flags (s, i) | GPIO_V2_LINE_FLAG_USED;
+		  return 0;
+		}
+	    }
+	}
+
+      errno = EINVAL;
+      return -1;
+
+    default:
+      return syscall (SYS_ioctl, fd, request, arg);
+    }
+}
+
+static void
+sim_inject (int s, unsigned int offset, unsigned int id,
+	    uint64_t timestamp, unsigned int line_seqno)
+{
+  struct gpio_v2_line_event event;
+
+  memset (&event, 0, sizeof (event));
+  event.timestamp_ns = timestamp;
+  event.id = id;
+  event.offset = offset;
+  event.line_seqno = line_seqno;
+
+  write (100 + s, &event, sizeof (event));
+}
+
+static int callback_count = 0;
+
+int
+callback_test (void *arg)
+{
+  int *tmp_count = (int *) arg;
+
+  __atomic_add_fetch (tmp_count, 1, __ATOMIC_SEQ_CST);
+
+  return EXIT_SUCCESS;
+}
+
+static char cdev_dir[] = "/tmp/libsoc-cdev-XXXXXX";
+
+int
+main (void)
+{
+  unsigned int offsets[BUS_WIDTH];
+  gpio_lines *bus = NULL;
+  gpio *gpio_input = NULL;
+  gpio *gpio_edge, *gpio_callback;
+  gpio *byte_gpios[8];
+  gpio_group *byte_group;
+  gpio_event events[8];
+  char path[64];
+  uint64_t bits;
+  int i, n, ret = EXIT_FAILURE;
+
+  if (mkdtemp (cdev_dir) == NULL)
+    return EXIT_FAILURE;
+
+  sprintf (path, "%s/gpiochip0", cdev_dir);
+  close (open (path, O_CREAT | O_RDWR, 0644));
+
+  setenv ("LIBSOC_GPIO_CDEV", cdev_dir, 1);
+
+  for (i = 0; i < BUS_WIDTH; i++)
+    offsets[i] = 8 + i;
+
+  // A 16-bit bus is written and read with one ioctl each
+  bus = libsoc_gpio_lines_request (0, offsets, BUS_WIDTH, OUTPUT);
+
+  if (bus == NULL)
+    {
+      printf ("Failed to request bus lines\n");
+      goto fail;
+    }
+
+  libsoc_gpio_lines_set_values (bus, 0xffff, 0xa5a5);
+  libsoc_gpio_lines_get_values (bus, 0xffff, &bits);
+
+  if (bits != 0xa5a5 || sim[0].set_values_calls != 1
+      || sim[0].get_values_calls != 1)
+    {
+      printf ("Failed bus write/read, read 0x%04llx\n",
+	      (unsigned long long) bits);
+      goto fail;
+    }
+
+  // An 8-bit group over the high byte of the bus in reverse order is
+  // still a single ioctl
+  for (i = 0; i < 8; i++)
+    byte_gpios[i] = libsoc_gpio_lines_get_gpio (bus, 15 - i);
+
+  byte_group = libsoc_gpio_group_create (byte_gpios, 8);
+  libsoc_gpio_group_set_mask (byte_group, 0xff, 0x0f);
+  libsoc_gpio_group_get_mask (byte_group, 0xff, &bits);
+  libsoc_gpio_group_free (byte_group);
+
+  if (bits != 0x0f || sim[0].values != 0xf0a5 || sim[0].set_values_calls != 2)
+    {
+      printf ("Failed group write/read, read 0x%02llx\n",
+	      (unsigned long long) bits);
+      goto fail;
+    }
+
+  // Single line access through the normal gpio calls
+  libsoc_gpio_set_level (libsoc_gpio_lines_get_gpio (bus, 0), LOW);
+
+  if (libsoc_gpio_get_level (libsoc_gpio_lines_get_gpio (bus, 0)) != LOW
+      || libsoc_gpio_get_level (libsoc_gpio_lines_get_gpio (bus, 2)) != HIGH
+      || sim[0].values != 0xf0a4)
+    {
+      printf ("Failed single line level access\n");
+      goto fail;
+    }
+
+  // Reconfigure two lines of the bus as edge triggered inputs, the rest
+  // must stay outputs holding their levels
+  gpio_edge = libsoc_gpio_lines_get_gpio (bus, 3);
+  gpio_callback = libsoc_gpio_lines_get_gpio (bus, 5);
+
+  if (libsoc_gpio_set_edge (gpio_edge, BOTH) == EXIT_SUCCESS)
+    {
+      printf ("Edge was accepted on an output\n");
+      goto fail;
+    }
+
+  libsoc_gpio_set_direction (gpio_edge, INPUT);
+  libsoc_gpio_set_edge (gpio_edge, BOTH);
+  libsoc_gpio_set_direction (gpio_callback, INPUT);
+  libsoc_gpio_set_edge (gpio_callback, RISING);
+
+  if (!(sim_line_flags (0, 0) & GPIO_V2_LINE_FLAG_OUTPUT)
+      || sim_line_flags (0, 3) != (GPIO_V2_LINE_FLAG_INPUT |
+				   GPIO_V2_LINE_FLAG_EDGE_RISING |
+				   GPIO_V2_LINE_FLAG_EDGE_FALLING)
+      || libsoc_gpio_resync (gpio_callback) == EXIT_FAILURE
+      || libsoc_gpio_get_edge (gpio_callback) != RISING)
+    {
+      printf ("Failed line reconfiguration\n");
+      goto fail;
+    }
+
+  // Capture keeps the kernel timestamps and exposes dropped events as
+  // gaps in the sequence numbers
+  libsoc_gpio_capture_enable (gpio_edge, 8);
+  libsoc_gpio_callback_interrupt (gpio_callback, &callback_test,
+				  (void *) &callback_count);
+
+  sim_inject (0, offsets[3], GPIO_V2_LINE_EVENT_RISING_EDGE, 1000, 1);
+  sim_inject (0, offsets[5], GPIO_V2_LINE_EVENT_RISING_EDGE, 1500, 1);
+  sim_inject (0, offsets[3], GPIO_V2_LINE_EVENT_FALLING_EDGE, 2000, 2);
+  sim_inject (0, offsets[3], GPIO_V2_LINE_EVENT_RISING_EDGE, 4000, 4);
+
+  usleep (100000);
+
+  n = libsoc_gpio_capture_drain (gpio_edge, events, 8);
+
+  if (n != 3 || events[0].timestamp != 1000 || events[0].level != HIGH
+      || events[1].level != LOW || events[2].sequence != 3
+      || callback_count != 1)
+    {
+      printf ("Failed event capture, %d events %d callbacks\n", n,
+	      callback_count);
+      goto fail;
+    }
+
+  // Waiting on a line of its own request
+  gpio_input = libsoc_gpio_request_line (0, 40, INPUT);
+
+  if (gpio_input == NULL)
+    {
+      printf ("Failed to request input line\n");
+      goto fail;
+    }
+
+  libsoc_gpio_set_edge (gpio_input, FALLING);
+
+  if (libsoc_gpio_wait_interrupt (gpio_input, 10) != EXIT_FAILURE)
+    {
+      printf ("Wait did not time out\n");
+      goto fail;
+    }
+
+  sim_inject (1, 40, GPIO_V2_LINE_EVENT_FALLING_EDGE, 5000, 1);
+
+  if (libsoc_gpio_wait_interrupt (gpio_input, 1000) != EXIT_SUCCESS)
+    {
+      printf ("Failed waiting for interrupt\n");
+      goto fail;
+    }
+
+  ret = EXIT_SUCCESS;
+
+fail:
+
+  if (gpio_input)
+    libsoc_gpio_free (gpio_input);
+
+  if (bus)
+    libsoc_gpio_lines_free (bus);
+
+  libsoc_gpio_dispatcher_shutdown ();
+
+  unlink (path);
+  rmdir (cdev_dir);
+
+  if (ret == EXIT_SUCCESS)
+    printf ("Test passed\n");
+  else
+    printf ("Test failed\n");
+
+  return ret;
+}
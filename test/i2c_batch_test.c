@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libsoc_i2c.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This i2c_batch_test checks batched i2c transfers without hardware. The
+ * I2C_RDWR ioctl is interposed by this executable and served by simulated
+ * sensors at addresses 0x40 upwards, which answer a read with their
+ * address and register. One address does not acknowledge, and like a
+ * real adapter the whole ioctl then fails with ENXIO.
+ *
+ * Build: gcc -I../lib/include i2c_batch_test.c -o i2c_batch_test -lsoc
+ *
+ */
+
+#define NUM_SENSORS 24
+#define FIRST_ADDRESS 0x40
+#define MISSING_ADDRESS 0x45
+
+static struct {
+  unsigned int ioctls;
+  unsigned int max_msgs;
+} sim;
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  struct i2c_rdwr_ioctl_data *data;
+  uint8_t reg = 0;
+  unsigned int i;
+
+  if (request != I2C_RDWR)
+    return real_ioctl (fd, request, arg);
+
+  data = arg;
+  sim.ioctls++;
+
+  if (data->nmsgs > sim.max_msgs)
+    sim.max_msgs = data->nmsgs;
+
+  if (data->nmsgs > I2C_RDWR_IOCTL_MAX_MSGS)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  for (i = 0; i < data->nmsgs; i++)
+    {
+      struct i2c_msg *msg = &data->msgs[i];
+
+      if (msg->addr == MISSING_ADDRESS)
+	{
+	  errno = ENXIO;
+	  return -1;
+	}
+
+      if (msg->flags & I2C_M_RD)
+	memset (msg->buf, msg->addr ^ reg, msg->len);
+      else
+	reg = msg->buf[0];
+    }
+
+  return data->nmsgs;
+}
+
+int
+main (void)
+{
+  i2c *sensors[NUM_SENSORS];
+  uint8_t values[NUM_SENSORS][2], cmd = 0x01;
+  int ops[NUM_SENSORS], write_op, fails = 0, i;
+  i2c_batch *batch = NULL;
+  const char *path;
+
+  memset (sensors, 0, sizeof (sensors));
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  path = fake_dev_create ("i2c-0");
+
+  batch = libsoc_i2c_batch_init ();
+
+  for (i = 0; i < NUM_SENSORS; i++)
+    {
+      sensors[i] = libsoc_i2c_init (0, FIRST_ADDRESS + i);
+
+      if (sensors[i] == NULL)
+	{
+	  printf ("Failed to open %s\n", path);
+	  fails++;
+	  goto fail;
+	}
+    }
+
+  // Every sensor answers, two register reads per sensor in 2 ioctls
+  for (i = 0; i < NUM_SENSORS; i++)
+    {
+      if (FIRST_ADDRESS + i != MISSING_ADDRESS)
+	ops[i] = libsoc_i2c_batch_add_read_reg (batch, sensors[i], 0x0f,
+						values[i], 2);
+    }
+
+  libsoc_i2c_batch_add_write (batch, sensors[0], &cmd, 1);
+
+  if (libsoc_i2c_batch_transfer (batch) == EXIT_FAILURE
+      || sim.ioctls != 2 || sim.max_msgs != I2C_RDWR_IOCTL_MAX_MSGS)
+    {
+      printf ("ERROR: batch took %d ioctls of up to %d messages\n",
+	      sim.ioctls, sim.max_msgs);
+      fails++;
+    }
+
+  for (i = 0; i < NUM_SENSORS; i++)
+    {
+      if (FIRST_ADDRESS + i != MISSING_ADDRESS
+	  && values[i][1] != ((FIRST_ADDRESS + i) ^ 0x0f))
+	{
+	  printf ("ERROR: sensor %d read 0x%02x\n", i, values[i][1]);
+	  fails++;
+	}
+    }
+
+  // Without retries a missing sensor fails every operation of its ioctl
+  libsoc_i2c_batch_clear (batch);
+
+  for (i = 0; i < NUM_SENSORS; i++)
+    ops[i] = libsoc_i2c_batch_add_read_reg (batch, sensors[i], 0x0f,
+					    values[i], 2);
+
+  write_op = libsoc_i2c_batch_add_write (batch, sensors[1], &cmd, 1);
+
+  sim.ioctls = 0;
+
+  if (libsoc_i2c_batch_transfer (batch) != EXIT_FAILURE || sim.ioctls != 2)
+    {
+      printf ("ERROR: batch without retries took %d ioctls\n", sim.ioctls);
+      fails++;
+    }
+
+  for (i = 0; i < NUM_SENSORS; i++)
+    {
+      int expected = i < I2C_RDWR_IOCTL_MAX_MSGS / 2 ? ENXIO : 0;
+
+      if (libsoc_i2c_batch_get_status (batch, ops[i]) != expected)
+	{
+	  printf ("ERROR: sensor %d status %d without retries, expected %d\n",
+		  i, libsoc_i2c_batch_get_status (batch, ops[i]), expected);
+	  fails++;
+	}
+    }
+
+  // With retries it is found by sending the reads of its ioctl alone
+  libsoc_i2c_batch_set_retry_reads (batch, 1);
+
+  sim.ioctls = 0;
+
+  if (libsoc_i2c_batch_transfer (batch) != EXIT_FAILURE)
+    {
+      printf ("ERROR: batch with a missing sensor succeeded\n");
+      fails++;
+    }
+
+  for (i = 0; i < NUM_SENSORS; i++)
+    {
+      int expected = FIRST_ADDRESS + i == MISSING_ADDRESS ? ENXIO : 0;
+
+      if (libsoc_i2c_batch_get_status (batch, ops[i]) != expected)
+	{
+	  printf ("ERROR: sensor %d status %d, expected %d\n", i,
+		  libsoc_i2c_batch_get_status (batch, ops[i]), expected);
+	  fails++;
+	}
+    }
+
+  // The write shares the second ioctl, which succeeds, and is sent once
+  if (libsoc_i2c_batch_get_status (batch, write_op) != 0 || sim.ioctls != 23)
+    {
+      printf ("ERROR: write status %d after %d ioctls\n",
+	      libsoc_i2c_batch_get_status (batch, write_op), sim.ioctls);
+      fails++;
+    }
+
+fail:
+
+  for (i = 0; i < NUM_SENSORS; i++)
+    {
+      if (sensors[i])
+	libsoc_i2c_free (sensors[i]);
+    }
+
+  libsoc_i2c_batch_free (batch);
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libsoc_i2c.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This i2c_bench measures i2c throughput from 1 to MAX_THREADS threads
+ * without hardware. The I2C_RDWR ioctl is interposed by this executable
+ * and, like an adapter, serves one ioctl per bus at a time and sleeps
+ * for the time the messages would take at BUS_HZ. Every read returns
+ * data derived from the device address and register, and the threads
+ * check it, so transfers mixed up between threads are counted as errors.
+ *
+ * The rows are
+ *  - shared handle: all threads use one handle on bus 0
+ *  - handle per thread: each thread has its own handle on bus 0
+ *  - bus per thread: each thread has a handle on its own bus
+ *  - locked transaction: each thread holds the bus for a register write
+ *    and a read back, so the read always sees its own write
+ *
+ * Build: gcc -O2 -I../lib/include i2c_bench.c -o i2c_bench -lsoc -lpthread
+ *
+ */
+
+#define BUS_HZ 400000
+#define MAX_THREADS 8
+#define DURATION_MS 300
+
+static struct {
+  pthread_mutex_t lock;
+  uint8_t regs[128];
+} adapters[MAX_THREADS];
+
+static int bus_of_fd[1024];
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  struct i2c_rdwr_ioctl_data *data;
+  unsigned int i, j, bits = 0;
+  struct timespec ts;
+  uint8_t *regs, pointer = 0;
+
+  if (request != I2C_RDWR)
+    return real_ioctl (fd, request, arg);
+
+  data = arg;
+  regs = adapters[bus_of_fd[fd]].regs;
+
+  pthread_mutex_lock (&adapters[bus_of_fd[fd]].lock);
+
+  for (i = 0; i < data->nmsgs; i++)
+    {
+      struct i2c_msg *msg = &data->msgs[i];
+
+      bits += (msg->len + 1) * 9;
+
+      if (msg->flags & I2C_M_RD)
+	{
+	  for (j = 0; j < msg->len; j++)
+	    msg->buf[j] = msg->addr ^ regs[(pointer + j) & 0x7f];
+	}
+      else
+	{
+	  pointer = msg->buf[0];
+
+	  for (j = 1; j < msg->len; j++)
+	    regs[(pointer + j - 1) & 0x7f] = msg->buf[j];
+	}
+    }
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = (long) bits * 1000000000L / BUS_HZ;
+  nanosleep (&ts, NULL);
+
+  pthread_mutex_unlock (&adapters[bus_of_fd[fd]].lock);
+
+  return data->nmsgs;
+}
+
+enum
+{
+  SHARED_HANDLE,
+  HANDLE_PER_THREAD,
+  BUS_PER_THREAD,
+  LOCKED_TRANSACTION,
+};
+
+static const char *names[] = {
+  "shared handle", "handle per thread", "bus per thread", "locked transaction"
+};
+
+struct worker
+{
+  i2c *dev;
+  int mode;
+  int id;
+  volatile int *stop;
+  unsigned long ops;
+  unsigned long errors;
+};
+
+static void *
+worker (void *arg)
+{
+  struct worker *w = arg;
+  uint8_t reg = w->id, value[2], mark;
+
+  while (!*w->stop)
+    {
+      if (w->mode == LOCKED_TRANSACTION)
+	{
+	  mark = w->ops;
+	  libsoc_i2c_lock (w->dev);
+	  libsoc_i2c_write_reg (w->dev, 0x40, &mark, 1);
+	  libsoc_i2c_read_reg (w->dev, 0x40, value, 1);
+	  libsoc_i2c_unlock (w->dev);
+
+	  if (value[0] != (w->dev->address ^ mark))
+	    w->errors++;
+	}
+      else
+	{
+	  libsoc_i2c_read_reg (w->dev, reg, value, 2);
+
+	  if (value[0] != (w->dev->address ^ reg))
+	    w->errors++;
+	}
+
+      w->ops++;
+    }
+
+  return NULL;
+}
+
+static void
+run (int mode, int num_threads)
+{
+  struct worker workers[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  unsigned long ops = 0, errors = 0;
+  volatile int stop = 0;
+  i2c *shared = NULL;
+  int i;
+
+  if (mode == SHARED_HANDLE)
+    shared = libsoc_i2c_init (0, 0x50);
+
+  for (i = 0; i < num_threads; i++)
+    {
+      workers[i].mode = mode;
+      workers[i].id = i;
+      workers[i].stop = &stop;
+      workers[i].ops = 0;
+      workers[i].errors = 0;
+
+      if (mode == SHARED_HANDLE)
+	workers[i].dev = shared;
+      else
+	workers[i].dev = libsoc_i2c_init (mode == BUS_PER_THREAD ? i : 0,
+					  0x50 + i);
+
+      bus_of_fd[workers[i].dev->fd] = mode == BUS_PER_THREAD ? i : 0;
+    }
+
+  for (i = 0; i < num_threads; i++)
+    pthread_create (&threads[i], NULL, worker, &workers[i]);
+
+  usleep (DURATION_MS * 1000);
+  stop = 1;
+
+  for (i = 0; i < num_threads; i++)
+    {
+      pthread_join (threads[i], NULL);
+      ops += workers[i].ops;
+      errors += workers[i].errors;
+
+      if (mode != SHARED_HANDLE)
+	libsoc_i2c_free (workers[i].dev);
+    }
+
+  if (shared)
+    libsoc_i2c_free (shared);
+
+  printf ("%-20s %d threads %8.0f ops/s %6lu errors\n", names[mode],
+	  num_threads, ops * 1000.0 / DURATION_MS, errors);
+}
+
+int
+main (void)
+{
+  unsigned int j;
+  char name[16];
+  int mode, n, i;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < MAX_THREADS; i++)
+    {
+      sprintf (name, "i2c-%d", i);
+      fake_dev_create (name);
+      pthread_mutex_init (&adapters[i].lock, NULL);
+
+      for (j = 0; j < sizeof (adapters[i].regs); j++)
+	adapters[i].regs[j] = j;
+    }
+
+  for (mode = SHARED_HANDLE; mode <= LOCKED_TRANSACTION; mode++)
+    {
+      for (n = 1; n <= MAX_THREADS; n *= 2)
+	run (mode, n);
+    }
+
+  fake_dev_cleanup ();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libsoc_i2c.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This i2c_bus_test checks that device handles on a bus share one open
+ * adapter and that it is closed with the last handle. open is interposed
+ * by this executable to count how often the adapter is opened, and ioctl
+ * to count how often the bus wide timeout is set.
+ *
+ * Build: gcc -I../lib/include i2c_bus_test.c -o i2c_bus_test -lsoc
+ *
+ */
+
+#define NUM_DEVICES 32
+
+static unsigned int opens;
+
+int
+open (const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  va_list args;
+
+  va_start (args, flags);
+
+  if (flags & O_CREAT)
+    mode = va_arg (args, int);
+
+  va_end (args);
+
+  if (strstr (path, "/i2c-"))
+    opens++;
+
+  return syscall (SYS_openat, AT_FDCWD, path, flags, mode);
+}
+
+static unsigned int timeouts;
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  if (request == I2C_TIMEOUT)
+    {
+      timeouts++;
+      return 0;
+    }
+
+  return real_ioctl (fd, request, arg);
+}
+
+int
+main (void)
+{
+  i2c *devices[NUM_DEVICES], *other;
+  const char *path;
+  int fails = 0, fd, i;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  path = fake_dev_create ("i2c-0");
+  fake_dev_create ("i2c-1");
+  opens = 0;
+
+  for (i = 0; i < NUM_DEVICES; i++)
+    devices[i] = libsoc_i2c_init (0, 0x20 + i);
+
+  other = libsoc_i2c_init (1, 0x20);
+
+  if (devices[0] == NULL || other == NULL)
+    {
+      printf ("Failed to open %s\n", path);
+      fails++;
+      goto fail;
+    }
+
+  fd = devices[0]->fd;
+
+  if (opens != 2 || devices[NUM_DEVICES - 1]->fd != fd || other->fd == fd
+      || devices[0]->adapter->refs != NUM_DEVICES)
+    {
+      printf ("ERROR: %d opens for %d devices on 2 buses\n", opens,
+	      NUM_DEVICES + 1);
+      fails++;
+    }
+
+  // The timeout is set once for the bus, whichever device sets it
+  if (libsoc_i2c_set_timeout (devices[0], 5) == EXIT_FAILURE
+      || libsoc_i2c_set_timeout (devices[1], 5) == EXIT_FAILURE
+      || timeouts != 1
+      || libsoc_i2c_set_timeout (devices[1], 7) == EXIT_FAILURE
+      || timeouts != 2 || devices[0]->adapter->timeout != 7
+      || other->adapter->timeout != -1)
+    {
+      printf ("ERROR: %d I2C_TIMEOUT ioctls for one bus\n", timeouts);
+      fails++;
+    }
+
+  for (i = 0; i < NUM_DEVICES - 1; i++)
+    libsoc_i2c_free (devices[i]);
+
+  if (fcntl (fd, F_GETFD) < 0)
+    {
+      printf ("ERROR: adapter closed while a device still used it\n");
+      fails++;
+    }
+
+  libsoc_i2c_free (devices[NUM_DEVICES - 1]);
+
+  if (fcntl (fd, F_GETFD) >= 0 || errno != EBADF)
+    {
+      printf ("ERROR: adapter was not closed with the last device\n");
+      fails++;
+    }
+
+  // Hot plug cycles open the adapter again without leaking
+  for (i = 0; i < 100; i++)
+    libsoc_i2c_free (libsoc_i2c_init (0, 0x20));
+
+  if (opens != 102)
+    {
+      printf ("ERROR: %d opens after init and free cycles\n", opens);
+      fails++;
+    }
+
+  libsoc_i2c_free (other);
+
+fail:
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libsoc_i2c.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This i2c_reg_test checks register access without hardware. The
+ * I2C_RDWR ioctl is interposed by this executable and served by two
+ * simulated register devices, one with 8 bit register addresses at 0x50
+ * and one with 16 bit register addresses at 0x51. Like most such
+ * devices, a write sets the register pointer from its first bytes and
+ * stores the rest, and a read returns data from the register pointer.
+ *
+ * Build: gcc -I../lib/include i2c_reg_test.c -o i2c_reg_test -lsoc
+ *
+ */
+
+#define REG8_ADDRESS  0x50
+#define REG16_ADDRESS 0x51
+
+static struct {
+  unsigned int ioctls;
+  unsigned int nmsgs;
+  uint8_t regs8[256];
+  uint8_t regs16[4096];
+  uint16_t pointer[2];
+} sim;
+
+static void
+sim_message (struct i2c_msg *msg)
+{
+  int wide = msg->addr == REG16_ADDRESS, i = 0;
+  uint8_t *regs = wide ? sim.regs16 : sim.regs8;
+  uint16_t mask = wide ? sizeof (sim.regs16) - 1 : sizeof (sim.regs8) - 1;
+  uint16_t *pointer = &sim.pointer[wide];
+
+  if (msg->flags & I2C_M_RD)
+    {
+      for (i = 0; i < msg->len; i++)
+	msg->buf[i] = regs[(*pointer)++ & mask];
+
+      return;
+    }
+
+  if (wide && msg->len >= 2)
+    *pointer = msg->buf[0] << 8 | msg->buf[1], i = 2;
+  else if (!wide && msg->len >= 1)
+    *pointer = msg->buf[0], i = 1;
+
+  for (; i < msg->len; i++)
+    regs[(*pointer)++ & mask] = msg->buf[i];
+}
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  struct i2c_rdwr_ioctl_data *data;
+  unsigned int i;
+
+  if (request != I2C_RDWR)
+    return real_ioctl (fd, request, arg);
+
+  data = arg;
+  sim.ioctls++;
+  sim.nmsgs = data->nmsgs;
+
+  for (i = 0; i < data->nmsgs; i++)
+    sim_message (&data->msgs[i]);
+
+  return data->nmsgs;
+}
+
+int
+main (void)
+{
+  uint8_t data[200], readback[200], cmd = 0x10;
+  i2c *reg8 = NULL, *reg16 = NULL;
+  const char *path;
+  unsigned int i;
+  int fails = 0;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  path = fake_dev_create ("i2c-0");
+
+  reg8 = libsoc_i2c_init (0, REG8_ADDRESS);
+  reg16 = libsoc_i2c_init (0, REG16_ADDRESS);
+
+  if (reg8 == NULL || reg16 == NULL)
+    {
+      printf ("Failed to open %s\n", path);
+      fails++;
+      goto fail;
+    }
+
+  for (i = 0; i < sizeof (data); i++)
+    data[i] = i * 7;
+
+  // Short writes, then a write too long for the stack buffer
+  if (libsoc_i2c_write_reg (reg8, 0x20, data, 4) == EXIT_FAILURE
+      || libsoc_i2c_write_reg16 (reg16, 0x0123, data, sizeof (data))
+      == EXIT_FAILURE || sim.ioctls != 2 || sim.nmsgs != 1)
+    {
+      printf ("ERROR: register writes failed\n");
+      fails++;
+    }
+
+  if (memcmp (&sim.regs8[0x20], data, 4)
+      || memcmp (&sim.regs16[0x0123], data, sizeof (data)))
+    {
+      printf ("ERROR: registers were not written at their address\n");
+      fails++;
+    }
+
+  // Reads are a write of the address and a read in one ioctl
+  sim.ioctls = 0;
+  memset (readback, 0, sizeof (readback));
+
+  if (libsoc_i2c_read_reg (reg8, 0x21, readback, 3) == EXIT_FAILURE
+      || sim.ioctls != 1 || sim.nmsgs != 2
+      || memcmp (readback, data + 1, 3))
+    {
+      printf ("ERROR: 8 bit register read\n");
+      fails++;
+    }
+
+  if (libsoc_i2c_read_reg16 (reg16, 0x0123, readback, sizeof (readback))
+      == EXIT_FAILURE || sim.ioctls != 2 || sim.nmsgs != 2
+      || memcmp (readback, data, sizeof (readback)))
+    {
+      printf ("ERROR: 16 bit register read\n");
+      fails++;
+    }
+
+  sim.regs8[0x10] = 0xa5;
+
+  if (libsoc_i2c_write_read (reg8, &cmd, 1, readback, 1) == EXIT_FAILURE
+      || readback[0] != 0xa5)
+    {
+      printf ("ERROR: write then read\n");
+      fails++;
+    }
+
+fail:
+
+  if (reg8)
+    libsoc_i2c_free (reg8);
+
+  if (reg16)
+    libsoc_i2c_free (reg16);
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libsoc_i2c.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This i2c_regmap_test checks the register cache without hardware. The
+ * I2C_RDWR ioctl is interposed by this executable and served by a
+ * simulated device with 8 bit registers and an auto incrementing
+ * register pointer. Its transactions are counted to check which
+ * accesses reach the bus.
+ *
+ * Build: gcc -I../lib/include i2c_regmap_test.c -o i2c_regmap_test -lsoc
+ *
+ */
+
+#define ADDRESS 0x48
+
+#define REG_ID     0x00
+#define REG_STATUS 0x01
+#define REG_CONFIG 0x10
+#define REG_CMD    0x20
+
+static const i2c_reg table[] = {
+  {REG_ID, I2C_REG_CACHEABLE | I2C_REG_READ_ONLY},
+  {REG_STATUS, I2C_REG_VOLATILE | I2C_REG_READ_ONLY},
+  {REG_CONFIG, I2C_REG_CACHEABLE},
+  {REG_CONFIG + 1, I2C_REG_CACHEABLE},
+  {REG_CONFIG + 2, I2C_REG_CACHEABLE},
+  {REG_CONFIG + 3, I2C_REG_CACHEABLE},
+  {REG_CONFIG + 4, I2C_REG_CACHEABLE},
+  {REG_CMD, I2C_REG_VOLATILE},
+};
+
+static struct {
+  unsigned int reads;
+  unsigned int writes;
+  uint8_t regs[256];
+  uint8_t pointer;
+} sim;
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  struct i2c_rdwr_ioctl_data *data;
+  unsigned int i, j;
+
+  if (request != I2C_RDWR)
+    return real_ioctl (fd, request, arg);
+
+  data = arg;
+
+  if (data->msgs[data->nmsgs - 1].flags & I2C_M_RD)
+    sim.reads++;
+  else
+    sim.writes++;
+
+  for (i = 0; i < data->nmsgs; i++)
+    {
+      struct i2c_msg *msg = &data->msgs[i];
+
+      if (msg->flags & I2C_M_RD)
+	{
+	  for (j = 0; j < msg->len; j++)
+	    msg->buf[j] = sim.regs[sim.pointer++];
+
+	  // The status register changes on every read
+	  sim.regs[REG_STATUS]++;
+	}
+      else
+	{
+	  sim.pointer = msg->buf[0];
+
+	  for (j = 1; j < msg->len; j++)
+	    sim.regs[sim.pointer++] = msg->buf[j];
+	}
+    }
+
+  return data->nmsgs;
+}
+
+int
+main (void)
+{
+  i2c_regmap *map = NULL;
+  i2c_regmap_stats stats;
+  i2c *dev = NULL;
+  uint8_t value, status;
+  const char *path;
+  int fails = 0;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  path = fake_dev_create ("i2c-0");
+
+  dev = libsoc_i2c_init (0, ADDRESS);
+  map = libsoc_i2c_regmap_init (dev, table, sizeof (table) / sizeof (table[0]));
+
+  if (map == NULL)
+    {
+      printf ("Failed to open %s\n", path);
+      fails++;
+      goto fail;
+    }
+
+  sim.regs[REG_ID] = 0x5a;
+  sim.regs[REG_CONFIG] = 0x80;
+
+  // Only the first bitfield update reads the register
+  libsoc_i2c_regmap_update_bits (map, REG_CONFIG, 0x0f, 0x03);
+  libsoc_i2c_regmap_update_bits (map, REG_CONFIG, 0x70, 0x50);
+  libsoc_i2c_regmap_write (map, REG_CONFIG + 1, 0x11);
+  libsoc_i2c_regmap_write (map, REG_CONFIG + 2, 0x22);
+  libsoc_i2c_regmap_write (map, REG_CONFIG + 4, 0x44);
+
+  if (sim.reads != 1 || sim.writes != 0)
+    {
+      printf ("ERROR: %d reads, %d writes before sync\n", sim.reads,
+	      sim.writes);
+      fails++;
+    }
+
+  // 0x10 to 0x12 go in one burst, 0x14 on its own
+  if (libsoc_i2c_regmap_sync (map) == EXIT_FAILURE || sim.writes != 2
+      || sim.regs[REG_CONFIG] != 0xd3 || sim.regs[REG_CONFIG + 1] != 0x11
+      || sim.regs[REG_CONFIG + 2] != 0x22 || sim.regs[REG_CONFIG + 3] != 0
+      || sim.regs[REG_CONFIG + 4] != 0x44)
+    {
+      printf ("ERROR: sync took %d writes, config 0x%02x\n", sim.writes,
+	      sim.regs[REG_CONFIG]);
+      fails++;
+    }
+
+  libsoc_i2c_regmap_sync (map);
+  libsoc_i2c_regmap_write (map, REG_CONFIG + 1, 0x11);
+  libsoc_i2c_regmap_sync (map);
+
+  if (sim.writes != 2)
+    {
+      printf ("ERROR: clean registers were written again\n");
+      fails++;
+    }
+
+  // Cacheable reads hit after the first, volatile ones always miss
+  sim.reads = 0;
+  libsoc_i2c_regmap_read (map, REG_ID, &value);
+  libsoc_i2c_regmap_read (map, REG_ID, &value);
+  libsoc_i2c_regmap_read (map, REG_STATUS, &status);
+  libsoc_i2c_regmap_read (map, REG_STATUS, &status);
+
+  if (value != 0x5a || status != 3 || sim.reads != 3)
+    {
+      printf ("ERROR: id 0x%02x status %d after %d reads\n", value, status,
+	      sim.reads);
+      fails++;
+    }
+
+  if (libsoc_i2c_regmap_write (map, REG_ID, 0) != EXIT_FAILURE
+      || libsoc_i2c_regmap_write (map, 0x99, 0) != EXIT_FAILURE)
+    {
+      printf ("ERROR: read only or undeclared register was written\n");
+      fails++;
+    }
+
+  if (libsoc_i2c_regmap_write (map, REG_CMD, 0x01) == EXIT_FAILURE
+      || sim.writes != 3 || sim.regs[REG_CMD] != 0x01)
+    {
+      printf ("ERROR: volatile register was not written through\n");
+      fails++;
+    }
+
+  libsoc_i2c_regmap_get_stats (map, &stats);
+
+  if (stats.hits != 2 || stats.misses != 4 || stats.bus_reads != 4
+      || stats.bus_writes != 3 || stats.registers_written != 5)
+    {
+      printf ("ERROR: %lu hits, %lu misses, %lu bus reads, %lu bus writes"
+	      " of %lu registers\n", stats.hits, stats.misses,
+	      stats.bus_reads, stats.bus_writes, stats.registers_written);
+      fails++;
+    }
+
+fail:
+
+  if (map)
+    libsoc_i2c_regmap_free (map);
+
+  if (dev)
+    libsoc_i2c_free (dev);
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libsoc_i2c.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This i2c_smbus_test checks the SMBus calls without hardware. The
+ * I2C_FUNCS, I2C_SLAVE, I2C_PEC, I2C_SMBUS and I2C_RDWR ioctls are
+ * interposed by this executable and served by simulated register devices
+ * behind an adapter whose functionality mask the test chooses. The
+ * ioctls of each kind are counted, to check that the mask is probed once
+ * per bus, that the slave address and PEC are only set when they change
+ * and that multi byte reads use as few transactions as the adapter
+ * allows.
+ *
+ * Build: gcc -I../lib/include i2c_smbus_test.c -o i2c_smbus_test -lsoc
+ *
+ */
+
+#define DEV_A 0x50
+#define DEV_B 0x51
+
+static struct {
+  unsigned long funcs;
+  unsigned int funcs_ioctls;
+  unsigned int slave_ioctls;
+  unsigned int pec_ioctls;
+  unsigned int smbus_ioctls;
+  unsigned int rdwr_ioctls;
+  unsigned int unchecked_reads;
+  unsigned long slave;
+  unsigned long pec;
+  unsigned int pointer;
+  uint8_t regs[2][256];
+} sim;
+
+static uint8_t *
+sim_regs (unsigned long addr)
+{
+  return sim.regs[addr == DEV_B];
+}
+
+static int
+sim_smbus (struct i2c_smbus_ioctl_data *args)
+{
+  uint8_t *regs = sim_regs (sim.slave), cmd = args->command;
+  union i2c_smbus_data *data = args->data;
+  int i;
+
+  sim.smbus_ioctls++;
+
+  // The kernel never applies PEC to I2C block transfers
+  if (sim.pec && args->size == I2C_SMBUS_I2C_BLOCK_DATA)
+    sim.unchecked_reads++;
+
+  switch (args->size)
+    {
+    case I2C_SMBUS_QUICK:
+      break;
+
+    case I2C_SMBUS_BYTE:
+      if (args->read_write == I2C_SMBUS_READ)
+	data->byte = regs[sim.pointer++ & 0xff];
+      else
+	sim.pointer = cmd;
+      break;
+
+    case I2C_SMBUS_BYTE_DATA:
+      if (args->read_write == I2C_SMBUS_READ)
+	data->byte = regs[cmd];
+      else
+	regs[cmd] = data->byte;
+      break;
+
+    case I2C_SMBUS_WORD_DATA:
+      if (args->read_write == I2C_SMBUS_READ)
+	data->word = regs[cmd] | regs[(cmd + 1) & 0xff] << 8;
+      else
+	{
+	  regs[cmd] = data->word;
+	  regs[(cmd + 1) & 0xff] = data->word >> 8;
+	}
+      break;
+
+    case I2C_SMBUS_BLOCK_DATA:
+      // The count is kept in the register before the data
+      if (args->read_write == I2C_SMBUS_READ)
+	data->block[0] = regs[cmd];
+      else
+	regs[cmd] = data->block[0];
+
+      for (i = 1; i <= data->block[0]; i++)
+	{
+	  if (args->read_write == I2C_SMBUS_READ)
+	    data->block[i] = regs[(cmd + i) & 0xff];
+	  else
+	    regs[(cmd + i) & 0xff] = data->block[i];
+	}
+      break;
+
+    case I2C_SMBUS_I2C_BLOCK_DATA:
+      if (!(sim.funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK)
+	  || data->block[0] > I2C_SMBUS_BLOCK_MAX)
+	return -1;
+
+      for (i = 0; i < data->block[0]; i++)
+	{
+	  if (args->read_write == I2C_SMBUS_READ)
+	    data->block[i + 1] = regs[(cmd + i) & 0xff];
+	  else
+	    regs[(cmd + i) & 0xff] = data->block[i + 1];
+	}
+      break;
+
+    default:
+      return -1;
+    }
+
+  return 0;
+}
+
+static int
+sim_rdwr (struct i2c_rdwr_ioctl_data *data)
+{
+  unsigned int i, j;
+  uint8_t *regs;
+
+  sim.rdwr_ioctls++;
+
+  for (i = 0; i < data->nmsgs; i++)
+    {
+      regs = sim_regs (data->msgs[i].addr);
+
+      if (data->msgs[i].flags & I2C_M_RD)
+	{
+	  for (j = 0; j < data->msgs[i].len; j++)
+	    data->msgs[i].buf[j] = regs[sim.pointer++ & 0xff];
+	}
+      else if (data->msgs[i].len)
+	sim.pointer = data->msgs[i].buf[0];
+    }
+
+  return data->nmsgs;
+}
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  switch (request)
+    {
+    case I2C_FUNCS:
+      sim.funcs_ioctls++;
+      *(unsigned long *) arg = sim.funcs;
+      return 0;
+
+    case I2C_SLAVE:
+      sim.slave_ioctls++;
+      sim.slave = (unsigned long) arg;
+      return 0;
+
+    case I2C_PEC:
+      sim.pec_ioctls++;
+      sim.pec = (unsigned long) arg;
+      return 0;
+
+    case I2C_SMBUS:
+      return sim_smbus (arg);
+
+    case I2C_RDWR:
+      return sim_rdwr (arg);
+    }
+
+  return real_ioctl (fd, request, arg);
+}
+
+static void
+reset_counts (void)
+{
+  sim.funcs_ioctls = sim.slave_ioctls = sim.pec_ioctls = 0;
+  sim.smbus_ioctls = sim.rdwr_ioctls = sim.unchecked_reads = 0;
+}
+
+// Reads 40 registers of a device on a freshly opened bus with this mask
+static int
+test_read_regs (unsigned long funcs, unsigned int smbus, unsigned int rdwr)
+{
+  uint8_t readback[40];
+  i2c *dev;
+  int fails = 0;
+
+  sim.funcs = funcs;
+  reset_counts ();
+
+  dev = libsoc_i2c_init (0, DEV_A);
+
+  if (dev == NULL)
+    return 1;
+
+  memset (readback, 0, sizeof (readback));
+
+  if (libsoc_i2c_smbus_read_regs (dev, 0x30, readback, sizeof (readback))
+      == EXIT_FAILURE || memcmp (readback, &sim.regs[0][0x30],
+				 sizeof (readback)))
+    {
+      printf ("ERROR: read_regs with funcs 0x%08lx returned wrong data\n",
+	      funcs);
+      fails++;
+    }
+
+  if (sim.smbus_ioctls != smbus || sim.rdwr_ioctls != rdwr
+      || sim.funcs_ioctls != 1)
+    {
+      printf ("ERROR: read_regs with funcs 0x%08lx took %d smbus and %d "
+	      "rdwr ioctls, expected %d and %d\n", funcs, sim.smbus_ioctls,
+	      sim.rdwr_ioctls, smbus, rdwr);
+      fails++;
+    }
+
+  libsoc_i2c_free (dev);
+
+  return fails;
+}
+
+int
+main (void)
+{
+  uint8_t data[I2C_SMBUS_BLOCK_MAX], block[I2C_SMBUS_BLOCK_MAX], value, len;
+  unsigned long funcs;
+  i2c *a = NULL, *b = NULL;
+  uint16_t word;
+  const char *path;
+  unsigned int i;
+  int fails = 0;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  path = fake_dev_create ("i2c-0");
+
+  for (i = 0; i < 256; i++)
+    {
+      sim.regs[0][i] = i;
+      sim.regs[1][i] = 255 - i;
+    }
+
+  sim.funcs = I2C_FUNC_SMBUS_EMUL | I2C_FUNC_SMBUS_PEC;
+
+  a = libsoc_i2c_init (0, DEV_A);
+  b = libsoc_i2c_init (0, DEV_B);
+
+  if (a == NULL || b == NULL)
+    {
+      printf ("Failed to open %s\n", path);
+      fails++;
+      goto fail;
+    }
+
+  // The mask is probed once for the bus, by whichever device asks first
+  if (libsoc_i2c_get_funcs (a, &funcs) == EXIT_FAILURE
+      || libsoc_i2c_get_funcs (b, &funcs) == EXIT_FAILURE
+      || funcs != sim.funcs || sim.funcs_ioctls != 1)
+    {
+      printf ("ERROR: I2C_FUNCS probed %d times\n", sim.funcs_ioctls);
+      fails++;
+    }
+
+  // Repeated transfers to one device set its address once
+  reset_counts ();
+
+  if (libsoc_i2c_smbus_read_byte_data (a, 0x12, &value) == EXIT_FAILURE
+      || value != 0x12
+      || libsoc_i2c_smbus_write_byte_data (a, 0x13, 0xaa) == EXIT_FAILURE
+      || sim.regs[0][0x13] != 0xaa
+      || libsoc_i2c_smbus_read_word_data (a, 0x20, &word) == EXIT_FAILURE
+      || word != 0x2120)
+    {
+      printf ("ERROR: byte and word data transfers\n");
+      fails++;
+    }
+
+  if (sim.slave_ioctls != 1 || sim.smbus_ioctls != 3)
+    {
+      printf ("ERROR: %d I2C_SLAVE ioctls for one device\n",
+	      sim.slave_ioctls);
+      fails++;
+    }
+
+  // Alternating devices on the shared descriptor sets the address each time
+  reset_counts ();
+
+  if (libsoc_i2c_smbus_write_word_data (b, 0x40, 0x1234) == EXIT_FAILURE
+      || libsoc_i2c_smbus_read_byte_data (a, 0x40, &value) == EXIT_FAILURE
+      || value != 0x40 || sim.regs[1][0x40] != 0x34
+      || sim.regs[1][0x41] != 0x12 || sim.slave_ioctls != 2)
+    {
+      printf ("ERROR: transfers to two devices\n");
+      fails++;
+    }
+
+  if (libsoc_i2c_smbus_write_byte (b, 0x80) == EXIT_FAILURE
+      || libsoc_i2c_smbus_read_byte (b, &value) == EXIT_FAILURE
+      || value != sim.regs[1][0x80]
+      || libsoc_i2c_smbus_quick (b, I2C_SMBUS_WRITE) == EXIT_FAILURE)
+    {
+      printf ("ERROR: send byte, receive byte or quick command\n");
+      fails++;
+    }
+
+  for (i = 0; i < sizeof (data); i++)
+    data[i] = 0xc0 + i;
+
+  if (libsoc_i2c_smbus_write_block_data (a, 0x60, data, 5) == EXIT_FAILURE
+      || libsoc_i2c_smbus_read_block_data (a, 0x60, block, &len)
+      == EXIT_FAILURE || len != 5 || memcmp (block, data, 5))
+    {
+      printf ("ERROR: SMBus block write and read\n");
+      fails++;
+    }
+
+  if (libsoc_i2c_smbus_write_block_data (a, 0x60, data, 33) != EXIT_FAILURE)
+    {
+      printf ("ERROR: block of 33 bytes was accepted\n");
+      fails++;
+    }
+
+  // PEC is a setting of the descriptor, changed only when devices differ
+  reset_counts ();
+
+  if (libsoc_i2c_smbus_set_pec (a, 1) == EXIT_FAILURE
+      || libsoc_i2c_smbus_read_byte_data (a, 0x01, &value) == EXIT_FAILURE
+      || libsoc_i2c_smbus_read_byte_data (a, 0x02, &value) == EXIT_FAILURE
+      || sim.pec != 1 || sim.pec_ioctls != 1
+      || libsoc_i2c_smbus_read_byte_data (b, 0x02, &value) == EXIT_FAILURE
+      || sim.pec != 0 || sim.pec_ioctls != 2)
+    {
+      printf ("ERROR: PEC set %d times\n", sim.pec_ioctls);
+      fails++;
+    }
+
+  // Checked multi byte reads never use the unchecked I2C block reads
+  reset_counts ();
+  memset (block, 0, sizeof (block));
+
+  if (libsoc_i2c_smbus_read_regs (a, 0x30, block, 20) == EXIT_FAILURE
+      || memcmp (block, &sim.regs[0][0x30], 20) || sim.unchecked_reads
+      || sim.smbus_ioctls != 20)
+    {
+      printf ("ERROR: read_regs with PEC took %d transfers, %d unchecked\n",
+	      sim.smbus_ioctls, sim.unchecked_reads);
+      fails++;
+    }
+
+  libsoc_i2c_smbus_set_pec (a, 0);
+
+  libsoc_i2c_free (a);
+  libsoc_i2c_free (b);
+  a = b = NULL;
+
+  // Without PEC support it can not be enabled
+  sim.funcs = I2C_FUNC_SMBUS_EMUL & ~I2C_FUNC_SMBUS_PEC;
+  a = libsoc_i2c_init (0, DEV_A);
+
+  if (a == NULL || libsoc_i2c_smbus_set_pec (a, 1) != EXIT_FAILURE)
+    {
+      printf ("ERROR: PEC enabled on an adapter without it\n");
+      fails++;
+    }
+
+  if (a)
+    libsoc_i2c_free (a);
+  a = NULL;
+
+  // A plain i2c adapter reads all 40 bytes in one I2C_RDWR
+  fails += test_read_regs (I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL, 0, 1);
+
+  // An SMBus only adapter with I2C block reads needs two transfers
+  fails += test_read_regs (I2C_FUNC_SMBUS_EMUL, 2, 0);
+
+  // Without block reads every byte is a transfer
+  fails += test_read_regs (I2C_FUNC_SMBUS_BYTE_DATA, 40, 0);
+
+fail:
+
+  if (a)
+    libsoc_i2c_free (a);
+
+  if (b)
+    libsoc_i2c_free (b);
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/mman.h>
+
+#include "libsoc_mmap_gpio.h"
+#include "libsoc_mmap_gpio_fast.h"
+
+/**
+ *
+ * This mmap_gpio_bench measures how fast a pin can be toggled through
+ * the mmap gpio calls without hardware. A memfd stands in for /dev/mem,
+ * so the times are the software cost of each toggle. On a real SoC every
+ * register access is an uncached bus transaction that usually costs far
+ * more than the code around it, so the register accesses per toggle are
+ * reported as well.
+ *
+ * The "legacy" row reproduces the old set level path, which did a read
+ * modify write of the CFG, PULL, DLEVEL and DATA registers for every
+ * level change. The "fast" rows use the static inline calls from
+ * libsoc_mmap_gpio_fast.h instead of the exported functions.
+ *
+ * Build: gcc -O2 -I../lib/include mmap_gpio_bench.c -o mmap_gpio_bench -lsoc
+ *
+ */
+
+#define ITERATIONS 10000000
+
+static double elapsed(struct timespec* start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static void report(const char* name, double ns, int accesses)
+{
+	printf("%-22s %2d accesses/toggle %8.2f ns/toggle %8.2f Mtoggles/s\n", name, accesses, ns / ITERATIONS, ITERATIONS / ns * 1e3);
+}
+
+static void legacy_rmw(volatile uint32_t* addr, uint32_t mask, uint32_t bits)
+{
+	uint32_t val = le32toh(*addr);
+	val &= ~mask;
+	val |= bits;
+	*addr = htole32(val);
+}
+
+static void __attribute__((noinline)) legacy_set_level(mmap_gpio* gpio, int level)
+{
+	/* Allwinner layout of the old pio_set, relative to the port */
+	volatile uint32_t* port = (volatile uint32_t*)((char*)gpio->data_out - 0x10);
+	uint32_t shift_func = (gpio->pin & 0x07) << 2;
+	uint32_t shift_pull = (gpio->pin & 0x0f) << 1;
+
+	legacy_rmw(port + (gpio->pin >> 3), 0x07 << shift_func, 1 << shift_func);
+	legacy_rmw(port + 7 + (gpio->pin >> 4), 0x03 << shift_pull, 0);
+	legacy_rmw(port + 5 + (gpio->pin >> 4), 0x03 << shift_pull, 0);
+	legacy_rmw(port + 4, gpio->mask, level ? gpio->mask : 0);
+}
+
+static void bench_legacy(mmap_gpio* gpio)
+{
+	struct timespec start;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		legacy_set_level(gpio, i & 1);
+	}
+
+	report("legacy set_level", elapsed(&start), 8);
+}
+
+static void bench_set_level(const char* name, mmap_gpio* gpio)
+{
+	struct timespec start;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		libsoc_mmap_gpio_set_level(gpio, i & 1);
+	}
+
+	report(name, elapsed(&start), gpio->set != NULL ? 1 : 2);
+}
+
+static void bench_fast(const char* soc, mmap_gpio* gpio)
+{
+	mmap_gpio_pin pin = libsoc_mmap_gpio_fast_resolve(gpio);
+	int accesses = pin.set != NULL ? 1 : 2;
+	struct timespec start;
+	char name[64];
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		libsoc_mmap_gpio_fast_write(&pin, i & 1);
+	}
+
+	sprintf(name, "%s fast write", soc);
+	report(name, elapsed(&start), accesses);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		libsoc_mmap_gpio_fast_toggle(&pin);
+	}
+
+	sprintf(name, "%s fast toggle", soc);
+	report(name, elapsed(&start), accesses);
+}
+
+static int run(const char* soc, char port, unsigned int pin, const char* mem_path)
+{
+	char name[64];
+
+	if (libsoc_mmap_gpio_init_soc(libsoc_mmap_gpio_find_soc(soc), mem_path) != 0)
+	{
+		printf("Failed to init %s\n", soc);
+		return EXIT_FAILURE;
+	}
+
+	mmap_gpio* gpio = libsoc_mmap_gpio_request(port, pin);
+	if (gpio == NULL)
+	{
+		printf("Failed to request %s %c%d\n", soc, port, pin);
+		libsoc_mmap_gpio_shutdown();
+		return EXIT_FAILURE;
+	}
+
+	libsoc_mmap_gpio_set_direction(gpio, OUTPUT);
+
+	if (gpio->set == NULL)
+		bench_legacy(gpio);
+
+	sprintf(name, "%s set_level", soc);
+	bench_set_level(name, gpio);
+	bench_fast(soc, gpio);
+
+	libsoc_mmap_gpio_free(gpio);
+	libsoc_mmap_gpio_shutdown();
+
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	char mem_path[64];
+	int ret = EXIT_SUCCESS;
+
+	int fd = memfd_create("libsoc-mem", 0);
+	if (fd < 0 || ftruncate(fd, 0x50000000) < 0)
+	{
+		printf("Failed to create register memfd\n");
+		return EXIT_FAILURE;
+	}
+
+	sprintf(mem_path, "/proc/self/fd/%d", fd);
+
+	if (run("allwinner", 'E', 4, mem_path) != EXIT_SUCCESS)
+		ret = EXIT_FAILURE;
+
+	if (run("bcm2836", 'A', 17, mem_path) != EXIT_SUCCESS)
+		ret = EXIT_FAILURE;
+
+	if (run("am335x", 'B', 21, mem_path) != EXIT_SUCCESS)
+		ret = EXIT_FAILURE;
+
+	close(fd);
+
+	return ret;
+}
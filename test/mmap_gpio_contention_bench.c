@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "libsoc_mmap_gpio.h"
+#include "libsoc_mmap_gpio_fast.h"
+
+/**
+ *
+ * This mmap_gpio_contention_bench hammers pins of a single port from N
+ * threads, each thread owning one pin, against a memfd standing in for
+ * /dev/mem. After every write the thread reads its pin back from the
+ * output register, a mismatch means another thread's read-modify-write
+ * overwrote the update.
+ *
+ * "unlocked" uses the inline read-modify-write from
+ * libsoc_mmap_gpio_fast.h, "locked" uses libsoc_mmap_gpio_set_level
+ * which takes the per port lock on Allwinner, "set/clear" uses the
+ * AM335x set and clear registers that need no lock. A memfd does not
+ * emulate set/clear registers, so no updates can be checked for those.
+ * Lost updates only show up with more than one CPU. The "processes" row
+ * runs the locked case in N forked processes sharing their locks through
+ * libsoc_mmap_gpio_share_locks.
+ *
+ * Build: gcc -O2 -I../lib/include mmap_gpio_contention_bench.c -o mmap_gpio_contention_bench -lsoc -lpthread
+ *
+ * Usage: mmap_gpio_contention_bench [max threads]
+ *
+ */
+
+#define ITERATIONS 1000000
+
+enum mode {
+	UNLOCKED,
+	LOCKED,
+};
+
+struct worker {
+	pthread_t thread;
+	enum mode mode;
+	mmap_gpio* gpio;
+	unsigned long lost;
+};
+
+static void* worker_run(void* arg)
+{
+	struct worker* w = arg;
+	mmap_gpio_pin pin = libsoc_mmap_gpio_fast_resolve(w->gpio);
+	int i, level;
+
+	for (i = 0; i < ITERATIONS; i++)
+	{
+		level = i & 1;
+
+		if (w->mode == UNLOCKED)
+			libsoc_mmap_gpio_fast_write(&pin, level);
+		else
+			libsoc_mmap_gpio_set_level(w->gpio, level);
+
+		/* a memfd does not apply set/clear writes, only check the RMW */
+		if (pin.set == NULL && ((*pin.data_out & pin.mask) != 0) != level)
+			w->lost++;
+	}
+
+	return NULL;
+}
+
+static double elapsed(struct timespec* start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static void run_threads(const char* name, char port, enum mode mode, int threads)
+{
+	struct worker workers[32];
+	struct timespec start;
+	unsigned long lost = 0;
+	double ns;
+	int t;
+
+	for (t = 0; t < threads; t++)
+	{
+		workers[t].mode = mode;
+		workers[t].gpio = libsoc_mmap_gpio_request(port, t);
+		workers[t].lost = 0;
+		libsoc_mmap_gpio_set_direction(workers[t].gpio, OUTPUT);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (t = 0; t < threads; t++)
+		pthread_create(&workers[t].thread, NULL, worker_run, &workers[t]);
+
+	for (t = 0; t < threads; t++)
+	{
+		pthread_join(workers[t].thread, NULL);
+		lost += workers[t].lost;
+		libsoc_mmap_gpio_free(workers[t].gpio);
+	}
+
+	ns = elapsed(&start);
+
+	printf("%-10s %2d threads %8.2f Mwrites/s %10lu lost\n", name, threads,
+		(double) threads * ITERATIONS / ns * 1e3, lost);
+}
+
+static void run_processes(char port, int processes)
+{
+	struct worker w;
+	struct timespec start;
+	unsigned long lost = 0;
+	int fds[2], status, p;
+	double ns;
+
+	pipe(fds);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (p = 0; p < processes; p++)
+	{
+		if (fork() == 0)
+		{
+			w.mode = LOCKED;
+			w.gpio = libsoc_mmap_gpio_request(port, p);
+			w.lost = 0;
+			libsoc_mmap_gpio_set_direction(w.gpio, OUTPUT);
+			worker_run(&w);
+			write(fds[1], &w.lost, sizeof(w.lost));
+			_exit(0);
+		}
+	}
+
+	for (p = 0; p < processes; p++)
+	{
+		read(fds[0], &w.lost, sizeof(w.lost));
+		lost += w.lost;
+		wait(&status);
+	}
+
+	ns = elapsed(&start);
+	close(fds[0]);
+	close(fds[1]);
+
+	printf("%-10s %2d procs   %8.2f Mwrites/s %10lu lost\n", "processes", processes,
+		(double) processes * ITERATIONS / ns * 1e3, lost);
+}
+
+int main(int argc, char** argv)
+{
+	char mem_path[64], lock_name[64];
+	int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+	int threads;
+
+	if (max_threads < 1 || max_threads > 32)
+		max_threads = 4;
+
+	int fd = memfd_create("libsoc-mem", 0);
+	if (fd < 0 || ftruncate(fd, 0x50000000) < 0)
+	{
+		printf("Failed to create register memfd\n");
+		return EXIT_FAILURE;
+	}
+
+	sprintf(mem_path, "/proc/self/fd/%d", fd);
+
+	if (libsoc_mmap_gpio_init_soc(libsoc_mmap_gpio_find_soc("allwinner"), mem_path) != 0)
+		return EXIT_FAILURE;
+
+	for (threads = 1; threads <= max_threads; threads *= 2)
+		run_threads("unlocked", 'E', UNLOCKED, threads);
+
+	for (threads = 1; threads <= max_threads; threads *= 2)
+		run_threads("locked", 'E', LOCKED, threads);
+
+	sprintf(lock_name, "/libsoc-bench-%d", getpid());
+	if (libsoc_mmap_gpio_share_locks(lock_name) == 0)
+	{
+		run_processes('E', max_threads);
+		shm_unlink(lock_name);
+	}
+
+	libsoc_mmap_gpio_shutdown();
+
+	if (libsoc_mmap_gpio_init_soc(libsoc_mmap_gpio_find_soc("am335x"), mem_path) != 0)
+		return EXIT_FAILURE;
+
+	for (threads = 1; threads <= max_threads; threads *= 2)
+		run_threads("set/clear", 'B', UNLOCKED, threads);
+
+	libsoc_mmap_gpio_shutdown();
+	close(fd);
+
+	return EXIT_SUCCESS;
+}
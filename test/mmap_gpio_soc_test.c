@@ -0,0 +1,209 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include "libsoc_mmap_gpio.h"
+
+/**
+ *
+ * This mmap_gpio_soc_test checks the register layout of each built in SoC
+ * descriptor without hardware. A sparse temporary file stands in for
+ * /dev/mem, so the register at physical address X is at offset X of the
+ * file and can be checked with pread after every call.
+ *
+ * Build: gcc -I../lib/include mmap_gpio_soc_test.c -o mmap_gpio_soc_test -lsoc
+ *
+ */
+
+static char mem_path[] = "/tmp/libsoc-mem-XXXXXX";
+static int mem_fd;
+static int fails = 0;
+
+static uint32_t reg_read(unsigned long addr)
+{
+	uint32_t val = 0;
+
+	pread(mem_fd, &val, sizeof(val), addr);
+	return le32toh(val);
+}
+
+static void reg_write(unsigned long addr, uint32_t val)
+{
+	val = htole32(val);
+	pwrite(mem_fd, &val, sizeof(val), addr);
+}
+
+static void check(const char* what, unsigned long addr, uint32_t expected)
+{
+	uint32_t val = reg_read(addr);
+
+	if (val != expected)
+	{
+		printf("ERROR: %s at 0x%08lx is 0x%08x, expected 0x%08x\n", what, addr, val, expected);
+		fails++;
+	}
+}
+
+static mmap_gpio* soc_request(const char* name, char port, unsigned int pin)
+{
+	if (libsoc_mmap_gpio_init_soc(libsoc_mmap_gpio_find_soc(name), mem_path) != 0)
+	{
+		printf("ERROR: failed to init %s\n", name);
+		fails++;
+		return NULL;
+	}
+
+	mmap_gpio* gpio = libsoc_mmap_gpio_request(port, pin);
+	if (gpio == NULL)
+	{
+		printf("ERROR: failed to request %s %c%d\n", name, port, pin);
+		fails++;
+	}
+
+	return gpio;
+}
+
+static void test_allwinner()
+{
+	/* PE4: port 4 at 0x24 per port, CFG0 bits 16-19, DATA bit 4 */
+	unsigned long port = 0x01c20800 + 4 * 0x24;
+	mmap_gpio* gpio;
+
+	reg_write(port + 0x00, 0x77777777);
+	reg_write(port + 0x10, 0x00000000);
+
+	gpio = soc_request("allwinner", 'E', 4);
+	if (gpio == NULL)
+		return;
+
+	if (libsoc_mmap_gpio_get_direction(gpio) != INPUT)
+	{
+		printf("ERROR: allwinner PE4 is not an input\n");
+		fails++;
+	}
+
+	libsoc_mmap_gpio_set_direction(gpio, OUTPUT);
+	check("allwinner PE_CFG0", port + 0x00, 0x77717777);
+
+	libsoc_mmap_gpio_set_level(gpio, HIGH);
+	check("allwinner PE_DAT", port + 0x10, 0x00000010);
+
+	libsoc_mmap_gpio_set_level(gpio, LOW);
+	check("allwinner PE_DAT", port + 0x10, 0x00000000);
+
+	libsoc_mmap_gpio_free(gpio);
+	libsoc_mmap_gpio_shutdown();
+}
+
+static void test_bcm2836()
+{
+	/* gpio 47: bank 1 pin 15, GPFSEL4 bits 21-23, GPSET1/GPCLR1 bit 15 */
+	unsigned long base = 0x3f200000;
+	mmap_gpio* gpio;
+
+	gpio = soc_request("bcm2836", 'B', 15);
+	if (gpio == NULL)
+		return;
+
+	libsoc_mmap_gpio_set_direction(gpio, OUTPUT);
+	check("bcm2836 GPFSEL4", base + 0x10, 0x00200000);
+
+	libsoc_mmap_gpio_set_level(gpio, HIGH);
+	check("bcm2836 GPSET1", base + 0x20, 0x00008000);
+
+	libsoc_mmap_gpio_set_level(gpio, LOW);
+	check("bcm2836 GPCLR1", base + 0x2c, 0x00008000);
+
+	/* gpio 53 is the last one, bank 1 has no pin 22 and up */
+	mmap_gpio* last = libsoc_mmap_gpio_request('B', 21);
+	mmap_gpio* past = libsoc_mmap_gpio_request('B', 22);
+	if (last == NULL || past != NULL
+		|| libsoc_mmap_gpio_port_update('B', 0x00400000, 0) != -1)
+	{
+		printf("ERROR: bcm2836 bank 1 pins past 21 were accepted\n");
+		fails++;
+	}
+
+	libsoc_mmap_gpio_free(last);
+	libsoc_mmap_gpio_free(past);
+	libsoc_mmap_gpio_free(gpio);
+	libsoc_mmap_gpio_shutdown();
+}
+
+static void test_am335x()
+{
+	/* gpio2_5: GPIO2 module, OE bit 5 is cleared for an output */
+	unsigned long bank = 0x481ac000;
+	mmap_gpio* gpio;
+
+	reg_write(bank + 0x134, 0xffffffff);
+
+	gpio = soc_request("am335x", 'C', 5);
+	if (gpio == NULL)
+		return;
+
+	libsoc_mmap_gpio_set_direction(gpio, OUTPUT);
+	check("am335x GPIO2_OE", bank + 0x134, 0xffffffdf);
+
+	libsoc_mmap_gpio_set_level(gpio, HIGH);
+	check("am335x GPIO2_SETDATAOUT", bank + 0x194, 0x00000020);
+
+	libsoc_mmap_gpio_set_level(gpio, LOW);
+	check("am335x GPIO2_CLEARDATAOUT", bank + 0x190, 0x00000020);
+
+	/* inputs are sampled from DATAIN on every read */
+	reg_write(bank + 0x138, 0x00000020);
+	if (libsoc_mmap_gpio_get_level(gpio) != HIGH)
+	{
+		printf("ERROR: am335x gpio2_5 did not read high\n");
+		fails++;
+	}
+
+	reg_write(bank + 0x138, 0x80000001);
+	if (libsoc_mmap_gpio_get_level(gpio) != LOW)
+	{
+		printf("ERROR: am335x gpio2_5 did not read low\n");
+		fails++;
+	}
+
+	uint32_t value = 0;
+	if (libsoc_mmap_gpio_get_port('C', &value) != 0 || value != 0x80000001)
+	{
+		printf("ERROR: am335x GPIO2 snapshot is 0x%08x\n", value);
+		fails++;
+	}
+
+	if (libsoc_mmap_gpio_get_direction(gpio) != OUTPUT)
+	{
+		printf("ERROR: am335x gpio2_5 is not an output\n");
+		fails++;
+	}
+
+	libsoc_mmap_gpio_free(gpio);
+	libsoc_mmap_gpio_shutdown();
+}
+
+int main()
+{
+	mem_fd = mkstemp(mem_path);
+	if (mem_fd < 0 || ftruncate(mem_fd, 0x50000000) < 0)
+	{
+		printf("Failed to create register file\n");
+		return EXIT_FAILURE;
+	}
+
+	test_allwinner();
+	test_bcm2836();
+	test_am335x();
+
+	close(mem_fd);
+	unlink(mem_path);
+
+	printf("Tests completed with %d failure(s).\n", fails);
+
+	return fails;
+}
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/spi/spidev.h>
+
+#include "libsoc_poller.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This poller_test checks the periodic poller without hardware. The
+ * I2C_RDWR and spidev message ioctls are interposed by this executable.
+ * The i2c stand-in serves register reads from one register file per
+ * device address and can be slowed down to make jobs miss their
+ * deadlines. The spi stand-in answers every byte sent with its
+ * complement. Both record how many ioctls were made and what they held,
+ * to check that jobs due together share a transfer in deadline order.
+ *
+ * Build: gcc -I../lib/include poller_test.c -o poller_test -lsoc -lpthread
+ *
+ */
+
+#define NUM_I2C 3
+#define RUN_MS 200
+
+static struct {
+  unsigned int i2c_ioctls;
+  uint16_t first_addrs[NUM_I2C];
+  unsigned int delay_us;
+  uint8_t regs[NUM_I2C + 1][256];
+  unsigned int spi_merged;
+} sim;
+
+static int
+sim_i2c (struct i2c_rdwr_ioctl_data *data)
+{
+  unsigned int i, j;
+  uint8_t *regs, pointer = 0;
+
+  if (sim.delay_us)
+    usleep (sim.delay_us);
+
+  for (i = 0; i < data->nmsgs; i++)
+    {
+      regs = sim.regs[(data->msgs[i].addr - 0x50) & 3];
+
+      if (data->msgs[i].flags & I2C_M_RD)
+	{
+	  for (j = 0; j < data->msgs[i].len; j++)
+	    data->msgs[i].buf[j] = regs[pointer++];
+	}
+      else
+	{
+	  pointer = data->msgs[i].buf[0];
+
+	  if (sim.i2c_ioctls == 0 && i / 2 < NUM_I2C)
+	    sim.first_addrs[i / 2] = data->msgs[i].addr;
+	}
+    }
+
+  sim.i2c_ioctls++;
+
+  return data->nmsgs;
+}
+
+static int
+sim_spi (unsigned long request, struct spi_ioc_transfer *tr)
+{
+  unsigned int i, j, n, ret = 0;
+  uint8_t *tx, *rx;
+
+  n = _IOC_SIZE (request) / sizeof (struct spi_ioc_transfer);
+
+  for (i = 0; i < n; i++)
+    {
+      tx = (uint8_t *) (unsigned long) tr[i].tx_buf;
+      rx = (uint8_t *) (unsigned long) tr[i].rx_buf;
+
+      for (j = 0; j < tr[i].len; j++)
+	rx[j] = ~tx[j];
+
+      ret += tr[i].len;
+    }
+
+  if (n > 1)
+    sim.spi_merged++;
+
+  return ret;
+}
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  if (request == I2C_RDWR)
+    return sim_i2c (arg);
+
+  if (_IOC_TYPE (request) == SPI_IOC_MAGIC && _IOC_NR (request) == 0)
+    return sim_spi (request, arg);
+
+  return real_ioctl (fd, request, arg);
+}
+
+static poller_result results[1024];
+
+// Checks that every result of a job holds the expected bytes, in order
+static int
+check_results (poller * p, int job, uint8_t * expected, unsigned int len,
+	       unsigned int period_ms)
+{
+  poller_stats stats;
+  int n, i, fails = 0;
+
+  n = libsoc_poller_drain (p, job, results, 1024);
+  libsoc_poller_get_stats (p, job, &stats);
+
+  printf ("job %d: %d runs, mean latency %llu us, max %llu us, %llu "
+	  "misses\n", job, (int) stats.runs, (unsigned long long)
+	  (stats.runs ? stats.latency_total / stats.runs / 1000 : 0),
+	  (unsigned long long) stats.latency_max / 1000,
+	  (unsigned long long) stats.deadline_misses);
+
+  if (n <= 0 || n != (int) stats.runs
+      || (unsigned int) n < RUN_MS / period_ms / 2)
+    {
+      printf ("ERROR: job %d produced %d results\n", job, n);
+      return 1;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      if (results[i].status || results[i].len != len
+	  || memcmp (results[i].data, expected, len)
+	  || results[i].completion < results[i].release
+	  || (i && results[i].release <= results[i - 1].release)
+	  || (i && results[i].sequence <= results[i - 1].sequence))
+	{
+	  printf ("ERROR: job %d result %d is wrong\n", job, i);
+	  fails++;
+	  break;
+	}
+    }
+
+  return fails;
+}
+
+int
+main (void)
+{
+  static const unsigned int period_ms[NUM_I2C] = { 2, 4, 10 };
+  static const unsigned int deadline_ms[NUM_I2C] = { 2, 4, 1 };
+  uint8_t reg = 0x10, tx[4] = { 1, 2, 3, 4 }, expected[4];
+  i2c *dev[NUM_I2C + 1] = { NULL };
+  spi *spi_dev[2] = { NULL, NULL };
+  poller *p = NULL;
+  poller_stats stats;
+  int fails = 0, i, job[NUM_I2C], spi_job[3];
+  unsigned int runs = 0;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  fake_dev_create ("i2c-0");
+  fake_dev_create ("spidev0.0");
+  fake_dev_create ("spidev0.1");
+
+  for (i = 0; i <= NUM_I2C; i++)
+    {
+      memset (sim.regs[i], 0x10 * (i + 1), sizeof (sim.regs[i]));
+      dev[i] = libsoc_i2c_init (0, 0x50 + i);
+    }
+
+  spi_dev[0] = libsoc_spi_init (0, 0);
+  spi_dev[1] = libsoc_spi_init (0, 1);
+  p = libsoc_poller_init ();
+
+  if (dev[0] == NULL || dev[NUM_I2C] == NULL || spi_dev[0] == NULL
+      || spi_dev[1] == NULL || p == NULL)
+    {
+      printf ("Failed to open devices or poller\n");
+      fails++;
+      goto fail;
+    }
+
+  // Three register reads at different rates, the slowest is most urgent
+  for (i = 0; i < NUM_I2C; i++)
+    job[i] = libsoc_poller_add_i2c (p, dev[i], &reg, 1, 2, period_ms[i] *
+				    1000, deadline_ms[i] * 1000, 256);
+
+  if (job[0] < 0 || job[1] < 0 || job[2] < 0
+      || libsoc_poller_add_spi (p, spi_dev[0], tx, 4, 1000, 0, 16) != -1)
+    {
+      printf ("ERROR: adding jobs\n");
+      fails++;
+      goto fail;
+    }
+
+  if (libsoc_poller_start (p) == EXIT_FAILURE)
+    {
+      printf ("ERROR: starting the poller\n");
+      fails++;
+      goto fail;
+    }
+
+  usleep (RUN_MS * 1000);
+  libsoc_poller_stop (p);
+
+  for (i = 0; i < NUM_I2C; i++)
+    {
+      memset (expected, 0x10 * (i + 1), 2);
+      fails += check_results (p, job[i], expected, 2, period_ms[i]);
+      libsoc_poller_get_stats (p, job[i], &stats);
+      runs += stats.runs;
+    }
+
+  // Releases that coincide share an ioctl, earliest deadline first
+  if (sim.i2c_ioctls >= runs || sim.first_addrs[0] != 0x52
+      || sim.first_addrs[1] != 0x50 || sim.first_addrs[2] != 0x51)
+    {
+      printf ("ERROR: %d runs took %d ioctls, first order %02x %02x %02x\n",
+	      runs, sim.i2c_ioctls, sim.first_addrs[0], sim.first_addrs[1],
+	      sim.first_addrs[2]);
+      fails++;
+    }
+  else
+    printf ("%d i2c runs in %d ioctls\n", runs, sim.i2c_ioctls);
+
+  libsoc_poller_free (p);
+
+  // A device slower than the deadline misses it on every run
+  p = libsoc_poller_init ();
+  sim.delay_us = 3000;
+
+  if (p == NULL || libsoc_poller_add_i2c (p, dev[NUM_I2C], &reg, 1, 2, 1000,
+					  500, 256) != 0
+      || libsoc_poller_start (p) == EXIT_FAILURE)
+    {
+      printf ("ERROR: starting the slow poller\n");
+      fails++;
+      goto fail;
+    }
+
+  usleep (50000);
+  libsoc_poller_stop (p);
+  sim.delay_us = 0;
+
+  libsoc_poller_get_stats (p, 0, &stats);
+
+  if (stats.runs == 0 || stats.deadline_misses < stats.runs
+      || stats.skipped == 0 || stats.latency_min < 3000000)
+    {
+      printf ("ERROR: slow job had %d runs, %d misses, %d skipped\n",
+	      (int) stats.runs, (int) stats.deadline_misses,
+	      (int) stats.skipped);
+      fails++;
+    }
+  else
+    printf ("slow job: %d runs, %d misses, %d releases skipped\n",
+	    (int) stats.runs, (int) stats.deadline_misses,
+	    (int) stats.skipped);
+
+  libsoc_poller_free (p);
+
+  // Two jobs on one spi device share a message, the third is separate
+  p = libsoc_poller_init ();
+
+  if (p == NULL)
+    {
+      fails++;
+      goto fail;
+    }
+
+  spi_job[0] = libsoc_poller_add_spi (p, spi_dev[0], tx, 4, 5000, 0, 64);
+  spi_job[1] = libsoc_poller_add_spi (p, spi_dev[0], tx, 2, 5000, 0, 64);
+  spi_job[2] = libsoc_poller_add_spi (p, spi_dev[1], tx, 4, 10000, 0, 64);
+
+  if (spi_job[0] < 0 || spi_job[1] < 0 || spi_job[2] < 0
+      || libsoc_poller_add_i2c (p, dev[0], &reg, 1, 2, 1000, 0, 16) != -1
+      || libsoc_poller_start (p) == EXIT_FAILURE)
+    {
+      printf ("ERROR: adding spi jobs\n");
+      fails++;
+      goto fail;
+    }
+
+  usleep (RUN_MS * 1000);
+  libsoc_poller_stop (p);
+
+  for (i = 0; i < 4; i++)
+    expected[i] = ~tx[i];
+
+  fails += check_results (p, spi_job[0], expected, 4, 5);
+  fails += check_results (p, spi_job[1], expected, 2, 5);
+  fails += check_results (p, spi_job[2], expected, 4, 10);
+
+  if (sim.spi_merged == 0)
+    {
+      printf ("ERROR: spi jobs due together were not merged\n");
+      fails++;
+    }
+
+fail:
+
+  if (p)
+    libsoc_poller_free (p);
+
+  for (i = 0; i <= NUM_I2C; i++)
+    {
+      if (dev[i])
+	libsoc_i2c_free (dev[i]);
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      if (spi_dev[i])
+	libsoc_spi_free (spi_dev[i]);
+    }
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/spi/spidev.h>
+
+#include "libsoc_spi.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This spi_bench measures SPI write throughput without hardware. The
+ * spidev message ioctl is interposed by this executable and sleeps for
+ * the time the transfer would take on the wire at BUS_HZ plus a fixed
+ * per message overhead, so the results show the cost of splitting
+ * transfers into bufsiz sized messages and how much of the data
+ * preparation the double buffered stream hides behind the bus.
+ *
+ * The "fill then write" row prepares the whole buffer and then writes
+ * it, the "write stream" row prepares each chunk on the worker thread
+ * while the previous one is on the bus.
+ *
+ * Build: gcc -O2 -I../lib/include spi_bench.c -o spi_bench -lsoc -lpthread
+ *
+ */
+
+#define BUS_HZ 50000000
+#define MESSAGE_NS 20000
+#define STREAM_LEN (4 * 1024 * 1024)
+
+static unsigned int messages;
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  struct spi_ioc_transfer *tr;
+  struct timespec ts;
+  unsigned long long ns = MESSAGE_NS;
+  unsigned int i, n, ret = 0;
+
+  if (_IOC_TYPE (request) != SPI_IOC_MAGIC || _IOC_NR (request) != 0)
+    return real_ioctl (fd, request, arg);
+
+  tr = arg;
+  n = _IOC_SIZE (request) / sizeof (struct spi_ioc_transfer);
+
+  for (i = 0; i < n; i++)
+    ret += tr[i].len;
+
+  ns += (unsigned long long) ret * 8 * 1000000000ULL / BUS_HZ;
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  nanosleep (&ts, NULL);
+
+  messages++;
+
+  return ret;
+}
+
+static double
+elapsed (struct timespec *start)
+{
+  struct timespec end;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+report (const char *name, uint32_t len, double s)
+{
+  printf ("%-24s %8d bytes %6d messages %8.2f MB/s\n", name, len, messages,
+	  len / s / 1e6);
+}
+
+/*
+ * Stand in for data preparation, roughly half the wire time per byte
+ */
+static int
+fill (void *arg, uint8_t * buf, uint32_t offset, uint32_t len)
+{
+  uint32_t i, j, x = offset;
+
+  (void) arg;
+
+  for (i = 0; i < len; i++)
+    {
+      for (j = 0; j < 16; j++)
+	x = x * 1103515245 + 12345;
+
+      buf[i] = x >> 16;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+main (void)
+{
+  static const uint32_t sizes[] = { 256, 4096, 65536, 1024 * 1024 };
+  struct timespec start;
+  const char *path;
+  spi *spi_dev;
+  uint8_t *buf;
+  unsigned int i;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  path = fake_dev_create ("spidev0.0");
+
+  spi_dev = libsoc_spi_init (0, 0);
+  buf = calloc (1, STREAM_LEN);
+
+  if (spi_dev == NULL || buf == NULL)
+    {
+      printf ("Failed to open %s\n", path);
+      return EXIT_FAILURE;
+    }
+
+  printf ("bufsiz %d, bus %d Hz, %d ns per message\n",
+	  libsoc_spi_get_bufsiz (), BUS_HZ, MESSAGE_NS);
+
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    {
+      messages = 0;
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      libsoc_spi_write (spi_dev, buf, sizes[i]);
+      report ("write", sizes[i], elapsed (&start));
+    }
+
+  messages = 0;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  fill (NULL, buf, 0, STREAM_LEN);
+  libsoc_spi_write (spi_dev, buf, STREAM_LEN);
+  report ("fill then write", STREAM_LEN, elapsed (&start));
+
+  messages = 0;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  libsoc_spi_write_stream (spi_dev, STREAM_LEN, fill, NULL);
+  report ("write stream", STREAM_LEN, elapsed (&start));
+
+  free (buf);
+  libsoc_spi_free (spi_dev);
+  fake_dev_cleanup ();
+
+  return EXIT_SUCCESS;
+}
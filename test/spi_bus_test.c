@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/spi/spidev.h>
+
+#include "libsoc_spi.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This spi_bus_test checks the ordering of a shared spi bus without
+ * hardware. Config ioctls are interposed by this executable and counted.
+ *
+ * Chip selects 0 and 2 share a config, chip select 1 uses another. The
+ * main thread holds the bus for chip select 0 while threads for chip
+ * selects 1, 2 and 1 queue up in that order. With a latency bound the
+ * waiter for chip select 2 is moved ahead to save a config switch, with
+ * no bound the bus is strictly first come first served.
+ *
+ * Build: gcc -I../lib/include spi_bus_test.c -o spi_bus_test -lsoc -lpthread
+ *
+ */
+
+#define NUM_DEVICES 3
+#define NUM_WAITERS 3
+
+static unsigned int config_writes;
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  if (_IOC_TYPE (request) != SPI_IOC_MAGIC)
+    return real_ioctl (fd, request, arg);
+
+  if (_IOC_NR (request) != 0 && _IOC_DIR (request) == _IOC_WRITE)
+    __atomic_fetch_add (&config_writes, 1, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+static spi_bus *bus;
+static spi *devices[NUM_DEVICES];
+static int order[NUM_WAITERS + 1], granted;
+
+static void *
+waiter (void *arg)
+{
+  int cs = (long) arg;
+
+  libsoc_spi_bus_acquire (bus, devices[cs]);
+  order[granted++] = cs;
+  libsoc_spi_bus_release (bus);
+
+  return NULL;
+}
+
+static int
+run (uint32_t latency_us, const int *expected, uint64_t switches,
+     uint64_t avoided)
+{
+  static const int waiters[NUM_WAITERS] = { 1, 2, 1 };
+  pthread_t threads[NUM_WAITERS];
+  spi_bus_stats stats;
+  int fails = 0, i;
+
+  bus = libsoc_spi_bus_init (0, latency_us);
+
+  for (i = 0; i < NUM_DEVICES; i++)
+    devices[i] = libsoc_spi_bus_add_device (bus, i, i == 1 ? MODE_3 : MODE_0,
+					    i == 1 ? 1000000 : 8000000,
+					    BITS_8);
+
+  granted = 0;
+  libsoc_spi_bus_acquire (bus, devices[0]);
+  order[granted++] = 0;
+
+  // Space the waiters out so they queue in a known order
+  for (i = 0; i < NUM_WAITERS; i++)
+    {
+      pthread_create (&threads[i], NULL, waiter, (void *) (long) waiters[i]);
+      usleep (20000);
+    }
+
+  libsoc_spi_bus_release (bus);
+
+  for (i = 0; i < NUM_WAITERS; i++)
+    pthread_join (threads[i], NULL);
+
+  for (i = 0; i <= NUM_WAITERS; i++)
+    {
+      if (order[i] != expected[i])
+	{
+	  printf ("ERROR: latency %d grant %d went to cs %d, expected %d\n",
+		  latency_us, i, order[i], expected[i]);
+	  fails++;
+	}
+    }
+
+  libsoc_spi_bus_get_stats (bus, &stats);
+
+  if (stats.grants != NUM_WAITERS + 1 || stats.config_switches != switches
+      || stats.config_switches_avoided != avoided)
+    {
+      printf ("ERROR: latency %d gave %d grants, %d switches, %d avoided\n",
+	      latency_us, (int) stats.grants, (int) stats.config_switches,
+	      (int) stats.config_switches_avoided);
+      fails++;
+    }
+
+  if (libsoc_spi_bus_free (bus) == EXIT_FAILURE)
+    {
+      printf ("ERROR: failed to free bus\n");
+      fails++;
+    }
+
+  return fails;
+}
+
+int
+main (void)
+{
+  static const int fifo[] = { 0, 1, 2, 1 };
+  static const int grouped[] = { 0, 2, 1, 1 };
+  char name[16];
+  int fails = 0, i;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  for (i = 0; i < NUM_DEVICES; i++)
+    {
+      sprintf (name, "spidev0.%d", i);
+      fake_dev_create (name);
+    }
+
+  fails += run (0, fifo, 3, 0);
+
+  // Each device is configured once, its handle remembers the config
+  if (config_writes != NUM_DEVICES * 3)
+    {
+      printf ("ERROR: %d config writes\n", config_writes);
+      fails++;
+    }
+
+  fails += run (1000000, grouped, 1, 1);
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/spi/spidev.h>
+
+#include "libsoc_spi.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This spi_queue_test checks the asynchronous spi queue without hardware.
+ * The spidev message ioctl is interposed by this executable and served by
+ * a stand-in that records the transfers of every message. The first
+ * message is held back until the test has queued the rest, so they are
+ * all waiting together and the merging is deterministic.
+ *
+ * Build: gcc -I../lib/include spi_queue_test.c -o spi_queue_test -lsoc -lpthread
+ *
+ */
+
+#define NUM_REQUESTS 6
+
+static struct {
+  unsigned int messages;
+  unsigned int transfers[NUM_REQUESTS];
+  uint8_t cs_change[NUM_REQUESTS][NUM_REQUESTS];
+  volatile int release;
+} sim;
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  struct spi_ioc_transfer *tr;
+  unsigned int i, n, ret = 0;
+
+  if (_IOC_TYPE (request) != SPI_IOC_MAGIC || _IOC_NR (request) != 0)
+    return real_ioctl (fd, request, arg);
+
+  tr = arg;
+  n = _IOC_SIZE (request) / sizeof (struct spi_ioc_transfer);
+
+  while (!sim.release)
+    usleep (1000);
+
+  for (i = 0; i < n; i++)
+    {
+      if (tr[i].rx_buf)
+	memset ((void *) (unsigned long) tr[i].rx_buf, fd, tr[i].len);
+
+      if (sim.messages < NUM_REQUESTS && i < NUM_REQUESTS)
+	sim.cs_change[sim.messages][i] = tr[i].cs_change;
+
+      ret += tr[i].len;
+    }
+
+  if (sim.messages < NUM_REQUESTS)
+    sim.transfers[sim.messages] = n;
+
+  sim.messages++;
+
+  return ret;
+}
+
+static int callbacks;
+
+static void
+completed (spi_request * request, void *arg)
+{
+  (void) request;
+  (void) arg;
+
+  __atomic_fetch_add (&callbacks, 1, __ATOMIC_RELAXED);
+}
+
+int
+main (void)
+{
+  // Requests 1 to 3 share a device and are merged, 4 and 5 are not
+  static const unsigned int expected[] = { 1, 3, 1, 1 };
+  spi_request requests[NUM_REQUESTS];
+  uint8_t rx[NUM_REQUESTS][4];
+  spi *spi_dev[2] = { NULL, NULL };
+  spi_queue *queue = NULL;
+  unsigned int i, j;
+  int fails = 0;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  fake_dev_create ("spidev0.0");
+  fake_dev_create ("spidev0.1");
+
+  spi_dev[0] = libsoc_spi_init (0, 0);
+  spi_dev[1] = libsoc_spi_init (0, 1);
+  queue = libsoc_spi_queue_init ();
+
+  if (spi_dev[0] == NULL || spi_dev[1] == NULL || queue == NULL)
+    {
+      printf ("Failed to open devices or queue\n");
+      fails++;
+      goto fail;
+    }
+
+  memset (requests, 0, sizeof (requests));
+
+  for (i = 0; i < NUM_REQUESTS; i++)
+    {
+      requests[i].spi = spi_dev[i == 4];
+      requests[i].rx = rx[i];
+      requests[i].len = sizeof (rx[i]);
+      requests[i].callback_fn = completed;
+
+      if (libsoc_spi_queue_submit (queue, &requests[i]) == EXIT_FAILURE)
+	{
+	  printf ("Failed to submit request %d\n", i);
+	  fails++;
+	}
+
+      // Let the worker pick up the first request on its own
+      if (i == 0)
+	usleep (50000);
+    }
+
+  if (libsoc_spi_request_done (&requests[NUM_REQUESTS - 1]))
+    {
+      printf ("ERROR: request completed before its message was sent\n");
+      fails++;
+    }
+
+  sim.release = 1;
+
+  for (i = 0; i < NUM_REQUESTS; i++)
+    {
+      if (libsoc_spi_request_wait (&requests[i]) != EXIT_SUCCESS
+	  || rx[i][3] != spi_dev[i == 4]->fd)
+	{
+	  printf ("ERROR: request %d failed or was not read\n", i);
+	  fails++;
+	}
+    }
+
+  if (sim.messages != 4 || callbacks != NUM_REQUESTS)
+    {
+      printf ("ERROR: %d messages, %d callbacks\n", sim.messages, callbacks);
+      fails++;
+    }
+
+  for (i = 0; i < 4 && i < sim.messages; i++)
+    {
+      for (j = 0; j < sim.transfers[i]; j++)
+	{
+	  if (sim.transfers[i] != expected[i]
+	      || sim.cs_change[i][j] != (j + 1 < sim.transfers[i]))
+	    {
+	      printf ("ERROR: message %d had %d transfers, cs_change %d\n", i,
+		      sim.transfers[i], sim.cs_change[i][j]);
+	      fails++;
+	    }
+	}
+    }
+
+fail:
+
+  if (queue)
+    libsoc_spi_queue_free (queue);
+
+  for (i = 0; i < 2; i++)
+    {
+      if (spi_dev[i])
+	libsoc_spi_free (spi_dev[i]);
+    }
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/spi/spidev.h>
+
+#include "libsoc_spi.h"
+#include "fake_dev.h"
+
+/**
+ *
+ * This spi_transaction_test checks the spi transaction builder without
+ * hardware. The spidev ioctls are interposed by this executable and
+ * served by a stand-in that records every message and answers reads
+ * with a counting pattern. Config ioctls are counted to check that
+ * unchanged mode, speed and bits per word are not written again.
+ *
+ * A fake spidev bufsiz parameter of 512 bytes is given with
+ * LIBSOC_SPI_BUFSIZ to check that longer transfers are split. Like
+ * spidev, the stand-in rejects messages whose transfers, each rounded up
+ * to 128 bytes, add up to more than bufsiz in either direction.
+ *
+ * Build: gcc -I../lib/include spi_transaction_test.c -o spi_transaction_test -lsoc -lpthread
+ *
+ */
+
+#define SIM_BUFSIZ 512
+#define SIM_ALIGN(len) (((len) + 127) & ~127)
+#define SIM_HISTORY 16
+
+static struct {
+  unsigned int messages;
+  unsigned int num_transfers;
+  struct spi_ioc_transfer transfers[SPI_TRANSFERS_MAX];
+  uint32_t lengths[SIM_HISTORY];
+  uint8_t cs_change[SIM_HISTORY];
+  unsigned int config_writes;
+  unsigned int config_reads;
+  uint32_t mode;
+  uint32_t mode_unsupported;
+} sim;
+
+static int
+sim_ioctl (int fd, unsigned long request, void *arg)
+{
+  struct spi_ioc_transfer *tr;
+  unsigned int i, n, j, ret = 0, tx_total = 0, rx_total = 0;
+
+  if (_IOC_TYPE (request) != SPI_IOC_MAGIC)
+    return real_ioctl (fd, request, arg);
+
+  // Like spidev, the 8 bit mode clears the upper flags and controllers
+  // drop the dual and quad flags they can not do
+  if (request == SPI_IOC_WR_MODE)
+    sim.mode = *(uint8_t *) arg;
+  else if (request == SPI_IOC_WR_MODE32)
+    sim.mode = *(uint32_t *) arg & ~sim.mode_unsupported;
+  else if (request == SPI_IOC_RD_MODE)
+    *(uint8_t *) arg = sim.mode;
+  else if (request == SPI_IOC_RD_MODE32)
+    *(uint32_t *) arg = sim.mode;
+  else if (_IOC_NR (request) != 0 && _IOC_DIR (request) == _IOC_READ)
+    memset (arg, 0, _IOC_SIZE (request));
+
+  if (_IOC_NR (request) != 0)
+    {
+      if (_IOC_DIR (request) == _IOC_WRITE)
+	sim.config_writes++;
+      else
+	sim.config_reads++;
+
+      return 0;
+    }
+
+  tr = arg;
+  n = _IOC_SIZE (request) / sizeof (struct spi_ioc_transfer);
+
+  for (i = 0; i < n; i++)
+    {
+      if (tr[i].tx_buf)
+	tx_total += SIM_ALIGN (tr[i].len);
+
+      if (tr[i].rx_buf)
+	rx_total += SIM_ALIGN (tr[i].len);
+    }
+
+  if (tx_total > SIM_BUFSIZ || rx_total > SIM_BUFSIZ)
+    {
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+  if (sim.messages < SIM_HISTORY)
+    {
+      sim.lengths[sim.messages] = 0;
+      sim.cs_change[sim.messages] = tr[n - 1].cs_change;
+    }
+
+  sim.num_transfers = n;
+  memcpy (sim.transfers, tr, n * sizeof (struct spi_ioc_transfer));
+
+  for (i = 0; i < n; i++)
+    {
+      if (sim.messages < SIM_HISTORY)
+	sim.lengths[sim.messages] += tr[i].len;
+
+
+      if (tr[i].rx_buf)
+	{
+	  for (j = 0; j < tr[i].len; j++)
+	    ((uint8_t *) (unsigned long) tr[i].rx_buf)[j] = j;
+	}
+
+      ret += tr[i].len;
+    }
+
+  sim.messages++;
+
+  return ret;
+}
+
+static int
+fill (void *arg, uint8_t * buf, uint32_t offset, uint32_t len)
+{
+  uint32_t i;
+
+  (void) arg;
+
+  for (i = 0; i < len; i++)
+    buf[i] = offset + i;
+
+  return EXIT_SUCCESS;
+}
+
+static int
+consume (void *arg, uint8_t * buf, uint32_t offset, uint32_t len)
+{
+  uint32_t *total = arg;
+
+  (void) offset;
+
+  if (buf[len - 1] != (uint8_t) (len - 1))
+    return EXIT_FAILURE;
+
+  *total += len;
+
+  return EXIT_SUCCESS;
+}
+
+static int
+check_split (const char *name, unsigned int messages, const uint32_t * lengths)
+{
+  unsigned int i;
+
+  if (sim.messages != messages)
+    {
+      printf ("ERROR: %s sent %d messages, expected %d\n", name,
+	      sim.messages, messages);
+      return 1;
+    }
+
+  for (i = 0; i < messages; i++)
+    {
+      if (sim.lengths[i] != lengths[i]
+	  || sim.cs_change[i] != (i + 1 < messages))
+	{
+	  printf ("ERROR: %s message %d was %d bytes, cs_change %d\n", name,
+		  i, sim.lengths[i], sim.cs_change[i]);
+	  return 1;
+	}
+    }
+
+  return 0;
+}
+
+static const uint32_t rw_split[] = { 512, 512, 276 };
+static const uint32_t stream_split[] = { 512, 512, 176 };
+static const uint32_t packed_split[] = { 387, 512, 304 };
+
+int
+main (void)
+{
+  uint8_t cmd = 0x03, addr[2] = { 0x12, 0x34 }, data[16], big[1300];
+  spi_transaction *transaction = NULL;
+  spi *spi_dev = NULL;
+  const char *path, *bufsiz;
+  uint32_t total = 0, flags = 0;
+  int fails = 0, i;
+  FILE *fp;
+
+  if (fake_dev_init () == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  path = fake_dev_create ("spidev0.0");
+  bufsiz = fake_dev_create ("bufsiz");
+
+  fp = fopen (bufsiz, "w");
+  fprintf (fp, "%d\n", SIM_BUFSIZ);
+  fclose (fp);
+
+  setenv ("LIBSOC_SPI_BUFSIZ", bufsiz, 1);
+
+  spi_dev = libsoc_spi_init (0, 0);
+  transaction = libsoc_spi_transaction_init (spi_dev);
+
+  if (transaction == NULL)
+    {
+      printf ("Failed to open %s\n", path);
+      fails++;
+      goto fail;
+    }
+
+  // Command, address and data from separate buffers in one message
+  libsoc_spi_transaction_add (transaction, &cmd, NULL, 1);
+  i = libsoc_spi_transaction_add (transaction, addr, NULL, 2);
+  libsoc_spi_transaction_set_delay (transaction, i, 10);
+  i = libsoc_spi_transaction_add (transaction, NULL, data, sizeof (data));
+  libsoc_spi_transaction_set_speed (transaction, i, 1000000);
+  libsoc_spi_transaction_set_bits_per_word (transaction, i, BITS_16);
+  libsoc_spi_transaction_set_cs_change (transaction, i, 1);
+
+  if (libsoc_spi_transaction_transfer (transaction) == EXIT_FAILURE)
+    {
+      printf ("Failed transaction transfer\n");
+      fails++;
+    }
+
+  if (sim.messages != 1 || sim.num_transfers != 3)
+    {
+      printf ("ERROR: %d messages of %d transfers\n", sim.messages,
+	      sim.num_transfers);
+      fails++;
+    }
+
+  if (sim.transfers[0].tx_buf != (unsigned long) &cmd
+      || sim.transfers[1].tx_buf != (unsigned long) addr
+      || sim.transfers[1].delay_usecs != 10
+      || sim.transfers[2].rx_buf != (unsigned long) data
+      || sim.transfers[2].speed_hz != 1000000
+      || sim.transfers[2].bits_per_word != 16
+      || !sim.transfers[2].cs_change || sim.transfers[0].cs_change)
+    {
+      printf ("ERROR: segment options were not passed through\n");
+      fails++;
+    }
+
+  if (data[15] != 15)
+    {
+      printf ("ERROR: read segment was not filled\n");
+      fails++;
+    }
+
+  // Full transactions are rejected, cleared ones can be reused
+  for (i = 3; i < SPI_TRANSFERS_MAX; i++)
+    libsoc_spi_transaction_add (transaction, &cmd, NULL, 1);
+
+  if (libsoc_spi_transaction_add (transaction, &cmd, NULL, 1) != -1)
+    {
+      printf ("ERROR: segment %d was accepted\n", SPI_TRANSFERS_MAX);
+      fails++;
+    }
+
+  libsoc_spi_transaction_clear (transaction);
+
+  if (libsoc_spi_transaction_add (transaction, &cmd, NULL, 1) != 0)
+    {
+      printf ("ERROR: cleared transaction was not empty\n");
+      fails++;
+    }
+
+  // Transfers beyond bufsiz are split with chip select held between them
+  if (libsoc_spi_get_bufsiz () != SIM_BUFSIZ)
+    {
+      printf ("ERROR: bufsiz read as %d\n", libsoc_spi_get_bufsiz ());
+      fails++;
+    }
+
+  sim.messages = 0;
+  memset (big, 0, sizeof (big));
+
+  if (libsoc_spi_rw (spi_dev, big, big, sizeof (big)) == EXIT_FAILURE)
+    {
+      printf ("Failed split transfer\n");
+      fails++;
+    }
+
+  fails += check_split ("rw", 3, rw_split);
+
+  // A long payload packed after a short command fits the rounded budget
+  sim.messages = 0;
+  libsoc_spi_transaction_clear (transaction);
+  libsoc_spi_transaction_add (transaction, big, NULL, 3);
+  libsoc_spi_transaction_add (transaction, big, NULL, 1200);
+
+  if (libsoc_spi_transaction_transfer (transaction) == EXIT_FAILURE)
+    {
+      printf ("Failed packed transfer\n");
+      fails++;
+    }
+
+  fails += check_split ("packed", 3, packed_split);
+
+  sim.messages = 0;
+
+  if (libsoc_spi_write_stream (spi_dev, 1200, fill, NULL) == EXIT_FAILURE)
+    {
+      printf ("Failed write stream\n");
+      fails++;
+    }
+
+  fails += check_split ("write stream", 3, stream_split);
+
+  sim.messages = 0;
+
+  if (libsoc_spi_read_stream (spi_dev, 1200, consume, &total) == EXIT_FAILURE
+      || total != 1200)
+    {
+      printf ("Failed read stream, %d bytes consumed\n", total);
+      fails++;
+    }
+
+  fails += check_split ("read stream", 3, stream_split);
+
+  // Only config values that changed reach the device
+  sim.config_writes = 0;
+  libsoc_spi_configure (spi_dev, MODE_3, 1000000, BITS_8);
+
+  if (sim.config_writes != 3)
+    {
+      printf ("ERROR: first configure wrote %d values\n", sim.config_writes);
+      fails++;
+    }
+
+  sim.config_writes = 0;
+  libsoc_spi_configure (spi_dev, MODE_3, 1000000, BITS_8);
+  libsoc_spi_set_mode (spi_dev, MODE_3);
+  libsoc_spi_set_speed (spi_dev, 1000000);
+
+  if (sim.config_writes != 0)
+    {
+      printf ("ERROR: unchanged configure wrote %d values\n",
+	      sim.config_writes);
+      fails++;
+    }
+
+  libsoc_spi_configure (spi_dev, MODE_3, 2000000, BITS_8);
+
+  if (sim.config_writes != 1 || libsoc_spi_get_speed (spi_dev) != 2000000
+      || libsoc_spi_get_mode (spi_dev) != MODE_3
+      || libsoc_spi_get_bits_per_word (spi_dev) != BITS_8
+      || sim.config_reads != 0)
+    {
+      printf ("ERROR: speed change wrote %d values, read %d\n",
+	      sim.config_writes, sim.config_reads);
+      fails++;
+    }
+
+  libsoc_spi_invalidate_config (spi_dev);
+  libsoc_spi_get_mode (spi_dev);
+  sim.config_writes = 0;
+  libsoc_spi_configure (spi_dev, MODE_3, 2000000, BITS_8);
+
+  if (sim.config_reads != 1 || sim.config_writes != 2)
+    {
+      printf ("ERROR: invalidated config read %d, wrote %d values\n",
+	      sim.config_reads, sim.config_writes);
+      fails++;
+    }
+
+  // Extended mode flags, the controller cannot transmit on four wires
+  sim.mode_unsupported = SPI_TX_QUAD;
+
+  if (libsoc_spi_probe_mode32 (spi_dev, SPI_TX_QUAD | SPI_RX_QUAD
+			       | SPI_CS_HIGH, &flags) == EXIT_FAILURE
+      || flags != (SPI_RX_QUAD | SPI_CS_HIGH) || sim.mode != SPI_MODE_3)
+    {
+      printf ("ERROR: probe accepted 0x%x, left mode 0x%x\n", flags,
+	      sim.mode);
+      fails++;
+    }
+
+  libsoc_spi_set_mode32 (spi_dev, SPI_MODE_0 | SPI_RX_QUAD | SPI_LSB_FIRST);
+  libsoc_spi_set_mode (spi_dev, MODE_2);
+
+  if (sim.mode != (SPI_MODE_2 | SPI_RX_QUAD | SPI_LSB_FIRST)
+      || libsoc_spi_get_mode (spi_dev) != MODE_2
+      || libsoc_spi_get_mode32 (spi_dev, &flags) == EXIT_FAILURE
+      || flags != sim.mode)
+    {
+      printf ("ERROR: clock mode change left mode 0x%x\n", sim.mode);
+      fails++;
+    }
+
+  libsoc_spi_transaction_clear (transaction);
+  libsoc_spi_transaction_add (transaction, &cmd, NULL, 1);
+  i = libsoc_spi_transaction_add (transaction, NULL, data, sizeof (data));
+
+  if (libsoc_spi_transaction_set_nbits (transaction, i, 0, 3) != EXIT_FAILURE
+      || libsoc_spi_transaction_set_nbits (transaction, i, 0, 4)
+      == EXIT_FAILURE
+      || libsoc_spi_transaction_transfer (transaction) == EXIT_FAILURE
+      || sim.transfers[0].rx_nbits != 0 || sim.transfers[1].rx_nbits != 4)
+    {
+      printf ("ERROR: segment nbits were not passed through\n");
+      fails++;
+    }
+
+fail:
+
+  if (transaction)
+    libsoc_spi_transaction_free (transaction);
+
+  if (spi_dev)
+    libsoc_spi_free (spi_dev);
+
+  fake_dev_cleanup ();
+
+  printf ("Tests completed with %d failure(s).\n", fails);
+
+  return fails;
+}